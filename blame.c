@@ -4,7 +4,11 @@
 #include "mergesort.h"
 #include "diff.h"
 #include "diffcore.h"
+#include "dir.h"
 #include "tag.h"
+#include "lockfile.h"
+#include "quote.h"
+#include "userdiff.h"
 #include "blame.h"
 
 void blame_origin_decref(struct blame_origin *o)
@@ -154,7 +158,7 @@ static struct commit *fake_working_tree_commit(struct diff_options *opt,
 	struct strbuf buf = STRBUF_INIT;
 	const char *ident;
 	time_t now;
-	int size, len;
+	int len;
 	struct cache_entry *ce;
 	unsigned mode;
 	struct strbuf msg = STRBUF_INIT;
@@ -252,8 +256,7 @@ static struct commit *fake_working_tree_commit(struct diff_options *opt,
 			/* Let's not bother reading from HEAD tree */
 			mode = S_IFREG | 0644;
 	}
-	size = cache_entry_size(len);
-	ce = xcalloc(1, size);
+	ce = make_empty_cache_entry(&the_index, len);
 	oidcpy(&ce->oid, &origin->blob_oid);
 	memcpy(ce->name, path, len);
 	ce->ce_flags = create_ce_flags(0);
@@ -1539,6 +1542,422 @@ static void pass_blame(struct blame_scoreboard *sb, struct blame_origin *origin,
 		free(sg_origin);
 }
 
+/*
+ * The blame cache remembers the final blame of a whole file at a
+ * commit, so that blaming it again, or blaming a descendant whose
+ * lines make their way back to it, does not have to dig through the
+ * history behind it again.  It is keyed by the commit, the path and
+ * the options that affect the outcome, and lives in files under
+ * $GIT_DIR/blame-cache/ that can be removed at any time; "git gc"
+ * removes those that have not been used for gc.blameCacheExpire.
+ *
+ * Each file starts with a "blob <oid> <lines>" line naming the blob
+ * that was blamed, followed by "origin <commit> <boundary> <path>"
+ * lines, each optionally followed by a "previous <commit> <path>"
+ * line, and by "entry <lno> <num_lines> <s_lno> <origin>" lines
+ * covering all lines of the blob in order.  Origins are numbered from
+ * 0 in the order they are given, and paths are quoted if needed.
+ */
+struct cached_origin {
+	struct object_id commit;
+	struct object_id previous;
+	char *path;
+	char *previous_path;
+	int boundary;
+	struct blame_origin *o;
+};
+
+struct cached_entry {
+	int lno;
+	int num_lines;
+	int s_lno;
+	int origin;
+};
+
+struct blame_cache {
+	struct object_id blob;
+	int num_lines;
+	struct cached_origin *origin;
+	int origin_nr, origin_alloc;
+	struct cached_entry *entry;
+	int entry_nr, entry_alloc;
+};
+
+static int blame_cache_usable(struct blame_scoreboard *sb, const char *path)
+{
+	struct userdiff_driver *drv;
+
+	/* what textconv makes of the blob is not part of the key */
+	if (!sb->revs->diffopt.flags.allow_textconv)
+		return 1;
+	drv = userdiff_find_by_path(path);
+	return !drv || !drv->textconv;
+}
+
+static char *blame_cache_file(struct blame_scoreboard *sb,
+			      struct commit *commit, const char *path)
+{
+	git_hash_ctx ctx;
+	unsigned char hash[GIT_MAX_RAWSZ];
+	struct strbuf key = STRBUF_INIT;
+	const char *hex;
+
+	strbuf_addf(&key, "%s\nxdl %x root %d follow %d first-parent %d textconv %d\n%s",
+		    oid_to_hex(&commit->object.oid), sb->xdl_opts,
+		    sb->show_root, !sb->no_whole_file_rename,
+		    sb->revs->first_parent_only,
+		    sb->revs->diffopt.flags.allow_textconv, path);
+	the_hash_algo->init_fn(&ctx);
+	the_hash_algo->update_fn(&ctx, key.buf, key.len);
+	the_hash_algo->final_fn(hash, &ctx);
+	strbuf_release(&key);
+
+	hex = sha1_to_hex(hash);
+	return git_pathdup("blame-cache/%.2s/%s", hex, hex + 2);
+}
+
+static void clear_blame_cache(struct blame_cache *c)
+{
+	int i;
+
+	for (i = 0; i < c->origin_nr; i++) {
+		free(c->origin[i].path);
+		free(c->origin[i].previous_path);
+	}
+	free(c->origin);
+	free(c->entry);
+}
+
+/* Take the rest of the line as a path, unquoting it if needed. */
+static int parse_cached_path(const char *p, char **path)
+{
+	struct strbuf buf = STRBUF_INIT;
+
+	if (*p == '"') {
+		const char *end;
+		if (unquote_c_style(&buf, p, &end) || *end)
+			return -1;
+		*path = strbuf_detach(&buf, NULL);
+	} else {
+		*path = xstrdup(p);
+	}
+	return 0;
+}
+
+static int parse_blame_cache(struct blame_cache *c, char *buf)
+{
+	char *line, *next;
+	int lno = 0;
+
+	for (line = buf; *line; line = next) {
+		const char *p;
+		char *end;
+
+		next = strchrnul(line, '\n');
+		if (*next)
+			*next++ = '\0';
+
+		if (skip_prefix(line, "blob ", &p)) {
+			if (parse_oid_hex(p, &c->blob, &p) || *p++ != ' ')
+				return -1;
+			c->num_lines = strtol(p, &end, 10);
+			if (*end || c->num_lines < 0)
+				return -1;
+		} else if (skip_prefix(line, "origin ", &p)) {
+			struct cached_origin *o;
+
+			ALLOC_GROW(c->origin, c->origin_nr + 1, c->origin_alloc);
+			o = &c->origin[c->origin_nr++];
+			memset(o, 0, sizeof(*o));
+			if (parse_oid_hex(p, &o->commit, &p) || *p++ != ' ' ||
+			    (*p != '0' && *p != '1') || p[1] != ' ')
+				return -1;
+			o->boundary = *p == '1';
+			if (parse_cached_path(p + 2, &o->path))
+				return -1;
+		} else if (skip_prefix(line, "previous ", &p)) {
+			struct cached_origin *o;
+
+			if (!c->origin_nr)
+				return -1;
+			o = &c->origin[c->origin_nr - 1];
+			if (o->previous_path ||
+			    parse_oid_hex(p, &o->previous, &p) || *p++ != ' ' ||
+			    parse_cached_path(p, &o->previous_path))
+				return -1;
+		} else if (skip_prefix(line, "entry ", &p)) {
+			struct cached_entry *e;
+
+			ALLOC_GROW(c->entry, c->entry_nr + 1, c->entry_alloc);
+			e = &c->entry[c->entry_nr++];
+			if (sscanf(p, "%d %d %d %d", &e->lno, &e->num_lines,
+				   &e->s_lno, &e->origin) != 4 ||
+			    e->lno != lno || e->num_lines <= 0 || e->s_lno < 0 ||
+			    e->origin < 0 || e->origin >= c->origin_nr)
+				return -1;
+			lno += e->num_lines;
+		} else if (*line) {
+			return -1;
+		}
+	}
+	return lno == c->num_lines ? 0 : -1;
+}
+
+/*
+ * Find the cached entry that covers line "lno" of the cached blob.
+ */
+static struct cached_entry *find_cached_entry(struct blame_cache *c, int lno)
+{
+	int lo = 0, hi = c->entry_nr;
+
+	while (lo < hi) {
+		int mi = lo + (hi - lo) / 2;
+		struct cached_entry *e = &c->entry[mi];
+
+		if (lno < e->lno)
+			hi = mi;
+		else if (e->lno + e->num_lines <= lno)
+			lo = mi + 1;
+		else
+			return e;
+	}
+	return NULL;
+}
+
+/*
+ * If the final blame of the origin's file is in the cache, use it to
+ * settle all of its suspects at once and return 1; otherwise return
+ * 0 and leave them alone.
+ */
+static int blame_from_cache(struct blame_scoreboard *sb,
+			    struct blame_origin *origin)
+{
+	struct blame_cache c;
+	struct strbuf buf = STRBUF_INIT;
+	struct blame_entry *e, *next;
+	char *file;
+	int i, ret = 0;
+
+	if (is_null_oid(&origin->commit->object.oid) ||
+	    !blame_cache_usable(sb, origin->path) ||
+	    fill_blob_sha1_and_mode(origin))
+		return 0;
+
+	memset(&c, 0, sizeof(c));
+	file = blame_cache_file(sb, origin->commit, origin->path);
+	if (strbuf_read_file(&buf, file, 0) < 0)
+		goto out;
+	if (parse_blame_cache(&c, buf.buf) || oidcmp(&c.blob, &origin->blob_oid))
+		goto out;
+	for (e = origin->suspects; e; e = e->next)
+		if (e->s_lno < 0 || e->s_lno + e->num_lines > c.num_lines)
+			goto out;
+
+	for (i = 0; i < c.origin_nr; i++) {
+		struct cached_origin *co = &c.origin[i];
+		struct commit *commit = lookup_commit(&co->commit);
+
+		if (!commit)
+			goto out;
+		co->o = get_origin(commit, co->path);
+		if (co->previous_path && !co->o->previous) {
+			struct commit *prev = lookup_commit(&co->previous);
+			if (prev)
+				co->o->previous = get_origin(prev, co->previous_path);
+		}
+		if (co->boundary)
+			commit->object.flags |= UNINTERESTING;
+	}
+
+	for (e = origin->suspects; e; e = next) {
+		int lno = e->s_lno, end = e->s_lno + e->num_lines;
+
+		next = e->next;
+		while (lno < end) {
+			struct cached_entry *ce = find_cached_entry(&c, lno);
+			struct blame_entry *n = xcalloc(1, sizeof(*n));
+			struct blame_origin *suspect = c.origin[ce->origin].o;
+
+			n->lno = e->lno + lno - e->s_lno;
+			n->num_lines = ce->lno + ce->num_lines - lno;
+			if (n->num_lines > end - lno)
+				n->num_lines = end - lno;
+			n->s_lno = ce->s_lno + lno - ce->lno;
+			n->suspect = blame_origin_incref(suspect);
+			suspect->guilty = 1;
+			if (sb->found_guilty_entry)
+				sb->found_guilty_entry(n, sb->found_guilty_entry_data);
+			n->next = sb->ent;
+			sb->ent = n;
+			lno += n->num_lines;
+		}
+		blame_origin_decref(e->suspect);
+		free(e);
+	}
+	origin->suspects = NULL;
+	ret = 1;
+
+	/* keep it from being expired while it is being used */
+	utime(file, NULL);
+
+out:
+	for (i = 0; i < c.origin_nr; i++)
+		blame_origin_decref(c.origin[i].o);
+	clear_blame_cache(&c);
+	strbuf_release(&buf);
+	free(file);
+	return ret;
+}
+
+static int compare_entry_lno(const void *a, const void *b)
+{
+	const struct blame_entry *x = *(const struct blame_entry **)a;
+	const struct blame_entry *y = *(const struct blame_entry **)b;
+
+	return x->lno < y->lno ? -1 : x->lno > y->lno;
+}
+
+static int compare_origin_ptr(const void *a, const void *b)
+{
+	const struct blame_origin *x = *(const struct blame_origin **)a;
+	const struct blame_origin *y = *(const struct blame_origin **)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void add_cached_path(struct strbuf *out, const char *path)
+{
+	quote_c_style(path, out, NULL, 0);
+	strbuf_addch(out, '\n');
+}
+
+/*
+ * Record the final blame of the whole file in the cache, if that is
+ * what we have.
+ */
+static void write_blame_cache(struct blame_scoreboard *sb)
+{
+	struct blame_entry **ent, *e;
+	struct blame_origin **origin;
+	struct object_id blob;
+	unsigned mode;
+	struct strbuf out = STRBUF_INIT;
+	struct lock_file lk = LOCK_INIT;
+	char *file;
+	int i, nr = 0, nr_origin = 0, lno = 0;
+
+	if (is_null_oid(&sb->final->object.oid) ||
+	    !blame_cache_usable(sb, sb->path) ||
+	    get_tree_entry(&sb->final->object.oid, sb->path, &blob, &mode))
+		return;
+
+	for (e = sb->ent; e; e = e->next)
+		nr++;
+	ALLOC_ARRAY(ent, nr);
+	ALLOC_ARRAY(origin, nr);
+	for (e = sb->ent, i = 0; e; e = e->next, i++) {
+		ent[i] = e;
+		origin[i] = e->suspect;
+	}
+	QSORT(ent, nr, compare_entry_lno);
+	QSORT(origin, nr, compare_origin_ptr);
+	for (i = 0; i < nr; i++)
+		if (!nr_origin || origin[nr_origin - 1] != origin[i])
+			origin[nr_origin++] = origin[i];
+
+	strbuf_addf(&out, "blob %s %d\n", oid_to_hex(&blob), sb->num_lines);
+	for (i = 0; i < nr_origin; i++) {
+		struct blame_origin *o = origin[i];
+
+		strbuf_addf(&out, "origin %s %d ", oid_to_hex(&o->commit->object.oid),
+			    !!(o->commit->object.flags & UNINTERESTING));
+		add_cached_path(&out, o->path);
+		if (o->previous) {
+			strbuf_addf(&out, "previous %s ",
+				    oid_to_hex(&o->previous->commit->object.oid));
+			add_cached_path(&out, o->previous->path);
+		}
+	}
+	for (i = 0; i < nr; i++) {
+		struct blame_origin **o;
+		int num_lines = ent[i]->num_lines;
+
+		/* only the blame of the whole file is worth keeping */
+		if (ent[i]->lno != lno)
+			goto out;
+		o = bsearch(&ent[i]->suspect, origin, nr_origin, sizeof(*origin),
+			    compare_origin_ptr);
+		strbuf_addf(&out, "entry %d %d %d %d\n", lno, num_lines,
+			    ent[i]->s_lno, (int)(o - origin));
+		lno += num_lines;
+	}
+	if (lno != sb->num_lines)
+		goto out;
+
+	file = blame_cache_file(sb, sb->final, sb->path);
+	if (!safe_create_leading_directories(file) &&
+	    hold_lock_file_for_update(&lk, file, 0) >= 0) {
+		if (write_in_full(get_lock_file_fd(&lk), out.buf, out.len) < 0 ||
+		    commit_lock_file(&lk))
+			rollback_lock_file(&lk);
+	}
+	free(file);
+
+out:
+	strbuf_release(&out);
+	free(origin);
+	free(ent);
+}
+
+void prune_blame_cache(timestamp_t expire)
+{
+	struct strbuf path = STRBUF_INIT;
+	size_t baselen;
+	DIR *dir;
+	struct dirent *de;
+
+	strbuf_addstr(&path, git_path("blame-cache"));
+	dir = opendir(path.buf);
+	if (!dir) {
+		strbuf_release(&path);
+		return;
+	}
+	strbuf_addch(&path, '/');
+	baselen = path.len;
+	while ((de = readdir(dir)) != NULL) {
+		size_t sublen;
+		DIR *sub;
+		struct dirent *sde;
+
+		if (is_dot_or_dotdot(de->d_name))
+			continue;
+		strbuf_setlen(&path, baselen);
+		strbuf_addstr(&path, de->d_name);
+		sub = opendir(path.buf);
+		if (!sub)
+			continue;
+		strbuf_addch(&path, '/');
+		sublen = path.len;
+		while ((sde = readdir(sub)) != NULL) {
+			struct stat st;
+
+			if (is_dot_or_dotdot(sde->d_name))
+				continue;
+			strbuf_setlen(&path, sublen);
+			strbuf_addstr(&path, sde->d_name);
+			if (!lstat(path.buf, &st) && st.st_mtime < expire)
+				unlink_or_warn(path.buf);
+		}
+		closedir(sub);
+		strbuf_setlen(&path, sublen - 1);
+		rmdir(path.buf); /* fails unless it is empty */
+	}
+	closedir(dir);
+	strbuf_setlen(&path, baselen - 1);
+	rmdir(path.buf);
+	strbuf_release(&path);
+}
+
 /*
  * The main loop -- while we have blobs with lines whose true origin
  * is still unknown, pick one blob, and allow its lines to pass blames
@@ -1547,6 +1966,7 @@ void assign_blame(struct blame_scoreboard *sb, int opt)
 {
 	struct rev_info *revs = sb->revs;
 	struct commit *commit = prio_queue_get(&sb->commits);
+	int final_from_cache = 0;
 
 	while (commit) {
 		struct blame_entry *ent;
@@ -1569,11 +1989,14 @@ void assign_blame(struct blame_scoreboard *sb, int opt)
 		 */
 		blame_origin_incref(suspect);
 		parse_commit(commit);
-		if (sb->reverse ||
-		    (!(commit->object.flags & UNINTERESTING) &&
-		     !(revs->max_age != -1 && commit->date < revs->max_age)))
+		if (sb->use_cache && blame_from_cache(sb, suspect)) {
+			if (commit == sb->final)
+				final_from_cache = 1;
+		} else if (sb->reverse ||
+			   (!(commit->object.flags & UNINTERESTING) &&
+			    !(revs->max_age != -1 && commit->date < revs->max_age))) {
 			pass_blame(sb, suspect, opt);
-		else {
+		} else {
 			commit->object.flags |= UNINTERESTING;
 			if (commit->object.parsed)
 				mark_parents_uninteresting(commit);
@@ -1605,6 +2028,9 @@ void assign_blame(struct blame_scoreboard *sb, int opt)
 		if (sb->debug) /* sanity */
 			sanity_check_refcnt(sb);
 	}
+
+	if (sb->use_cache && !final_from_cache)
+		write_blame_cache(sb);
 }
 
 static const char *get_next_line(const char *start, const char *end)
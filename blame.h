@@ -142,6 +142,14 @@ struct blame_scoreboard {
 	int no_whole_file_rename;
 	int debug;
 
+	/*
+	 * Settle the blame of files at commits whose final blame is in
+	 * the blame cache from there, and record the final blame of
+	 * the whole file in it.  Only meaningful without move and copy
+	 * detection, and when walking all of the history.
+	 */
+	int use_cache;
+
 	/* callbacks */
 	void(*on_sanity_fail)(struct blame_scoreboard *, int);
 	void(*found_guilty_entry)(struct blame_entry *, void *);
@@ -172,4 +180,7 @@ extern void setup_scoreboard(struct blame_scoreboard *sb, const char *path, stru
 
 extern struct blame_entry *blame_entry_prepend(struct blame_entry *head, long start, long end, struct blame_origin *o);
 
+/* Remove the files of the blame cache not used since "expire". */
+extern void prune_blame_cache(timestamp_t expire);
+
 #endif /* BLAME_H */
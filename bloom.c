@@ -0,0 +1,314 @@
+#include "cache.h"
+#include "bloom.h"
+#include "diff.h"
+#include "diffcore.h"
+#include "commit-graph.h"
+#include "commit.h"
+#include "commit-slab.h"
+#include "object-store.h"
+
+define_commit_slab(bloom_filter_slab, struct bloom_filter);
+
+static struct bloom_filter_slab bloom_filters;
+static int bloom_filters_initialized;
+
+/* the data of the filters we computed, as opposed to read from a graph */
+static unsigned char **computed_filters;
+static size_t computed_filters_nr, computed_filters_alloc;
+
+#define BITS_PER_WORD 8
+#define BLOOM_KEY_SEED_0 0x293ae76f
+#define BLOOM_KEY_SEED_1 0x7e646e2c
+
+static uint32_t rotate_left(uint32_t value, int32_t count)
+{
+	uint32_t mask = 8 * sizeof(uint32_t) - 1;
+	count &= mask;
+	return ((value << count) | (value >> ((-count) & mask)));
+}
+
+static inline size_t get_bitmask(uint32_t pos)
+{
+	return ((size_t)1) << (pos & (BITS_PER_WORD - 1));
+}
+
+/*
+ * Seeded murmur3 as described in
+ * https://en.wikipedia.org/wiki/MurmurHash#Algorithm, reading the
+ * data as unsigned bytes in little-endian order.
+ */
+uint32_t murmur3_seeded(uint32_t seed, const char *data, size_t len)
+{
+	const unsigned char *bytes = (const unsigned char *)data;
+	const uint32_t c1 = 0xcc9e2d51;
+	const uint32_t c2 = 0x1b873593;
+	const uint32_t r1 = 15;
+	const uint32_t r2 = 13;
+	const uint32_t m = 5;
+	const uint32_t n = 0xe6546b64;
+	size_t i, len4 = len / sizeof(uint32_t);
+	uint32_t k, k1 = 0;
+	const unsigned char *tail;
+
+	for (i = 0; i < len4; i++) {
+		k = (uint32_t)bytes[4 * i] |
+		    ((uint32_t)bytes[4 * i + 1] << 8) |
+		    ((uint32_t)bytes[4 * i + 2] << 16) |
+		    ((uint32_t)bytes[4 * i + 3] << 24);
+		k *= c1;
+		k = rotate_left(k, r1);
+		k *= c2;
+
+		seed ^= k;
+		seed = rotate_left(seed, r2) * m + n;
+	}
+
+	tail = bytes + len4 * sizeof(uint32_t);
+
+	switch (len & (sizeof(uint32_t) - 1)) {
+	case 3:
+		k1 ^= ((uint32_t)tail[2]) << 16;
+		/* fallthrough */
+	case 2:
+		k1 ^= ((uint32_t)tail[1]) << 8;
+		/* fallthrough */
+	case 1:
+		k1 ^= ((uint32_t)tail[0]) << 0;
+		k1 *= c1;
+		k1 = rotate_left(k1, r1);
+		k1 *= c2;
+		seed ^= k1;
+		break;
+	}
+
+	seed ^= (uint32_t)len;
+	seed ^= (seed >> 16);
+	seed *= 0x85ebca6b;
+	seed ^= (seed >> 13);
+	seed *= 0xc2b2ae35;
+	seed ^= (seed >> 16);
+
+	return seed;
+}
+
+void fill_bloom_key(const char *data, size_t len,
+		    struct bloom_key *key,
+		    const struct bloom_filter_settings *settings)
+{
+	int i;
+	const uint32_t hash0 = murmur3_seeded(BLOOM_KEY_SEED_0, data, len);
+	const uint32_t hash1 = murmur3_seeded(BLOOM_KEY_SEED_1, data, len);
+
+	ALLOC_ARRAY(key->hashes, settings->num_hashes);
+	for (i = 0; i < settings->num_hashes; i++)
+		key->hashes[i] = hash0 + i * hash1;
+}
+
+void clear_bloom_key(struct bloom_key *key)
+{
+	FREE_AND_NULL(key->hashes);
+}
+
+void add_key_to_filter(const struct bloom_key *key,
+		       struct bloom_filter *filter,
+		       const struct bloom_filter_settings *settings)
+{
+	int i;
+	uint64_t mod = filter->len * BITS_PER_WORD;
+
+	for (i = 0; i < settings->num_hashes; i++) {
+		uint64_t hash_mod = key->hashes[i] % mod;
+		uint64_t block_pos = hash_mod / BITS_PER_WORD;
+
+		filter->data[block_pos] |= get_bitmask(hash_mod);
+	}
+}
+
+int bloom_filter_contains(const struct bloom_filter *filter,
+			  const struct bloom_key *key,
+			  const struct bloom_filter_settings *settings)
+{
+	int i;
+	uint64_t mod = filter->len * BITS_PER_WORD;
+
+	if (!mod)
+		return -1;
+
+	for (i = 0; i < settings->num_hashes; i++) {
+		uint64_t hash_mod = key->hashes[i] % mod;
+		uint64_t block_pos = hash_mod / BITS_PER_WORD;
+
+		if (!(filter->data[block_pos] & get_bitmask(hash_mod)))
+			return 0;
+	}
+
+	return 1;
+}
+
+static int load_bloom_filter_from_graph(struct commit_graph *g,
+					struct bloom_filter *filter,
+					struct commit *c)
+{
+	uint32_t lex_pos, start_index, end_index;
+
+	if (!g->chunk_bloom_indexes)
+		return 0;
+
+	lex_pos = c->graph_pos;
+	if (lex_pos >= g->num_commits)
+		return 0;
+
+	end_index = get_be32(g->chunk_bloom_indexes + 4 * lex_pos);
+	if (lex_pos > 0)
+		start_index = get_be32(g->chunk_bloom_indexes + 4 * (lex_pos - 1));
+	else
+		start_index = 0;
+
+	if (start_index > end_index ||
+	    end_index > g->chunk_bloom_data_size - BLOOMDATA_CHUNK_HEADER_SIZE) {
+		warning(_("ignoring out-of-range Bloom filter for commit %s"),
+			oid_to_hex(&c->object.oid));
+		return 0;
+	}
+
+	filter->len = end_index - start_index;
+	filter->data = (unsigned char *)(g->chunk_bloom_data +
+					 BLOOMDATA_CHUNK_HEADER_SIZE +
+					 start_index);
+	return 1;
+}
+
+/*
+ * A pathspec naming a directory must match the commits that change
+ * anything below it, so the filter records the leading directories of
+ * every changed path as well.
+ */
+static void add_path_and_leading_dirs(struct string_list *paths,
+				      const char *path)
+{
+	const char *slash;
+
+	for (slash = strchr(path, '/'); slash; slash = strchr(slash + 1, '/'))
+		string_list_append_nodup(paths, xstrndup(path, slash - path));
+	string_list_append(paths, path);
+}
+
+static void compute_bloom_filter(struct commit *c, struct bloom_filter *filter,
+				 const struct bloom_filter_settings *settings)
+{
+	struct diff_options diffopt;
+	struct string_list paths = STRING_LIST_INIT_DUP;
+	int i;
+
+	diff_setup(&diffopt);
+	diffopt.flags.recursive = 1;
+	diff_setup_done(&diffopt);
+
+	if (c->parents) {
+		struct commit *parent = c->parents->item;
+
+		if (parse_commit(parent))
+			die(_("unable to parse commit %s"),
+			    oid_to_hex(&parent->object.oid));
+		diff_tree_oid(&parent->tree->object.oid, &c->tree->object.oid,
+			      "", &diffopt);
+	} else
+		diff_tree_oid(NULL, &c->tree->object.oid, "", &diffopt);
+
+	if (diff_queued_diff.nr <= BLOOM_FILTER_MAX_CHANGED_PATHS) {
+		for (i = 0; i < diff_queued_diff.nr; i++) {
+			struct diff_filepair *p = diff_queued_diff.queue[i];
+			add_path_and_leading_dirs(&paths, p->two->path);
+		}
+		string_list_sort(&paths);
+		string_list_remove_duplicates(&paths, 0);
+	}
+
+	if (diff_queued_diff.nr > BLOOM_FILTER_MAX_CHANGED_PATHS) {
+		/* a filter that matches everything */
+		filter->len = 1;
+		filter->data = xmalloc(1);
+		filter->data[0] = 0xFF;
+	} else if (!paths.nr) {
+		/* a filter that matches nothing */
+		filter->len = 1;
+		filter->data = xcalloc(1, 1);
+	} else {
+		filter->len = DIV_ROUND_UP(paths.nr * settings->bits_per_entry,
+					   BITS_PER_WORD);
+		filter->data = xcalloc(filter->len, 1);
+
+		for (i = 0; i < paths.nr; i++) {
+			struct bloom_key key;
+			const char *path = paths.items[i].string;
+
+			fill_bloom_key(path, strlen(path), &key, settings);
+			add_key_to_filter(&key, filter, settings);
+			clear_bloom_key(&key);
+		}
+	}
+
+	for (i = 0; i < diff_queued_diff.nr; i++)
+		diff_free_filepair(diff_queued_diff.queue[i]);
+	free(diff_queued_diff.queue);
+	DIFF_QUEUE_CLEAR(&diff_queued_diff);
+	string_list_clear(&paths, 0);
+}
+
+struct bloom_filter *get_bloom_filter(struct commit *c,
+				      int compute_if_not_present)
+{
+	struct bloom_filter *filter;
+	struct bloom_filter_settings settings = DEFAULT_BLOOM_FILTER_SETTINGS;
+
+	if (!bloom_filters_initialized) {
+		init_bloom_filter_slab(&bloom_filters);
+		bloom_filters_initialized = 1;
+	}
+
+	filter = bloom_filter_slab_at(&bloom_filters, c);
+	if (filter->data)
+		return filter;
+
+	if (c->graph_pos != COMMIT_NOT_FROM_GRAPH && prepare_commit_graph()) {
+		struct commit_graph *g = the_repository->objects->commit_graph;
+
+		/*
+		 * Filters computed with other settings cannot be mixed
+		 * with the ones we would compute ourselves.
+		 */
+		if ((!compute_if_not_present ||
+		     (g->bloom_filter_settings &&
+		      g->bloom_filter_settings->num_hashes == settings.num_hashes &&
+		      g->bloom_filter_settings->bits_per_entry == settings.bits_per_entry)) &&
+		    load_bloom_filter_from_graph(g, filter, c))
+			return filter;
+	}
+
+	if (!compute_if_not_present)
+		return NULL;
+
+	if (parse_commit(c))
+		die(_("unable to parse commit %s"), oid_to_hex(&c->object.oid));
+	compute_bloom_filter(c, filter, &settings);
+	ALLOC_GROW(computed_filters, computed_filters_nr + 1,
+		   computed_filters_alloc);
+	computed_filters[computed_filters_nr++] = filter->data;
+	return filter;
+}
+
+void clear_bloom_filters(void)
+{
+	size_t i;
+
+	if (!bloom_filters_initialized)
+		return;
+
+	for (i = 0; i < computed_filters_nr; i++)
+		free(computed_filters[i]);
+	FREE_AND_NULL(computed_filters);
+	computed_filters_nr = computed_filters_alloc = 0;
+
+	clear_bloom_filter_slab(&bloom_filters);
+	bloom_filters_initialized = 0;
+}
@@ -46,6 +46,7 @@ static int xdl_opts;
 static int abbrev = -1;
 static int no_whole_file_rename;
 static int show_progress;
+static int use_blame_cache;
 
 static struct date_mode blame_date_mode = { DATE_ISO8601 };
 static size_t blame_date_width;
@@ -583,6 +584,22 @@ static const char *add_prefix(const char *prefix, const char *path)
 	return prefix_path(prefix, prefix ? strlen(prefix) : 0, path);
 }
 
+/*
+ * The blame cache records blame with all of the history to look at;
+ * it is of no use when digging stops at a bottom commit or a date.
+ */
+static int is_limited(struct rev_info *revs)
+{
+	int i;
+
+	if (revs->max_age != -1)
+		return 1;
+	for (i = 0; i < revs->pending.nr; i++)
+		if (revs->pending.objects[i].item->flags & UNINTERESTING)
+			return 1;
+	return 0;
+}
+
 static int git_blame_config(const char *var, const char *value, void *cb)
 {
 	if (!strcmp(var, "blame.showroot")) {
@@ -601,6 +618,10 @@ static int git_blame_config(const char *var, const char *value, void *cb)
 			*output_option &= ~OUTPUT_SHOW_EMAIL;
 		return 0;
 	}
+	if (!strcmp(var, "blame.cache")) {
+		use_blame_cache = git_config_bool(var, value);
+		return 0;
+	}
 	if (!strcmp(var, "blame.date")) {
 		if (!value)
 			return config_error_nonbool(var);
@@ -679,6 +700,7 @@ int cmd_blame(int argc, const char **argv, const char *prefix)
 		OPT_BOOL(0, "root", &show_root, N_("Do not treat root commits as boundaries (Default: off)")),
 		OPT_BOOL(0, "show-stats", &show_stats, N_("Show work cost statistics")),
 		OPT_BOOL(0, "progress", &show_progress, N_("Force progress reporting")),
+		OPT_BOOL(0, "cache", &use_blame_cache, N_("Use and update the blame cache (Default: blame.cache)")),
 		OPT_BIT(0, "score-debug", &output_option, N_("Show output score for blame entries"), OUTPUT_SHOW_SCORE),
 		OPT_BIT('f', "show-name", &output_option, N_("Show original filename (Default: auto)"), OUTPUT_SHOW_NAME),
 		OPT_BIT('n', "show-number", &output_option, N_("Show original linenumber (Default: off)"), OUTPUT_SHOW_NUMBER),
@@ -873,6 +895,8 @@ int cmd_blame(int argc, const char **argv, const char *prefix)
 	sb.revs = &revs;
 	sb.contents_from = contents_from;
 	sb.reverse = reverse;
+	sb.use_cache = use_blame_cache && !reverse && !revs_file && !opt &&
+		       !is_limited(&revs);
 	setup_scoreboard(&sb, path, &o);
 	lno = sb.num_lines;
 
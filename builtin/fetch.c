@@ -264,7 +264,7 @@ static void find_non_local_tags(struct transport *transport,
 	struct string_list_item *item = NULL;
 
 	for_each_ref(add_existing, &existing_refs);
-	for (ref = transport_get_remote_refs(transport); ref; ref = ref->next) {
+	for (ref = transport_get_remote_refs(transport, NULL); ref; ref = ref->next) {
 		if (!starts_with(ref->name, "refs/tags/"))
 			continue;
 
@@ -350,7 +350,34 @@ static struct ref *get_ref_map(struct transport *transport,
 	/* opportunistically-updated references: */
 	struct ref *orefs = NULL, **oref_tail = &orefs;
 
-	const struct ref *remote_refs = transport_get_remote_refs(transport);
+	const struct ref *remote_refs;
+	struct argv_array ref_prefixes = ARGV_ARRAY_INIT;
+
+	/*
+	 * Only ask for the refs the refspecs can match (the server
+	 * may still send more); without command-line refspecs the
+	 * configured ones decide, unless HEAD is what gets fetched.
+	 */
+	if (refspec_count) {
+		refspec_ref_prefixes(refspecs, refspec_count, &ref_prefixes);
+	} else if (transport->remote && transport->remote->fetch_refspec_nr) {
+		struct branch *branch = branch_get(NULL);
+
+		refspec_ref_prefixes(transport->remote->fetch,
+				     transport->remote->fetch_refspec_nr,
+				     &ref_prefixes);
+		if (branch_has_merge_config(branch) &&
+		    !strcmp(branch->remote_name, transport->remote->name)) {
+			for (i = 0; i < branch->merge_nr; i++)
+				expand_ref_prefix(&ref_prefixes,
+						  branch->merge[i]->src);
+		}
+	}
+	if (ref_prefixes.argc && tags != TAGS_UNSET)
+		argv_array_push(&ref_prefixes, "refs/tags/");
+
+	remote_refs = transport_get_remote_refs(transport, &ref_prefixes);
+	argv_array_clear(&ref_prefixes);
 
 	if (refspec_count) {
 		struct refspec *fetch_refspec;
@@ -0,0 +1,602 @@
+#include "builtin.h"
+#include "config.h"
+#include "dir.h"
+#include "fsmonitor.h"
+#include "hashmap.h"
+#include "parse-options.h"
+#include "run-command.h"
+#include "sigchain.h"
+#include "tempfile.h"
+#include "unix-socket.h"
+
+static const char * const builtin_fsmonitor_daemon_usage[] = {
+	N_("git fsmonitor--daemon start"),
+	N_("git fsmonitor--daemon run [--debug]"),
+	N_("git fsmonitor--daemon stop"),
+	N_("git fsmonitor--daemon status"),
+	NULL
+};
+
+#if defined(HAVE_INOTIFY) && !defined(NO_UNIX_SOCKETS)
+
+#include <sys/inotify.h>
+
+/*
+ * The daemon watches every directory of the working tree with inotify
+ * and remembers, for each path that changed since it started, when it
+ * last changed. A query gives the time of the previous one, exactly as
+ * the "fsmonitor-watchman" hook is given it, and the paths that changed
+ * since are sent back in the format such a hook uses: NUL-terminated
+ * paths, with a trailing '/' for a directory that appeared, went away
+ * or was renamed as a whole, or a lone "/" if the daemon cannot tell,
+ * so that everything has to be checked.
+ */
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | \
+		    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | \
+		    IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | \
+		    IN_EXCL_UNLINK)
+
+/*
+ * Once this many different paths have changed, the journal starts
+ * over, and clients that have not asked since are told to check
+ * everything.
+ */
+#define MAX_JOURNAL_ENTRIES 100000
+
+/*
+ * The time of a query comes from another process, and is compared to
+ * ours; a change that happened slightly before it is sent again rather
+ * than risking to miss one because of rounding or clock adjustments.
+ */
+#define CLOCK_SLACK_NS (100 * 1000 * 1000)
+
+struct watched_dir {
+	struct hashmap_entry ent;
+	int wd;
+	/* relative to the top of the working tree, with a trailing '/' */
+	char path[FLEX_ARRAY];
+};
+
+struct journal_entry {
+	struct hashmap_entry ent;
+	uint64_t when;
+	char path[FLEX_ARRAY];
+};
+
+static int inotify_fd = -1;
+static struct hashmap watched_dirs;
+static struct hashmap journal;
+static uint64_t journal_start;
+static int debug;
+
+static int watched_dir_cmp(const void *unused_cmp_data,
+			   const void *entry, const void *entry_or_key,
+			   const void *unused_keydata)
+{
+	const struct watched_dir *a = entry;
+	const struct watched_dir *b = entry_or_key;
+
+	return a->wd != b->wd;
+}
+
+static int journal_entry_cmp(const void *unused_cmp_data,
+			     const void *entry, const void *entry_or_key,
+			     const void *keydata)
+{
+	const struct journal_entry *a = entry;
+	const struct journal_entry *b = entry_or_key;
+
+	return strcmp(a->path, keydata ? keydata : b->path);
+}
+
+/*
+ * The clients stamp their queries with getnanotime(), which starts out
+ * from the wall clock; so do we, every time, as we live much longer
+ * than they do and their idea of the time would drift from ours.
+ */
+static uint64_t now_ns(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+}
+
+static void trace_daemon(const char *fmt, ...)
+{
+	va_list ap;
+
+	if (!debug)
+		return;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+static void reset_journal(void)
+{
+	hashmap_free(&journal, 1);
+	hashmap_init(&journal, journal_entry_cmp, NULL, 0);
+	journal_start = now_ns();
+}
+
+static void record_change(const char *path)
+{
+	unsigned int hash = strhash(path);
+	struct journal_entry key, *e;
+
+	hashmap_entry_init(&key, hash);
+	e = hashmap_get(&journal, &key, path);
+	if (!e) {
+		if (hashmap_get_size(&journal) >= MAX_JOURNAL_ENTRIES)
+			reset_journal();
+		FLEX_ALLOC_STR(e, path, path);
+		hashmap_entry_init(e, hash);
+		hashmap_add(&journal, e);
+	}
+	e->when = now_ns();
+	trace_daemon("changed: %s", path);
+}
+
+static struct watched_dir *find_watch(int wd)
+{
+	struct watched_dir key;
+
+	hashmap_entry_init(&key, memhash(&wd, sizeof(wd)));
+	key.wd = wd;
+	return hashmap_get(&watched_dirs, &key, NULL);
+}
+
+static void forget_watch(struct watched_dir *w)
+{
+	hashmap_remove(&watched_dirs, w, NULL);
+	free(w);
+}
+
+static int is_directory_entry(const char *path, struct dirent *de)
+{
+	struct stat st;
+
+	if (DTYPE(de) != DT_UNKNOWN)
+		return DTYPE(de) == DT_DIR;
+	return !lstat(path, &st) && S_ISDIR(st.st_mode);
+}
+
+/*
+ * Watch the directory "dir" (empty for the top of the working tree,
+ * otherwise with a trailing '/') and everything below it, except for
+ * repositories.
+ */
+static void watch_directory(struct strbuf *dir)
+{
+	const char *name = dir->len ? dir->buf : ".";
+	size_t baselen = dir->len;
+	struct watched_dir *w;
+	struct dirent *de;
+	DIR *d;
+	int wd;
+
+	wd = inotify_add_watch(inotify_fd, name, WATCH_MASK);
+	if (wd < 0) {
+		if (errno == ENOSPC)
+			die(_("too many directories to watch; consider raising "
+			      "fs.inotify.max_user_watches"));
+		/* it went away again, or is not a directory after all */
+		return;
+	}
+
+	/* the same directory may be seen again under a new name */
+	w = find_watch(wd);
+	if (w)
+		forget_watch(w);
+	FLEX_ALLOC_MEM(w, path, dir->buf, dir->len);
+	hashmap_entry_init(w, memhash(&wd, sizeof(wd)));
+	w->wd = wd;
+	hashmap_add(&watched_dirs, w);
+
+	d = opendir(name);
+	if (!d)
+		return;
+	while ((de = readdir(d)) != NULL) {
+		if (is_dot_or_dotdot(de->d_name) ||
+		    !fspathcmp(de->d_name, ".git"))
+			continue;
+		strbuf_setlen(dir, baselen);
+		strbuf_addstr(dir, de->d_name);
+		if (!is_directory_entry(dir->buf, de))
+			continue;
+		strbuf_addch(dir, '/');
+		watch_directory(dir);
+	}
+	strbuf_setlen(dir, baselen);
+	closedir(d);
+}
+
+/*
+ * A directory was moved away: the watches below it still carry the old
+ * names, so drop them; should it reappear in the working tree, it is
+ * watched anew under its new name.
+ */
+static void unwatch_directory(const char *dir)
+{
+	struct hashmap_iter iter;
+	struct watched_dir *w;
+	struct watched_dir **gone = NULL;
+	size_t nr = 0, alloc = 0, i;
+
+	hashmap_iter_init(&watched_dirs, &iter);
+	while ((w = hashmap_iter_next(&iter))) {
+		if (!starts_with(w->path, dir))
+			continue;
+		ALLOC_GROW(gone, nr + 1, alloc);
+		gone[nr++] = w;
+	}
+
+	for (i = 0; i < nr; i++) {
+		inotify_rm_watch(inotify_fd, gone[i]->wd);
+		forget_watch(gone[i]);
+	}
+	free(gone);
+}
+
+/*
+ * The kernel dropped events, among them possibly the creation of
+ * directories we would have had to watch: start over from scratch,
+ * and tell every client to check everything.
+ */
+static void rewatch_everything(void)
+{
+	struct strbuf dir = STRBUF_INIT;
+
+	unwatch_directory("");
+	watch_directory(&dir);
+	strbuf_release(&dir);
+	reset_journal();
+}
+
+static void handle_event(const struct inotify_event *ev, struct strbuf *path)
+{
+	struct watched_dir *w;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		trace_daemon("event queue overflow");
+		rewatch_everything();
+		return;
+	}
+
+	w = find_watch(ev->wd);
+	if (!w)
+		return;
+
+	if (ev->mask & IN_IGNORED) {
+		forget_watch(w);
+		return;
+	}
+
+	if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+		if (!*w->path) {
+			trace_daemon("the working tree went away");
+			exit(0);
+		}
+		/* the event in the parent directory tells us about it */
+		return;
+	}
+
+	/* we do not care about the directory's own attributes */
+	if (!ev->len)
+		return;
+	if (!*w->path && !fspathcmp(ev->name, ".git"))
+		return;
+
+	strbuf_reset(path);
+	strbuf_addstr(path, w->path);
+	strbuf_addstr(path, ev->name);
+
+	if (ev->mask & IN_ISDIR) {
+		if (!(ev->mask & (IN_CREATE | IN_DELETE |
+				  IN_MOVED_FROM | IN_MOVED_TO)))
+			return;
+		strbuf_addch(path, '/');
+		if (ev->mask & IN_MOVED_FROM)
+			unwatch_directory(path->buf);
+		if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+			watch_directory(path);
+	}
+
+	record_change(path->buf);
+}
+
+/*
+ * Handle all events queued so far. The kernel queues an event as part
+ * of the system call making the change, so once this returns, every
+ * change made before it was called is in the journal.
+ */
+static void read_events(void)
+{
+	static union {
+		struct inotify_event ev;
+		char buf[64 * 1024];
+	} u;
+	struct strbuf path = STRBUF_INIT;
+
+	for (;;) {
+		ssize_t len = read(inotify_fd, u.buf, sizeof(u.buf));
+		char *p;
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			die_errno(_("could not read file system events"));
+		}
+		if (!len)
+			break;
+
+		for (p = u.buf; p < u.buf + len; ) {
+			const struct inotify_event *ev = (void *)p;
+			handle_event(ev, &path);
+			p += sizeof(*ev) + ev->len;
+		}
+	}
+
+	strbuf_release(&path);
+}
+
+static void answer_query(const char *args, struct strbuf *answer)
+{
+	struct hashmap_iter iter;
+	struct journal_entry *e;
+	uint64_t since = 0, now = now_ns();
+	char *end;
+	int version;
+
+	version = strtol(args, &end, 10);
+	if (*end == ' ')
+		since = strtoumax(end + 1, &end, 10);
+	if (*end || !since || version != 1) {
+		warning(_("fsmonitor--daemon client sent bogus query: %s"), args);
+		strbuf_addch(answer, '/');
+		return;
+	}
+
+	/*
+	 * We were not watching yet, or lost track since, or the clock
+	 * was turned back and "since" cannot be compared with our times.
+	 */
+	if (since < journal_start + CLOCK_SLACK_NS ||
+	    since > now + CLOCK_SLACK_NS) {
+		strbuf_addch(answer, '/');
+		return;
+	}
+
+	since -= CLOCK_SLACK_NS;
+	hashmap_iter_init(&journal, &iter);
+	while ((e = hashmap_iter_next(&iter)))
+		if (e->when >= since)
+			strbuf_add(answer, e->path, strlen(e->path) + 1);
+}
+
+static void serve_one_client(int fd)
+{
+	struct strbuf request = STRBUF_INIT;
+	struct strbuf answer = STRBUF_INIT;
+	const char *args;
+
+	if (strbuf_read(&request, fd, 0) < 0) {
+		warning_errno(_("could not read fsmonitor--daemon request"));
+		goto out;
+	}
+	strbuf_rtrim(&request);
+	trace_daemon("request: %s", request.buf);
+
+	if (skip_prefix(request.buf, "query ", &args)) {
+		read_events();
+		answer_query(args, &answer);
+	} else if (!strcmp(request.buf, "stop")) {
+		/*
+		 * As in credential-cache--daemon, exit() removes the socket
+		 * in our atexit() handler before the client sees EOF.
+		 */
+		exit(0);
+	} else if (!strcmp(request.buf, "status")) {
+		strbuf_addf(&answer, "%s\n", get_git_work_tree());
+	} else
+		warning(_("fsmonitor--daemon client sent unknown request: %s"),
+			request.buf);
+
+	write_in_full(fd, answer.buf, answer.len);
+out:
+	strbuf_release(&request);
+	strbuf_release(&answer);
+}
+
+static void serve(int listen_fd)
+{
+	for (;;) {
+		struct pollfd pfd[2];
+
+		pfd[0].fd = inotify_fd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = listen_fd;
+		pfd[1].events = POLLIN;
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno != EINTR)
+				die_errno(_("poll failed"));
+			continue;
+		}
+
+		if (pfd[0].revents & POLLIN)
+			read_events();
+
+		if (pfd[1].revents & POLLIN) {
+			int client = accept(listen_fd, NULL, NULL);
+			if (client < 0) {
+				warning_errno(_("accept failed"));
+				continue;
+			}
+			serve_one_client(client);
+			close(client);
+		}
+	}
+}
+
+static int fsmonitor_run(int report_ready)
+{
+	struct strbuf dir = STRBUF_INIT;
+	struct tempfile *socket_file;
+	char *socket_path;
+	int fd;
+
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd < 0)
+		die_errno(_("could not initialize inotify"));
+
+	hashmap_init(&watched_dirs, watched_dir_cmp, NULL, 0);
+	watch_directory(&dir);
+	strbuf_release(&dir);
+	/*
+	 * Only from now on are all directories watched; queries for
+	 * changes since an earlier time will be told to check everything.
+	 */
+	reset_journal();
+
+	socket_path = absolute_pathdup(git_path_fsmonitor_daemon_socket());
+	fd = unix_stream_listen(socket_path);
+	if (fd < 0)
+		die_errno(_("unable to bind to '%s'"), socket_path);
+	socket_file = register_tempfile(socket_path);
+	sigchain_push(SIGPIPE, SIG_IGN);
+
+	trace_daemon("watching '%s' with %u directories",
+		     get_git_work_tree(), hashmap_get_size(&watched_dirs));
+	if (report_ready) {
+		printf("ok\n");
+		fclose(stdout);
+		if (!debug && !freopen("/dev/null", "w", stderr))
+			die_errno(_("unable to point stderr to /dev/null"));
+	}
+
+	serve(fd);
+
+	close(fd);
+	delete_tempfile(&socket_file);
+	free(socket_path);
+	return 0;
+}
+
+static int send_request(const char *request, struct strbuf *answer)
+{
+	int fd = unix_stream_connect(git_path_fsmonitor_daemon_socket());
+
+	if (fd < 0)
+		return -1;
+	if (write_in_full(fd, request, strlen(request)) < 0 ||
+	    shutdown(fd, SHUT_WR) < 0 ||
+	    strbuf_read(answer, fd, 0) < 0) {
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+static int fsmonitor_start(void)
+{
+	struct child_process daemon = CHILD_PROCESS_INIT;
+	struct strbuf answer = STRBUF_INIT;
+	char buf[128];
+	int r;
+
+	if (!send_request("status", &answer))
+		die(_("fsmonitor--daemon is already watching '%s'"),
+		    get_git_work_tree());
+	strbuf_release(&answer);
+
+	argv_array_pushl(&daemon.args, "fsmonitor--daemon", "run",
+			 "--report-ready", NULL);
+	daemon.git_cmd = 1;
+	daemon.no_stdin = 1;
+	daemon.out = -1;
+
+	if (start_command(&daemon))
+		die_errno(_("unable to start fsmonitor--daemon"));
+	r = read_in_full(daemon.out, buf, sizeof(buf));
+	if (r < 0)
+		die_errno(_("unable to read result code from fsmonitor--daemon"));
+	if (r != 3 || memcmp(buf, "ok\n", 3))
+		die(_("fsmonitor--daemon did not start: %.*s"), r, buf);
+	close(daemon.out);
+	return 0;
+}
+
+static int fsmonitor_stop(void)
+{
+	struct strbuf answer = STRBUF_INIT;
+
+	if (send_request("stop", &answer)) {
+		if (errno != ENOENT && errno != ECONNREFUSED)
+			die_errno(_("unable to connect to fsmonitor--daemon"));
+		return error(_("fsmonitor--daemon is not running"));
+	}
+	strbuf_release(&answer);
+	return 0;
+}
+
+static int fsmonitor_status(void)
+{
+	struct strbuf answer = STRBUF_INIT;
+
+	if (send_request("status", &answer)) {
+		printf(_("fsmonitor--daemon is not running\n"));
+		return 1;
+	}
+	strbuf_rtrim(&answer);
+	printf(_("fsmonitor--daemon is watching '%s'\n"), answer.buf);
+	strbuf_release(&answer);
+	return 0;
+}
+
+int cmd_fsmonitor__daemon(int argc, const char **argv, const char *prefix)
+{
+	int report_ready = 0;
+	struct option options[] = {
+		OPT_BOOL(0, "debug", &debug,
+			 N_("print debugging messages to stderr")),
+		OPT_HIDDEN_BOOL(0, "report-ready", &report_ready,
+				N_("print \"ok\" and detach stdio once listening")),
+		OPT_END()
+	};
+
+	git_config(git_default_config, NULL);
+	argc = parse_options(argc, argv, prefix, options,
+			     builtin_fsmonitor_daemon_usage, 0);
+	if (argc != 1)
+		usage_with_options(builtin_fsmonitor_daemon_usage, options);
+
+	if (!strcmp(argv[0], "start"))
+		return fsmonitor_start();
+	if (!strcmp(argv[0], "run"))
+		return fsmonitor_run(report_ready);
+	if (!strcmp(argv[0], "stop"))
+		return !!fsmonitor_stop();
+	if (!strcmp(argv[0], "status"))
+		return fsmonitor_status();
+
+	usage_with_options(builtin_fsmonitor_daemon_usage, options);
+}
+
+#else
+
+int cmd_fsmonitor__daemon(int argc, const char **argv, const char *prefix)
+{
+	if (argc == 2 && !strcmp(argv[1], "-h"))
+		usage(builtin_fsmonitor_daemon_usage[0]);
+	die(_("fsmonitor--daemon is not supported on this platform"));
+}
+
+#endif
@@ -22,6 +22,8 @@
 #include "commit.h"
 #include "packfile.h"
 #include "object-store.h"
+#include "commit-graph.h"
+#include "blame.h"
 
 #define FAILED_RUN "failed to run %s"
 
@@ -37,10 +39,13 @@ static int aggressive_window = 250;
 static int gc_auto_threshold = 6700;
 static int gc_auto_pack_limit = 50;
 static int detach_auto = 1;
+static int gc_write_commit_graph;
 static timestamp_t gc_log_expire_time;
 static const char *gc_log_expire = "1.day.ago";
 static const char *prune_expire = "2.weeks.ago";
 static const char *prune_worktrees_expire = "3.months.ago";
+static timestamp_t blame_cache_expire_time;
+static const char *blame_cache_expire = "1.week.ago";
 
 static struct argv_array pack_refs_cmd = ARGV_ARRAY_INIT;
 static struct argv_array reflog = ARGV_ARRAY_INIT;
@@ -124,9 +129,11 @@ static void gc_config(void)
 	git_config_get_int("gc.auto", &gc_auto_threshold);
 	git_config_get_int("gc.autopacklimit", &gc_auto_pack_limit);
 	git_config_get_bool("gc.autodetach", &detach_auto);
+	git_config_get_bool("gc.writecommitgraph", &gc_write_commit_graph);
 	git_config_get_expiry("gc.pruneexpire", &prune_expire);
 	git_config_get_expiry("gc.worktreepruneexpire", &prune_worktrees_expire);
 	git_config_get_expiry("gc.logexpiry", &gc_log_expire);
+	git_config_get_expiry("gc.blamecacheexpire", &blame_cache_expire);
 
 	git_config(git_default_config, NULL);
 }
@@ -383,6 +390,9 @@ int cmd_gc(int argc, const char **argv, const char *prefix)
 	gc_config();
 	if (parse_expiry_date(gc_log_expire, &gc_log_expire_time))
 		die(_("Failed to parse gc.logexpiry value %s"), gc_log_expire);
+	if (parse_expiry_date(blame_cache_expire, &blame_cache_expire_time))
+		die(_("Failed to parse gc.blameCacheExpire value %s"),
+		    blame_cache_expire);
 
 	if (pack_refs < 0)
 		pack_refs = !is_bare_repository();
@@ -479,11 +489,16 @@ int cmd_gc(int argc, const char **argv, const char *prefix)
 	if (run_command_v_opt(rerere.argv, RUN_GIT_CMD))
 		return error(FAILED_RUN, rerere.argv[0]);
 
+	prune_blame_cache(blame_cache_expire_time);
+
 	report_garbage = report_pack_garbage;
 	reprepare_packed_git(the_repository);
 	if (pack_garbage.nr > 0)
 		clean_pack_garbage();
 
+	if (gc_write_commit_graph)
+		write_commit_graph_reachable(get_object_directory(), 0);
+
 	if (auto_gc && too_many_loose_objects())
 		warning(_("There are too many unreachable loose objects; "
 			"run 'git prune' to remove them."));
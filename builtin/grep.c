@@ -23,6 +23,10 @@
 #include "submodule.h"
 #include "submodule-config.h"
 #include "object-store.h"
+#include "thread-utils.h"
+#include "convert.h"
+#include "sha1-array.h"
+#include "trigram-index.h"
 
 static char const * const grep_usage[] = {
 	N_("git grep [<options>] [-e] <pattern> [<rev>...] [[--] <path>...]"),
@@ -31,9 +35,13 @@ static char const * const grep_usage[] = {
 
 static int recurse_submodules;
 
-#define GREP_NUM_THREADS_DEFAULT 8
 static int num_threads;
 
+static int use_trigram_index;
+static struct trigram_index *trigram_index;
+static int nr_skipped_by_trigram_index;
+static struct trace_key trace_trigram_index = TRACE_KEY_INIT(TRIGRAM_INDEX);
+
 #ifndef NO_PTHREADS
 static pthread_t *threads;
 
@@ -54,14 +62,22 @@ struct work_item {
  * The work_items in [todo_start, todo_end) are waiting to be picked
  * up by a consumer thread.
  *
- * The ranges are modulo TODO_SIZE.
+ * The ranges are modulo todo_alloc. The work_items themselves never
+ * move, so that consumers can hold on to them while 'todo' grows.
  */
 #define TODO_SIZE 128
-static struct work_item todo[TODO_SIZE];
+#define TODO_PER_THREAD 16
+#define TODO_GROWTH_LIMIT 32
+static struct work_item **todo;
+static int todo_alloc;
+static int todo_max;
 static int todo_start;
 static int todo_end;
 static int todo_done;
 
+/* Is a consumer writing out results (without holding grep_mutex)? */
+static int todo_writing;
+
 /* Has all work items been added? */
 static int all_work_added;
 
@@ -83,8 +99,9 @@ static inline void grep_unlock(void)
 /* Signalled when a new work_item is added to todo. */
 static pthread_cond_t cond_add;
 
-/* Signalled when the result from one work_item is written to
- * stdout.
+/* Signalled when the producer may be able to add to a full todo:
+ * results were written to stdout, or the consumers took the last
+ * waiting work_item.
  */
 static pthread_cond_t cond_write;
 
@@ -93,20 +110,70 @@ static pthread_cond_t cond_result;
 
 static int skip_first_line;
 
+static int todo_full(void)
+{
+	return (todo_end + 1) % todo_alloc == todo_done;
+}
+
+static struct work_item *new_work_item(void)
+{
+	struct work_item *w = xcalloc(1, sizeof(*w));
+	strbuf_init(&w->out, 0);
+	return w;
+}
+
+/*
+ * Make room in a full todo while no consumer is writing, moving the
+ * work_items from todo_done on to the start of the new array.
+ */
+static void grow_todo(void)
+{
+	int alloc = todo_alloc * 2, nr = 0, i;
+	struct work_item **grown;
+
+	if (alloc > todo_max)
+		alloc = todo_max;
+	ALLOC_ARRAY(grown, alloc);
+	for (i = todo_done; nr < todo_alloc; i = (i + 1) % todo_alloc)
+		grown[nr++] = todo[i];
+	while (nr < alloc)
+		grown[nr++] = new_work_item();
+
+	todo_start = (todo_start - todo_done + todo_alloc) % todo_alloc;
+	todo_end = (todo_end - todo_done + todo_alloc) % todo_alloc;
+	todo_done = 0;
+	free(todo);
+	todo = grown;
+	todo_alloc = alloc;
+}
+
 static void add_work(struct grep_opt *opt, const struct grep_source *gs)
 {
+	struct work_item *w;
+
 	grep_lock();
 
-	while ((todo_end+1) % ARRAY_SIZE(todo) == todo_done) {
-		pthread_cond_wait(&cond_write, &grep_mutex);
+	while (todo_full()) {
+		/*
+		 * When every queued work_item has been picked up, the
+		 * consumers would sit idle until the oldest one (which
+		 * may be a large file) is done and written out; give
+		 * them more room instead.
+		 */
+		if (todo_start == todo_end && !todo_writing &&
+		    todo_alloc < todo_max)
+			grow_todo();
+		else
+			pthread_cond_wait(&cond_write, &grep_mutex);
 	}
 
-	todo[todo_end].source = *gs;
+	w = todo[todo_end];
+	w->source = *gs;
 	if (opt->binary != GREP_BINARY_TEXT)
-		grep_source_load_driver(&todo[todo_end].source);
-	todo[todo_end].done = 0;
-	strbuf_reset(&todo[todo_end].out);
-	todo_end = (todo_end + 1) % ARRAY_SIZE(todo);
+		grep_source_load_driver(&w->source);
+	w->done = 0;
+	strbuf_reset(&w->out);
+	todo_end = (todo_end + 1) % todo_alloc;
 
 	pthread_cond_signal(&cond_add);
 	grep_unlock();
@@ -124,44 +191,64 @@ static struct work_item *get_work(void)
 	if (todo_start == todo_end && all_work_added) {
 		ret = NULL;
 	} else {
-		ret = &todo[todo_start];
-		todo_start = (todo_start + 1) % ARRAY_SIZE(todo);
+		ret = todo[todo_start];
+		todo_start = (todo_start + 1) % todo_alloc;
+		if (todo_start == todo_end && todo_full())
+			pthread_cond_signal(&cond_write);
 	}
 	grep_unlock();
 	return ret;
 }
 
-static void work_done(struct work_item *w)
+static void write_work(struct work_item *w)
 {
-	int old_done;
+	if (w->out.len) {
+		const char *p = w->out.buf;
+		size_t len = w->out.len;
+
+		/* Skip the leading hunk mark of the first file. */
+		if (skip_first_line) {
+			while (len) {
+				len--;
+				if (*p++ == '\n')
+					break;
+			}
+			skip_first_line = 0;
+		}
 
+		write_or_die(1, p, len);
+	}
+	grep_source_clear(&w->source);
+}
+
+static void work_done(struct work_item *w)
+{
 	grep_lock();
 	w->done = 1;
-	old_done = todo_done;
-	for(; todo[todo_done].done && todo_done != todo_start;
-	    todo_done = (todo_done+1) % ARRAY_SIZE(todo)) {
-		w = &todo[todo_done];
-		if (w->out.len) {
-			const char *p = w->out.buf;
-			size_t len = w->out.len;
-
-			/* Skip the leading hunk mark of the first file. */
-			if (skip_first_line) {
-				while (len) {
-					len--;
-					if (*p++ == '\n')
-						break;
-				}
-				skip_first_line = 0;
-			}
 
-			write_or_die(1, p, len);
-		}
-		grep_source_clear(&w->source);
-	}
+	/*
+	 * Write out the finished work_items at the head of todo, in
+	 * order. Only one consumer does so at a time, and it does not
+	 * hold the lock while writing; those finishing meanwhile leave
+	 * their results to it.
+	 */
+	while (!todo_writing && todo_done != todo_start &&
+	       todo[todo_done]->done) {
+		int i, done = todo_done;
+
+		while (done != todo_start && todo[done]->done)
+			done = (done + 1) % todo_alloc;
+
+		todo_writing = 1;
+		grep_unlock();
+		for (i = todo_done; i != done; i = (i + 1) % todo_alloc)
+			write_work(todo[i]);
+		grep_lock();
+		todo_writing = 0;
 
-	if (old_done != todo_done)
+		todo_done = done;
 		pthread_cond_signal(&cond_write);
+	}
 
 	if (all_work_added && todo_done == todo_end)
 		pthread_cond_signal(&cond_result);
@@ -207,10 +294,19 @@ static void start_threads(struct grep_opt *opt)
 	pthread_cond_init(&cond_write, NULL);
 	pthread_cond_init(&cond_result, NULL);
 	grep_use_locks = 1;
+	enable_obj_read_lock();
 
-	for (i = 0; i < ARRAY_SIZE(todo); i++) {
-		strbuf_init(&todo[i].out, 0);
-	}
+	/*
+	 * Start with enough room to keep all threads busy, and let
+	 * add_work() grow it when a slow file holds up the output.
+	 */
+	todo_alloc = num_threads * TODO_PER_THREAD;
+	if (todo_alloc < TODO_SIZE)
+		todo_alloc = TODO_SIZE;
+	todo_max = todo_alloc * TODO_GROWTH_LIMIT;
+	ALLOC_ARRAY(todo, todo_alloc);
+	for (i = 0; i < todo_alloc; i++)
+		todo[i] = new_work_item();
 
 	threads = xcalloc(num_threads, sizeof(*threads));
 	for (i = 0; i < num_threads; i++) {
@@ -254,12 +350,20 @@ static int wait_all(void)
 
 	free(threads);
 
+	for (i = 0; i < todo_alloc; i++) {
+		strbuf_release(&todo[i]->out);
+		free(todo[i]);
+	}
+	FREE_AND_NULL(todo);
+	todo_alloc = 0;
+
 	pthread_mutex_destroy(&grep_mutex);
 	pthread_mutex_destroy(&grep_read_mutex);
 	pthread_mutex_destroy(&grep_attr_mutex);
 	pthread_cond_destroy(&cond_add);
 	pthread_cond_destroy(&cond_write);
 	pthread_cond_destroy(&cond_result);
+	disable_obj_read_lock();
 	grep_use_locks = 0;
 
 	return hit;
@@ -299,17 +403,278 @@ static int grep_cmd_config(const char *var, const char *value, void *cb)
 	if (!strcmp(var, "submodule.recurse"))
 		recurse_submodules = git_config_bool(var, value);
 
+	if (!strcmp(var, "grep.trigramindex"))
+		use_trigram_index = git_config_bool(var, value);
+
 	return st;
 }
 
-static void *lock_and_read_oid_file(const struct object_id *oid, enum object_type *type, unsigned long *size)
+/*
+ * Skip the end of an interval expression "{...}" or of a bracket
+ * expression "[...]" starting at pat[*i], leaving *i at its last
+ * character. Return -1 if it does not end.
+ */
+static int skip_interval(const char *pat, size_t len, size_t *i)
+{
+	const char *end = memchr(pat + *i, '}', len - *i);
+
+	if (!end)
+		return -1;
+	*i = end - pat;
+	return 0;
+}
+
+static int skip_bracket(const char *pat, size_t len, size_t *i)
+{
+	size_t j = *i + 1;
+
+	if (j < len && pat[j] == '^')
+		j++;
+	if (j < len && pat[j] == ']')
+		j++;
+	while (j < len && pat[j] != ']') {
+		if (pat[j] == '[' && j + 1 < len && strchr(":.=", pat[j + 1])) {
+			/* "[:alpha:]" and friends end with the same char */
+			size_t k = j + 2;
+
+			while (k + 1 < len &&
+			       !(pat[k] == pat[j + 1] && pat[k + 1] == ']'))
+				k++;
+			if (k + 1 >= len)
+				return -1;
+			j = k + 2;
+		} else {
+			j++;
+		}
+	}
+	if (j >= len)
+		return -1;
+	*i = j;
+	return 0;
+}
+
+static int is_quantified(const char *pat, size_t len, size_t i)
+{
+	if (i < len && strchr("*+?{", pat[i]))
+		return 1;
+	return i + 1 < len && pat[i] == '\\' && strchr("+?{", pat[i + 1]);
+}
+
+/*
+ * Collect the runs of literal characters that every match of the basic
+ * or (if "extended" is set) extended regular expression "pat" must
+ * contain. We err on the side of caution: "+", "?" and "{" are taken as
+ * operators even in basic expressions, anything within a group is
+ * ignored, and any alternation or non-ASCII character makes us give up
+ * and return -1. Groups are "\(...\)" in basic and "(...)" in extended
+ * expressions; the other kind of parenthesis is a literal character.
+ */
+static int regex_literals(const char *pat, size_t len, int extended,
+			  struct string_list *literals)
+{
+	struct strbuf run = STRBUF_INIT;
+	int depth = 0;
+	size_t i;
+
+	for (i = 0; i <= len; i++) {
+		int c = i < len ? (unsigned char)pat[i] : -1;
+		int literal = -1;
+
+		if (c == '\\') {
+			if (++i == len)
+				goto fail;
+			c = (unsigned char)pat[i];
+			if (c == '(' && !extended)
+				depth++;
+			else if (c == ')' && !extended) {
+				if (--depth < 0)
+					goto fail;
+			} else if (c == '{') {
+				if (skip_interval(pat, len, &i))
+					goto fail;
+			} else if (c == '|')
+				goto fail;
+			else if (!isalnum(c) && !strchr("+?<>`'", c))
+				literal = c;
+		} else if (c == '[') {
+			if (skip_bracket(pat, len, &i))
+				goto fail;
+		} else if (c == '{') {
+			if (skip_interval(pat, len, &i))
+				goto fail;
+		} else if (c == '(' && extended) {
+			depth++;
+		} else if (c == ')' && extended) {
+			if (--depth < 0)
+				goto fail;
+		} else if (c == '|') {
+			goto fail;
+		} else if (c >= 0 && !strchr(".*+?^$]}", c)) {
+			literal = c;
+		}
+
+		if (c >= 0x80)
+			goto fail;
+		if (literal >= 0 && !depth && !is_quantified(pat, len, i + 1)) {
+			strbuf_addch(&run, literal);
+			continue;
+		}
+		if (run.len >= 3)
+			string_list_append(literals, run.buf);
+		strbuf_reset(&run);
+	}
+	strbuf_release(&run);
+	return 0;
+
+fail:
+	strbuf_release(&run);
+	return -1;
+}
+
+/*
+ * Collect the strings that every match of "p" must contain, or return
+ * -1 if we cannot tell.
+ */
+static int pattern_literals(struct grep_opt *opt, struct grep_pat *p,
+			    struct string_list *literals)
+{
+	size_t i;
+
+	if (memchr(p->pattern, 0, p->patternlen))
+		return -1;
+	for (i = 0; i < p->patternlen; i++)
+		if (opt->ignore_case && (p->pattern[i] & 0x80))
+			return -1;
+
+	if (opt->pcre1 || opt->pcre2) {
+		/* Only a pattern without any special character is literal. */
+		for (i = 0; i < p->patternlen; i++)
+			if (strchr("\\^$.[]|()?*+{}", p->pattern[i]))
+				return -1;
+	} else if (!opt->fixed) {
+		return regex_literals(p->pattern, p->patternlen,
+				      opt->extended_regexp_option, literals);
+	}
+	string_list_append_nodup(literals,
+				 xmemdupz(p->pattern, p->patternlen));
+	return 0;
+}
+
+/*
+ * Load the trigram index, if there is one, and tell it what we are
+ * looking for so that it can rule out blobs; leave trigram_index
+ * NULL if it cannot do so for this search.
+ */
+static void setup_trigram_index(struct grep_opt *opt)
+{
+	struct grep_pat *p;
+
+	if (opt->invert || opt->unmatch_name_only || opt->allow_textconv)
+		return;
+	for (p = opt->pattern_list; p; p = p->next)
+		if (p->token != GREP_PATTERN)
+			return;
+
+	trigram_index = load_trigram_index(get_object_directory());
+	if (!trigram_index)
+		return;
+	for (p = opt->pattern_list; p; p = p->next) {
+		struct string_list literals = STRING_LIST_INIT_DUP;
+		int ret = pattern_literals(opt, p, &literals) ||
+			  trigram_index_add_pattern(trigram_index, &literals);
+
+		string_list_clear(&literals, 0);
+		if (ret) {
+			trace_printf_key(&trace_trigram_index,
+					 "trigram index: cannot use it for '%s'",
+					 p->pattern);
+			free_trigram_index(trigram_index);
+			trigram_index = NULL;
+			return;
+		}
+	}
+}
+
+static int skip_by_trigram_index(const struct object_id *oid)
+{
+	if (!trigram_index || trigram_index_may_match(trigram_index, oid))
+		return 0;
+	nr_skipped_by_trigram_index++;
+	return 1;
+}
+
+/*
+ * A worktree file that is stat-clean and checked out without any
+ * conversion has the contents of its blob, so the trigram index can
+ * rule it out as well.
+ */
+static int skip_worktree_file(struct repository *repo,
+			      const struct cache_entry *ce)
 {
-	void *data;
+	struct conv_attrs ca;
+	struct stat st;
 
-	grep_read_lock();
-	data = read_object_file(oid, type, size);
-	grep_read_unlock();
-	return data;
+	if (!trigram_index || repo->submodule_prefix || ce_stage(ce) ||
+	    trigram_index_may_match(trigram_index, &ce->oid))
+		return 0;
+	if (lstat(ce->name, &st) || ie_match_stat(repo->index, ce, &st, 0))
+		return 0;
+	convert_attrs(&ca, ce->name);
+	if (ca.drv || ca.ident ||
+	    (ca.crlf_action != CRLF_BINARY &&
+	     ca.crlf_action != CRLF_TEXT_INPUT &&
+	     ca.crlf_action != CRLF_AUTO_INPUT))
+		return 0;
+	nr_skipped_by_trigram_index++;
+	return 1;
+}
+
+static int collect_blob(const struct object_id *oid, struct strbuf *base,
+			const char *pathname, unsigned mode, int stage,
+			void *context)
+{
+	if (S_ISDIR(mode))
+		return READ_TREE_RECURSIVE;
+	if (S_ISREG(mode))
+		oid_array_append(context, oid);
+	return 0;
+}
+
+static int write_grep_trigram_index(int argc, const char **argv)
+{
+	struct oid_array blobs = OID_ARRAY_INIT;
+	struct pathspec match_all;
+	int i;
+
+	if (!argc) {
+		struct index_state *istate = the_repository->index;
+
+		repo_read_index(the_repository);
+		for (i = 0; i < istate->cache_nr; i++) {
+			const struct cache_entry *ce = istate->cache[i];
+
+			if (S_ISREG(ce->ce_mode) && !ce_intent_to_add(ce))
+				oid_array_append(&blobs, &ce->oid);
+		}
+	}
+
+	memset(&match_all, 0, sizeof(match_all));
+	for (i = 0; i < argc; i++) {
+		struct object_id oid;
+		struct tree *tree;
+
+		if (get_oid(argv[i], &oid))
+			die(_("unable to resolve revision: %s"), argv[i]);
+		tree = parse_tree_indirect(&oid);
+		if (!tree)
+			die(_("not a tree object: %s"), argv[i]);
+		read_tree_recursive(tree, "", 0, 0, &match_all,
+				    collect_blob, &blobs);
+	}
+
+	write_trigram_index(get_object_directory(), &blobs);
+	oid_array_clear(&blobs);
+	return 0;
 }
 
 static int grep_oid(struct grep_opt *opt, const struct object_id *oid,
@@ -319,6 +684,9 @@ static int grep_oid(struct grep_opt *opt, const struct object_id *oid,
 	struct strbuf pathbuf = STRBUF_INIT;
 	struct grep_source gs;
 
+	if (skip_by_trigram_index(oid))
+		return 0;
+
 	if (opt->relative && opt->prefix_length) {
 		quote_path_relative(filename + tree_name_len, opt->prefix, &pathbuf);
 		strbuf_insert(&pathbuf, 0, filename, tree_name_len);
@@ -439,9 +807,9 @@ static int grep_submodule(struct grep_opt *opt, struct repository *superproject,
 	 * store is no longer global and instead is a member of the repository
 	 * object.
 	 */
-	grep_read_lock();
+	obj_read_lock();
 	add_to_alternates_memory(submodule.objects->objectdir);
-	grep_read_unlock();
+	obj_read_unlock();
 
 	if (oid) {
 		struct object *object;
@@ -450,12 +818,12 @@ static int grep_submodule(struct grep_opt *opt, struct repository *superproject,
 		unsigned long size;
 		struct strbuf base = STRBUF_INIT;
 
+		grep_read_lock();
 		object = parse_object_or_die(oid, oid_to_hex(oid));
+		grep_read_unlock();
 
-		grep_read_lock();
 		data = read_object_with_reference(&object->oid, tree_type,
 						  &size, NULL);
-		grep_read_unlock();
 
 		if (!data)
 			die(_("unable to read tree (%s)"), oid_to_hex(&object->oid));
@@ -510,7 +878,7 @@ static int grep_cache(struct grep_opt *opt, struct repository *repo,
 					continue;
 				hit |= grep_oid(opt, &ce->oid, name.buf,
 						 0, name.buf);
-			} else {
+			} else if (!skip_worktree_file(repo, ce)) {
 				hit |= grep_file(opt, name.buf);
 			}
 		} else if (recurse_submodules && S_ISGITLINK(ce->ce_mode) &&
@@ -576,7 +944,7 @@ static int grep_tree(struct grep_opt *opt, const struct pathspec *pathspec,
 			void *data;
 			unsigned long size;
 
-			data = lock_and_read_oid_file(entry.oid, &type, &size);
+			data = read_object_file(entry.oid, &type, &size);
 			if (!data)
 				die(_("unable to read tree (%s)"),
 				    oid_to_hex(entry.oid));
@@ -614,10 +982,8 @@ static int grep_object(struct grep_opt *opt, const struct pathspec *pathspec,
 		struct strbuf base;
 		int hit, len;
 
-		grep_read_lock();
 		data = read_object_with_reference(&obj->oid, tree_type,
 						  &size, NULL);
-		grep_read_unlock();
 
 		if (!data)
 			die(_("unable to read tree (%s)"), oid_to_hex(&obj->oid));
@@ -783,6 +1149,7 @@ int cmd_grep(int argc, const char **argv, const char *prefix)
 	int i;
 	int dummy;
 	int use_index = 1;
+	int write_index = 0;
 	int pattern_type_arg = GREP_PATTERN_TYPE_UNSPECIFIED;
 	int allow_revs;
 
@@ -860,6 +1227,10 @@ int cmd_grep(int argc, const char **argv, const char *prefix)
 			N_("show <n> context lines after matches")),
 		OPT_INTEGER(0, "threads", &num_threads,
 			N_("use <n> worker threads")),
+		OPT_BOOL(0, "trigram-index", &use_trigram_index,
+			N_("skip blobs that the trigram index rules out")),
+		OPT_BOOL(0, "write-trigram-index", &write_index,
+			N_("add blobs of the index or the given trees to the trigram index")),
 		OPT_NUMBER_CALLBACK(&opt, N_("shortcut for -C NUM"),
 			context_callback),
 		OPT_BOOL('p', "show-function", &opt.funcname,
@@ -930,6 +1301,12 @@ int cmd_grep(int argc, const char **argv, const char *prefix)
 			setup_git_directory();
 	}
 
+	if (write_index) {
+		if (!use_index || untracked || cached)
+			die(_("--write-trigram-index cannot be used with --no-index, --untracked or --cached"));
+		return write_grep_trigram_index(argc, argv);
+	}
+
 	/*
 	 * skip a -- separator; we know it cannot be
 	 * separating revisions from pathnames if
@@ -1029,10 +1406,10 @@ int cmd_grep(int argc, const char **argv, const char *prefix)
 	pathspec.recurse_submodules = !!recurse_submodules;
 
 #ifndef NO_PTHREADS
-	if (list.nr || cached || show_in_pager)
+	if (show_in_pager)
 		num_threads = 0;
 	else if (num_threads == 0)
-		num_threads = GREP_NUM_THREADS_DEFAULT;
+		num_threads = online_cpus();
 	else if (num_threads < 0)
 		die(_("invalid number of threads specified (%d)"), num_threads);
 	if (num_threads == 1)
@@ -1094,6 +1471,9 @@ int cmd_grep(int argc, const char **argv, const char *prefix)
 	if (!use_index && (untracked || cached))
 		die(_("--cached or --untracked cannot be used with --no-index."));
 
+	if (use_trigram_index && use_index && !untracked)
+		setup_trigram_index(&opt);
+
 	if (!use_index || untracked) {
 		int use_exclude = (opt_exclude < 0) ? use_index : !!opt_exclude;
 		hit = grep_directory(&opt, &pathspec, use_exclude, use_index);
@@ -1113,6 +1493,12 @@ int cmd_grep(int argc, const char **argv, const char *prefix)
 
 	if (num_threads)
 		hit |= wait_all();
+	if (trigram_index) {
+		trace_printf_key(&trace_trigram_index,
+				 "trigram index: skipped %d files",
+				 nr_skipped_by_trigram_index);
+		free_trigram_index(trigram_index);
+	}
 	if (hit && show_in_pager)
 		run_pager(&opt, prefix);
 	clear_pathspec(&pathspec);
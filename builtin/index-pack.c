@@ -14,9 +14,10 @@
 #include "thread-utils.h"
 #include "packfile.h"
 #include "object-store.h"
+#include "oidset.h"
 
 static const char index_pack_usage[] =
-"git index-pack [-v] [-o <index-file>] [--keep | --keep=<msg>] [--verify] [--strict] (<pack-file> | --stdin [--fix-thin] [<pack-file>])";
+"git index-pack [-v] [-o <index-file>] [--keep | --keep=<msg>] [--verify] [--strict] [--pipeline-hash] (<pack-file> | --stdin [--fix-thin] [<pack-file>])";
 
 struct object_entry {
 	struct pack_idx_entry idx;
@@ -75,6 +76,7 @@ static int nr_ref_deltas;
 static int ref_deltas_alloc;
 static int nr_resolved_deltas;
 static int nr_threads;
+static int pipeline_hash;
 
 static int from_stdin;
 static int strict;
@@ -249,13 +251,143 @@ static unsigned check_objects(void)
 }
 
 
+#ifndef NO_PTHREADS
+
+/*
+ * With --pipeline-hash, the input that has been parsed is handed to a
+ * separate thread in larger blocks, which writes it to the pack file
+ * and feeds it to the pack checksum while the main thread goes on
+ * parsing objects.
+ */
+#define HASH_BLOCK_SIZE (128 * 1024)
+#define NR_HASH_BLOCKS 4
+
+struct hash_block {
+	unsigned char buf[HASH_BLOCK_SIZE];
+	size_t len;
+};
+
+static struct hash_block *hash_blocks;
+static unsigned int hash_blocks_filled, hash_blocks_drained;
+static int hash_input_done;
+static int hash_thread_active;
+static pthread_t hash_thread;
+static pthread_mutex_t hash_mutex;
+static pthread_cond_t hash_cond;
+
+static void *run_hash_thread(void *data)
+{
+	for (;;) {
+		struct hash_block *block;
+
+		pthread_mutex_lock(&hash_mutex);
+		while (hash_blocks_drained == hash_blocks_filled &&
+		       !hash_input_done)
+			pthread_cond_wait(&hash_cond, &hash_mutex);
+		if (hash_blocks_drained == hash_blocks_filled) {
+			pthread_mutex_unlock(&hash_mutex);
+			return NULL;
+		}
+		block = &hash_blocks[hash_blocks_drained % NR_HASH_BLOCKS];
+		pthread_mutex_unlock(&hash_mutex);
+
+		if (output_fd >= 0)
+			write_or_die(output_fd, block->buf, block->len);
+		the_hash_algo->update_fn(&input_ctx, block->buf, block->len);
+
+		pthread_mutex_lock(&hash_mutex);
+		hash_blocks_drained++;
+		pthread_cond_signal(&hash_cond);
+		pthread_mutex_unlock(&hash_mutex);
+	}
+}
+
+static void start_hash_thread(void)
+{
+	int ret;
+
+	hash_blocks = xcalloc(NR_HASH_BLOCKS, sizeof(*hash_blocks));
+	hash_blocks_filled = hash_blocks_drained = 0;
+	hash_input_done = 0;
+	pthread_mutex_init(&hash_mutex, NULL);
+	pthread_cond_init(&hash_cond, NULL);
+	ret = pthread_create(&hash_thread, NULL, run_hash_thread, NULL);
+	if (ret)
+		die(_("unable to create thread: %s"), strerror(ret));
+	hash_thread_active = 1;
+}
+
+/* Pass the block being filled to the hash thread. */
+static void publish_hash_block(void)
+{
+	pthread_mutex_lock(&hash_mutex);
+	hash_blocks_filled++;
+	pthread_cond_signal(&hash_cond);
+	while (hash_blocks_filled - hash_blocks_drained >= NR_HASH_BLOCKS)
+		pthread_cond_wait(&hash_cond, &hash_mutex);
+	pthread_mutex_unlock(&hash_mutex);
+	hash_blocks[hash_blocks_filled % NR_HASH_BLOCKS].len = 0;
+}
+
+static void queue_hash_input(const unsigned char *buf, size_t len)
+{
+	while (len) {
+		struct hash_block *block =
+			&hash_blocks[hash_blocks_filled % NR_HASH_BLOCKS];
+		size_t n = HASH_BLOCK_SIZE - block->len;
+
+		if (n > len)
+			n = len;
+		memcpy(block->buf + block->len, buf, n);
+		block->len += n;
+		buf += n;
+		len -= n;
+		if (block->len == HASH_BLOCK_SIZE)
+			publish_hash_block();
+	}
+}
+
+/*
+ * Wait until all input queued so far is written and hashed, and stop
+ * the hash thread.
+ */
+static void finish_hash_thread(void)
+{
+	if (!hash_thread_active)
+		return;
+	if (hash_blocks[hash_blocks_filled % NR_HASH_BLOCKS].len)
+		publish_hash_block();
+	pthread_mutex_lock(&hash_mutex);
+	hash_input_done = 1;
+	pthread_cond_signal(&hash_cond);
+	pthread_mutex_unlock(&hash_mutex);
+	pthread_join(hash_thread, NULL);
+	pthread_mutex_destroy(&hash_mutex);
+	pthread_cond_destroy(&hash_cond);
+	FREE_AND_NULL(hash_blocks);
+	hash_thread_active = 0;
+}
+
+#else
+
+#define hash_thread_active 0
+#define start_hash_thread()
+#define queue_hash_input(buf, len)
+#define finish_hash_thread()
+
+#endif
+
 /* Discard current buffer used content. */
 static void flush(void)
 {
 	if (input_offset) {
-		if (output_fd >= 0)
-			write_or_die(output_fd, input_buffer, input_offset);
-		the_hash_algo->update_fn(&input_ctx, input_buffer, input_offset);
+		if (hash_thread_active) {
+			queue_hash_input(input_buffer, input_offset);
+		} else {
+			if (output_fd >= 0)
+				write_or_die(output_fd, input_buffer, input_offset);
+			the_hash_algo->update_fn(&input_ctx, input_buffer, input_offset);
+		}
 		memmove(input_buffer, input_buffer + input_offset, input_len);
 		input_offset = 0;
 	}
@@ -1127,6 +1259,8 @@ static void parse_pack_objects(unsigned char *hash)
 	struct object_id ref_delta_oid;
 	struct stat st;
 
+	if (pipeline_hash)
+		start_hash_thread();
 	if (verbose)
 		progress = start_progress(
 				from_stdin ? _("Receiving objects") : _("Indexing objects"),
@@ -1161,6 +1295,7 @@ static void parse_pack_objects(unsigned char *hash)
 
 	/* Check pack integrity */
 	flush();
+	finish_hash_thread();
 	the_hash_algo->final_fn(hash, &input_ctx);
 	if (hashcmp(fill(the_hash_algo->rawsz), hash))
 		die(_("pack is corrupted (SHA1 mismatch)"));
@@ -1187,30 +1322,15 @@ static void parse_pack_objects(unsigned char *hash)
 }
 
 /*
- * Second pass:
- * - for all non-delta objects, look if it is used as a base for
- *   deltas;
- * - if used as a base, uncompress the object and apply all deltas,
- *   recursively checking if the resulting object is used as a base
- *   for some more deltas.
+ * Resolve the deltas based on the non-delta objects starting at
+ * objects[first], on all threads.
  */
-static void resolve_deltas(void)
+static void resolve_bases(int first)
 {
 	int i;
 
-	if (!nr_ofs_deltas && !nr_ref_deltas)
-		return;
-
-	/* Sort deltas by base SHA1/offset for fast searching */
-	QSORT(ofs_deltas, nr_ofs_deltas, compare_ofs_delta_entry);
-	QSORT(ref_deltas, nr_ref_deltas, compare_ref_delta_entry);
-
-	if (verbose || show_resolving_progress)
-		progress = start_progress(_("Resolving deltas"),
-					  nr_ref_deltas + nr_ofs_deltas);
-
 #ifndef NO_PTHREADS
-	nr_dispatched = 0;
+	nr_dispatched = first;
 	if (nr_threads > 1 || getenv("GIT_FORCE_THREADS")) {
 		init_thread();
 		for (i = 0; i < nr_threads; i++) {
@@ -1227,7 +1347,7 @@ static void resolve_deltas(void)
 	}
 #endif
 
-	for (i = 0; i < nr_objects; i++) {
+	for (i = first; i < nr_objects; i++) {
 		struct object_entry *obj = &objects[i];
 
 		if (is_delta_type(obj->type))
@@ -1237,6 +1357,30 @@ static void resolve_deltas(void)
 	}
 }
 
+/*
+ * Second pass:
+ * - for all non-delta objects, look if it is used as a base for
+ *   deltas;
+ * - if used as a base, uncompress the object and apply all deltas,
+ *   recursively checking if the resulting object is used as a base
+ *   for some more deltas.
+ */
+static void resolve_deltas(void)
+{
+	if (!nr_ofs_deltas && !nr_ref_deltas)
+		return;
+
+	/* Sort deltas by base SHA1/offset for fast searching */
+	QSORT(ofs_deltas, nr_ofs_deltas, compare_ofs_delta_entry);
+	QSORT(ref_deltas, nr_ref_deltas, compare_ref_delta_entry);
+
+	if (verbose || show_resolving_progress)
+		progress = start_progress(_("Resolving deltas"),
+					  nr_ref_deltas + nr_ofs_deltas);
+
+	resolve_bases(0);
+}
+
 /*
  * Third pass:
  * - append objects to convert thin pack to full pack if required
@@ -1351,17 +1495,17 @@ static int delta_pos_compare(const void *_a, const void *_b)
 static void fix_unresolved_deltas(struct hashfile *f)
 {
 	struct ref_delta_entry **sorted_by_pos;
-	int i;
+	struct oidset appended = OIDSET_INIT;
+	int i, first_appended = nr_objects;
 
 	/*
-	 * Since many unresolved deltas may well be themselves base objects
-	 * for more unresolved deltas, we really want to include the
-	 * smallest number of base objects that would cover as much delta
-	 * as possible by picking the
-	 * trunc deltas first, allowing for other deltas to resolve without
-	 * additional base objects.  Since most base objects are to be found
-	 * before deltas depending on them, a good heuristic is to start
-	 * resolving deltas in the same order as their position in the pack.
+	 * Append the bases of the deltas we could not resolve, in the
+	 * order of the deltas in the pack, then resolve the deltas against
+	 * them on all threads, as the second pass does for the bases in
+	 * the pack. The bases a thin pack omits are objects the receiving
+	 * side already has, which the pack itself does not contain, so no
+	 * delta is reached from two bases. Deltas whose base we do not
+	 * have are left unresolved and reported by conclude_pack().
 	 */
 	ALLOC_ARRAY(sorted_by_pos, nr_ref_deltas);
 	for (i = 0; i < nr_ref_deltas; i++)
@@ -1371,24 +1515,26 @@ static void fix_unresolved_deltas(struct hashfile *f)
 	for (i = 0; i < nr_ref_deltas; i++) {
 		struct ref_delta_entry *d = sorted_by_pos[i];
 		enum object_type type;
-		struct base_data *base_obj = alloc_base_data();
+		unsigned long size;
+		void *data;
 
 		if (objects[d->obj_no].real_type != OBJ_REF_DELTA)
 			continue;
-		base_obj->data = read_object_file(&d->oid, &type,
-						  &base_obj->size);
-		if (!base_obj->data)
+		if (oidset_insert(&appended, &d->oid))
+			continue;
+		data = read_object_file(&d->oid, &type, &size);
+		if (!data)
 			continue;
 
-		if (check_object_signature(&d->oid, base_obj->data,
-				base_obj->size, type_name(type)))
+		if (check_object_signature(&d->oid, data, size, type_name(type)))
 			die(_("local object %s is corrupt"), oid_to_hex(&d->oid));
-		base_obj->obj = append_obj_to_pack(f, d->oid.hash,
-					base_obj->data, base_obj->size, type);
-		find_unresolved_deltas(base_obj);
-		display_progress(progress, nr_resolved_deltas);
+		append_obj_to_pack(f, d->oid.hash, data, size, type);
+		free(data);
 	}
 	free(sorted_by_pos);
+	oidset_clear(&appended);
+
+	resolve_bases(first_appended);
 }
 
 static const char *derive_filename(const char *pack_name, const char *suffix,
@@ -1527,6 +1673,10 @@ static int git_index_pack_config(const char *k, const char *v, void *cb)
 #endif
 		return 0;
 	}
+	if (!strcmp(k, "pack.pipelinehash")) {
+		pipeline_hash = git_config_bool(k, v);
+		return 0;
+	}
 	return git_default_config(k, v, cb);
 }
 
@@ -1717,6 +1867,10 @@ int cmd_index_pack(int argc, const char **argv, const char *prefix)
 						  "ignoring %s"), arg);
 				nr_threads = 1;
 #endif
+			} else if (!strcmp(arg, "--pipeline-hash")) {
+				pipeline_hash = 1;
+			} else if (!strcmp(arg, "--no-pipeline-hash")) {
+				pipeline_hash = 0;
 			} else if (starts_with(arg, "--pack_header=")) {
 				struct pack_header *hdr;
 				char *c;
@@ -1779,6 +1933,11 @@ int cmd_index_pack(int argc, const char **argv, const char *prefix)
 	if (strict)
 		opts.flags |= WRITE_IDX_STRICT;
 
+#ifdef NO_PTHREADS
+	if (pipeline_hash)
+		warning(_("no threads support, ignoring --pipeline-hash"));
+	pipeline_hash = 0;
+#endif
 #ifndef NO_PTHREADS
 	if (!nr_threads) {
 		nr_threads = online_cpus();
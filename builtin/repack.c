@@ -8,6 +8,7 @@
 #include "strbuf.h"
 #include "string-list.h"
 #include "argv-array.h"
+#include "midx.h"
 
 static int delta_base_offset = 1;
 static int pack_kept_objects = -1;
@@ -116,8 +117,23 @@ static void remove_redundant_pack(const char *dir_name, const char *base_name)
 	const char *exts[] = {".pack", ".idx", ".keep", ".bitmap"};
 	int i;
 	struct strbuf buf = STRBUF_INIT;
+	struct multi_pack_index *m;
 	size_t plen;
 
+	/*
+	 * A multi-pack-index naming the pack would point readers at
+	 * objects that no longer exist; drop it along with the pack.
+	 */
+	m = load_multi_pack_index(get_object_directory(), 1);
+	strbuf_addf(&buf, "%s.idx", base_name);
+	if (m && midx_contains_pack(m, buf.buf)) {
+		close_midx(m);
+		clear_midx_file(get_object_directory());
+	} else if (m) {
+		close_midx(m);
+	}
+	strbuf_reset(&buf);
+
 	strbuf_addf(&buf, "%s/%s", dir_name, base_name);
 	plen = buf.len;
 
@@ -164,6 +180,7 @@ int cmd_repack(int argc, const char **argv, const char *prefix)
 	int no_update_server_info = 0;
 	int quiet = 0;
 	int local = 0;
+	int use_delta_islands = 0;
 
 	struct option builtin_repack_options[] = {
 		OPT_BIT('a', NULL, &pack_everything,
@@ -184,6 +201,8 @@ int cmd_repack(int argc, const char **argv, const char *prefix)
 				N_("pass --local to git-pack-objects")),
 		OPT_BOOL('b', "write-bitmap-index", &write_bitmaps,
 				N_("write bitmap index")),
+		OPT_BOOL('i', "delta-islands", &use_delta_islands,
+				N_("pass --delta-islands to git-pack-objects")),
 		OPT_STRING(0, "unpack-unreachable", &unpack_unreachable, N_("approxidate"),
 				N_("with -A, do not loosen objects older than this")),
 		OPT_BOOL('k', "keep-unreachable", &keep_unreachable,
@@ -252,6 +271,8 @@ int cmd_repack(int argc, const char **argv, const char *prefix)
 		argv_array_pushf(&cmd.args, "--no-reuse-object");
 	if (write_bitmaps)
 		argv_array_push(&cmd.args, "--write-bitmap-index");
+	if (use_delta_islands)
+		argv_array_push(&cmd.args, "--delta-islands");
 
 	if (pack_everything & ALL_INTO_ONE) {
 		get_non_kept_pack_filenames(&existing_packs);
@@ -521,6 +521,13 @@ int cmd_rev_list(int argc, const char **argv, const char *prefix)
 				printf("%d\n", commit_count);
 				return 0;
 			}
+		} else if (revs.count && revs.left_right && !revs.cherry_mark &&
+			   !revs.cherry_pick && revs.max_count < 0) {
+			uint32_t left, right;
+			if (!count_bitmap_left_right(&revs, &left, &right)) {
+				printf("%d\t%d\n", left, right);
+				return 0;
+			}
 		} else if (revs.max_count < 0 &&
 			   revs.tag_objects && revs.tree_objects && revs.blob_objects) {
 			if (!prepare_bitmap_walk(&revs)) {
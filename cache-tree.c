@@ -291,16 +291,30 @@ static int update_one(struct cache_tree *it,
 		sub = find_subtree(it, path + baselen, sublen, 1);
 		if (!sub->cache_tree)
 			sub->cache_tree = cache_tree();
-		subcnt = update_one(sub->cache_tree,
-				    cache + i, entries - i,
-				    path,
-				    baselen + sublen + 1,
-				    &subskip,
-				    flags);
-		if (subcnt < 0)
-			return subcnt;
-		if (!subcnt)
-			die("index cache-tree records empty sub-tree");
+		if (S_ISSPARSEDIR(ce->ce_mode) && sublen == pathlen - baselen - 1) {
+			/*
+			 * A directory collapsed into a single entry of a
+			 * sparse index: its tree is known, and there is
+			 * nothing below it.
+			 */
+			cache_tree_free(&sub->cache_tree);
+			sub->cache_tree = cache_tree();
+			oidcpy(&sub->cache_tree->oid, &ce->oid);
+			sub->cache_tree->entry_count = 1;
+			subcnt = 1;
+			subskip = 0;
+		} else {
+			subcnt = update_one(sub->cache_tree,
+					    cache + i, entries - i,
+					    path,
+					    baselen + sublen + 1,
+					    &subskip,
+					    flags);
+			if (subcnt < 0)
+				return subcnt;
+			if (!subcnt)
+				die("index cache-tree records empty sub-tree");
+		}
 		i += subcnt;
 		sub->count = subcnt; /* to be used in the next loop */
 		*skip_count += subskip;
@@ -575,7 +589,7 @@ struct cache_tree *cache_tree_read(const char *buffer, unsigned long size)
 	return read_one(&buffer, &size);
 }
 
-static struct cache_tree *cache_tree_find(struct cache_tree *it, const char *path)
+struct cache_tree *cache_tree_find(struct cache_tree *it, const char *path)
 {
 	if (!it)
 		return NULL;
@@ -722,6 +736,58 @@ int cache_tree_matches_traversal(struct cache_tree *root,
 	return 0;
 }
 
+static int recount_entries(struct cache_tree *it,
+			   struct cache_entry **cache, int entries,
+			   const char *base, int baselen)
+{
+	int i = 0;
+
+	while (i < entries) {
+		const struct cache_entry *ce = cache[i];
+		struct cache_tree_sub *sub;
+		const char *path, *slash;
+		int pathlen, sublen;
+
+		path = ce->name;
+		pathlen = ce_namelen(ce);
+		if (pathlen <= baselen || memcmp(base, path, baselen))
+			break; /* at the end of this level */
+
+		slash = strchr(path + baselen, '/');
+		if (!slash) {
+			i++;
+			continue;
+		}
+		sublen = slash - (path + baselen);
+		sub = it ? find_subtree(it, path + baselen, sublen, 0) : NULL;
+
+		if (S_ISSPARSEDIR(ce->ce_mode) && sublen == pathlen - baselen - 1) {
+			/* a collapsed directory has no subtrees of its own */
+			if (sub && sub->cache_tree) {
+				cache_tree_free(&sub->cache_tree);
+				sub->cache_tree = cache_tree();
+				oidcpy(&sub->cache_tree->oid, &ce->oid);
+				sub->cache_tree->entry_count = 1;
+			}
+			i++;
+			continue;
+		}
+		i += recount_entries(sub ? sub->cache_tree : NULL,
+				     cache + i, entries - i,
+				     path, baselen + sublen + 1);
+	}
+
+	if (it && it->entry_count >= 0)
+		it->entry_count = i;
+	return i;
+}
+
+void cache_tree_recount_entries(struct index_state *istate)
+{
+	recount_entries(istate->cache_tree, istate->cache, istate->cache_nr,
+			"", 0);
+}
+
 int update_main_cache_tree(int flags)
 {
 	if (!the_index.cache_tree)
@@ -30,11 +30,20 @@ struct cache_tree_sub *cache_tree_sub(struct cache_tree *, const char *);
 void cache_tree_write(struct strbuf *, struct cache_tree *root);
 struct cache_tree *cache_tree_read(const char *buffer, unsigned long size);
 
+struct cache_tree *cache_tree_find(struct cache_tree *, const char *path);
+
 int cache_tree_fully_valid(struct cache_tree *);
 int cache_tree_update(struct index_state *, int);
 
 int update_main_cache_tree(int);
 
+/*
+ * Directories of the index were collapsed into sparse directory
+ * entries, or expanded back: fix the number of entries the valid
+ * trees cover, without having to recompute them.
+ */
+void cache_tree_recount_entries(struct index_state *);
+
 /* bitmasks to write_cache_as_tree flags */
 #define WRITE_TREE_MISSING_OK 1
 #define WRITE_TREE_IGNORE_CACHE_TREE 2
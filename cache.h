@@ -15,6 +15,7 @@
 #include "path.h"
 #include "sha1-array.h"
 #include "repository.h"
+#include "mem-pool.h"
 
 #include <zlib.h>
 typedef struct git_zstream {
@@ -81,6 +82,13 @@ struct object_id {
 #define S_IFGITLINK	0160000
 #define S_ISGITLINK(m)	(((m) & S_IFMT) == S_IFGITLINK)
 
+/*
+ * A directory outside of the sparse checkout, collapsed into a single
+ * index entry (named after the directory, with a trailing slash) that
+ * records its tree; see sparse-index.h.
+ */
+#define S_ISSPARSEDIR(m)	((m) == S_IFDIR)
+
 /*
  * Some mode bits are also used internally for computations.
  *
@@ -158,6 +166,7 @@ struct cache_entry {
 	unsigned int ce_flags;
 	unsigned int ce_namelen;
 	unsigned int index;	/* for link extension */
+	unsigned int mem_pool_allocated;
 	struct object_id oid;
 	char name[FLEX_ARRAY]; /* more */
 };
@@ -227,6 +236,7 @@ static inline void copy_cache_entry(struct cache_entry *dst,
 				    const struct cache_entry *src)
 {
 	unsigned int state = dst->ce_flags & CE_HASHED;
+	unsigned int mem_pool_allocated = dst->mem_pool_allocated;
 
 	/* Don't copy hash chain and name */
 	memcpy(&dst->ce_stat_data, &src->ce_stat_data,
@@ -235,6 +245,9 @@ static inline void copy_cache_entry(struct cache_entry *dst,
 
 	/* Restore the hash state */
 	dst->ce_flags = (dst->ce_flags & ~CE_HASHED) | state;
+
+	/* Restore where the memory comes from */
+	dst->mem_pool_allocated = mem_pool_allocated;
 }
 
 static inline unsigned create_ce_flags(unsigned stage)
@@ -321,13 +334,15 @@ struct index_state {
 	struct cache_time timestamp;
 	unsigned name_hash_initialized : 1,
 		 initialized : 1,
-		 drop_cache_tree : 1;
+		 drop_cache_tree : 1,
+		 sparse_index : 1;
 	struct hashmap name_hash;
 	struct hashmap dir_hash;
 	unsigned char sha1[20];
 	struct untracked_cache *untracked;
 	uint64_t fsmonitor_last_update;
 	struct ewah_bitmap *fsmonitor_dirty;
+	struct mem_pool *ce_mem_pool;
 };
 
 extern struct index_state the_index;
@@ -690,7 +705,34 @@ extern int remove_file_from_index(struct index_state *, const char *path);
 extern int add_to_index(struct index_state *, const char *path, struct stat *, int flags);
 extern int add_file_to_index(struct index_state *, const char *path, int flags);
 
-extern struct cache_entry *make_cache_entry(unsigned int mode, const unsigned char *sha1, const char *path, int stage, unsigned int refresh_options);
+/*
+ * Create a cache_entry to be added to the given index, allocated from
+ * the memory pool of that index; it is freed along with the index by
+ * discard_index(). The _empty_ variant leaves everything but the room
+ * for a name of `name_len` bytes to the caller.
+ */
+extern struct cache_entry *make_cache_entry(struct index_state *, unsigned int mode, const unsigned char *sha1, const char *path, int stage, unsigned int refresh_options);
+extern struct cache_entry *make_empty_cache_entry(struct index_state *, size_t name_len);
+
+/*
+ * Copy a cache entry into the memory pool of the given index, e.g. to
+ * add an entry taken from another index, or a transient one.
+ */
+extern struct cache_entry *dup_cache_entry(const struct cache_entry *ce, struct index_state *);
+
+/*
+ * Create a cache_entry that is not to be added to any index; the
+ * caller is responsible for discarding it with discard_cache_entry().
+ */
+extern struct cache_entry *make_transient_cache_entry(unsigned int mode, const unsigned char *sha1, const char *path, int stage);
+extern struct cache_entry *make_empty_transient_cache_entry(size_t name_len);
+
+/*
+ * Discard a cache entry that is not (or no longer) in any index. This
+ * is a no-op for entries allocated from the memory pool of an index,
+ * whose memory goes away with the index.
+ */
+extern void discard_cache_entry(struct cache_entry *ce);
 extern int chmod_index_entry(struct index_state *, struct cache_entry *ce, char flip);
 extern int ce_same_name(const struct cache_entry *a, const struct cache_entry *b);
 extern void set_object_name_for_intent_to_add_entry(struct cache_entry *ce);
@@ -743,7 +785,7 @@ extern void fill_stat_cache_info(struct cache_entry *ce, struct stat *st);
 #define REFRESH_IGNORE_SUBMODULES	0x0010	/* ignore submodules */
 #define REFRESH_IN_PORCELAIN	0x0020	/* user friendly output, not "needs update" */
 extern int refresh_index(struct index_state *, unsigned int flags, const struct pathspec *pathspec, char *seen, const char *header_msg);
-extern struct cache_entry *refresh_cache_entry(struct cache_entry *, unsigned int);
+extern struct cache_entry *refresh_cache_entry(struct index_state *, struct cache_entry *, unsigned int);
 
 /*
  * Opportunistically update the index but do not complain if we can't.
@@ -810,6 +852,7 @@ extern int precomposed_unicode;
 extern int protect_hfs;
 extern int protect_ntfs;
 extern const char *core_fsmonitor;
+extern int core_use_builtin_fsmonitor;
 
 /*
  * Include broken refs in all ref iterations, which will
@@ -897,11 +940,13 @@ extern int grafts_replace_parents;
 extern int repository_format_precious_objects;
 extern char *repository_format_partial_clone;
 extern const char *core_partial_clone_filter_default;
+extern char *repository_format_ref_storage;
 
 struct repository_format {
 	int version;
 	int precious_objects;
 	char *partial_clone; /* value of extensions.partialclone */
+	char *ref_storage; /* value of extensions.refstorage */
 	int is_bare;
 	int hash_algo;
 	char *work_tree;
@@ -1535,6 +1580,8 @@ struct checkout {
 
 #define TEMPORARY_FILENAME_LENGTH 25
 extern int checkout_entry(struct cache_entry *ce, const struct checkout *state, char *topath);
+/* Read the blob of a regular file or symlink entry; NULL on error. */
+extern void *read_blob_entry(const struct cache_entry *ce, unsigned long *size);
 extern void enable_delayed_checkout(struct checkout *state);
 extern int finish_delayed_checkout(struct checkout *state);
 
@@ -0,0 +1,1272 @@
+#include "cache.h"
+#include "config.h"
+#include "csum-file.h"
+#include "lockfile.h"
+#include "packfile.h"
+#include "pack.h"
+#include "commit.h"
+#include "object.h"
+#include "refs.h"
+#include "revision.h"
+#include "sha1-lookup.h"
+#include "commit-graph.h"
+#include "object-store.h"
+#include "progress.h"
+#include "bloom.h"
+
+#define GRAPH_SIGNATURE 0x43475048 /* "CGPH" */
+#define GRAPH_CHUNKID_OIDFANOUT 0x4f494446 /* "OIDF" */
+#define GRAPH_CHUNKID_OIDLOOKUP 0x4f49444c /* "OIDL" */
+#define GRAPH_CHUNKID_DATA 0x43444154 /* "CDAT" */
+#define GRAPH_CHUNKID_LARGEEDGES 0x45444745 /* "EDGE" */
+#define GRAPH_CHUNKID_BLOOMINDEXES 0x42494458 /* "BIDX" */
+#define GRAPH_CHUNKID_BLOOMDATA 0x42444154 /* "BDAT" */
+
+#define GRAPH_DATA_WIDTH (GRAPH_OID_LEN + 16)
+
+#define GRAPH_VERSION_1 0x1
+#define GRAPH_VERSION GRAPH_VERSION_1
+
+#define GRAPH_OID_VERSION_SHA1 1
+#define GRAPH_OID_LEN_SHA1 GIT_SHA1_RAWSZ
+#define GRAPH_OID_VERSION GRAPH_OID_VERSION_SHA1
+#define GRAPH_OID_LEN GRAPH_OID_LEN_SHA1
+
+#define GRAPH_OCTOPUS_EDGES_NEEDED 0x80000000
+#define GRAPH_EDGE_LAST_MASK 0x7fffffff
+#define GRAPH_PARENT_NONE 0x70000000
+
+#define GRAPH_LAST_EDGE 0x80000000
+
+#define GRAPH_HEADER_SIZE 8
+#define GRAPH_FANOUT_SIZE (4 * 256)
+#define GRAPH_CHUNKLOOKUP_WIDTH 12
+#define GRAPH_MIN_SIZE (GRAPH_HEADER_SIZE + 4 * GRAPH_CHUNKLOOKUP_WIDTH \
+			+ GRAPH_FANOUT_SIZE + GRAPH_OID_LEN)
+
+char *get_commit_graph_filename(const char *obj_dir)
+{
+	return xstrfmt("%s/info/commit-graph", obj_dir);
+}
+
+static struct commit_graph *alloc_commit_graph(void)
+{
+	struct commit_graph *g = xcalloc(1, sizeof(*g));
+	g->graph_fd = -1;
+
+	return g;
+}
+
+void free_commit_graph(struct commit_graph *g)
+{
+	if (!g)
+		return;
+	if (g->graph_fd >= 0) {
+		munmap((void *)g->data, g->data_len);
+		close(g->graph_fd);
+	}
+	free(g->bloom_filter_settings);
+	free(g);
+}
+
+struct commit_graph *load_commit_graph_one(const char *graph_file)
+{
+	void *graph_map;
+	const unsigned char *data, *chunk_lookup;
+	size_t graph_size;
+	struct stat st;
+	uint32_t i;
+	struct commit_graph *graph;
+	int fd = git_open(graph_file);
+	uint64_t last_chunk_offset;
+	uint32_t last_chunk_id;
+	uint32_t graph_signature;
+	unsigned char graph_version, hash_version;
+	int read_changed_paths = 1;
+
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return NULL;
+	}
+	graph_size = xsize_t(st.st_size);
+
+	if (graph_size < GRAPH_MIN_SIZE) {
+		close(fd);
+		error(_("graph file %s is too small"), graph_file);
+		return NULL;
+	}
+	graph_map = xmmap(NULL, graph_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	data = (const unsigned char *)graph_map;
+
+	graph = alloc_commit_graph();
+	graph->graph_fd = fd;
+	graph->data = graph_map;
+	graph->data_len = graph_size;
+
+	graph_signature = get_be32(data);
+	if (graph_signature != GRAPH_SIGNATURE) {
+		error(_("graph signature %X does not match signature %X"),
+		      graph_signature, GRAPH_SIGNATURE);
+		goto cleanup_fail;
+	}
+
+	graph_version = *(unsigned char*)(data + 4);
+	if (graph_version != GRAPH_VERSION) {
+		error(_("graph version %X does not match version %X"),
+		      graph_version, GRAPH_VERSION);
+		goto cleanup_fail;
+	}
+
+	hash_version = *(unsigned char*)(data + 5);
+	if (hash_version != GRAPH_OID_VERSION) {
+		error(_("hash version %X does not match version %X"),
+		      hash_version, GRAPH_OID_VERSION);
+		goto cleanup_fail;
+	}
+
+	graph->hash_len = GRAPH_OID_LEN;
+	graph->num_chunks = *(unsigned char*)(data + 6);
+
+	if (graph_size < GRAPH_HEADER_SIZE +
+	    (graph->num_chunks + 1) * GRAPH_CHUNKLOOKUP_WIDTH +
+	    GRAPH_OID_LEN) {
+		error(_("graph file %s is too small"), graph_file);
+		goto cleanup_fail;
+	}
+
+	chunk_lookup = data + GRAPH_HEADER_SIZE;
+	last_chunk_id = 0;
+	last_chunk_offset = 0;
+	for (i = 0; i <= graph->num_chunks; i++) {
+		uint32_t chunk_id = get_be32(chunk_lookup + 0);
+		uint64_t chunk_offset = get_be64(chunk_lookup + 4);
+		int chunk_repeated = 0;
+
+		chunk_lookup += GRAPH_CHUNKLOOKUP_WIDTH;
+
+		if (chunk_offset > graph_size - GRAPH_OID_LEN ||
+		    chunk_offset < last_chunk_offset) {
+			error(_("improper chunk offset %08x%08x"),
+			      (uint32_t)(chunk_offset >> 32),
+			      (uint32_t)chunk_offset);
+			goto cleanup_fail;
+		}
+
+		/* The terminating entry only records where the last chunk ends. */
+		if (i == graph->num_chunks) {
+			if (chunk_id) {
+				error(_("commit-graph chunk lookup is not terminated"));
+				goto cleanup_fail;
+			}
+		}
+
+		switch (chunk_id) {
+		case GRAPH_CHUNKID_OIDFANOUT:
+			if (graph->chunk_oid_fanout)
+				chunk_repeated = 1;
+			else
+				graph->chunk_oid_fanout = (uint32_t*)(data + chunk_offset);
+			break;
+
+		case GRAPH_CHUNKID_OIDLOOKUP:
+			if (graph->chunk_oid_lookup)
+				chunk_repeated = 1;
+			else
+				graph->chunk_oid_lookup = data + chunk_offset;
+			break;
+
+		case GRAPH_CHUNKID_DATA:
+			if (graph->chunk_commit_data)
+				chunk_repeated = 1;
+			else
+				graph->chunk_commit_data = data + chunk_offset;
+			break;
+
+		case GRAPH_CHUNKID_LARGEEDGES:
+			if (graph->chunk_large_edges)
+				chunk_repeated = 1;
+			else
+				graph->chunk_large_edges = data + chunk_offset;
+			break;
+
+		case GRAPH_CHUNKID_BLOOMINDEXES:
+			if (graph->chunk_bloom_indexes)
+				chunk_repeated = 1;
+			else
+				graph->chunk_bloom_indexes = data + chunk_offset;
+			break;
+
+		case GRAPH_CHUNKID_BLOOMDATA:
+			if (graph->chunk_bloom_data)
+				chunk_repeated = 1;
+			else
+				graph->chunk_bloom_data = data + chunk_offset;
+			break;
+		}
+
+		if (chunk_repeated) {
+			error(_("chunk id %08x appears multiple times"), chunk_id);
+			goto cleanup_fail;
+		}
+
+		if (last_chunk_id == GRAPH_CHUNKID_OIDLOOKUP)
+			graph->num_commits = (chunk_offset - last_chunk_offset)
+					     / graph->hash_len;
+		if (last_chunk_id == GRAPH_CHUNKID_BLOOMDATA)
+			graph->chunk_bloom_data_size = chunk_offset - last_chunk_offset;
+
+		last_chunk_id = chunk_id;
+		last_chunk_offset = chunk_offset;
+	}
+
+	if (!graph->chunk_oid_fanout || !graph->chunk_oid_lookup ||
+	    !graph->chunk_commit_data) {
+		error(_("commit-graph %s is missing a required chunk"), graph_file);
+		goto cleanup_fail;
+	}
+
+	if (get_be32(graph->chunk_oid_fanout + 255) != graph->num_commits ||
+	    graph->chunk_commit_data + (size_t)graph->num_commits * GRAPH_DATA_WIDTH >
+	    data + graph_size - GRAPH_OID_LEN) {
+		error(_("commit-graph %s has inconsistent commit count"),
+		      graph_file);
+		goto cleanup_fail;
+	}
+
+	git_config_get_bool("commitgraph.readchangedpaths", &read_changed_paths);
+	if (!read_changed_paths ||
+	    !graph->chunk_bloom_indexes != !graph->chunk_bloom_data) {
+		graph->chunk_bloom_indexes = NULL;
+		graph->chunk_bloom_data = NULL;
+	} else if (graph->chunk_bloom_data) {
+		uint32_t hash_version;
+
+		if (graph->chunk_bloom_data_size < BLOOMDATA_CHUNK_HEADER_SIZE ||
+		    graph->chunk_bloom_indexes + 4 * (size_t)graph->num_commits >
+		    data + graph_size - GRAPH_OID_LEN) {
+			error(_("commit-graph %s has truncated Bloom filter chunks"),
+			      graph_file);
+			goto cleanup_fail;
+		}
+
+		/*
+		 * Filters written with a hash we do not know cannot be
+		 * queried, but the rest of the graph is still usable.
+		 */
+		hash_version = get_be32(graph->chunk_bloom_data);
+		if (hash_version != 1) {
+			graph->chunk_bloom_indexes = NULL;
+			graph->chunk_bloom_data = NULL;
+		} else {
+			graph->bloom_filter_settings = xmalloc(sizeof(struct bloom_filter_settings));
+			graph->bloom_filter_settings->hash_version = hash_version;
+			graph->bloom_filter_settings->num_hashes = get_be32(graph->chunk_bloom_data + 4);
+			graph->bloom_filter_settings->bits_per_entry = get_be32(graph->chunk_bloom_data + 8);
+		}
+	}
+
+	hashcpy(graph->oid.hash, data + graph_size - GRAPH_OID_LEN);
+
+	return graph;
+
+cleanup_fail:
+	free_commit_graph(graph);
+	return NULL;
+}
+
+static void prepare_commit_graph_one(struct raw_object_store *o,
+				     const char *obj_dir)
+{
+	char *graph_name;
+
+	if (o->commit_graph)
+		return;
+
+	graph_name = get_commit_graph_filename(obj_dir);
+	o->commit_graph = load_commit_graph_one(graph_name);
+
+	FREE_AND_NULL(graph_name);
+}
+
+int prepare_commit_graph(void)
+{
+	struct raw_object_store *o = the_repository->objects;
+	struct alternate_object_database *alt;
+	int config_value;
+
+	if (o->commit_graph_attempted)
+		return !!o->commit_graph;
+	o->commit_graph_attempted = 1;
+
+	if (git_config_get_bool("core.commitgraph", &config_value) ||
+	    !config_value)
+		/*
+		 * This repository is not configured to use commit graphs, so
+		 * do not load one.
+		 */
+		return 0;
+
+	prepare_commit_graph_one(o, get_object_directory());
+	prepare_alt_odb(the_repository);
+	for (alt = o->alt_odb_list; !o->commit_graph && alt; alt = alt->next)
+		prepare_commit_graph_one(o, alt->path);
+	return !!o->commit_graph;
+}
+
+void close_commit_graph(struct raw_object_store *o)
+{
+	clear_bloom_filters();
+	free_commit_graph(o->commit_graph);
+	o->commit_graph = NULL;
+	o->commit_graph_attempted = 0;
+}
+
+static int bsearch_graph(struct commit_graph *g, const struct object_id *oid,
+			 uint32_t *pos)
+{
+	return bsearch_hash(oid->hash, g->chunk_oid_fanout,
+			    g->chunk_oid_lookup, g->hash_len, pos);
+}
+
+static struct commit_list **insert_parent_or_die(struct commit_graph *g,
+						 uint64_t pos,
+						 struct commit_list **pptr)
+{
+	struct commit *c;
+	struct object_id oid;
+
+	if (pos >= g->num_commits)
+		die(_("invalid parent position %"PRIu64), pos);
+
+	hashcpy(oid.hash, g->chunk_oid_lookup + g->hash_len * pos);
+	c = lookup_commit(&oid);
+	if (!c)
+		die(_("could not find commit %s"), oid_to_hex(&oid));
+	c->graph_pos = pos;
+	return &commit_list_insert(c, pptr)->next;
+}
+
+static void fill_commit_graph_info(struct commit *item,
+				   struct commit_graph *g, uint32_t pos)
+{
+	const unsigned char *commit_data =
+		g->chunk_commit_data + GRAPH_DATA_WIDTH * pos;
+
+	item->graph_pos = pos;
+	item->generation = get_be32(commit_data + g->hash_len + 8) >> 2;
+}
+
+static int fill_commit_in_graph(struct commit *item,
+				struct commit_graph *g, uint32_t pos)
+{
+	struct object_id oid;
+	uint32_t edge_value;
+	const unsigned char *parent_data_ptr;
+	uint64_t date_low, date_high;
+	struct commit_list **pptr;
+	const unsigned char *commit_data =
+		g->chunk_commit_data + GRAPH_DATA_WIDTH * pos;
+
+	hashcpy(oid.hash, commit_data);
+	item->tree = lookup_tree(&oid);
+	if (!item->tree)
+		return error(_("bad tree pointer %s in commit-graph for %s"),
+			     oid_to_hex(&oid), oid_to_hex(&item->object.oid));
+
+	item->object.parsed = 1;
+	fill_commit_graph_info(item, g, pos);
+
+	date_high = get_be32(commit_data + g->hash_len + 8) & 0x3;
+	date_low = get_be32(commit_data + g->hash_len + 12);
+	item->date = (timestamp_t)((date_high << 32) | date_low);
+
+	pptr = &item->parents;
+
+	edge_value = get_be32(commit_data + g->hash_len);
+	if (edge_value == GRAPH_PARENT_NONE)
+		return 1;
+	pptr = insert_parent_or_die(g, edge_value, pptr);
+
+	edge_value = get_be32(commit_data + g->hash_len + 4);
+	if (edge_value == GRAPH_PARENT_NONE)
+		return 1;
+	if (!(edge_value & GRAPH_OCTOPUS_EDGES_NEEDED)) {
+		pptr = insert_parent_or_die(g, edge_value, pptr);
+		return 1;
+	}
+
+	if (!g->chunk_large_edges)
+		die(_("commit-graph requires extra edges, but has no EDGE chunk"));
+	parent_data_ptr = g->chunk_large_edges +
+			  4 * (edge_value & GRAPH_EDGE_LAST_MASK);
+	do {
+		if (parent_data_ptr + 4 > g->data + g->data_len - GRAPH_OID_LEN)
+			die(_("commit-graph EDGE chunk is truncated"));
+		edge_value = get_be32(parent_data_ptr);
+		pptr = insert_parent_or_die(g, edge_value & GRAPH_EDGE_LAST_MASK,
+					    pptr);
+		parent_data_ptr += 4;
+	} while (!(edge_value & GRAPH_LAST_EDGE));
+
+	return 1;
+}
+
+/*
+ * Grafts and replacement objects change what parse_commit() reports
+ * for a commit; the graph only knows about the commit object itself,
+ * so such commits must be parsed from their buffer instead.
+ */
+static int commit_is_overridden(struct commit *item)
+{
+	return lookup_commit_graft(&item->object.oid) ||
+	       lookup_replace_object(&item->object.oid) != &item->object.oid;
+}
+
+static int find_commit_in_graph(struct commit *item, struct commit_graph *g,
+				uint32_t *pos)
+{
+	if (item->graph_pos != COMMIT_NOT_FROM_GRAPH) {
+		*pos = item->graph_pos;
+		return 1;
+	}
+	return bsearch_graph(g, &item->object.oid, pos);
+}
+
+int parse_commit_in_graph(struct commit *item)
+{
+	struct commit_graph *g;
+	uint32_t pos;
+
+	if (item->object.parsed)
+		return 1;
+	if (!prepare_commit_graph())
+		return 0;
+	g = the_repository->objects->commit_graph;
+	if (!find_commit_in_graph(item, g, &pos) || commit_is_overridden(item))
+		return 0;
+	return fill_commit_in_graph(item, g, pos) > 0;
+}
+
+void load_commit_graph_info(struct commit *item)
+{
+	struct commit_graph *g;
+	uint32_t pos;
+
+	if (!prepare_commit_graph())
+		return;
+	g = the_repository->objects->commit_graph;
+	if (find_commit_in_graph(item, g, &pos) && !commit_is_overridden(item))
+		fill_commit_graph_info(item, g, pos);
+}
+
+struct packed_oid_list {
+	struct object_id *list;
+	int nr;
+	int alloc;
+	struct progress *progress;
+	int progress_done;
+};
+
+static int commit_pos(struct commit **commits, int nr,
+		      const struct object_id *oid)
+{
+	int lo = 0, hi = nr;
+
+	while (lo < hi) {
+		int mi = lo + (hi - lo) / 2;
+		int cmp = oidcmp(&commits[mi]->object.oid, oid);
+
+		if (!cmp)
+			return mi;
+		if (cmp > 0)
+			hi = mi;
+		else
+			lo = mi + 1;
+	}
+	return -1;
+}
+
+static void write_graph_chunk_fanout(struct hashfile *f,
+				     struct commit **commits,
+				     int nr_commits)
+{
+	int i, count = 0;
+	struct commit **list = commits;
+
+	/*
+	 * Write the first-level table (the list is sorted,
+	 * but we use a 256-entry lookup to be able to avoid
+	 * having to do eight extra binary search iterations).
+	 */
+	for (i = 0; i < 256; i++) {
+		while (count < nr_commits) {
+			if ((*list)->object.oid.hash[0] != i)
+				break;
+			count++;
+			list++;
+		}
+
+		hashwrite_be32(f, count);
+	}
+}
+
+static void write_graph_chunk_oids(struct hashfile *f, int hash_len,
+				   struct commit **commits, int nr_commits)
+{
+	int i;
+
+	for (i = 0; i < nr_commits; i++)
+		hashwrite(f, commits[i]->object.oid.hash, hash_len);
+}
+
+static void write_graph_chunk_data(struct hashfile *f, int hash_len,
+				   struct commit **commits, int nr_commits)
+{
+	int i, num_extra_edges = 0;
+
+	for (i = 0; i < nr_commits; i++) {
+		struct commit *c = commits[i];
+		struct commit_list *parent;
+		int edge_value;
+		uint32_t packed_date[2];
+
+		hashwrite(f, c->tree->object.oid.hash, hash_len);
+
+		parent = c->parents;
+
+		if (!parent)
+			edge_value = GRAPH_PARENT_NONE;
+		else {
+			edge_value = commit_pos(commits, nr_commits,
+						&parent->item->object.oid);
+			if (edge_value < 0)
+				BUG("parent %s of %s is not in the commit-graph",
+				    oid_to_hex(&parent->item->object.oid),
+				    oid_to_hex(&c->object.oid));
+		}
+
+		hashwrite_be32(f, edge_value);
+
+		if (parent)
+			parent = parent->next;
+
+		if (!parent)
+			edge_value = GRAPH_PARENT_NONE;
+		else if (parent->next)
+			edge_value = GRAPH_OCTOPUS_EDGES_NEEDED | num_extra_edges;
+		else {
+			edge_value = commit_pos(commits, nr_commits,
+						&parent->item->object.oid);
+			if (edge_value < 0)
+				BUG("parent %s of %s is not in the commit-graph",
+				    oid_to_hex(&parent->item->object.oid),
+				    oid_to_hex(&c->object.oid));
+		}
+
+		hashwrite_be32(f, edge_value);
+
+		if (edge_value & GRAPH_OCTOPUS_EDGES_NEEDED) {
+			do {
+				num_extra_edges++;
+				parent = parent->next;
+			} while (parent);
+		}
+
+		if (sizeof(c->date) > 4)
+			packed_date[0] = htonl((c->date >> 32) & 0x3);
+		else
+			packed_date[0] = 0;
+
+		packed_date[0] |= htonl(c->generation << 2);
+
+		packed_date[1] = htonl(c->date);
+		hashwrite(f, packed_date, 8);
+	}
+}
+
+static void write_graph_chunk_large_edges(struct hashfile *f,
+					  struct commit **commits,
+					  int nr_commits)
+{
+	int i;
+
+	for (i = 0; i < nr_commits; i++) {
+		struct commit_list *parent = commits[i]->parents;
+		uint32_t num_parents = 0;
+
+		/* only octopus merges have their parents in this chunk */
+		if (commit_list_count(parent) <= 2)
+			continue;
+
+		while (parent) {
+			int edge_value;
+
+			num_parents++;
+
+			if (num_parents <= 1) {
+				parent = parent->next;
+				continue;
+			}
+
+			edge_value = commit_pos(commits, nr_commits,
+						&parent->item->object.oid);
+			if (edge_value < 0)
+				BUG("parent %s of %s is not in the commit-graph",
+				    oid_to_hex(&parent->item->object.oid),
+				    oid_to_hex(&commits[i]->object.oid));
+
+			/* Is this the last parent? */
+			if (!parent->next)
+				edge_value |= GRAPH_LAST_EDGE;
+
+			hashwrite_be32(f, edge_value);
+			parent = parent->next;
+		}
+	}
+}
+
+static void write_graph_chunk_bloom_indexes(struct hashfile *f,
+					    struct commit **commits,
+					    int nr_commits)
+{
+	int i;
+	uint32_t cur_pos = 0;
+
+	for (i = 0; i < nr_commits; i++) {
+		struct bloom_filter *filter = get_bloom_filter(commits[i], 0);
+
+		cur_pos += filter->len;
+		hashwrite_be32(f, cur_pos);
+	}
+}
+
+static void write_graph_chunk_bloom_data(struct hashfile *f,
+					 struct commit **commits,
+					 int nr_commits,
+					 const struct bloom_filter_settings *settings)
+{
+	int i;
+
+	hashwrite_be32(f, settings->hash_version);
+	hashwrite_be32(f, settings->num_hashes);
+	hashwrite_be32(f, settings->bits_per_entry);
+
+	for (i = 0; i < nr_commits; i++) {
+		struct bloom_filter *filter = get_bloom_filter(commits[i], 0);
+
+		hashwrite(f, filter->data, filter->len);
+	}
+}
+
+/*
+ * Compute (or look up in the existing graph) the changed-path filter
+ * of every commit, and return the total size of the filters.
+ */
+static uint64_t compute_bloom_filters(struct commit **commits, int nr_commits)
+{
+	int i;
+	uint64_t total_size = 0;
+	struct progress *progress;
+
+	progress = start_delayed_progress(
+			_("Computing commit changed paths Bloom filters"),
+			nr_commits);
+	for (i = 0; i < nr_commits; i++) {
+		struct bloom_filter *filter = get_bloom_filter(commits[i], 1);
+
+		total_size += filter->len;
+		display_progress(progress, i + 1);
+	}
+	stop_progress(&progress);
+
+	return total_size;
+}
+
+static int commit_compare(const void *_a, const void *_b)
+{
+	const struct object_id *a = (const struct object_id *)_a;
+	const struct object_id *b = (const struct object_id *)_b;
+	return oidcmp(a, b);
+}
+
+static int add_packed_commits(const struct object_id *oid,
+			      struct packed_git *pack,
+			      uint32_t pos,
+			      void *data)
+{
+	struct packed_oid_list *list = (struct packed_oid_list*)data;
+	enum object_type type;
+	off_t offset = nth_packed_object_offset(pack, pos);
+	struct object_info oi = OBJECT_INFO_INIT;
+
+	if (list->progress)
+		display_progress(list->progress, ++list->progress_done);
+
+	oi.typep = &type;
+	if (packed_object_info(pack, offset, &oi) < 0)
+		die(_("unable to get type of object %s"), oid_to_hex(oid));
+
+	if (type != OBJ_COMMIT)
+		return 0;
+
+	ALLOC_GROW(list->list, list->nr + 1, list->alloc);
+	oidcpy(&(list->list[list->nr]), oid);
+	list->nr++;
+
+	return 0;
+}
+
+static void add_missing_parents(struct packed_oid_list *oids,
+				struct commit *commit)
+{
+	struct commit_list *parent;
+
+	for (parent = commit->parents; parent; parent = parent->next) {
+		if (!(parent->item->object.flags & UNINTERESTING)) {
+			ALLOC_GROW(oids->list, oids->nr + 1, oids->alloc);
+			oidcpy(&oids->list[oids->nr], &(parent->item->object.oid));
+			oids->nr++;
+			parent->item->object.flags |= UNINTERESTING;
+		}
+	}
+}
+
+static void close_reachable(struct packed_oid_list *oids)
+{
+	int i;
+	struct commit *commit;
+
+	for (i = 0; i < oids->nr; i++) {
+		commit = lookup_commit(&oids->list[i]);
+		if (commit)
+			commit->object.flags |= UNINTERESTING;
+	}
+
+	/*
+	 * As this loop runs, oids->nr may grow, but not more
+	 * than the number of missing commits in the reachable
+	 * closure.
+	 */
+	for (i = 0; i < oids->nr; i++) {
+		commit = lookup_commit(&oids->list[i]);
+
+		if (commit && !parse_commit(commit))
+			add_missing_parents(oids, commit);
+	}
+
+	for (i = 0; i < oids->nr; i++) {
+		commit = lookup_commit(&oids->list[i]);
+
+		if (commit)
+			commit->object.flags &= ~UNINTERESTING;
+	}
+}
+
+static void compute_generation_numbers(struct commit **commits,
+				       int nr_commits)
+{
+	int i;
+	struct commit_list *list = NULL;
+
+	for (i = 0; i < nr_commits; i++) {
+		if (commits[i]->generation != GENERATION_NUMBER_INFINITY &&
+		    commits[i]->generation != GENERATION_NUMBER_ZERO)
+			continue;
+
+		commit_list_insert(commits[i], &list);
+		while (list) {
+			struct commit *current = list->item;
+			struct commit_list *parent;
+			int all_parents_computed = 1;
+			uint32_t max_generation = 0;
+
+			for (parent = current->parents; parent; parent = parent->next) {
+				if (parent->item->generation == GENERATION_NUMBER_INFINITY ||
+				    parent->item->generation == GENERATION_NUMBER_ZERO) {
+					all_parents_computed = 0;
+					commit_list_insert(parent->item, &list);
+					break;
+				} else if (parent->item->generation > max_generation) {
+					max_generation = parent->item->generation;
+				}
+			}
+
+			if (all_parents_computed) {
+				current->generation = max_generation + 1;
+				pop_commit(&list);
+
+				if (current->generation > GENERATION_NUMBER_MAX)
+					current->generation = GENERATION_NUMBER_MAX;
+			}
+		}
+	}
+}
+
+static int add_ref_to_list(const char *refname,
+			   const struct object_id *oid,
+			   int flags, void *cb_data)
+{
+	struct string_list *list = (struct string_list *)cb_data;
+
+	string_list_append(list, oid_to_hex(oid));
+	return 0;
+}
+
+void write_commit_graph_reachable(const char *obj_dir, unsigned int flags)
+{
+	struct string_list list = STRING_LIST_INIT_DUP;
+
+	for_each_ref(add_ref_to_list, &list);
+	write_commit_graph(obj_dir, NULL, &list, flags);
+	string_list_clear(&list, 0);
+}
+
+static int count_graft(const struct commit_graft *graft, void *cb_data)
+{
+	(*(int *)cb_data)++;
+	return 0;
+}
+
+static int count_replace_ref(const char *refname,
+			     const struct object_id *oid,
+			     int flags, void *cb_data)
+{
+	(*(int *)cb_data)++;
+	return 0;
+}
+
+/*
+ * A graph written while grafts or replace refs are in effect would
+ * record the altered history as if it were the real one.
+ */
+static int commit_graph_compatible(void)
+{
+	int nr = 0;
+
+	lookup_commit_graft(&null_oid);
+	for_each_commit_graft(count_graft, &nr);
+	if (check_replace_refs)
+		for_each_replace_ref(count_replace_ref, &nr);
+	return !nr;
+}
+
+void write_commit_graph(const char *obj_dir,
+			struct string_list *pack_indexes,
+			struct string_list *commit_hex,
+			unsigned int flags)
+{
+	struct packed_oid_list oids;
+	struct commit **commits = NULL;
+	int nr_commits, alloc_commits = 0;
+	struct hashfile *f;
+	uint32_t i, count_distinct = 0;
+	char *graph_name;
+	struct lock_file lk = LOCK_INIT;
+	uint32_t chunk_ids[7];
+	uint64_t chunk_offsets[7];
+	int num_chunks;
+	int num_extra_edges;
+	struct commit_list *parent;
+	struct progress *progress = NULL;
+	int append = flags & COMMIT_GRAPH_APPEND;
+	int changed_paths = flags & COMMIT_GRAPH_CHANGED_PATHS;
+	struct bloom_filter_settings bloom_settings = DEFAULT_BLOOM_FILTER_SETTINGS;
+	uint64_t total_bloom_size = 0;
+
+	if (!commit_graph_compatible()) {
+		warning(_("not writing a commit-graph: grafts or replace refs are in use"));
+		return;
+	}
+
+	graph_name = get_commit_graph_filename(obj_dir);
+
+	/* once a graph has changed-path filters, keep writing them */
+	if (!changed_paths) {
+		struct commit_graph *old = load_commit_graph_one(graph_name);
+
+		if (old && old->chunk_bloom_data)
+			changed_paths = 1;
+		free_commit_graph(old);
+	}
+
+	oids.nr = 0;
+	oids.alloc = approximate_object_count() / 4;
+	oids.progress = NULL;
+	oids.progress_done = 0;
+
+	if (append) {
+		prepare_commit_graph_one(the_repository->objects, obj_dir);
+		if (the_repository->objects->commit_graph)
+			oids.alloc += the_repository->objects->commit_graph->num_commits;
+	}
+
+	if (oids.alloc < 1024)
+		oids.alloc = 1024;
+	ALLOC_ARRAY(oids.list, oids.alloc);
+
+	if (append && the_repository->objects->commit_graph) {
+		struct commit_graph *commit_graph =
+			the_repository->objects->commit_graph;
+		for (i = 0; i < commit_graph->num_commits; i++) {
+			const unsigned char *hash = commit_graph->chunk_oid_lookup +
+				commit_graph->hash_len * i;
+			hashcpy(oids.list[oids.nr++].hash, hash);
+		}
+	}
+
+	if (pack_indexes) {
+		struct strbuf packname = STRBUF_INIT;
+		int dirlen;
+		strbuf_addf(&packname, "%s/pack/", obj_dir);
+		dirlen = packname.len;
+		for (i = 0; i < pack_indexes->nr; i++) {
+			struct packed_git *p;
+			strbuf_setlen(&packname, dirlen);
+			strbuf_addstr(&packname, pack_indexes->items[i].string);
+			p = add_packed_git(packname.buf, packname.len, 1);
+			if (!p)
+				die(_("error adding pack %s"), packname.buf);
+			if (open_pack_index(p))
+				die(_("error opening index for %s"), packname.buf);
+			for_each_object_in_pack(p, add_packed_commits, &oids);
+			close_pack(p);
+			free(p);
+		}
+		strbuf_release(&packname);
+	}
+
+	if (commit_hex) {
+		for (i = 0; i < commit_hex->nr; i++) {
+			const char *end;
+			struct object_id oid;
+			struct commit *result;
+
+			if (commit_hex->items[i].string &&
+			    parse_oid_hex(commit_hex->items[i].string, &oid, &end))
+				continue;
+
+			result = lookup_commit_reference_gently(&oid, 1);
+
+			if (result) {
+				ALLOC_GROW(oids.list, oids.nr + 1, oids.alloc);
+				oidcpy(&oids.list[oids.nr], &(result->object.oid));
+				oids.nr++;
+			}
+		}
+	}
+
+	if (!pack_indexes && !commit_hex) {
+		oids.progress = start_delayed_progress(
+			_("Finding commits for commit graph"),
+			approximate_object_count());
+		for_each_packed_object(add_packed_commits, &oids, 0);
+		stop_progress(&oids.progress);
+	}
+
+	close_reachable(&oids);
+
+	QSORT(oids.list, oids.nr, commit_compare);
+
+	count_distinct = 1;
+	for (i = 1; i < oids.nr; i++) {
+		if (oidcmp(&oids.list[i - 1], &oids.list[i]))
+			count_distinct++;
+	}
+
+	if (count_distinct >= GRAPH_PARENT_NONE)
+		die(_("the commit graph format cannot write %d commits"),
+		    count_distinct);
+
+	nr_commits = 0;
+	num_extra_edges = 0;
+	ALLOC_GROW(commits, count_distinct, alloc_commits);
+	for (i = 0; i < oids.nr; i++) {
+		int num_parents = 0;
+		if (i > 0 && !oidcmp(&oids.list[i - 1], &oids.list[i]))
+			continue;
+
+		commits[nr_commits] = lookup_commit(&oids.list[i]);
+		if (!commits[nr_commits] || parse_commit(commits[nr_commits]))
+			die(_("unable to parse commit %s"),
+			    oid_to_hex(&oids.list[i]));
+
+		for (parent = commits[nr_commits]->parents;
+		     parent; parent = parent->next)
+			num_parents++;
+
+		if (num_parents > 2)
+			num_extra_edges += num_parents - 1;
+
+		nr_commits++;
+	}
+	if (num_extra_edges >= GRAPH_EDGE_LAST_MASK)
+		die(_("too many commits to write graph"));
+
+	compute_generation_numbers(commits, nr_commits);
+
+	if (changed_paths) {
+		total_bloom_size = compute_bloom_filters(commits, nr_commits);
+		if (total_bloom_size > 0xffffffff)
+			die(_("changed-path Bloom filters are too large for the commit-graph"));
+	}
+
+	if (safe_create_leading_directories(graph_name))
+		die_errno(_("unable to create leading directories of %s"),
+			  graph_name);
+
+	hold_lock_file_for_update(&lk, graph_name, LOCK_DIE_ON_ERROR);
+	f = hashfd(get_lock_file_fd(&lk), get_lock_file_path(&lk));
+
+	chunk_ids[0] = GRAPH_CHUNKID_OIDFANOUT;
+	chunk_ids[1] = GRAPH_CHUNKID_OIDLOOKUP;
+	chunk_ids[2] = GRAPH_CHUNKID_DATA;
+	num_chunks = 3;
+	if (num_extra_edges)
+		chunk_ids[num_chunks++] = GRAPH_CHUNKID_LARGEEDGES;
+	if (changed_paths) {
+		chunk_ids[num_chunks++] = GRAPH_CHUNKID_BLOOMINDEXES;
+		chunk_ids[num_chunks++] = GRAPH_CHUNKID_BLOOMDATA;
+	}
+	chunk_ids[num_chunks] = 0;
+
+	chunk_offsets[0] = 8 + (num_chunks + 1) * GRAPH_CHUNKLOOKUP_WIDTH;
+	chunk_offsets[1] = chunk_offsets[0] + GRAPH_FANOUT_SIZE;
+	chunk_offsets[2] = chunk_offsets[1] + GRAPH_OID_LEN * nr_commits;
+	chunk_offsets[3] = chunk_offsets[2] + (GRAPH_OID_LEN + 16) * nr_commits;
+	for (i = 3; i < num_chunks; i++) {
+		switch (chunk_ids[i]) {
+		case GRAPH_CHUNKID_LARGEEDGES:
+			chunk_offsets[i + 1] = chunk_offsets[i] + 4 * num_extra_edges;
+			break;
+		case GRAPH_CHUNKID_BLOOMINDEXES:
+			chunk_offsets[i + 1] = chunk_offsets[i] + 4 * nr_commits;
+			break;
+		case GRAPH_CHUNKID_BLOOMDATA:
+			chunk_offsets[i + 1] = chunk_offsets[i] +
+				BLOOMDATA_CHUNK_HEADER_SIZE + total_bloom_size;
+			break;
+		}
+	}
+
+	hashwrite_be32(f, GRAPH_SIGNATURE);
+
+	hashwrite_u8(f, GRAPH_VERSION);
+	hashwrite_u8(f, GRAPH_OID_VERSION);
+	hashwrite_u8(f, num_chunks);
+	hashwrite_u8(f, 0); /* unused padding byte */
+
+	for (i = 0; i <= num_chunks; i++) {
+		uint32_t chunk_write[3];
+
+		chunk_write[0] = htonl(chunk_ids[i]);
+		chunk_write[1] = htonl(chunk_offsets[i] >> 32);
+		chunk_write[2] = htonl(chunk_offsets[i] & 0xffffffff);
+		hashwrite(f, chunk_write, 12);
+	}
+
+	progress = start_delayed_progress(_("Writing out commit graph"),
+					  nr_commits);
+	write_graph_chunk_fanout(f, commits, nr_commits);
+	write_graph_chunk_oids(f, GRAPH_OID_LEN, commits, nr_commits);
+	write_graph_chunk_data(f, GRAPH_OID_LEN, commits, nr_commits);
+	write_graph_chunk_large_edges(f, commits, nr_commits);
+	if (changed_paths) {
+		write_graph_chunk_bloom_indexes(f, commits, nr_commits);
+		write_graph_chunk_bloom_data(f, commits, nr_commits,
+					     &bloom_settings);
+	}
+	display_progress(progress, nr_commits);
+	stop_progress(&progress);
+
+	close_commit_graph(the_repository->objects);
+	hashclose(f, NULL, CSUM_HASH_IN_STREAM);
+	if (commit_lock_file(&lk))
+		die_errno(_("unable to write commit-graph file %s"), graph_name);
+
+	free(graph_name);
+	free(commits);
+	free(oids.list);
+}
+
+#define VERIFY_COMMIT_GRAPH_ERROR_HASH 2
+#define GENERATION_ZERO_EXISTS 1
+#define GENERATION_NUMBER_EXISTS 2
+
+static int verify_commit_graph_error;
+
+static void graph_report(const char *fmt, ...)
+{
+	va_list ap;
+
+	verify_commit_graph_error |= 1;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+}
+
+int verify_commit_graph(struct commit_graph *g)
+{
+	uint32_t i, cur_fanout_pos = 0;
+	struct object_id prev_oid, cur_oid, checksum;
+	struct hashfile *f;
+	int devnull;
+	int generation_zero = 0;
+
+	if (!g) {
+		graph_report("no commit-graph file loaded");
+		return 1;
+	}
+
+	verify_commit_graph_error = 0;
+
+	devnull = open("/dev/null", O_WRONLY);
+	f = hashfd(devnull, NULL);
+	hashwrite(f, g->data, g->data_len - g->hash_len);
+	hashclose(f, checksum.hash, CSUM_CLOSE);
+	if (hashcmp(checksum.hash, g->data + g->data_len - g->hash_len)) {
+		graph_report(_("the commit-graph file has incorrect checksum and is likely corrupt"));
+		verify_commit_graph_error = VERIFY_COMMIT_GRAPH_ERROR_HASH;
+	}
+
+	for (i = 0; i < g->num_commits; i++) {
+		struct commit *graph_commit;
+
+		hashcpy(cur_oid.hash, g->chunk_oid_lookup + g->hash_len * i);
+
+		if (i && oidcmp(&prev_oid, &cur_oid) >= 0)
+			graph_report(_("commit-graph has incorrect OID order: %s then %s"),
+				     oid_to_hex(&prev_oid),
+				     oid_to_hex(&cur_oid));
+
+		oidcpy(&prev_oid, &cur_oid);
+
+		while (cur_oid.hash[0] > cur_fanout_pos) {
+			uint32_t fanout_value = get_be32(g->chunk_oid_fanout + cur_fanout_pos);
+
+			if (i != fanout_value)
+				graph_report(_("commit-graph has incorrect fanout value: fanout[%d] = %u != %u"),
+					     cur_fanout_pos, fanout_value, i);
+			cur_fanout_pos++;
+		}
+
+		graph_commit = lookup_commit(&cur_oid);
+		if (!graph_commit ||
+		    (!graph_commit->object.parsed &&
+		     fill_commit_in_graph(graph_commit, g, i) <= 0))
+			graph_report(_("failed to parse commit %s from commit-graph"),
+				     oid_to_hex(&cur_oid));
+	}
+
+	while (cur_fanout_pos < 256) {
+		uint32_t fanout_value = get_be32(g->chunk_oid_fanout + cur_fanout_pos);
+
+		if (g->num_commits != fanout_value)
+			graph_report(_("commit-graph has incorrect fanout value: fanout[%d] = %u != %u"),
+				     cur_fanout_pos, fanout_value, i);
+
+		cur_fanout_pos++;
+	}
+
+	if (verify_commit_graph_error & ~VERIFY_COMMIT_GRAPH_ERROR_HASH)
+		return verify_commit_graph_error;
+
+	for (i = 0; i < g->num_commits; i++) {
+		struct commit *graph_commit, *odb_commit;
+		struct commit_list *graph_parents, *odb_parents;
+		uint32_t max_generation = 0;
+		enum object_type type;
+		unsigned long size;
+		void *buf;
+
+		hashcpy(cur_oid.hash, g->chunk_oid_lookup + g->hash_len * i);
+
+		graph_commit = lookup_commit(&cur_oid);
+		odb_commit = (struct commit *)alloc_commit_node();
+		oidcpy(&odb_commit->object.oid, &cur_oid);
+		odb_commit->object.type = OBJ_COMMIT;
+
+		buf = read_object_file(&cur_oid, &type, &size);
+		if (!buf || type != OBJ_COMMIT ||
+		    parse_commit_buffer(odb_commit, buf, size)) {
+			graph_report(_("failed to parse commit %s from object database for commit-graph"),
+				     oid_to_hex(&cur_oid));
+			free(buf);
+			continue;
+		}
+		free(buf);
+
+		if (oidcmp(&graph_commit->tree->object.oid,
+			   &odb_commit->tree->object.oid))
+			graph_report(_("root tree OID for commit %s in commit-graph is %s != %s"),
+				     oid_to_hex(&cur_oid),
+				     oid_to_hex(&graph_commit->tree->object.oid),
+				     oid_to_hex(&odb_commit->tree->object.oid));
+
+		graph_parents = graph_commit->parents;
+		odb_parents = odb_commit->parents;
+
+		while (graph_parents) {
+			if (odb_parents == NULL) {
+				graph_report(_("commit-graph parent list for commit %s is too long"),
+					     oid_to_hex(&cur_oid));
+				break;
+			}
+
+			if (oidcmp(&graph_parents->item->object.oid,
+				   &odb_parents->item->object.oid))
+				graph_report(_("commit-graph parent for %s is %s != %s"),
+					     oid_to_hex(&cur_oid),
+					     oid_to_hex(&graph_parents->item->object.oid),
+					     oid_to_hex(&odb_parents->item->object.oid));
+
+			if (graph_parents->item->generation > max_generation)
+				max_generation = graph_parents->item->generation;
+
+			graph_parents = graph_parents->next;
+			odb_parents = odb_parents->next;
+		}
+
+		if (odb_parents != NULL)
+			graph_report(_("commit-graph parent list for commit %s terminates early"),
+				     oid_to_hex(&cur_oid));
+
+		if (!graph_commit->generation) {
+			if (generation_zero == GENERATION_NUMBER_EXISTS)
+				graph_report(_("commit-graph has generation number zero for commit %s, but non-zero elsewhere"),
+					     oid_to_hex(&cur_oid));
+			generation_zero = GENERATION_ZERO_EXISTS;
+		} else if (generation_zero == GENERATION_ZERO_EXISTS)
+			graph_report(_("commit-graph has non-zero generation number for commit %s, but zero elsewhere"),
+				     oid_to_hex(&cur_oid));
+		else
+			generation_zero = GENERATION_NUMBER_EXISTS;
+
+		if (generation_zero == GENERATION_ZERO_EXISTS)
+			continue;
+
+		/*
+		 * If one of our parents has generation GENERATION_NUMBER_MAX,
+		 * then our generation is also GENERATION_NUMBER_MAX. Decrement
+		 * to make sure the comparison below matches.
+		 */
+		if (max_generation == GENERATION_NUMBER_MAX)
+			max_generation--;
+
+		if (graph_commit->generation != max_generation + 1)
+			graph_report(_("commit-graph generation for commit %s is %u != %u"),
+				     oid_to_hex(&cur_oid),
+				     graph_commit->generation,
+				     max_generation + 1);
+
+		if (graph_commit->date != odb_commit->date)
+			graph_report(_("commit date for commit %s in commit-graph is %"PRItime" != %"PRItime),
+				     oid_to_hex(&cur_oid),
+				     graph_commit->date,
+				     odb_commit->date);
+	}
+
+	return verify_commit_graph_error;
+}
@@ -0,0 +1,108 @@
+#ifndef COMMIT_GRAPH_H
+#define COMMIT_GRAPH_H
+
+#include "git-compat-util.h"
+#include "string-list.h"
+
+struct commit;
+struct raw_object_store;
+struct bloom_filter_settings;
+
+#define GENERATION_NUMBER_INFINITY 0xFFFFFFFF
+#define GENERATION_NUMBER_MAX 0x3FFFFFFF
+#define GENERATION_NUMBER_ZERO 0
+
+#define COMMIT_NOT_FROM_GRAPH 0xFFFFFFFF
+
+char *get_commit_graph_filename(const char *obj_dir);
+
+/*
+ * Given a commit struct, try to fill the commit struct info, including:
+ *  1. tree object
+ *  2. date
+ *  3. parents
+ *  4. generation number
+ *
+ * Returns 1 if and only if the commit was found in the commit-graph
+ * file. See parse_commit_buffer() for the fallback after this call.
+ */
+int parse_commit_in_graph(struct commit *item);
+
+/*
+ * It is possible that we loaded commit contents from the commit buffer,
+ * but we still want the generation number and graph position that the
+ * commit-graph file knows about. Fill the graph_pos and generation
+ * members of the given commit, if it is in the commit-graph.
+ */
+void load_commit_graph_info(struct commit *item);
+
+struct commit_graph {
+	int graph_fd;
+
+	const unsigned char *data;
+	size_t data_len;
+
+	unsigned char hash_len;
+	unsigned char num_chunks;
+	uint32_t num_commits;
+	struct object_id oid;
+
+	const uint32_t *chunk_oid_fanout;
+	const unsigned char *chunk_oid_lookup;
+	const unsigned char *chunk_commit_data;
+	const unsigned char *chunk_large_edges;
+	const unsigned char *chunk_bloom_indexes;
+	const unsigned char *chunk_bloom_data;
+	size_t chunk_bloom_data_size;
+
+	struct bloom_filter_settings *bloom_filter_settings;
+};
+
+/* hash version, number of hashes and bits per entry */
+#define BLOOMDATA_CHUNK_HEADER_SIZE (3 * sizeof(uint32_t))
+
+struct commit_graph *load_commit_graph_one(const char *graph_file);
+
+/*
+ * Return 1 if the commit-graph file can be used to answer questions
+ * about commits in this repository, 0 if it is absent, disabled by
+ * 'core.commitGraph', or incompatible with grafts or replace refs.
+ */
+int prepare_commit_graph(void);
+
+#define COMMIT_GRAPH_APPEND		(1 << 0)
+#define COMMIT_GRAPH_CHANGED_PATHS	(1 << 1)
+
+/*
+ * Write a commit-graph file for the object directory 'obj_dir'.
+ *
+ * The starting commits are taken from the pack-indexes named in
+ * 'pack_indexes' (basenames relative to obj_dir/pack), from the
+ * commits named in 'commit_hex', or, when both are NULL, from every
+ * packed object. The graph is then closed under reachability.
+ *
+ * With COMMIT_GRAPH_APPEND, the commits of the existing graph file
+ * are kept. With COMMIT_GRAPH_CHANGED_PATHS, or if the existing graph
+ * file already has them, a Bloom filter of the paths each commit
+ * changes is written as well.
+ */
+void write_commit_graph(const char *obj_dir,
+			struct string_list *pack_indexes,
+			struct string_list *commit_hex,
+			unsigned int flags);
+
+/*
+ * Write a commit-graph containing every commit reachable from a ref.
+ */
+void write_commit_graph_reachable(const char *obj_dir, unsigned int flags);
+
+/*
+ * Check the given commit-graph against the object database. Returns
+ * the number of problems found (and reported via error()).
+ */
+int verify_commit_graph(struct commit_graph *g);
+
+void close_commit_graph(struct raw_object_store *o);
+void free_commit_graph(struct commit_graph *g);
+
+#endif
@@ -10,6 +10,7 @@
 #include "mergesort.h"
 #include "commit-slab.h"
 #include "prio-queue.h"
+#include "commit-graph.h"
 #include "sha1-lookup.h"
 #include "wt-status.h"
 
@@ -369,6 +370,8 @@ int parse_commit_buffer(struct commit *item, const void *buffer, unsigned long s
 	}
 	item->date = parse_commit_date(bufptr, tail);
 
+	load_commit_graph_info(item);
+
 	return 0;
 }
 
@@ -383,6 +386,8 @@ int parse_commit_gently(struct commit *item, int quiet_on_missing)
 		return -1;
 	if (item->object.parsed)
 		return 0;
+	if (parse_commit_in_graph(item))
+		return 0;
 	buffer = read_object_file(&item->object.oid, &type, &size);
 	if (!buffer)
 		return quiet_on_missing ? -1 :
@@ -632,6 +637,24 @@ int compare_commits_by_commit_date(const void *a_, const void *b_, void *unused)
 	return 0;
 }
 
+int compare_commits_by_gen_then_commit_date(const void *a_, const void *b_, void *unused)
+{
+	const struct commit *a = a_, *b = b_;
+
+	/* newer commits first */
+	if (a->generation < b->generation)
+		return 1;
+	else if (a->generation > b->generation)
+		return -1;
+
+	/* use date as a heuristic when generations are equal */
+	if (a->date < b->date)
+		return 1;
+	else if (a->date > b->date)
+		return -1;
+	return 0;
+}
+
 /*
  * Performs an in-place topological sort on the list supplied.
  */
@@ -768,9 +791,16 @@ static int queue_has_nonstale(struct prio_queue *queue)
 }
 
 /* all input commits in one and twos[] must have been parsed! */
-static struct commit_list *paint_down_to_common(struct commit *one, int n, struct commit **twos)
+/*
+ * Commits with a generation number below 'min_generation' cannot
+ * reach any of the commits we are interested in, so the walk stops
+ * as soon as the queue only holds such commits.
+ */
+static struct commit_list *paint_down_to_common(struct commit *one, int n,
+						struct commit **twos,
+						uint32_t min_generation)
 {
-	struct prio_queue queue = { compare_commits_by_commit_date };
+	struct prio_queue queue = { compare_commits_by_gen_then_commit_date };
 	struct commit_list *result = NULL;
 	int i;
 
@@ -791,6 +821,9 @@ static struct commit_list *paint_down_to_common(struct commit *one, int n, struc
 		struct commit_list *parents;
 		int flags;
 
+		if (commit->generation < min_generation)
+			break;
+
 		flags = commit->object.flags & (PARENT1 | PARENT2 | STALE);
 		if (flags == (PARENT1 | PARENT2)) {
 			if (!(commit->object.flags & RESULT)) {
@@ -839,7 +872,7 @@ static struct commit_list *merge_bases_many(struct commit *one, int n, struct co
 			return NULL;
 	}
 
-	list = paint_down_to_common(one, n, twos);
+	list = paint_down_to_common(one, n, twos, 0);
 
 	while (list) {
 		struct commit *commit = pop_commit(&list);
@@ -906,7 +939,7 @@ static int remove_redundant(struct commit **array, int cnt)
 			filled_index[filled] = j;
 			work[filled++] = array[j];
 		}
-		common = paint_down_to_common(array[i], filled, work);
+		common = paint_down_to_common(array[i], filled, work, 0);
 		if (array[i]->object.flags & PARENT2)
 			redundant[i] = 1;
 		for (j = 0; j < filled; j++)
@@ -1016,14 +1049,27 @@ int in_merge_bases_many(struct commit *commit, int nr_reference, struct commit *
 {
 	struct commit_list *bases;
 	int ret = 0, i;
+	uint32_t max_generation = GENERATION_NUMBER_ZERO;
 
 	if (parse_commit(commit))
 		return ret;
-	for (i = 0; i < nr_reference; i++)
+	for (i = 0; i < nr_reference; i++) {
 		if (parse_commit(reference[i]))
 			return ret;
+		if (reference[i]->generation > max_generation)
+			max_generation = reference[i]->generation;
+	}
 
-	bases = paint_down_to_common(commit, nr_reference, reference);
+	/*
+	 * An ancestor always has a smaller generation number than its
+	 * descendants, so a commit with a larger generation than every
+	 * reference cannot be reached from any of them.
+	 */
+	if (commit->generation > max_generation)
+		return ret;
+
+	bases = paint_down_to_common(commit, nr_reference, reference,
+				     commit->generation);
 	if (commit->object.flags & PARENT2)
 		ret = 1;
 	clear_commit_marks(commit, all_flags);
@@ -1040,6 +1086,89 @@ int in_merge_bases(struct commit *commit, struct commit *reference)
 	return in_merge_bases_many(commit, 1, &reference);
 }
 
+static int compare_commits_by_gen(const void *_a, const void *_b)
+{
+	const struct commit *a = *(const struct commit * const *)_a;
+	const struct commit *b = *(const struct commit * const *)_b;
+
+	if (a->generation < b->generation)
+		return -1;
+	if (a->generation > b->generation)
+		return 1;
+	return 0;
+}
+
+void tips_reachable_from_base(struct commit *base,
+			      struct commit **tips, int nr_tips,
+			      unsigned int mark)
+{
+	struct commit **sorted;
+	struct commit_list *stack = NULL;
+	uint32_t min_generation;
+	int i, min_index = 0;
+
+	if (!nr_tips || parse_commit(base))
+		return;
+
+	/*
+	 * Tips not found yet are marked PARENT2, and kept sorted by
+	 * generation number: no commit with a generation number below
+	 * the smallest of those can lead to a tip we have not found yet.
+	 */
+	ALLOC_ARRAY(sorted, nr_tips);
+	for (i = 0; i < nr_tips; i++) {
+		parse_commit(tips[i]);
+		tips[i]->object.flags |= PARENT2;
+		sorted[i] = tips[i];
+	}
+	QSORT(sorted, nr_tips, compare_commits_by_gen);
+	min_generation = sorted[0]->generation;
+
+	base->object.flags |= SEEN;
+	commit_list_insert(base, &stack);
+
+	while (stack) {
+		struct commit *c = stack->item;
+		struct commit_list *p;
+
+		if (c->object.flags & PARENT2) {
+			c->object.flags &= ~PARENT2;
+			c->object.flags |= mark;
+			while (min_index < nr_tips &&
+			       !(sorted[min_index]->object.flags & PARENT2))
+				min_index++;
+			if (min_index == nr_tips)
+				break; /* found them all */
+			min_generation = sorted[min_index]->generation;
+		}
+
+		/*
+		 * Go depth-first down the first parent not explored yet;
+		 * we come back to this commit for the others.
+		 */
+		for (p = c->parents; p; p = p->next) {
+			struct commit *parent = p->item;
+
+			if (parent->object.flags & SEEN)
+				continue;
+			if (parse_commit(parent) ||
+			    parent->generation < min_generation)
+				continue;
+			parent->object.flags |= SEEN;
+			commit_list_insert(parent, &stack);
+			break;
+		}
+		if (!p)
+			pop_commit(&stack);
+	}
+
+	free_commit_list(stack);
+	clear_commit_marks(base, SEEN);
+	for (i = 0; i < nr_tips; i++)
+		tips[i]->object.flags &= ~PARENT2;
+	free(sorted);
+}
+
 struct commit_list *reduce_heads(struct commit_list *heads)
 {
 	struct commit_list *p;
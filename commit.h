@@ -21,6 +21,8 @@ struct commit {
 	timestamp_t date;
 	struct commit_list *parents;
 	struct tree *tree;
+	uint32_t graph_pos;
+	uint32_t generation;
 };
 
 extern int save_commit_buffer;
@@ -229,6 +231,16 @@ int is_descendant_of(struct commit *, struct commit_list *);
 int in_merge_bases(struct commit *, struct commit *);
 int in_merge_bases_many(struct commit *, int, struct commit **);
 
+/*
+ * Set `mark` in the flags of those of the `tips` that are reachable from
+ * `base`, answering for all of them with a single walk. With generation
+ * numbers from the commit-graph, the walk does not go below the tips not
+ * found yet.
+ */
+void tips_reachable_from_base(struct commit *base,
+			      struct commit **tips, int nr_tips,
+			      unsigned int mark);
+
 extern int interactive_add(int argc, const char **argv, const char *prefix, int patch);
 extern int run_add_interactive(const char *revision, const char *patch_mode,
 			       const struct pathspec *pathspec);
@@ -325,6 +337,7 @@ extern int remove_signature(struct strbuf *buf);
 extern int check_commit_signature(const struct commit *commit, struct signature_check *sigc);
 
 int compare_commits_by_commit_date(const void *a_, const void *b_, void *unused);
+int compare_commits_by_gen_then_commit_date(const void *a_, const void *b_, void *unused);
 
 LAST_ARG_MUST_BE_NULL
 extern int run_commit_hook(int editor_is_used, const char *index_file, const char *name, ...);
@@ -215,6 +215,12 @@ extern int git_config_get_split_index(void);
 extern int git_config_get_max_percent_split_change(void);
 extern int git_config_get_fsmonitor(void);
 
+/*
+ * Number of threads to use when reading the index, 0 meaning "pick one
+ * based on the number of entries and CPUs". Returns 1 if unconfigured.
+ */
+extern int git_config_get_index_threads(int *dest);
+
 /* This dies if the configured or default date is in the future */
 extern int git_config_get_expiry(const char *key, const char **output);
 
@@ -7,6 +7,7 @@
 #include "string-list.h"
 
 struct index_state;
+struct convert_driver;
 
 #define CONV_EOL_RNDTRP_DIE   (1<<0) /* Die if CRLF to LF to CRLF is different */
 #define CONV_EOL_RNDTRP_WARN  (1<<1) /* Warn if CRLF to LF to CRLF is different */
@@ -34,6 +35,63 @@ enum eol {
 #endif
 };
 
+enum crlf_action {
+	CRLF_UNDEFINED,
+	CRLF_BINARY,
+	CRLF_TEXT,
+	CRLF_TEXT_INPUT,
+	CRLF_TEXT_CRLF,
+	CRLF_AUTO,
+	CRLF_AUTO_INPUT,
+	CRLF_AUTO_CRLF
+};
+
+/*
+ * The conversion attributes of a path, as looked up by convert_attrs().
+ * They can be computed once and handed to the "_ca" variants of the
+ * conversion functions, e.g. when the conversion happens somewhere the
+ * attributes cannot be read (see parallel-checkout.c).
+ */
+struct conv_attrs {
+	struct convert_driver *drv;
+	enum crlf_action attr_action; /* What attr says */
+	enum crlf_action crlf_action; /* When no attr is set, use core.autocrlf */
+	int ident;
+};
+
+enum conv_attrs_classification {
+	/*
+	 * The blob must be loaded into a buffer before it can be
+	 * smudged. All smudging is done in-proc.
+	 */
+	CA_CLASS_INCORE,
+
+	/*
+	 * The blob must be loaded into a buffer, but uses a
+	 * single-file driver filter, such as rot13.
+	 */
+	CA_CLASS_INCORE_FILTER,
+
+	/*
+	 * The blob must be loaded into a buffer, but uses a
+	 * long-running driver process, such as LFS. This might or
+	 * might not use delayed operations. (The important thing is
+	 * that there is a single subordinate long-running process
+	 * handling all associated blobs and in case of delayed
+	 * operations, may hold per-blob state.)
+	 */
+	CA_CLASS_INCORE_PROCESS,
+
+	/*
+	 * The blob can be streamed and smudged without needing to
+	 * completely read it into a buffer.
+	 */
+	CA_CLASS_STREAMABLE,
+};
+
+extern void convert_attrs(struct conv_attrs *ca, const char *path);
+extern enum conv_attrs_classification classify_conv_attrs(const struct conv_attrs *ca);
+
 enum ce_delay_state {
 	CE_NO_DELAY = 0,
 	CE_CAN_DELAY = 1,
@@ -66,6 +124,9 @@ extern int convert_to_git(const struct index_state *istate,
 			  struct strbuf *dst, int conv_flags);
 extern int convert_to_working_tree(const char *path, const char *src,
 				   size_t len, struct strbuf *dst);
+extern int convert_to_working_tree_ca(const struct conv_attrs *ca,
+				      const char *path, const char *src,
+				      size_t len, struct strbuf *dst);
 extern int async_convert_to_working_tree(const char *path, const char *src,
 					 size_t len, struct strbuf *dst,
 					 void *dco);
@@ -94,6 +155,8 @@ extern int would_convert_to_git_filter_fd(const char *path);
 struct stream_filter; /* opaque */
 
 extern struct stream_filter *get_stream_filter(const char *path, const struct object_id *);
+extern struct stream_filter *get_stream_filter_ca(const struct conv_attrs *ca,
+						  const struct object_id *oid);
 extern void free_stream_filter(struct stream_filter *);
 extern int is_null_stream_filter(struct stream_filter *);
 
@@ -69,8 +69,11 @@ int hashclose(struct hashfile *f, unsigned char *result, unsigned int flags)
 		if (close(f->fd))
 			die_errno("%s: sha1 file error on close", f->name);
 		fd = 0;
-	} else
+	} else {
+		if (flags & CSUM_HASH_IN_STREAM)
+			flush(f, f->buffer, the_hash_algo->rawsz);
 		fd = f->fd;
+	}
 	if (0 <= f->check_fd) {
 		char discard;
 		int cnt = read_in_full(f->check_fd, &discard, 1);
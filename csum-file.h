@@ -29,6 +29,7 @@ extern int hashfile_truncate(struct hashfile *, struct hashfile_checkpoint *);
 /* hashclose flags */
 #define CSUM_CLOSE	1
 #define CSUM_FSYNC	2
+#define CSUM_HASH_IN_STREAM	4 /* write the checksum, but keep the fd open */
 
 extern struct hashfile *hashfd(int fd, const char *name);
 extern struct hashfile *hashfd_check(const char *name);
@@ -39,6 +40,12 @@ extern void hashflush(struct hashfile *f);
 extern void crc32_begin(struct hashfile *);
 extern uint32_t crc32_end(struct hashfile *);
 
+/* The number of bytes written to the file so far, including buffered ones. */
+static inline off_t hashfile_total(struct hashfile *f)
+{
+	return f->total + f->offset;
+}
+
 static inline void hashwrite_u8(struct hashfile *f, uint8_t data)
 {
 	hashwrite(f, &data, sizeof(data));
@@ -0,0 +1,417 @@
+#include "cache.h"
+#include "config.h"
+#include "refs.h"
+#include "object.h"
+#include "commit.h"
+#include "tag.h"
+#include "tree.h"
+#include "tree-walk.h"
+#include "progress.h"
+#include "string-list.h"
+#include "sha1-array.h"
+#include "khash.h"
+#include "pack.h"
+#include "pack-bitmap.h"
+#include "pack-objects.h"
+#include "delta-islands.h"
+
+/*
+ * The set of islands an object is reachable from.  Objects reached
+ * only through a single parent share the bitmap of that parent; it is
+ * copied before it is changed when the object turns out to be
+ * reachable from other islands, too.
+ */
+struct island_bitmap {
+	uint32_t refcount;
+	uint32_t bits[FLEX_ARRAY];
+};
+
+static uint32_t island_bitmap_size;
+
+#define ISLAND_BITMAP_BLOCK(x) ((x) / 32)
+#define ISLAND_BITMAP_MASK(x) (1u << ((x) % 32))
+
+static struct island_bitmap *island_bitmap_new(const struct island_bitmap *old)
+{
+	size_t size = st_add(sizeof(struct island_bitmap),
+			     st_mult(island_bitmap_size, sizeof(uint32_t)));
+	struct island_bitmap *b = xcalloc(1, size);
+
+	if (old)
+		memcpy(b, old, size);
+	b->refcount = 1;
+	return b;
+}
+
+static void island_bitmap_or(struct island_bitmap *self,
+			     const struct island_bitmap *other)
+{
+	uint32_t i;
+
+	for (i = 0; i < island_bitmap_size; i++)
+		self->bits[i] |= other->bits[i];
+}
+
+static int island_bitmap_is_subset(const struct island_bitmap *self,
+				   const struct island_bitmap *super)
+{
+	uint32_t i;
+
+	if (self == super)
+		return 1;
+	for (i = 0; i < island_bitmap_size; i++)
+		if ((self->bits[i] & super->bits[i]) != self->bits[i])
+			return 0;
+	return 1;
+}
+
+static void island_bitmap_set(struct island_bitmap *self, uint32_t i)
+{
+	self->bits[ISLAND_BITMAP_BLOCK(i)] |= ISLAND_BITMAP_MASK(i);
+}
+
+static int island_bitmap_get(const struct island_bitmap *self, uint32_t i)
+{
+	return (self->bits[ISLAND_BITMAP_BLOCK(i)] & ISLAND_BITMAP_MASK(i)) != 0;
+}
+
+/* Maps the object names of marked objects to their island_bitmap. */
+static khash_sha1 *island_marks;
+
+static struct island_bitmap *get_island_marks(const struct object_id *oid)
+{
+	khiter_t pos;
+
+	if (!island_marks)
+		return NULL;
+	pos = kh_get_sha1(island_marks, oid->hash);
+	if (pos >= kh_end(island_marks))
+		return NULL;
+	return kh_value(island_marks, pos);
+}
+
+int in_same_island(const struct object_id *trg, const struct object_id *src)
+{
+	struct island_bitmap *trg_marks, *src_marks;
+
+	if (!island_marks)
+		return 1;
+
+	/*
+	 * An object no island reaches may be stored against anything;
+	 * nobody will fetch it anyway.
+	 */
+	trg_marks = get_island_marks(trg);
+	if (!trg_marks)
+		return 1;
+
+	/* ... but such an object is not a good base for anything else. */
+	src_marks = get_island_marks(src);
+	if (!src_marks)
+		return 0;
+
+	return island_bitmap_is_subset(trg_marks, src_marks);
+}
+
+int island_delta_cmp(const struct object_id *a, const struct object_id *b)
+{
+	struct island_bitmap *a_marks, *b_marks;
+
+	if (!island_marks)
+		return 0;
+
+	a_marks = get_island_marks(a);
+	b_marks = get_island_marks(b);
+
+	if (a_marks && (!b_marks || !island_bitmap_is_subset(a_marks, b_marks)))
+		return -1;
+	if (b_marks && (!a_marks || !island_bitmap_is_subset(b_marks, a_marks)))
+		return 1;
+	return 0;
+}
+
+static struct island_bitmap *create_or_get_island_marks(struct object *obj)
+{
+	khiter_t pos;
+	int hash_ret;
+
+	pos = kh_put_sha1(island_marks, obj->oid.hash, &hash_ret);
+	if (hash_ret)
+		kh_value(island_marks, pos) = island_bitmap_new(NULL);
+	return kh_value(island_marks, pos);
+}
+
+static void set_island_marks(struct object *obj, struct island_bitmap *marks)
+{
+	struct island_bitmap *b;
+	khiter_t pos;
+	int hash_ret;
+
+	pos = kh_put_sha1(island_marks, obj->oid.hash, &hash_ret);
+	if (hash_ret) {
+		/* Not marked yet; share the marks of the parent. */
+		marks->refcount++;
+		kh_value(island_marks, pos) = marks;
+		return;
+	}
+
+	b = kh_value(island_marks, pos);
+	if (b == marks || island_bitmap_is_subset(marks, b))
+		return;
+
+	/* Split a shared bitmap before adding to it. */
+	if (b->refcount > 1) {
+		b->refcount--;
+		b = kh_value(island_marks, pos) = island_bitmap_new(b);
+	}
+	island_bitmap_or(b, marks);
+}
+
+/*
+ * The islands, as collected from the refs: the island name is the
+ * string, and the util pointer an oid_array of its ref tips.
+ */
+static struct string_list remote_islands = STRING_LIST_INIT_DUP;
+
+static regex_t *island_regexes;
+static int island_regexes_nr, island_regexes_alloc;
+static const char *core_island_name;
+static uint32_t island_counter_core;
+
+static int island_config_callback(const char *k, const char *v, void *cb)
+{
+	if (!strcmp(k, "pack.island")) {
+		struct strbuf re = STRBUF_INIT;
+
+		if (!v)
+			return config_error_nonbool(k);
+
+		ALLOC_GROW(island_regexes, island_regexes_nr + 1,
+			   island_regexes_alloc);
+
+		/* The regexes are anchored to the start of the refname. */
+		if (*v != '^')
+			strbuf_addch(&re, '^');
+		strbuf_addstr(&re, v);
+
+		if (regcomp(&island_regexes[island_regexes_nr], re.buf,
+			    REG_EXTENDED))
+			die(_("failed to load island regex for '%s': %s"),
+			    k, re.buf);
+		strbuf_release(&re);
+		island_regexes_nr++;
+		return 0;
+	}
+
+	if (!strcmp(k, "pack.islandcore"))
+		return git_config_string(&core_island_name, k, v);
+
+	return 0;
+}
+
+static void add_ref_to_island(const char *island_name,
+			      const struct object_id *oid)
+{
+	struct string_list_item *item;
+
+	item = string_list_insert(&remote_islands, island_name);
+	if (!item->util)
+		item->util = xcalloc(1, sizeof(struct oid_array));
+	oid_array_append(item->util, oid);
+}
+
+static int find_island_for_ref(const char *refname, const struct object_id *oid,
+			       int flags, void *data)
+{
+	/*
+	 * Keep one match slot spare, so that we can tell when a regex
+	 * has more capture groups than we support.
+	 */
+	regmatch_t matches[16];
+	struct strbuf island_name = STRBUF_INIT;
+	int i, m;
+
+	/* The last matching regex wins, as usual for config. */
+	for (i = island_regexes_nr - 1; i >= 0; i--) {
+		if (!regexec(&island_regexes[i], refname,
+			     ARRAY_SIZE(matches), matches, 0))
+			break;
+	}
+	if (i < 0)
+		return 0;
+
+	if (matches[ARRAY_SIZE(matches) - 1].rm_so != -1)
+		warning(_("island regex from config has "
+			  "too many capture groups (max=%d)"),
+			(int)ARRAY_SIZE(matches) - 2);
+
+	for (m = 1; m < ARRAY_SIZE(matches); m++) {
+		regmatch_t *match = &matches[m];
+
+		if (match->rm_so == -1)
+			continue;
+		if (island_name.len)
+			strbuf_addch(&island_name, '-');
+		strbuf_add(&island_name, refname + match->rm_so,
+			   match->rm_eo - match->rm_so);
+	}
+
+	add_ref_to_island(island_name.buf, oid);
+	strbuf_release(&island_name);
+	return 0;
+}
+
+static void mark_remote_island(struct oid_array *tips, uint32_t island,
+			       int is_core_island)
+{
+	int i;
+
+	for (i = 0; i < tips->nr; i++) {
+		struct object *obj = parse_object(&tips->oid[i]);
+
+		if (!obj)
+			continue;
+		island_bitmap_set(create_or_get_island_marks(obj), island);
+
+		/* Make sure bitmaps are written for the core island. */
+		if (is_core_island && obj->type == OBJ_COMMIT)
+			obj->flags |= NEEDS_BITMAP;
+
+		/* Mark what a tag points to, too. */
+		while (obj && obj->type == OBJ_TAG) {
+			obj = ((struct tag *)obj)->tagged;
+			if (!obj)
+				break;
+			parse_object(&obj->oid);
+			island_bitmap_set(create_or_get_island_marks(obj),
+					  island);
+		}
+	}
+}
+
+void load_delta_islands(int progress)
+{
+	int i;
+
+	git_config(island_config_callback, NULL);
+	if (!island_regexes_nr)
+		return;
+
+	for_each_ref(find_island_for_ref, NULL);
+	island_bitmap_size = remote_islands.nr / 32 + 1;
+	island_marks = kh_init_sha1();
+
+	for (i = 0; i < remote_islands.nr; i++) {
+		struct string_list_item *item = &remote_islands.items[i];
+		int is_core = core_island_name &&
+			      !strcmp(item->string, core_island_name);
+
+		if (is_core)
+			island_counter_core = i;
+		mark_remote_island(item->util, i, is_core);
+		oid_array_clear(item->util);
+	}
+	string_list_clear(&remote_islands, 1);
+
+	if (progress)
+		fprintf_ln(stderr, _("Marked %d islands, done."), i);
+}
+
+void propagate_island_marks(struct commit *commit)
+{
+	struct island_bitmap *marks = get_island_marks(&commit->object.oid);
+	struct commit_list *p;
+
+	if (!marks)
+		return;
+
+	parse_commit(commit);
+	set_island_marks(&commit->tree->object, marks);
+	for (p = commit->parents; p; p = p->next)
+		set_island_marks(&p->item->object, marks);
+}
+
+static int tree_depth_compare(const void *a, const void *b)
+{
+	const struct object_entry *ea = *(const struct object_entry **)a;
+	const struct object_entry *eb = *(const struct object_entry **)b;
+
+	return (int)ea->tree_depth - (int)eb->tree_depth;
+}
+
+void resolve_tree_islands(int progress, struct packing_data *to_pack)
+{
+	struct progress *progress_state = NULL;
+	struct object_entry **todo;
+	uint32_t i, nr = 0;
+
+	if (!island_marks)
+		return;
+
+	/*
+	 * Commits and tags have been handled already, and passed their
+	 * marks on to the root trees.  Process the trees shallowest
+	 * first, so that a subtree has collected the marks of all the
+	 * trees containing it before passing them on to its entries.
+	 */
+	ALLOC_ARRAY(todo, to_pack->nr_objects);
+	for (i = 0; i < to_pack->nr_objects; i++)
+		if (to_pack->objects[i].type == OBJ_TREE)
+			todo[nr++] = &to_pack->objects[i];
+	QSORT(todo, nr, tree_depth_compare);
+
+	if (progress)
+		progress_state = start_progress(_("Propagating island marks"), nr);
+
+	for (i = 0; i < nr; i++) {
+		struct object_entry *ent = todo[i];
+		struct island_bitmap *marks;
+		struct tree *tree;
+		struct tree_desc desc;
+		struct name_entry entry;
+
+		marks = get_island_marks(&ent->idx.oid);
+		if (!marks)
+			continue;
+
+		tree = lookup_tree(&ent->idx.oid);
+		if (!tree || parse_tree(tree) < 0)
+			die(_("bad tree object %s"), oid_to_hex(&ent->idx.oid));
+
+		init_tree_desc(&desc, tree->buffer, tree->size);
+		while (tree_entry(&desc, &entry)) {
+			struct object *obj;
+
+			if (S_ISGITLINK(entry.mode))
+				continue;
+			obj = lookup_object(entry.oid->hash);
+			if (!obj)
+				continue;
+			set_island_marks(obj, marks);
+		}
+
+		free_tree_buffer(tree);
+		display_progress(progress_state, i + 1);
+	}
+
+	stop_progress(&progress_state);
+	free(todo);
+}
+
+int compute_pack_layers(struct packing_data *to_pack)
+{
+	uint32_t i;
+
+	if (!core_island_name || !island_marks)
+		return 1;
+
+	for (i = 0; i < to_pack->nr_objects; i++) {
+		struct object_entry *entry = &to_pack->objects[i];
+		struct island_bitmap *marks = get_island_marks(&entry->idx.oid);
+
+		entry->layer = 1;
+		if (marks && island_bitmap_get(marks, island_counter_core))
+			entry->layer = 0;
+	}
+	return 2;
+}
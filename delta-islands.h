@@ -0,0 +1,51 @@
+#ifndef DELTA_ISLANDS_H
+#define DELTA_ISLANDS_H
+
+/*
+ * Delta islands keep pack-objects from storing an object as a delta
+ * against a base that is not reachable from all of the refs the
+ * object itself is reachable from.  Refs are grouped into islands by
+ * the "pack.island" regexes; a delta is only allowed if the islands
+ * of the delta are a subset of the islands of its base.  This matters
+ * in repositories holding a whole network of forks, where a fetch of
+ * one fork must not have to send the (otherwise unneeded) bases of
+ * its deltas taken from another fork.
+ */
+
+struct commit;
+struct object_id;
+struct packing_data;
+
+/*
+ * Read the islands from the config and the refs, and mark their tips.
+ * The marks are then pushed down to the parents and root tree of each
+ * commit by propagate_island_marks(), which must be called for every
+ * commit, children before parents (i.e. in "--topo-order"), and from
+ * the trees to their entries by resolve_tree_islands().
+ */
+void load_delta_islands(int progress);
+void propagate_island_marks(struct commit *commit);
+void resolve_tree_islands(int progress, struct packing_data *to_pack);
+
+/*
+ * Return true if `trg` may be stored as a delta against `src`.  This
+ * is always the case when no islands have been loaded.
+ */
+int in_same_island(const struct object_id *trg, const struct object_id *src);
+
+/*
+ * A sort order for delta candidates that puts objects which are in
+ * islands the other one is not in first, so that they are tried as
+ * bases for the objects sorted after them.
+ */
+int island_delta_cmp(const struct object_id *a, const struct object_id *b);
+
+/*
+ * Assign every object in `to_pack` to a layer: 0 for the objects of
+ * the island named by "pack.islandCore", and 1 for the rest.  Return
+ * the number of layers to write, which is 1 if there is no core
+ * island.
+ */
+int compute_pack_layers(struct packing_data *to_pack);
+
+#endif /* DELTA_ISLANDS_H */
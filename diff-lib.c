@@ -13,6 +13,7 @@
 #include "submodule.h"
 #include "dir.h"
 #include "fsmonitor.h"
+#include "sparse-index.h"
 
 /*
  * diff-files
@@ -494,6 +495,15 @@ static int diff_cache(struct rev_info *revs,
 	if (!tree)
 		return error("bad tree object %s",
 			     tree_name ? tree_name : oid_to_hex(tree_oid));
+
+	/*
+	 * Sparse directories can only be skipped over as a whole when
+	 * they are unchanged; otherwise we need to see their contents.
+	 */
+	if (!cached || revs->diffopt.flags.find_copies_harder ||
+	    !sparse_dirs_match_tree(&the_index, tree_oid))
+		ensure_full_index(&the_index);
+
 	memset(&opts, 0, sizeof(opts));
 	opts.head_idx = 1;
 	opts.index_only = cached;
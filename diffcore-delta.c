@@ -162,6 +162,12 @@ static struct spanhash_top *hash_chars(struct diff_filespec *one)
 	return hash;
 }
 
+void diffcore_prepare_count(struct diff_filespec *one)
+{
+	if (!one->cnt_data)
+		one->cnt_data = hash_chars(one);
+}
+
 int diffcore_count_changes(struct diff_filespec *src,
 			   struct diff_filespec *dst,
 			   void **src_count_p,
@@ -2,10 +2,13 @@
  * Copyright (C) 2005 Junio C Hamano
  */
 #include "cache.h"
+#include "config.h"
 #include "diff.h"
 #include "diffcore.h"
 #include "hashmap.h"
 #include "progress.h"
+#include "string-list.h"
+#include "thread-utils.h"
 
 /* Table of rename/copy destinations */
 
@@ -15,7 +18,7 @@ static struct diff_rename_dst {
 } *rename_dst;
 static int rename_dst_nr, rename_dst_alloc;
 
-static int find_rename_dst(struct diff_filespec *two)
+static int find_rename_dst(const char *path)
 {
 	int first, last;
 
@@ -24,7 +27,7 @@ static int find_rename_dst(struct diff_filespec *two)
 	while (last > first) {
 		int next = (last + first) >> 1;
 		struct diff_rename_dst *dst = &(rename_dst[next]);
-		int cmp = strcmp(two->path, dst->two->path);
+		int cmp = strcmp(path, dst->two->path);
 		if (!cmp)
 			return next;
 		if (cmp < 0) {
@@ -38,7 +41,7 @@ static int find_rename_dst(struct diff_filespec *two)
 
 static struct diff_rename_dst *locate_rename_dst(struct diff_filespec *two)
 {
-	int ofs = find_rename_dst(two);
+	int ofs = find_rename_dst(two->path);
 	return ofs < 0 ? NULL : &rename_dst[ofs];
 }
 
@@ -47,7 +50,7 @@ static struct diff_rename_dst *locate_rename_dst(struct diff_filespec *two)
  */
 static int add_rename_dst(struct diff_filespec *two)
 {
-	int first = find_rename_dst(two);
+	int first = find_rename_dst(two->path);
 
 	if (first >= 0)
 		return -1;
@@ -147,27 +150,11 @@ static int estimate_similarity(struct diff_filespec *src,
 	unsigned long max_size, delta_size, base_size, src_copied, literal_added;
 	int score;
 
-	/* We deal only with regular files.  Symlink renames are handled
-	 * only when they are exact matches --- in other words, no edits
-	 * after renaming.
-	 */
-	if (!S_ISREG(src->mode) || !S_ISREG(dst->mode))
-		return 0;
-
 	/*
-	 * Need to check that source and destination sizes are
-	 * filled in before comparing them.
-	 *
-	 * If we already have "cnt_data" filled in, we know it's
-	 * all good (avoid checking the size for zero, as that
-	 * is a possible size - we really should have a flag to
-	 * say whether the size is valid or not!)
+	 * We deal only with regular files whose signature has been
+	 * computed by prepare_similarity(); see there.
 	 */
-	if (!src->cnt_data &&
-	    diff_populate_filespec(src, CHECK_SIZE_ONLY))
-		return 0;
-	if (!dst->cnt_data &&
-	    diff_populate_filespec(dst, CHECK_SIZE_ONLY))
+	if (!src->cnt_data || !dst->cnt_data)
 		return 0;
 
 	max_size = ((src->size > dst->size) ? src->size : dst->size);
@@ -185,11 +172,6 @@ static int estimate_similarity(struct diff_filespec *src,
 	if (max_size * (MAX_SCORE-minimum_score) < delta_size * MAX_SCORE)
 		return 0;
 
-	if (!src->cnt_data && diff_populate_filespec(src, 0))
-		return 0;
-	if (!dst->cnt_data && diff_populate_filespec(dst, 0))
-		return 0;
-
 	if (diffcore_count_changes(src, dst,
 				   &src->cnt_data, &dst->cnt_data,
 				   &src_copied, &literal_added))
@@ -205,6 +187,122 @@ static int estimate_similarity(struct diff_filespec *src,
 	return score;
 }
 
+/*
+ * Look up the size of `one`, if it is a regular file; return -1 if it
+ * is not, or cannot be read.
+ */
+static int prepare_size(struct diff_filespec *one)
+{
+	/* We deal only with regular files.  Symlink renames are handled
+	 * only when they are exact matches --- in other words, no edits
+	 * after renaming.
+	 */
+	if (!S_ISREG(one->mode))
+		return -1;
+	if (diff_populate_filespec(one, CHECK_SIZE_ONLY))
+		return -1;
+	return 0;
+}
+
+static int ulong_cmp(const void *a_, const void *b_)
+{
+	unsigned long a = *(const unsigned long *)a_;
+	unsigned long b = *(const unsigned long *)b_;
+	return a < b ? -1 : a > b;
+}
+
+/*
+ * Is there a size among the `nr` sorted `sizes` that passes the size
+ * check of estimate_similarity() against `size`? Those that do form
+ * the interval of the sizes s with
+ *
+ *    s * MAX_SCORE >= size * minimum_score, and
+ *    s * minimum_score <= size * MAX_SCORE.
+ */
+static int has_similar_size(unsigned long size,
+			    const unsigned long *sizes, int nr,
+			    int minimum_score)
+{
+	uint64_t lo = (uint64_t)size * minimum_score;
+	int first = 0, last = nr;
+
+	while (first < last) {
+		int next = first + (last - first) / 2;
+		if ((uint64_t)sizes[next] * MAX_SCORE < lo)
+			first = next + 1;
+		else
+			last = next;
+	}
+	return first < nr &&
+		(uint64_t)sizes[first] * minimum_score <= (uint64_t)size * MAX_SCORE;
+}
+
+/*
+ * Read the contents of the rename sources and destinations, and compute
+ * their signatures, up front: this needs the object store and the
+ * attributes machinery, which we cannot call from several threads,
+ * while the comparisons in estimate_similarity() are then pure
+ * computation. A file whose size is too different from that of every
+ * file on the other side is never compared in earnest, and is not read.
+ */
+static void prepare_similarity(struct diff_filespec **srcs, int nr_src,
+			       struct diff_filespec **dsts, int nr_dst,
+			       int minimum_score)
+{
+	unsigned long *src_sizes, *dst_sizes;
+	char *src_ok, *dst_ok;
+	int i, nr_src_sizes = 0, nr_dst_sizes = 0;
+
+	ALLOC_ARRAY(src_sizes, nr_src);
+	ALLOC_ARRAY(dst_sizes, nr_dst);
+	src_ok = xcalloc(nr_src, 1);
+	dst_ok = xcalloc(nr_dst, 1);
+	for (i = 0; i < nr_src; i++) {
+		if (!srcs[i] ||
+		    (!srcs[i]->cnt_data && prepare_size(srcs[i]) < 0))
+			continue;
+		src_ok[i] = 1;
+		src_sizes[nr_src_sizes++] = srcs[i]->size;
+	}
+	for (i = 0; i < nr_dst; i++) {
+		if (!dsts[i]->cnt_data && prepare_size(dsts[i]) < 0)
+			continue;
+		dst_ok[i] = 1;
+		dst_sizes[nr_dst_sizes++] = dsts[i]->size;
+	}
+	QSORT(src_sizes, nr_src_sizes, ulong_cmp);
+	QSORT(dst_sizes, nr_dst_sizes, ulong_cmp);
+
+	for (i = 0; i < nr_src; i++) {
+		struct diff_filespec *one = srcs[i];
+		if (!src_ok[i] || one->cnt_data ||
+		    !has_similar_size(one->size, dst_sizes, nr_dst_sizes,
+				      minimum_score))
+			continue;
+		if (diff_populate_filespec(one, 0))
+			continue;
+		diffcore_prepare_count(one);
+		/* We do not need the text anymore. */
+		diff_free_filespec_blob(one);
+	}
+	for (i = 0; i < nr_dst; i++) {
+		struct diff_filespec *two = dsts[i];
+		if (!dst_ok[i] || two->cnt_data ||
+		    !has_similar_size(two->size, src_sizes, nr_src_sizes,
+				      minimum_score))
+			continue;
+		if (diff_populate_filespec(two, 0))
+			continue;
+		diffcore_prepare_count(two);
+		diff_free_filespec_blob(two);
+	}
+
+	free(src_ok);
+	free(dst_ok);
+	free(src_sizes);
+	free(dst_sizes);
+}
+
 static void record_rename_pair(int dst_index, int src_index, int score)
 {
 	struct diff_filespec *src, *dst;
@@ -355,6 +453,287 @@ static int find_exact_renames(struct diff_options *options)
 	return renames;
 }
 
+static const char *get_basename(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	return slash ? slash + 1 : path;
+}
+
+/*
+ * The length of the directory part of the first `len` bytes of `path`,
+ * without the trailing slash; 0 for a toplevel path.
+ */
+static size_t dirname_len(const char *path, size_t len)
+{
+	while (len && path[len - 1] != '/')
+		len--;
+	return len ? len - 1 : 0;
+}
+
+/*
+ * Estimate the similarity of a single pair of files outside of the
+ * matrix, reading them only if their sizes allow a match.
+ */
+static int estimate_pair_similarity(struct diff_filespec *one,
+				    struct diff_filespec *two,
+				    int minimum_score)
+{
+	prepare_similarity(&one, 1, &two, 1, minimum_score);
+	return estimate_similarity(one, two, minimum_score);
+}
+
+static int try_rename_pair(int dst_index, int src_index, int minimum_score)
+{
+	struct diff_filespec *one = rename_src[src_index].p->one;
+	struct diff_filespec *two = rename_dst[dst_index].two;
+	int score;
+
+	if (rename_dst[dst_index].pair || one->rename_used)
+		return 0;
+	score = estimate_pair_similarity(one, two, minimum_score);
+	if (score < minimum_score)
+		return 0;
+	record_rename_pair(dst_index, src_index, score);
+
+	/* Neither of them goes into the matrix anymore. */
+	diff_free_filespec_data(one);
+	diff_free_filespec_data(two);
+	return 1;
+}
+
+/*
+ * Sort a list of basenames, and mark those that are not unique in it
+ * with a util of -1.
+ */
+static void mark_duplicate_basenames(struct string_list *list)
+{
+	int i;
+
+	string_list_sort(list);
+	for (i = 1; i < list->nr; i++) {
+		if (strcmp(list->items[i - 1].string, list->items[i].string))
+			continue;
+		list->items[i - 1].util = (void *)(intptr_t)-1;
+		list->items[i].util = (void *)(intptr_t)-1;
+	}
+}
+
+struct dir_rename {
+	char *old_dir;
+	char *new_dir;
+};
+
+static int dir_rename_cmp(const void *a_, const void *b_)
+{
+	const struct dir_rename *a = a_, *b = b_;
+	int cmp = strcmp(a->old_dir, b->old_dir);
+
+	return cmp ? cmp : strcmp(a->new_dir, b->new_dir);
+}
+
+struct dir_rename_list {
+	struct dir_rename *items;
+	int nr, alloc;
+};
+
+/*
+ * Renaming old_path to new_path suggests that the directory of the one
+ * was renamed to that of the other, and so on upwards for as long as
+ * the names of the directories agree: "a/x/foo.c" -> "b/x/foo.c"
+ * suggests both "a/x" -> "b/x" and "a" -> "b".
+ */
+static void add_dir_renames(struct dir_rename_list *list,
+			    const char *old_path, const char *new_path)
+{
+	size_t old_len = dirname_len(old_path, strlen(old_path));
+	size_t new_len = dirname_len(new_path, strlen(new_path));
+
+	while (old_len != new_len || memcmp(old_path, new_path, old_len)) {
+		size_t old_up, new_up, old_base, new_base;
+
+		ALLOC_GROW(list->items, list->nr + 1, list->alloc);
+		list->items[list->nr].old_dir = xmemdupz(old_path, old_len);
+		list->items[list->nr].new_dir = xmemdupz(new_path, new_len);
+		list->nr++;
+
+		if (!old_len || !new_len)
+			break;
+		old_up = dirname_len(old_path, old_len);
+		new_up = dirname_len(new_path, new_len);
+		old_base = old_up ? old_up + 1 : 0;
+		new_base = new_up ? new_up + 1 : 0;
+		if (old_len - old_base != new_len - new_base ||
+		    memcmp(old_path + old_base, new_path + new_base,
+			   old_len - old_base))
+			break;
+		old_len = old_up;
+		new_len = new_up;
+	}
+}
+
+/*
+ * Map each directory that we have seen renamed to the directory most
+ * of its files went to.
+ */
+static void guess_dir_renames(struct string_list *guesses,
+			      struct dir_rename_list *list)
+{
+	struct dir_rename *r = list->items;
+	int i = 0;
+
+	QSORT(r, list->nr, dir_rename_cmp);
+	while (i < list->nr) {
+		int j = i, best = i, best_count = 0;
+
+		while (j < list->nr && !strcmp(r[j].old_dir, r[i].old_dir)) {
+			int k = j + 1;
+			while (k < list->nr && !dir_rename_cmp(&r[k], &r[j]))
+				k++;
+			if (k - j > best_count) {
+				best = j;
+				best_count = k - j;
+			}
+			j = k;
+		}
+		string_list_append(guesses, r[i].old_dir)->util = r[best].new_dir;
+		i = j;
+	}
+}
+
+/*
+ * Where would `path` be if its directory, or else the closest of its
+ * leading directories we have a guess for, went where the others did?
+ * Returns the index in rename_dst of that path, or -1.
+ */
+static int guess_rename_dst(struct string_list *guesses, const char *path,
+			    struct strbuf *buf)
+{
+	size_t len = strlen(path);
+
+	do {
+		struct string_list_item *item;
+
+		len = dirname_len(path, len);
+		strbuf_reset(buf);
+		strbuf_add(buf, path, len);
+		item = string_list_lookup(guesses, buf->buf);
+		if (item) {
+			int ofs;
+
+			strbuf_reset(buf);
+			strbuf_addstr(buf, item->util);
+			if (buf->len)
+				strbuf_addch(buf, '/');
+			strbuf_addstr(buf, path + len + !!len);
+			ofs = find_rename_dst(buf->buf);
+			return ofs < 0 ? -1 : ofs;
+		}
+	} while (len);
+	return -1;
+}
+
+/*
+ * Pair up the sources and destinations left over by the exact renames
+ * using their names as a hint, so that the quadratic similarity matrix
+ * only needs to deal with what remains. Most renames in practice move
+ * a file to another directory under the same name, often along with
+ * all of its siblings:
+ *
+ *  - a source and a destination whose basename is unique among the
+ *    remaining sources and destinations, respectively, are paired up
+ *    if they are similar enough;
+ *
+ *  - the renames found so far tell which directories went where, and
+ *    the remaining sources are compared with the destination at the
+ *    place their directory went to, which takes care of basenames
+ *    like "Makefile" that are found all over the tree.
+ *
+ * A pair found this way may not be the best one the matrix would have
+ * found, hence the caller asks for a higher score here than there.
+ */
+static int find_basename_renames(int minimum_score)
+{
+	struct string_list src_names = STRING_LIST_INIT_NODUP;
+	struct string_list dst_names = STRING_LIST_INIT_NODUP;
+	struct string_list guesses = STRING_LIST_INIT_NODUP;
+	struct dir_rename_list dir_renames = { NULL };
+	struct strbuf buf = STRBUF_INIT;
+	int i, renames = 0;
+
+	for (i = 0; i < rename_src_nr; i++) {
+		const char *path = rename_src[i].p->one->path;
+		if (!rename_src[i].p->one->rename_used)
+			string_list_append(&src_names, get_basename(path))->util =
+				(void *)(intptr_t)i;
+	}
+	for (i = 0; i < rename_dst_nr; i++) {
+		const char *path = rename_dst[i].two->path;
+		if (!rename_dst[i].pair)
+			string_list_append(&dst_names, get_basename(path))->util =
+				(void *)(intptr_t)i;
+	}
+	mark_duplicate_basenames(&src_names);
+	mark_duplicate_basenames(&dst_names);
+
+	for (i = 0; i < src_names.nr; i++) {
+		intptr_t src_index = (intptr_t)src_names.items[i].util;
+		struct string_list_item *dst;
+
+		if (src_index < 0)
+			continue;
+		dst = string_list_lookup(&dst_names, src_names.items[i].string);
+		if (!dst || (intptr_t)dst->util < 0)
+			continue;
+		renames += try_rename_pair((intptr_t)dst->util, src_index,
+					   minimum_score);
+	}
+
+	for (i = 0; i < rename_dst_nr; i++) {
+		struct diff_filepair *p = rename_dst[i].pair;
+		if (p)
+			add_dir_renames(&dir_renames, p->one->path, p->two->path);
+	}
+	guess_dir_renames(&guesses, &dir_renames);
+
+	for (i = 0; guesses.nr && i < rename_src_nr; i++) {
+		struct diff_filespec *one = rename_src[i].p->one;
+		int dst_index;
+
+		if (one->rename_used)
+			continue;
+		dst_index = guess_rename_dst(&guesses, one->path, &buf);
+		if (dst_index >= 0)
+			renames += try_rename_pair(dst_index, i, minimum_score);
+	}
+
+	for (i = 0; i < dir_renames.nr; i++) {
+		free(dir_renames.items[i].old_dir);
+		free(dir_renames.items[i].new_dir);
+	}
+	free(dir_renames.items);
+	string_list_clear(&guesses, 0);
+	string_list_clear(&src_names, 0);
+	string_list_clear(&dst_names, 0);
+	strbuf_release(&buf);
+	return renames;
+}
+
+/*
+ * When detecting renames only, a source can be used only once; drop
+ * the used ones so that the matrix need not consider them.
+ */
+static void remove_used_sources(void)
+{
+	int i, nr = 0;
+
+	for (i = 0; i < rename_src_nr; i++) {
+		if (rename_src[i].p->one->rename_used)
+			continue;
+		rename_src[nr++] = rename_src[i];
+	}
+	rename_src_nr = nr;
+}
+
 #define NUM_CANDIDATE_PER_DST 4
 static void record_if_better(struct diff_score m[], struct diff_score *o)
 {
@@ -440,6 +819,152 @@ static int find_renames(struct diff_score *mx, int dst_cnt, int minimum_score, i
 	return count;
 }
 
+/*
+ * The state shared by the threads computing the similarity matrix: the
+ * row of `mx` for the n-th destination dsts[n] (at dst_index[n] in
+ * rename_dst) gets the best NUM_CANDIDATE_PER_DST sources among `srcs`
+ * (indexed like rename_src, NULL for those not to be considered).
+ */
+struct similarity_state {
+	struct diff_score *mx;
+	struct diff_filespec **srcs;
+	struct diff_filespec **dsts;
+	int *dst_index;
+	int dst_nr;
+	int minimum_score;
+	struct progress *progress;
+
+	/* The next destination to be handled, and the number done. */
+	int next_dst;
+	int dsts_done;
+#ifndef NO_PTHREADS
+	pthread_mutex_t mutex;
+#endif
+};
+
+#ifndef NO_PTHREADS
+/*
+ * The number of threads to compute the similarity matrix with, from
+ * diff.renameThreads; 0 (the default) means one per CPU.
+ */
+static int diff_rename_threads(void)
+{
+	static int threads = -1;
+
+	if (threads < 0) {
+		if (git_config_get_int("diff.renamethreads", &threads) ||
+		    threads < 0)
+			threads = 0;
+		if (!threads)
+			threads = online_cpus();
+	}
+	return threads;
+}
+#endif
+
+/* Hand out this many destinations at a time to each thread. */
+#define SIMILARITY_CHUNK 16
+
+#ifndef NO_PTHREADS
+#define similarity_lock(s)	pthread_mutex_lock(&(s)->mutex)
+#define similarity_unlock(s)	pthread_mutex_unlock(&(s)->mutex)
+#else
+#define similarity_lock(s)	(void)0
+#define similarity_unlock(s)	(void)0
+#endif
+
+static void compute_similarity_row(struct similarity_state *state, int n)
+{
+	struct diff_filespec *two = state->dsts[n];
+	struct diff_score *m = &state->mx[n * NUM_CANDIDATE_PER_DST];
+	int j;
+
+	for (j = 0; j < NUM_CANDIDATE_PER_DST; j++)
+		m[j].dst = -1;
+
+	for (j = 0; j < rename_src_nr; j++) {
+		struct diff_filespec *one = state->srcs[j];
+		struct diff_score this_src;
+
+		if (!one)
+			continue;
+
+		this_src.score = estimate_similarity(one, two,
+						     state->minimum_score);
+		this_src.name_score = basename_same(one, two);
+		this_src.dst = state->dst_index[n];
+		this_src.src = j;
+		record_if_better(m, &this_src);
+	}
+}
+
+static void *similarity_worker(void *data)
+{
+	struct similarity_state *state = data;
+
+	similarity_lock(state);
+	while (state->next_dst < state->dst_nr) {
+		int start = state->next_dst;
+		int end = start + SIMILARITY_CHUNK;
+		int n;
+
+		if (end > state->dst_nr)
+			end = state->dst_nr;
+		state->next_dst = end;
+		similarity_unlock(state);
+
+		for (n = start; n < end; n++)
+			compute_similarity_row(state, n);
+
+		similarity_lock(state);
+		state->dsts_done += end - start;
+		display_progress(state->progress,
+				 (uint64_t)state->dsts_done * rename_src_nr);
+	}
+	similarity_unlock(state);
+	return NULL;
+}
+
+/*
+ * Don't bother with threads for fewer comparisons than this.
+ */
+#define SIMILARITY_THREADS_MIN_PAIRS 4096
+
+static void compute_similarity_matrix(struct similarity_state *state)
+{
+#ifndef NO_PTHREADS
+	int nr_threads = diff_rename_threads();
+	pthread_t *threads;
+	int i;
+
+	if ((uint64_t)state->dst_nr * rename_src_nr < SIMILARITY_THREADS_MIN_PAIRS)
+		nr_threads = 1;
+	if (nr_threads > state->dst_nr / SIMILARITY_CHUNK)
+		nr_threads = state->dst_nr / SIMILARITY_CHUNK;
+
+	pthread_mutex_init(&state->mutex, NULL);
+	if (nr_threads <= 1) {
+		similarity_worker(state);
+		pthread_mutex_destroy(&state->mutex);
+		return;
+	}
+
+	ALLOC_ARRAY(threads, nr_threads);
+	for (i = 0; i < nr_threads; i++) {
+		int err = pthread_create(&threads[i], NULL,
+					 similarity_worker, state);
+		if (err)
+			die(_("unable to create thread: %s"), strerror(err));
+	}
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&state->mutex);
+#else
+	similarity_worker(state);
+#endif
+}
+
 void diffcore_rename(struct diff_options *options)
 {
 	int detect_rename = options->detect_rename;
@@ -447,9 +972,12 @@ void diffcore_rename(struct diff_options *options)
 	struct diff_queue_struct *q = &diff_queued_diff;
 	struct diff_queue_struct outq;
 	struct diff_score *mx;
-	int i, j, rename_count, skip_unmodified = 0;
+	int i, rename_count, skip_unmodified = 0;
 	int num_create, dst_cnt;
 	struct progress *progress = NULL;
+	struct diff_filespec **srcs, **dsts;
+	int *dst_index;
+	struct similarity_state state = { NULL };
 
 	if (!minimum_score)
 		minimum_score = DEFAULT_RENAME_SCORE;
@@ -510,8 +1038,21 @@ void diffcore_rename(struct diff_options *options)
 		goto cleanup;
 
 	/*
-	 * Calculate how many renames are left (but all the source
-	 * files still remain as options for rename/copies!)
+	 * Then use the names of the files as a hint.  Not when looking
+	 * for copies, which should be free to find their sources
+	 * anywhere, nor when breaking, which is about content only.
+	 */
+	if (detect_rename != DIFF_DETECT_COPY && options->break_opt == -1) {
+		rename_count += find_basename_renames(minimum_score +
+				(MAX_SCORE - minimum_score) / 2);
+		remove_used_sources();
+		if (!rename_src_nr)
+			goto cleanup;
+	}
+
+	/*
+	 * Calculate how many renames are left (but with copies, all the
+	 * source files still remain as options!)
 	 */
 	num_create = (rename_dst_nr - rename_count);
 
@@ -536,43 +1077,37 @@ void diffcore_rename(struct diff_options *options)
 				(uint64_t)rename_dst_nr * (uint64_t)rename_src_nr);
 	}
 
-	mx = xcalloc(st_mult(NUM_CANDIDATE_PER_DST, num_create), sizeof(*mx));
+	ALLOC_ARRAY(srcs, rename_src_nr);
+	for (i = 0; i < rename_src_nr; i++) {
+		if (skip_unmodified &&
+		    diff_unmodified_pair(rename_src[i].p))
+			srcs[i] = NULL;
+		else
+			srcs[i] = rename_src[i].p->one;
+	}
+	ALLOC_ARRAY(dsts, num_create);
+	ALLOC_ARRAY(dst_index, num_create);
 	for (dst_cnt = i = 0; i < rename_dst_nr; i++) {
-		struct diff_filespec *two = rename_dst[i].two;
-		struct diff_score *m;
-
 		if (rename_dst[i].pair)
 			continue; /* dealt with exact match already. */
-
-		m = &mx[dst_cnt * NUM_CANDIDATE_PER_DST];
-		for (j = 0; j < NUM_CANDIDATE_PER_DST; j++)
-			m[j].dst = -1;
-
-		for (j = 0; j < rename_src_nr; j++) {
-			struct diff_filespec *one = rename_src[j].p->one;
-			struct diff_score this_src;
-
-			if (skip_unmodified &&
-			    diff_unmodified_pair(rename_src[j].p))
-				continue;
-
-			this_src.score = estimate_similarity(one, two,
-							     minimum_score);
-			this_src.name_score = basename_same(one, two);
-			this_src.dst = i;
-			this_src.src = j;
-			record_if_better(m, &this_src);
-			/*
-			 * Once we run estimate_similarity,
-			 * We do not need the text anymore.
-			 */
-			diff_free_filespec_blob(one);
-			diff_free_filespec_blob(two);
-		}
-		dst_cnt++;
-		display_progress(progress, (uint64_t)(i+1)*(uint64_t)rename_src_nr);
+		dsts[dst_cnt] = rename_dst[i].two;
+		dst_index[dst_cnt++] = i;
 	}
+	prepare_similarity(srcs, rename_src_nr, dsts, dst_cnt, minimum_score);
+
+	mx = xcalloc(st_mult(NUM_CANDIDATE_PER_DST, num_create), sizeof(*mx));
+	state.mx = mx;
+	state.srcs = srcs;
+	state.dsts = dsts;
+	state.dst_index = dst_index;
+	state.dst_nr = dst_cnt;
+	state.minimum_score = minimum_score;
+	state.progress = progress;
+	compute_similarity_matrix(&state);
 	stop_progress(&progress);
+	free(srcs);
+	free(dsts);
+	free(dst_index);
 
 	/* cost matrix sorted by most to least similar pair */
 	QSORT(mx, dst_cnt * NUM_CANDIDATE_PER_DST, score_compare);
@@ -138,6 +138,14 @@ void diff_debug_queue(const char *, struct diff_queue_struct *);
 #define diff_debug_queue(a,b) do { /* nothing */ } while (0)
 #endif
 
+/*
+ * Compute the signature diffcore_count_changes() works with for `one`,
+ * whose data must have been populated, and keep it in one->cnt_data.
+ * Once both sides have theirs, diffcore_count_changes() only reads them,
+ * and can be called from several threads.
+ */
+extern void diffcore_prepare_count(struct diff_filespec *one);
+
 extern int diffcore_count_changes(struct diff_filespec *src,
 				  struct diff_filespec *dst,
 				  void **src_count_p,
@@ -19,6 +19,7 @@
 #include "varint.h"
 #include "ewah/ewok.h"
 #include "fsmonitor.h"
+#include "sparse-index.h"
 
 /*
  * Tells read_directory_recursive how a file or directory should be treated.
@@ -1393,6 +1394,13 @@ static enum exist_status directory_exists_in_index(struct index_state *istate,
 {
 	int pos;
 
+	/*
+	 * A directory the index only knows as a sparse directory entry
+	 * exists in the working tree after all; we need to see what is
+	 * tracked inside it.
+	 */
+	expand_to_path(istate, dirname, len);
+
 	if (ignore_case)
 		return directory_exists_in_index_icase(istate, dirname, len);
 
@@ -4,6 +4,7 @@
 #include "string-list.h"
 #include "run-command.h"
 #include "list-objects-filter-options.h"
+#include "protocol.h"
 
 struct oid_array;
 
@@ -53,7 +54,8 @@ struct ref *fetch_pack(struct fetch_pack_args *args,
 		       struct ref **sought,
 		       int nr_sought,
 		       struct oid_array *shallow,
-		       char **pack_lockfile);
+		       char **pack_lockfile,
+		       enum protocol_version version);
 
 /*
  * Print an appropriate error message for each sought ref that wasn't
@@ -5,12 +5,15 @@
 #include "fsmonitor.h"
 #include "run-command.h"
 #include "strbuf.h"
+#include "unix-socket.h"
 
 #define INDEX_EXTENSION_VERSION	(1)
 #define HOOK_INTERFACE_VERSION	(1)
 
 struct trace_key trace_fsmonitor = TRACE_KEY_INIT(FSMONITOR);
 
+GIT_PATH_FUNC(git_path_fsmonitor_daemon_socket, "fsmonitor--daemon.ipc")
+
 static void fsmonitor_ewah_callback(size_t pos, void *is)
 {
 	struct index_state *istate = (struct index_state *)is;
@@ -91,6 +94,39 @@ void write_fsmonitor_extension(struct strbuf *sb, struct index_state *istate)
 	trace_printf_key(&trace_fsmonitor, "write fsmonitor extension successful");
 }
 
+/*
+ * Ask "git fsmonitor--daemon" the same question the hook would be
+ * asked; the answer comes back in the same format, too.
+ */
+static int query_fsmonitor_daemon(int version, uint64_t last_update,
+				  struct strbuf *query_result)
+{
+#ifdef NO_UNIX_SOCKETS
+	return -1;
+#else
+	struct strbuf request = STRBUF_INIT;
+	int fd, ret = 0;
+
+	fd = unix_stream_connect(git_path_fsmonitor_daemon_socket());
+	if (fd < 0) {
+		trace_printf_key(&trace_fsmonitor,
+				 "fsmonitor--daemon is not running");
+		return -1;
+	}
+
+	strbuf_addf(&request, "query %d %" PRIuMAX "\n",
+		    version, (uintmax_t)last_update);
+	if (write_in_full(fd, request.buf, request.len) < 0 ||
+	    shutdown(fd, SHUT_WR) < 0 ||
+	    strbuf_read(query_result, fd, 1024) < 0)
+		ret = error_errno(_("could not query fsmonitor--daemon"));
+
+	close(fd);
+	strbuf_release(&request);
+	return ret;
+#endif
+}
+
 /*
  * Call the query-fsmonitor hook passing the time of the last saved results.
  */
@@ -104,6 +140,10 @@ static int query_fsmonitor(int version, uint64_t last_update, struct strbuf *que
 	if (!(argv[0] = core_fsmonitor))
 		return -1;
 
+	if (core_use_builtin_fsmonitor)
+		return query_fsmonitor_daemon(version, last_update,
+					      query_result);
+
 	snprintf(ver, sizeof(ver), "%d", version);
 	snprintf(date, sizeof(date), "%" PRIuMAX, (uintmax_t)last_update);
 	argv[1] = ver;
@@ -118,8 +158,34 @@ static int query_fsmonitor(int version, uint64_t last_update, struct strbuf *que
 
 static void fsmonitor_refresh_callback(struct index_state *istate, const char *name)
 {
-	int pos = index_name_pos(istate, name, strlen(name));
+	int len = strlen(name);
+	int pos;
+
+	if (len > 1 && name[len - 1] == '/') {
+		/*
+		 * A whole directory was created, removed or renamed:
+		 * everything below it may have changed.
+		 */
+		char *dir = xmemdupz(name, len - 1);
+
+		pos = index_name_pos(istate, name, len);
+		if (pos < 0)
+			pos = -pos - 1;
+		for (; pos < istate->cache_nr; pos++) {
+			struct cache_entry *ce = istate->cache[pos];
+			if (strncmp(ce->name, name, len))
+				break;
+			ce->ce_flags &= ~CE_FSMONITOR_VALID;
+		}
+
+		trace_printf_key(&trace_fsmonitor, "fsmonitor_refresh_callback '%s'", name);
+		if (verify_path(dir))
+			untracked_cache_invalidate_path(istate, name, 1);
+		free(dir);
+		return;
+	}
 
+	pos = index_name_pos(istate, name, len);
 	if (pos >= 0) {
 		struct cache_entry *ce = istate->cache[pos];
 		ce->ce_flags &= ~CE_FSMONITOR_VALID;
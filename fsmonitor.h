@@ -3,6 +3,12 @@
 
 extern struct trace_key trace_fsmonitor;
 
+/*
+ * The Unix domain socket on which "git fsmonitor--daemon" answers the
+ * queries for this working tree.
+ */
+extern const char *git_path_fsmonitor_daemon_socket(void);
+
 /*
  * Read the fsmonitor index extension and (if configured) restore the
  * CE_FSMONITOR_VALID state.
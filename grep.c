@@ -1452,7 +1452,9 @@ static inline void grep_attr_unlock(void)
 }
 
 /*
- * Same as git_attr_mutex, but protecting the thread-unsafe object db access.
+ * Same as git_attr_mutex, but protecting the thread-unsafe parts of
+ * object access that are not covered by the object read lock, like
+ * textconv and the parsed object hash.
  */
 pthread_mutex_t grep_read_mutex;
 
@@ -2014,9 +2016,7 @@ static int grep_source_load_oid(struct grep_source *gs)
 {
 	enum object_type type;
 
-	grep_read_lock();
 	gs->buf = read_object_file(gs->identifier, &type, &gs->size);
-	grep_read_unlock();
 
 	if (!gs->buf)
 		return error(_("'%s': unable to read %s"),
@@ -35,6 +35,7 @@
 #include "cache.h"
 
 #include "kwset.h"
+#include "literal-search.h"
 #include "compat/obstack.h"
 
 #define NCHAR (UCHAR_MAX + 1)
@@ -79,6 +80,7 @@ struct kwset
   char *target;			/* Target string if there's only one. */
   int mind2;			/* Used in Boyer-Moore search for one string. */
   unsigned char const *trans;  /* Character translation table. */
+  literal_search_fn search;	/* Vectorized search for one string. */
 };
 
 /* Allocate and initialize a keyword set object, returning an opaque
@@ -110,6 +112,7 @@ kwsalloc (unsigned char const *trans)
   kwset->maxd = -1;
   kwset->target = NULL;
   kwset->trans = trans;
+  kwset->search = NULL;
 
   return (kwset_t) kwset;
 }
@@ -389,9 +392,15 @@ kwsprep (kwset_t kws)
      node at which an outgoing edge is labeled by that character. */
   memset(delta, kwset->mind < UCHAR_MAX ? kwset->mind : UCHAR_MAX, NCHAR);
 
+  /* Git: one string, also one to be found regardless of ASCII case,
+     can be looked for with a vectorized search if the CPU allows. */
+  if (kwset->words == 1 && kwset->mind > 0
+      && (kwset->trans == NULL || kwset->trans == tolower_trans_tbl))
+    kwset->search = get_literal_search_fn ();
+
   /* Check if we can use the simple boyer-moore algorithm, instead
      of the hairy commentz-walter algorithm. */
-  if (kwset->words == 1 && kwset->trans == NULL)
+  if (kwset->words == 1 && (kwset->trans == NULL || kwset->search))
     {
       char c;
 
@@ -742,9 +751,12 @@ kwsexec (kwset_t kws, char const *text, size_t size,
 	 struct kwsmatch *kwsmatch)
 {
   struct kwset const *kwset = (struct kwset *) kws;
-  if (kwset->words == 1 && kwset->trans == NULL)
+  if (kwset->search || (kwset->words == 1 && kwset->trans == NULL))
     {
-      size_t ret = bmexec (kws, text, size);
+      size_t ret = kwset->search
+	? kwset->search (text, size, kwset->target, kwset->mind,
+			 kwset->trans != NULL)
+	: bmexec (kws, text, size);
       if (kwsmatch != NULL && ret != (size_t) -1)
 	{
 	  kwsmatch->index = 0;
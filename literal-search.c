@@ -0,0 +1,144 @@
+#include "cache.h"
+#include "literal-search.h"
+
+/*
+ * The vector searches look at a whole block of candidate positions at
+ * once: a position is worth checking only if the text has the first
+ * byte of the needle there, and its last byte len - 1 bytes later.
+ * Comparing both bytes weeds out nearly all positions for real world
+ * needles, so the search runs close to memory speed.
+ */
+
+#if defined(__GNUC__) && defined(__SSE2__) && \
+	(defined(__x86_64__) || defined(__i386__))
+#define HAVE_SSE2_SEARCH
+#include <emmintrin.h>
+#if defined(__clang__) || GIT_GNUC_PREREQ(4, 9)
+#define HAVE_AVX2_SEARCH
+#include <immintrin.h>
+#endif
+#endif
+
+#if defined(HAVE_SSE2_SEARCH)
+
+static int matches_at(const unsigned char *text, const unsigned char *needle,
+		      size_t len, int icase)
+{
+	size_t i;
+
+	if (!icase)
+		return !memcmp(text, needle, len);
+	for (i = 0; i < len; i++)
+		if (tolower_trans_tbl[text[i]] != needle[i])
+			return 0;
+	return 1;
+}
+
+/*
+ * With icase, setting the 0x20 bit of the text folds the case of a
+ * letter; other bytes may then compare equal by accident, which the
+ * final comparison sorts out.
+ */
+static unsigned char case_bit(unsigned char c, int icase)
+{
+	return icase && c >= 'a' && c <= 'z' ? 0x20 : 0;
+}
+
+/* Check the positions from "pos" on one by one. */
+static size_t search_tail(const unsigned char *text, size_t size, size_t pos,
+			  const unsigned char *needle, size_t len, int icase)
+{
+	unsigned char first = needle[0], last = needle[len - 1];
+	unsigned char first_bit = case_bit(first, icase);
+	unsigned char last_bit = case_bit(last, icase);
+
+	for (; pos + len <= size; pos++)
+		if ((text[pos] | first_bit) == first &&
+		    (text[pos + len - 1] | last_bit) == last &&
+		    matches_at(text + pos, needle, len, icase))
+			return pos;
+	return -1;
+}
+
+static size_t search_sse2(const char *text_, size_t size,
+			  const char *needle_, size_t len, int icase)
+{
+	const unsigned char *text = (const unsigned char *)text_;
+	const unsigned char *needle = (const unsigned char *)needle_;
+	const __m128i first = _mm_set1_epi8(needle[0]);
+	const __m128i last = _mm_set1_epi8(needle[len - 1]);
+	const __m128i first_bit = _mm_set1_epi8(case_bit(needle[0], icase));
+	const __m128i last_bit = _mm_set1_epi8(case_bit(needle[len - 1], icase));
+	size_t pos = 0;
+
+	for (; pos + len - 1 + 16 <= size; pos += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(text + pos));
+		__m128i b = _mm_loadu_si128((const __m128i *)(text + pos + len - 1));
+		unsigned mask;
+
+		a = _mm_cmpeq_epi8(_mm_or_si128(a, first_bit), first);
+		b = _mm_cmpeq_epi8(_mm_or_si128(b, last_bit), last);
+		mask = _mm_movemask_epi8(_mm_and_si128(a, b));
+		while (mask) {
+			int bit = __builtin_ctz(mask);
+
+			if (matches_at(text + pos + bit, needle, len, icase))
+				return pos + bit;
+			mask &= mask - 1;
+		}
+	}
+	return search_tail(text, size, pos, needle, len, icase);
+}
+
+#ifdef HAVE_AVX2_SEARCH
+__attribute__((target("avx2")))
+static size_t search_avx2(const char *text_, size_t size,
+			  const char *needle_, size_t len, int icase)
+{
+	const unsigned char *text = (const unsigned char *)text_;
+	const unsigned char *needle = (const unsigned char *)needle_;
+	const __m256i first = _mm256_set1_epi8(needle[0]);
+	const __m256i last = _mm256_set1_epi8(needle[len - 1]);
+	const __m256i first_bit = _mm256_set1_epi8(case_bit(needle[0], icase));
+	const __m256i last_bit = _mm256_set1_epi8(case_bit(needle[len - 1], icase));
+	size_t pos = 0;
+
+	for (; pos + len - 1 + 32 <= size; pos += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(text + pos));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(text + pos + len - 1));
+		unsigned mask;
+
+		a = _mm256_cmpeq_epi8(_mm256_or_si256(a, first_bit), first);
+		b = _mm256_cmpeq_epi8(_mm256_or_si256(b, last_bit), last);
+		mask = _mm256_movemask_epi8(_mm256_and_si256(a, b));
+		while (mask) {
+			int bit = __builtin_ctz(mask);
+
+			if (matches_at(text + pos + bit, needle, len, icase))
+				return pos + bit;
+			mask &= mask - 1;
+		}
+	}
+	return search_tail(text, size, pos, needle, len, icase);
+}
+#endif
+
+#endif /* HAVE_SSE2_SEARCH */
+
+literal_search_fn get_literal_search_fn(void)
+{
+	const char *force = getenv("GIT_TEST_LITERAL_SEARCH");
+
+	if (force && !strcmp(force, "scalar"))
+		return NULL;
+#ifdef HAVE_SSE2_SEARCH
+#ifdef HAVE_AVX2_SEARCH
+	if ((!force || !strcmp(force, "avx2")) &&
+	    __builtin_cpu_supports("avx2"))
+		return search_avx2;
+#endif
+	return search_sse2;
+#else
+	return NULL;
+#endif
+}
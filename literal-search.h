@@ -0,0 +1,25 @@
+#ifndef LITERAL_SEARCH_H
+#define LITERAL_SEARCH_H
+
+/*
+ * Search "text" for the first occurrence of "needle" (which must not
+ * be empty), returning its offset or (size_t)-1. With "icase", ASCII
+ * letters in the text match regardless of case; the needle must then
+ * be in lowercase already.
+ */
+typedef size_t (*literal_search_fn)(const char *text, size_t size,
+				    const char *needle, size_t len,
+				    int icase);
+
+/*
+ * Return a search function that uses the vector instructions of the
+ * CPU we run on to compare many candidate positions at a time, or
+ * NULL if there is none, in which case the caller should use its own
+ * scalar search.
+ *
+ * GIT_TEST_LITERAL_SEARCH can be set to "scalar", "sse2" or "avx2" to
+ * force one of the implementations (or none) for testing.
+ */
+extern literal_search_fn get_literal_search_fn(void);
+
+#endif /* LITERAL_SEARCH_H */
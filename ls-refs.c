@@ -0,0 +1,174 @@
+#include "cache.h"
+#include "repository.h"
+#include "refs.h"
+#include "string-list.h"
+#include "ls-refs.h"
+#include "pkt-line.h"
+#include "config.h"
+
+struct ls_refs_data {
+	unsigned peel;
+	unsigned symrefs;
+	struct string_list prefixes;
+};
+
+/*
+ * Check if one of the prefixes is a prefix of the ref.
+ * If no prefixes were provided, all refs match.
+ */
+static int ref_match(const struct string_list *prefixes, const char *refname)
+{
+	struct string_list_item *item;
+
+	if (!prefixes->nr)
+		return 1; /* no restriction */
+
+	for_each_string_list_item(item, prefixes)
+		if (starts_with(refname, item->string))
+			return 1;
+
+	return 0;
+}
+
+static int send_ref(const char *refname, const struct object_id *oid,
+		    int flag, void *cb_data)
+{
+	struct ls_refs_data *data = cb_data;
+	const char *refname_nons = strip_namespace(refname);
+	struct strbuf refline = STRBUF_INIT;
+
+	if (ref_is_hidden(refname_nons, refname))
+		return 0;
+
+	if (!ref_match(&data->prefixes, refname_nons))
+		return 0;
+
+	strbuf_addf(&refline, "%s %s", oid_to_hex(oid), refname_nons);
+	if (data->symrefs && flag & REF_ISSYMREF) {
+		struct object_id unused;
+		const char *symref_target = resolve_ref_unsafe(refname, 0,
+							       &unused,
+							       &flag);
+
+		if (!symref_target)
+			die("'%s' is a symref but it is not?", refname);
+
+		strbuf_addf(&refline, " symref-target:%s",
+			    strip_namespace(symref_target));
+	}
+
+	if (data->peel) {
+		struct object_id peeled;
+		if (!peel_ref(refname, &peeled))
+			strbuf_addf(&refline, " peeled:%s", oid_to_hex(&peeled));
+	}
+
+	strbuf_addch(&refline, '\n');
+	packet_write(1, refline.buf, refline.len);
+
+	strbuf_release(&refline);
+	return 0;
+}
+
+/*
+ * Sort the requested prefixes and drop those that are covered by a
+ * shorter one, so that each ref is visited (and sent) at most once.
+ */
+static void normalize_prefixes(struct string_list *prefixes)
+{
+	int i, j;
+
+	string_list_sort(prefixes);
+	for (i = j = 0; i < prefixes->nr; i++) {
+		if (j && starts_with(prefixes->items[i].string,
+				     prefixes->items[j - 1].string))
+			continue;
+		prefixes->items[j++] = prefixes->items[i];
+	}
+	prefixes->nr = j;
+}
+
+/*
+ * Only walk the parts of the ref namespace the client asked for, so
+ * that the cost of a request is proportional to the number of refs it
+ * names rather than to the number of refs in the repository.
+ */
+static void send_refs(struct ls_refs_data *data)
+{
+	struct strbuf buf = STRBUF_INIT;
+	struct string_list_item *item;
+
+	if (!data->prefixes.nr) {
+		head_ref_namespaced(send_ref, data);
+		for_each_namespaced_ref(send_ref, data);
+		return;
+	}
+
+	normalize_prefixes(&data->prefixes);
+
+	for_each_string_list_item(item, &data->prefixes) {
+		if (starts_with("HEAD", item->string)) {
+			head_ref_namespaced(send_ref, data);
+			break;
+		}
+	}
+
+	for_each_string_list_item(item, &data->prefixes) {
+		const char *prefix = item->string;
+
+		if (starts_with("refs/", prefix)) {
+			/* e.g. "ref-prefix r" covers everything */
+			for_each_namespaced_ref(send_ref, data);
+			break;
+		}
+		if (!starts_with(prefix, "refs/"))
+			continue;
+
+		strbuf_reset(&buf);
+		strbuf_addf(&buf, "%s%s", get_git_namespace(), prefix);
+		for_each_fullref_in(buf.buf, send_ref, data, 0);
+	}
+
+	strbuf_release(&buf);
+}
+
+static int ls_refs_config(const char *var, const char *value, void *data)
+{
+	/*
+	 * We only serve fetches over v2 for now, so respect only "uploadpack"
+	 * config. This may need to eventually be expanded to "receive", but we
+	 * don't yet know how that information will be passed to ls-refs.
+	 */
+	return parse_hide_refs_config(var, value, "uploadpack");
+}
+
+int ls_refs(struct repository *r, struct argv_array *keys,
+	    struct packet_reader *request)
+{
+	struct ls_refs_data data;
+
+	memset(&data, 0, sizeof(data));
+
+	git_config(ls_refs_config, NULL);
+	string_list_init(&data.prefixes, 1);
+
+	while (packet_reader_read(request) == PACKET_READ_NORMAL) {
+		const char *arg = request->line;
+		const char *out;
+
+		if (!strcmp("peel", arg))
+			data.peel = 1;
+		else if (!strcmp("symrefs", arg))
+			data.symrefs = 1;
+		else if (skip_prefix(arg, "ref-prefix ", &out))
+			string_list_append(&data.prefixes, out);
+	}
+
+	if (request->status != PACKET_READ_FLUSH)
+		die(_("expected flush after ls-refs arguments"));
+
+	send_refs(&data);
+	packet_flush(1);
+	string_list_clear(&data.prefixes, 0);
+	return 0;
+}
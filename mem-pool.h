@@ -21,6 +21,19 @@ struct mem_pool {
 	size_t pool_alloc;
 };
 
+/*
+ * Initialize *mem_pool with the specified initial size, unless it has
+ * already been.
+ */
+void mem_pool_init(struct mem_pool **mem_pool, size_t initial_size);
+
+/*
+ * Discard a memory pool and free all the memory it is responsible for.
+ * With `invalidate_memory`, the memory is overwritten first, so that a
+ * use after free shows.
+ */
+void mem_pool_discard(struct mem_pool *mem_pool, int invalidate_memory);
+
 /*
  * Alloc memory from the mem_pool.
  */
@@ -31,4 +44,17 @@ void *mem_pool_alloc(struct mem_pool *pool, size_t len);
  */
 void *mem_pool_calloc(struct mem_pool *pool, size_t count, size_t size);
 
+/*
+ * Move the memory associated with the 'src' pool to the 'dst' pool. The 'src'
+ * pool will be empty and not contain any memory. It still needs to be free'd
+ * with a call to `mem_pool_discard`.
+ */
+void mem_pool_combine(struct mem_pool *dst, struct mem_pool *src);
+
+/*
+ * Check if a memory pointed at by 'mem' is part of the range of
+ * memory managed by the specified mem_pool.
+ */
+int mem_pool_contains(struct mem_pool *mem_pool, void *mem);
+
 #endif
@@ -0,0 +1,960 @@
+#include "cache.h"
+#include "config.h"
+#include "csum-file.h"
+#include "dir.h"
+#include "lockfile.h"
+#include "packfile.h"
+#include "object-store.h"
+#include "sha1-lookup.h"
+#include "midx.h"
+
+#define MIDX_SIGNATURE 0x4d494458 /* "MIDX" */
+#define MIDX_VERSION 1
+#define MIDX_BYTE_FILE_VERSION 4
+#define MIDX_BYTE_HASH_VERSION 5
+#define MIDX_BYTE_NUM_CHUNKS 6
+#define MIDX_BYTE_NUM_PACKS 8
+#define MIDX_HASH_VERSION 1
+#define MIDX_HEADER_SIZE 12
+#define MIDX_HASH_LEN 20
+#define MIDX_MIN_SIZE (MIDX_HEADER_SIZE + MIDX_HASH_LEN)
+
+#define MIDX_MAX_CHUNKS 5
+#define MIDX_CHUNK_ALIGNMENT 4
+#define MIDX_CHUNKID_PACKNAMES 0x504e414d /* "PNAM" */
+#define MIDX_CHUNKID_OIDFANOUT 0x4f494446 /* "OIDF" */
+#define MIDX_CHUNKID_OIDLOOKUP 0x4f49444c /* "OIDL" */
+#define MIDX_CHUNKID_OBJECTOFFSETS 0x4f4f4646 /* "OOFF" */
+#define MIDX_CHUNKID_LARGEOFFSETS 0x4c4f4646 /* "LOFF" */
+#define MIDX_CHUNKLOOKUP_WIDTH (sizeof(uint32_t) + sizeof(uint64_t))
+#define MIDX_CHUNK_FANOUT_SIZE (sizeof(uint32_t) * 256)
+#define MIDX_CHUNK_OFFSET_WIDTH (2 * sizeof(uint32_t))
+#define MIDX_CHUNK_LARGE_OFFSET_WIDTH (sizeof(uint64_t))
+#define MIDX_LARGE_OFFSET_NEEDED 0x80000000
+
+char *get_midx_filename(const char *object_dir)
+{
+	return xstrfmt("%s/pack/multi-pack-index", object_dir);
+}
+
+struct multi_pack_index *load_multi_pack_index(const char *object_dir, int local)
+{
+	struct multi_pack_index *m = NULL;
+	int fd;
+	struct stat st;
+	size_t midx_size;
+	void *midx_map = NULL;
+	uint32_t hash_version;
+	char *midx_name = get_midx_filename(object_dir);
+	uint32_t i;
+	const char *cur_pack_name;
+	uint64_t chunk_end[MIDX_MAX_CHUNKS] = { 0 };
+
+	fd = git_open(midx_name);
+
+	if (fd < 0)
+		goto cleanup_fail;
+	if (fstat(fd, &st)) {
+		error_errno(_("failed to read %s"), midx_name);
+		goto cleanup_fail;
+	}
+
+	midx_size = xsize_t(st.st_size);
+
+	if (midx_size < MIDX_MIN_SIZE) {
+		error(_("multi-pack-index file %s is too small"), midx_name);
+		goto cleanup_fail;
+	}
+
+	FREE_AND_NULL(midx_name);
+
+	midx_map = xmmap(NULL, midx_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	FLEX_ALLOC_STR(m, object_dir, object_dir);
+	m->fd = fd;
+	m->data = midx_map;
+	m->data_len = midx_size;
+	m->local = local;
+
+	m->signature = get_be32(m->data);
+	if (m->signature != MIDX_SIGNATURE) {
+		error(_("multi-pack-index signature 0x%08x does not match signature 0x%08x"),
+		      m->signature, MIDX_SIGNATURE);
+		goto cleanup_fail;
+	}
+
+	m->version = m->data[MIDX_BYTE_FILE_VERSION];
+	if (m->version != MIDX_VERSION) {
+		error(_("multi-pack-index version %d not recognized"),
+		      m->version);
+		goto cleanup_fail;
+	}
+
+	hash_version = m->data[MIDX_BYTE_HASH_VERSION];
+	if (hash_version != MIDX_HASH_VERSION) {
+		error(_("hash version %u does not match"), hash_version);
+		goto cleanup_fail;
+	}
+	m->hash_len = MIDX_HASH_LEN;
+
+	m->num_chunks = m->data[MIDX_BYTE_NUM_CHUNKS];
+
+	m->num_packs = get_be32(m->data + MIDX_BYTE_NUM_PACKS);
+
+	if (MIDX_HEADER_SIZE + (m->num_chunks + 1) * MIDX_CHUNKLOOKUP_WIDTH >
+	    midx_size - MIDX_HASH_LEN) {
+		error(_("multi-pack-index file %s is too small"), object_dir);
+		goto cleanup_fail;
+	}
+
+	for (i = 0; i < m->num_chunks; i++) {
+		const unsigned char *lookup = m->data + MIDX_HEADER_SIZE +
+					      MIDX_CHUNKLOOKUP_WIDTH * i;
+		uint32_t chunk_id = get_be32(lookup);
+		uint64_t chunk_offset = get_be64(lookup + 4);
+		uint64_t next_offset = get_be64(lookup + MIDX_CHUNKLOOKUP_WIDTH + 4);
+		const unsigned char **chunk = NULL;
+		int slot = -1;
+
+		if (!chunk_id) {
+			error(_("terminating multi-pack-index chunk id appears earlier than expected"));
+			goto cleanup_fail;
+		}
+
+		if (chunk_offset > next_offset ||
+		    next_offset > midx_size - MIDX_HASH_LEN) {
+			error(_("improper chunk offset(s) %"PRIx64" and %"PRIx64""),
+			      chunk_offset, next_offset);
+			goto cleanup_fail;
+		}
+
+		switch (chunk_id) {
+		case MIDX_CHUNKID_PACKNAMES:
+			chunk = &m->chunk_pack_names;
+			slot = 0;
+			break;
+
+		case MIDX_CHUNKID_OIDFANOUT:
+			chunk = (const unsigned char **)&m->chunk_oid_fanout;
+			slot = 1;
+			break;
+
+		case MIDX_CHUNKID_OIDLOOKUP:
+			chunk = &m->chunk_oid_lookup;
+			slot = 2;
+			break;
+
+		case MIDX_CHUNKID_OBJECTOFFSETS:
+			chunk = &m->chunk_object_offsets;
+			slot = 3;
+			break;
+
+		case MIDX_CHUNKID_LARGEOFFSETS:
+			chunk = &m->chunk_large_offsets;
+			slot = 4;
+			break;
+
+		default:
+			/*
+			 * Do nothing on unrecognized chunks, allowing future
+			 * extensions to add optional chunks.
+			 */
+			break;
+		}
+
+		if (!chunk)
+			continue;
+		if (*chunk) {
+			error(_("multi-pack-index chunk id %08x appears multiple times"),
+			      chunk_id);
+			goto cleanup_fail;
+		}
+		*chunk = m->data + chunk_offset;
+		chunk_end[slot] = next_offset;
+	}
+
+	if (!m->chunk_pack_names) {
+		error(_("multi-pack-index missing required pack-name chunk"));
+		goto cleanup_fail;
+	}
+	if (!m->chunk_oid_fanout) {
+		error(_("multi-pack-index missing required OID fanout chunk"));
+		goto cleanup_fail;
+	}
+	if (!m->chunk_oid_lookup) {
+		error(_("multi-pack-index missing required OID lookup chunk"));
+		goto cleanup_fail;
+	}
+	if (!m->chunk_object_offsets) {
+		error(_("multi-pack-index missing required object offsets chunk"));
+		goto cleanup_fail;
+	}
+
+	m->num_objects = ntohl(m->chunk_oid_fanout[255]);
+
+	if (m->chunk_oid_lookup + (size_t)m->num_objects * m->hash_len >
+	    m->data + chunk_end[2] ||
+	    m->chunk_object_offsets +
+	    (size_t)m->num_objects * MIDX_CHUNK_OFFSET_WIDTH >
+	    m->data + chunk_end[3]) {
+		error(_("multi-pack-index object chunks are too small"));
+		goto cleanup_fail;
+	}
+
+	m->pack_names = xcalloc(m->num_packs, sizeof(*m->pack_names));
+	m->packs = xcalloc(m->num_packs, sizeof(*m->packs));
+
+	cur_pack_name = (const char *)m->chunk_pack_names;
+	for (i = 0; i < m->num_packs; i++) {
+		const char *end = memchr(cur_pack_name, '\0',
+					 m->data + chunk_end[0] -
+					 (const unsigned char *)cur_pack_name);
+
+		if (!end) {
+			error(_("multi-pack-index pack names are truncated"));
+			goto cleanup_fail;
+		}
+		m->pack_names[i] = cur_pack_name;
+
+		if (i && strcmp(m->pack_names[i], m->pack_names[i - 1]) <= 0) {
+			error(_("multi-pack-index pack names out of order: '%s' before '%s'"),
+			      m->pack_names[i - 1],
+			      m->pack_names[i]);
+			goto cleanup_fail;
+		}
+		cur_pack_name = end + 1;
+	}
+
+	return m;
+
+cleanup_fail:
+	if (m)
+		close_midx(m);
+	else {
+		if (midx_map)
+			munmap(midx_map, midx_size);
+		if (0 <= fd)
+			close(fd);
+	}
+	free(midx_name);
+	return NULL;
+}
+
+void close_midx(struct multi_pack_index *m)
+{
+	if (!m)
+		return;
+
+	munmap((unsigned char *)m->data, m->data_len);
+	close(m->fd);
+	free(m->packs);
+	free(m->pack_names);
+	free(m);
+}
+
+static int midx_pack_pos(struct multi_pack_index *m, const char *idx_name)
+{
+	uint32_t first = 0, last = m->num_packs;
+
+	while (first < last) {
+		uint32_t mid = first + (last - first) / 2;
+		int cmp = strcmp(idx_name, m->pack_names[mid]);
+
+		if (!cmp)
+			return mid;
+		if (cmp > 0)
+			first = mid + 1;
+		else
+			last = mid;
+	}
+
+	return -1;
+}
+
+int midx_contains_pack(struct multi_pack_index *m, const char *idx_name)
+{
+	return midx_pack_pos(m, idx_name) >= 0;
+}
+
+int prepare_multi_pack_index_one(struct repository *r, const char *object_dir, int local)
+{
+	struct multi_pack_index *m;
+	struct multi_pack_index *m_search;
+	int config_value;
+
+	if (repo_config_get_bool(r, "core.multipackindex", &config_value) ||
+	    !config_value)
+		return 0;
+
+	for (m_search = r->objects->multi_pack_index; m_search; m_search = m_search->next)
+		if (!strcmp(object_dir, m_search->object_dir))
+			return 1;
+
+	m = load_multi_pack_index(object_dir, local);
+
+	if (m) {
+		m->next = r->objects->multi_pack_index;
+		r->objects->multi_pack_index = m;
+		return 1;
+	}
+
+	return 0;
+}
+
+void link_multi_pack_index_packs(struct repository *r)
+{
+	struct multi_pack_index *m;
+	struct strbuf idx_name = STRBUF_INIT;
+
+	for (m = r->objects->multi_pack_index; m; m = m->next) {
+		struct packed_git *p;
+		size_t dirlen = strlen(m->object_dir);
+
+		for (p = r->objects->packed_git; p; p = p->next) {
+			const char *base;
+			size_t len;
+			int pos;
+
+			if (p->multi_pack_index ||
+			    strncmp(p->pack_name, m->object_dir, dirlen) ||
+			    !skip_prefix(p->pack_name + dirlen, "/pack/", &base) ||
+			    !strip_suffix(base, ".pack", &len))
+				continue;
+
+			strbuf_reset(&idx_name);
+			strbuf_add(&idx_name, base, len);
+			strbuf_addstr(&idx_name, ".idx");
+
+			pos = midx_pack_pos(m, idx_name.buf);
+			if (pos < 0)
+				continue;
+			m->packs[pos] = p;
+			p->multi_pack_index = 1;
+		}
+	}
+
+	strbuf_release(&idx_name);
+}
+
+int bsearch_midx(const struct object_id *oid, struct multi_pack_index *m, uint32_t *result)
+{
+	return bsearch_hash(oid->hash, m->chunk_oid_fanout, m->chunk_oid_lookup,
+			    MIDX_HASH_LEN, result);
+}
+
+struct object_id *nth_midxed_object_oid(struct object_id *oid,
+					struct multi_pack_index *m,
+					uint32_t n)
+{
+	if (n >= m->num_objects)
+		return NULL;
+
+	hashcpy(oid->hash, m->chunk_oid_lookup + m->hash_len * n);
+	return oid;
+}
+
+off_t nth_midxed_offset(struct multi_pack_index *m, uint32_t pos)
+{
+	const unsigned char *offset_data;
+	uint32_t offset32;
+
+	offset_data = m->chunk_object_offsets + pos * MIDX_CHUNK_OFFSET_WIDTH;
+	offset32 = get_be32(offset_data + sizeof(uint32_t));
+
+	if (m->chunk_large_offsets && offset32 & MIDX_LARGE_OFFSET_NEEDED) {
+		if (sizeof(off_t) < sizeof(uint64_t))
+			die(_("multi-pack-index stores a 64-bit offset, but off_t is too small"));
+
+		offset32 ^= MIDX_LARGE_OFFSET_NEEDED;
+		return get_be64(m->chunk_large_offsets + sizeof(uint64_t) * offset32);
+	}
+
+	return offset32;
+}
+
+uint32_t nth_midxed_pack_int_id(struct multi_pack_index *m, uint32_t pos)
+{
+	return get_be32(m->chunk_object_offsets + pos * MIDX_CHUNK_OFFSET_WIDTH);
+}
+
+int fill_midx_entry(const struct object_id *oid, struct pack_entry *e, struct multi_pack_index *m)
+{
+	uint32_t pos, pack_int_id;
+	struct packed_git *p;
+
+	if (!bsearch_midx(oid, m, &pos))
+		return 0;
+
+	pack_int_id = nth_midxed_pack_int_id(m, pos);
+	if (pack_int_id >= m->num_packs)
+		return -1;
+
+	p = m->packs[pack_int_id];
+	if (!p)
+		return -1;
+
+	if (p->num_bad_objects) {
+		uint32_t i;
+		for (i = 0; i < p->num_bad_objects; i++)
+			if (!hashcmp(oid->hash, p->bad_object_sha1 + 20 * i))
+				return -1;
+	}
+
+	/*
+	 * We are about to tell the caller where they can locate the
+	 * requested object.  We better make sure the packfile is
+	 * still here and can be accessed before supplying that
+	 * answer, as it may have been deleted since the index was
+	 * loaded!
+	 */
+	if (!is_pack_valid(p))
+		return -1;
+
+	e->offset = nth_midxed_offset(m, pos);
+	e->p = p;
+	hashcpy(e->sha1, oid->hash);
+	return 1;
+}
+
+struct pack_list {
+	struct packed_git **list;
+	char **names;
+	uint32_t nr;
+	uint32_t alloc;
+};
+
+static int pack_name_cmp(const void *a_, const void *b_)
+{
+	const struct packed_git *a = *(const struct packed_git **)a_;
+	const struct packed_git *b = *(const struct packed_git **)b_;
+	return strcmp(a->pack_name, b->pack_name);
+}
+
+static void collect_packs(const char *object_dir, struct pack_list *packs)
+{
+	struct strbuf path = STRBUF_INIT;
+	size_t dirlen;
+	DIR *dir;
+	struct dirent *de;
+	uint32_t i;
+
+	strbuf_addf(&path, "%s/pack", object_dir);
+	dir = opendir(path.buf);
+	if (!dir) {
+		if (errno != ENOENT)
+			error_errno(_("unable to open object pack directory: %s"),
+				    path.buf);
+		strbuf_release(&path);
+		return;
+	}
+
+	strbuf_addch(&path, '/');
+	dirlen = path.len;
+	while ((de = readdir(dir)) != NULL) {
+		struct packed_git *p;
+
+		if (!ends_with(de->d_name, ".idx"))
+			continue;
+
+		strbuf_setlen(&path, dirlen);
+		strbuf_addstr(&path, de->d_name);
+
+		p = add_packed_git(path.buf, path.len, 0);
+		if (!p) {
+			warning(_("failed to add packfile '%s'"), path.buf);
+			continue;
+		}
+		if (open_pack_index(p)) {
+			warning(_("failed to open pack-index '%s'"), path.buf);
+			close_pack(p);
+			free(p);
+			continue;
+		}
+
+		ALLOC_GROW(packs->list, packs->nr + 1, packs->alloc);
+		packs->list[packs->nr++] = p;
+	}
+	closedir(dir);
+	strbuf_release(&path);
+
+	/*
+	 * Packs are identified by their position in the sorted list of
+	 * pack names; sort them once so pack_int_id is that position.
+	 */
+	QSORT(packs->list, packs->nr, pack_name_cmp);
+	ALLOC_ARRAY(packs->names, packs->nr);
+	for (i = 0; i < packs->nr; i++) {
+		const char *base = strrchr(packs->list[i]->pack_name, '/') + 1;
+		size_t len;
+
+		if (!strip_suffix(base, ".pack", &len))
+			BUG("pack name '%s' does not end in .pack",
+			    packs->list[i]->pack_name);
+		packs->names[i] = xstrfmt("%.*s.idx", (int)len, base);
+	}
+}
+
+struct pack_midx_entry {
+	struct object_id oid;
+	uint32_t pack_int_id;
+	time_t pack_mtime;
+	uint64_t offset;
+};
+
+static int midx_oid_compare(const void *_a, const void *_b)
+{
+	const struct pack_midx_entry *a = (const struct pack_midx_entry *)_a;
+	const struct pack_midx_entry *b = (const struct pack_midx_entry *)_b;
+	int cmp = oidcmp(&a->oid, &b->oid);
+
+	if (cmp)
+		return cmp;
+
+	/* Prefer the copy in the most recently modified pack. */
+	if (a->pack_mtime > b->pack_mtime)
+		return -1;
+	else if (a->pack_mtime < b->pack_mtime)
+		return 1;
+
+	return a->pack_int_id - b->pack_int_id;
+}
+
+/*
+ * Collect the objects of every pack, sorted by object name, keeping
+ * only the copy in the most recently modified pack for duplicates.
+ */
+static struct pack_midx_entry *get_sorted_entries(struct pack_list *packs,
+						  uint32_t *nr_objects)
+{
+	struct pack_midx_entry *entries = NULL;
+	uint32_t i, cur, total_objects = 0, nr = 0;
+
+	for (i = 0; i < packs->nr; i++)
+		total_objects += packs->list[i]->num_objects;
+
+	ALLOC_ARRAY(entries, total_objects);
+
+	for (i = 0; i < packs->nr; i++) {
+		struct packed_git *p = packs->list[i];
+		uint32_t j;
+
+		for (j = 0; j < p->num_objects; j++) {
+			struct pack_midx_entry *e = &entries[nr++];
+
+			nth_packed_object_oid(&e->oid, p, j);
+			e->pack_int_id = i;
+			e->pack_mtime = p->mtime;
+			e->offset = nth_packed_object_offset(p, j);
+		}
+	}
+
+	QSORT(entries, nr, midx_oid_compare);
+
+	for (i = cur = 0; i < nr; i++) {
+		if (cur && !oidcmp(&entries[cur - 1].oid, &entries[i].oid))
+			continue;
+		entries[cur++] = entries[i];
+	}
+
+	*nr_objects = cur;
+	return entries;
+}
+
+static size_t write_midx_pack_names(struct hashfile *f,
+				    char **pack_names,
+				    uint32_t num_packs)
+{
+	unsigned char padding[MIDX_CHUNK_ALIGNMENT];
+	uint32_t i;
+	size_t written = 0;
+
+	for (i = 0; i < num_packs; i++) {
+		size_t writelen = strlen(pack_names[i]) + 1;
+
+		hashwrite(f, pack_names[i], writelen);
+		written += writelen;
+	}
+
+	/* add padding to be aligned */
+	i = MIDX_CHUNK_ALIGNMENT - (written % MIDX_CHUNK_ALIGNMENT);
+	if (i < MIDX_CHUNK_ALIGNMENT) {
+		memset(padding, 0, sizeof(padding));
+		hashwrite(f, padding, i);
+		written += i;
+	}
+
+	return written;
+}
+
+static size_t write_midx_oid_fanout(struct hashfile *f,
+				    struct pack_midx_entry *objects,
+				    uint32_t nr_objects)
+{
+	struct pack_midx_entry *list = objects;
+	struct pack_midx_entry *last = objects + nr_objects;
+	uint32_t count = 0;
+	uint32_t i;
+
+	/*
+	 * Write the first-level table (the list is sorted,
+	 * but we use a 256-entry lookup to be able to avoid
+	 * having to do eight extra binary search iterations).
+	 */
+	for (i = 0; i < 256; i++) {
+		struct pack_midx_entry *next = list;
+
+		while (next < last && next->oid.hash[0] == i) {
+			count++;
+			next++;
+		}
+
+		hashwrite_be32(f, count);
+		list = next;
+	}
+
+	return MIDX_CHUNK_FANOUT_SIZE;
+}
+
+static size_t write_midx_oid_lookup(struct hashfile *f, unsigned char hash_len,
+				    struct pack_midx_entry *objects,
+				    uint32_t nr_objects)
+{
+	uint32_t i;
+
+	for (i = 0; i < nr_objects; i++)
+		hashwrite(f, objects[i].oid.hash, (int)hash_len);
+
+	return (size_t)hash_len * nr_objects;
+}
+
+static size_t write_midx_object_offsets(struct hashfile *f, int large_offset_needed,
+					struct pack_midx_entry *objects, uint32_t nr_objects)
+{
+	uint32_t i, nr_large_offset = 0;
+
+	for (i = 0; i < nr_objects; i++) {
+		struct pack_midx_entry *obj = &objects[i];
+
+		hashwrite_be32(f, obj->pack_int_id);
+
+		if (large_offset_needed && obj->offset >> 31)
+			hashwrite_be32(f, MIDX_LARGE_OFFSET_NEEDED | nr_large_offset++);
+		else if (!large_offset_needed && obj->offset >> 32)
+			BUG("object %s requires a large offset (%"PRIx64") but the MIDX is not writing large offsets!",
+			    oid_to_hex(&obj->oid),
+			    obj->offset);
+		else
+			hashwrite_be32(f, (uint32_t)obj->offset);
+	}
+
+	return MIDX_CHUNK_OFFSET_WIDTH * nr_objects;
+}
+
+static size_t write_midx_large_offsets(struct hashfile *f, uint32_t nr_large_offset,
+				       struct pack_midx_entry *objects, uint32_t nr_objects)
+{
+	struct pack_midx_entry *list = objects, *end = objects + nr_objects;
+	size_t written = 0;
+
+	while (nr_large_offset) {
+		struct pack_midx_entry *obj;
+		uint64_t offset;
+
+		if (list >= end)
+			BUG("too many large-offset objects");
+
+		obj = list++;
+		offset = obj->offset;
+
+		if (!(offset >> 31))
+			continue;
+
+		hashwrite_be32(f, offset >> 32);
+		hashwrite_be32(f, offset & 0xffffffffUL);
+		written += 2 * sizeof(uint32_t);
+
+		nr_large_offset--;
+	}
+
+	return written;
+}
+
+int write_midx_file(const char *object_dir)
+{
+	unsigned char cur_chunk, num_chunks = 0;
+	char *midx_name;
+	uint32_t i;
+	struct hashfile *f = NULL;
+	struct lock_file lk = LOCK_INIT;
+	struct pack_list packs = { NULL, NULL, 0, 0 };
+	uint64_t written = 0;
+	uint32_t chunk_ids[MIDX_MAX_CHUNKS + 1];
+	uint64_t chunk_offsets[MIDX_MAX_CHUNKS + 1];
+	uint32_t nr_entries, num_large_offsets = 0;
+	struct pack_midx_entry *entries = NULL;
+	int large_offsets_needed = 0;
+
+	midx_name = get_midx_filename(object_dir);
+	if (safe_create_leading_directories(midx_name))
+		die_errno(_("unable to create leading directories of %s"),
+			  midx_name);
+
+	collect_packs(object_dir, &packs);
+	entries = get_sorted_entries(&packs, &nr_entries);
+
+	for (i = 0; i < nr_entries; i++) {
+		if (entries[i].offset > 0x7fffffff)
+			num_large_offsets++;
+		if (entries[i].offset > 0xffffffff)
+			large_offsets_needed = 1;
+	}
+
+	hold_lock_file_for_update(&lk, midx_name, LOCK_DIE_ON_ERROR);
+	f = hashfd(get_lock_file_fd(&lk), get_lock_file_path(&lk));
+	FREE_AND_NULL(midx_name);
+
+	cur_chunk = 0;
+	num_chunks = large_offsets_needed ? 5 : 4;
+
+	written = MIDX_HEADER_SIZE;
+	hashwrite_be32(f, MIDX_SIGNATURE);
+	hashwrite_u8(f, MIDX_VERSION);
+	hashwrite_u8(f, MIDX_HASH_VERSION);
+	hashwrite_u8(f, num_chunks);
+	hashwrite_u8(f, 0); /* unused: number of base multi-pack-indexes */
+	hashwrite_be32(f, packs.nr);
+
+	chunk_ids[cur_chunk] = MIDX_CHUNKID_PACKNAMES;
+	chunk_offsets[cur_chunk] = written + (num_chunks + 1) * MIDX_CHUNKLOOKUP_WIDTH;
+
+	cur_chunk++;
+	chunk_ids[cur_chunk] = MIDX_CHUNKID_OIDFANOUT;
+	chunk_offsets[cur_chunk] = chunk_offsets[cur_chunk - 1];
+	for (i = 0; i < packs.nr; i++)
+		chunk_offsets[cur_chunk] += strlen(packs.names[i]) + 1;
+	if (chunk_offsets[cur_chunk] % MIDX_CHUNK_ALIGNMENT)
+		chunk_offsets[cur_chunk] += MIDX_CHUNK_ALIGNMENT -
+			(chunk_offsets[cur_chunk] % MIDX_CHUNK_ALIGNMENT);
+
+	cur_chunk++;
+	chunk_ids[cur_chunk] = MIDX_CHUNKID_OIDLOOKUP;
+	chunk_offsets[cur_chunk] = chunk_offsets[cur_chunk - 1] + MIDX_CHUNK_FANOUT_SIZE;
+
+	cur_chunk++;
+	chunk_ids[cur_chunk] = MIDX_CHUNKID_OBJECTOFFSETS;
+	chunk_offsets[cur_chunk] = chunk_offsets[cur_chunk - 1] +
+				   (uint64_t)nr_entries * MIDX_HASH_LEN;
+
+	cur_chunk++;
+	chunk_offsets[cur_chunk] = chunk_offsets[cur_chunk - 1] +
+				   (uint64_t)nr_entries * MIDX_CHUNK_OFFSET_WIDTH;
+	if (large_offsets_needed) {
+		chunk_ids[cur_chunk] = MIDX_CHUNKID_LARGEOFFSETS;
+
+		cur_chunk++;
+		chunk_offsets[cur_chunk] = chunk_offsets[cur_chunk - 1] +
+					   (uint64_t)num_large_offsets * MIDX_CHUNK_LARGE_OFFSET_WIDTH;
+	}
+
+	chunk_ids[cur_chunk] = 0;
+
+	for (i = 0; i <= num_chunks; i++) {
+		if (i && chunk_offsets[i] < chunk_offsets[i - 1])
+			BUG("incorrect chunk offsets: %"PRIu64" before %"PRIu64,
+			    chunk_offsets[i - 1],
+			    chunk_offsets[i]);
+
+		if (chunk_offsets[i] % MIDX_CHUNK_ALIGNMENT)
+			BUG("chunk offset %"PRIu64" is not properly aligned",
+			    chunk_offsets[i]);
+
+		hashwrite_be32(f, chunk_ids[i]);
+		hashwrite_be32(f, chunk_offsets[i] >> 32);
+		hashwrite_be32(f, chunk_offsets[i]);
+
+		written += MIDX_CHUNKLOOKUP_WIDTH;
+	}
+
+	for (i = 0; i < num_chunks; i++) {
+		if (written != chunk_offsets[i])
+			BUG("incorrect chunk offset (%"PRIu64" != %"PRIu64") for chunk id %"PRIx32,
+			    chunk_offsets[i],
+			    written,
+			    chunk_ids[i]);
+
+		switch (chunk_ids[i]) {
+		case MIDX_CHUNKID_PACKNAMES:
+			written += write_midx_pack_names(f, packs.names, packs.nr);
+			break;
+
+		case MIDX_CHUNKID_OIDFANOUT:
+			written += write_midx_oid_fanout(f, entries, nr_entries);
+			break;
+
+		case MIDX_CHUNKID_OIDLOOKUP:
+			written += write_midx_oid_lookup(f, MIDX_HASH_LEN, entries, nr_entries);
+			break;
+
+		case MIDX_CHUNKID_OBJECTOFFSETS:
+			written += write_midx_object_offsets(f, large_offsets_needed, entries, nr_entries);
+			break;
+
+		case MIDX_CHUNKID_LARGEOFFSETS:
+			written += write_midx_large_offsets(f, num_large_offsets, entries, nr_entries);
+			break;
+
+		default:
+			BUG("trying to write unknown chunk id %"PRIx32,
+			    chunk_ids[i]);
+		}
+	}
+
+	if (written != chunk_offsets[num_chunks])
+		BUG("incorrect final offset %"PRIu64" != %"PRIu64,
+		    written,
+		    chunk_offsets[num_chunks]);
+
+	hashclose(f, NULL, CSUM_HASH_IN_STREAM);
+	if (commit_lock_file(&lk))
+		die_errno(_("unable to write multi-pack-index"));
+
+	for (i = 0; i < packs.nr; i++) {
+		close_pack(packs.list[i]);
+		free(packs.list[i]);
+		free(packs.names[i]);
+	}
+
+	free(packs.list);
+	free(packs.names);
+	free(entries);
+	return 0;
+}
+
+void clear_midx_file(const char *object_dir)
+{
+	struct multi_pack_index **mp = &the_repository->objects->multi_pack_index;
+	char *midx = get_midx_filename(object_dir);
+
+	while (*mp) {
+		struct multi_pack_index *m = *mp;
+		uint32_t i;
+
+		if (strcmp(m->object_dir, object_dir)) {
+			mp = &m->next;
+			continue;
+		}
+		for (i = 0; i < m->num_packs; i++)
+			if (m->packs[i])
+				m->packs[i]->multi_pack_index = 0;
+		*mp = m->next;
+		close_midx(m);
+	}
+
+	if (remove_path(midx))
+		die(_("failed to clear multi-pack-index at %s"), midx);
+
+	free(midx);
+}
+
+static int verify_midx_error;
+
+static void midx_report(const char *fmt, ...)
+{
+	va_list ap;
+	verify_midx_error = 1;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+}
+
+int verify_midx_file(const char *object_dir)
+{
+	uint32_t i;
+	struct multi_pack_index *m = load_multi_pack_index(object_dir, 1);
+	struct strbuf pack_name = STRBUF_INIT;
+	struct object_id checksum;
+	struct hashfile *f;
+	int devnull;
+
+	verify_midx_error = 0;
+
+	if (!m) {
+		char *midx_name = get_midx_filename(object_dir);
+		int exists = file_exists(midx_name);
+
+		free(midx_name);
+		return exists;
+	}
+
+	devnull = open("/dev/null", O_WRONLY);
+	f = hashfd(devnull, NULL);
+	hashwrite(f, m->data, m->data_len - m->hash_len);
+	hashclose(f, checksum.hash, CSUM_CLOSE);
+	if (hashcmp(checksum.hash, m->data + m->data_len - m->hash_len))
+		midx_report(_("incorrect checksum"));
+
+	for (i = 0; i < m->num_packs; i++) {
+		strbuf_reset(&pack_name);
+		strbuf_addf(&pack_name, "%s/pack/%s",
+			    m->object_dir, m->pack_names[i]);
+		m->packs[i] = add_packed_git(pack_name.buf, pack_name.len, 1);
+		if (!m->packs[i] || open_pack_index(m->packs[i]))
+			midx_report(_("failed to load pack in position %d"), i);
+	}
+	strbuf_release(&pack_name);
+
+	for (i = 0; i < 255; i++) {
+		uint32_t oid_fanout1 = ntohl(m->chunk_oid_fanout[i]);
+		uint32_t oid_fanout2 = ntohl(m->chunk_oid_fanout[i + 1]);
+
+		if (oid_fanout1 > oid_fanout2)
+			midx_report(_("oid fanout out of order: fanout[%d] = %"PRIx32" > %"PRIx32" = fanout[%d]"),
+				    i, oid_fanout1, oid_fanout2, i + 1);
+	}
+
+	for (i = 0; i < m->num_objects - 1 && m->num_objects; i++) {
+		struct object_id oid1, oid2;
+
+		nth_midxed_object_oid(&oid1, m, i);
+		nth_midxed_object_oid(&oid2, m, i + 1);
+
+		if (oidcmp(&oid1, &oid2) >= 0)
+			midx_report(_("oid lookup out of order: oid[%d] = %s >= %s = oid[%d]"),
+				    i, oid_to_hex(&oid1), oid_to_hex(&oid2), i + 1);
+	}
+
+	for (i = 0; i < m->num_objects; i++) {
+		struct object_id oid;
+		uint32_t pack_int_id = nth_midxed_pack_int_id(m, i);
+		struct packed_git *p;
+		off_t m_offset, p_offset;
+
+		nth_midxed_object_oid(&oid, m, i);
+
+		if (pack_int_id >= m->num_packs || !m->packs[pack_int_id] ||
+		    !m->packs[pack_int_id]->index_data) {
+			midx_report(_("failed to load pack entry for oid[%d] = %s"),
+				    i, oid_to_hex(&oid));
+			continue;
+		}
+		p = m->packs[pack_int_id];
+
+		m_offset = nth_midxed_offset(m, i);
+		p_offset = find_pack_entry_one(oid.hash, p);
+
+		if (m_offset != p_offset)
+			midx_report(_("incorrect object offset for oid[%d] = %s: %"PRIx64" != %"PRIx64),
+				    i, oid_to_hex(&oid), m_offset, p_offset);
+	}
+
+	for (i = 0; i < m->num_packs; i++) {
+		if (!m->packs[i])
+			continue;
+		close_pack(m->packs[i]);
+		free(m->packs[i]);
+	}
+	close_midx(m);
+
+	return verify_midx_error;
+}
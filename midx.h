@@ -0,0 +1,81 @@
+#ifndef MIDX_H
+#define MIDX_H
+
+#include "repository.h"
+
+struct pack_entry;
+
+struct multi_pack_index {
+	struct multi_pack_index *next;
+
+	int fd;
+
+	const unsigned char *data;
+	size_t data_len;
+
+	uint32_t signature;
+	unsigned char version;
+	unsigned char hash_len;
+	unsigned char num_chunks;
+	uint32_t num_packs;
+	uint32_t num_objects;
+
+	int local;
+
+	const unsigned char *chunk_pack_names;
+	const uint32_t *chunk_oid_fanout;
+	const unsigned char *chunk_oid_lookup;
+	const unsigned char *chunk_object_offsets;
+	const unsigned char *chunk_large_offsets;
+
+	const char **pack_names;
+	/*
+	 * The packed_git of each pack named in the index, once it has
+	 * been found in the repository's pack list (NULL otherwise).
+	 */
+	struct packed_git **packs;
+	char object_dir[FLEX_ARRAY];
+};
+
+char *get_midx_filename(const char *object_dir);
+
+struct multi_pack_index *load_multi_pack_index(const char *object_dir, int local);
+
+/*
+ * Load the multi-pack-index of 'object_dir' (if there is one and
+ * 'core.multiPackIndex' is enabled) and add it to the object store.
+ * Returns 1 if a multi-pack-index was loaded.
+ */
+int prepare_multi_pack_index_one(struct repository *r, const char *object_dir, int local);
+
+/*
+ * Associate the packs of the repository's pack list with the
+ * multi-pack-indexes that cover them, marking them with
+ * 'multi_pack_index' so that per-pack lookups can skip them.
+ */
+void link_multi_pack_index_packs(struct repository *r);
+
+int bsearch_midx(const struct object_id *oid, struct multi_pack_index *m, uint32_t *result);
+struct object_id *nth_midxed_object_oid(struct object_id *oid,
+					struct multi_pack_index *m,
+					uint32_t n);
+off_t nth_midxed_offset(struct multi_pack_index *m, uint32_t pos);
+uint32_t nth_midxed_pack_int_id(struct multi_pack_index *m, uint32_t pos);
+
+/*
+ * Look up 'oid' in the multi-pack-index and, if it is found in a pack
+ * that is still usable, fill 'e' with its location. Returns 1 on
+ * success, 0 if the object is not indexed, and -1 if it is indexed
+ * but its pack cannot be used (the caller should fall back to
+ * searching all packs).
+ */
+int fill_midx_entry(const struct object_id *oid, struct pack_entry *e, struct multi_pack_index *m);
+int midx_contains_pack(struct multi_pack_index *m, const char *idx_name);
+
+int write_midx_file(const char *object_dir);
+int verify_midx_file(const char *object_dir);
+void clear_midx_file(const char *object_dir);
+
+void close_midx(struct multi_pack_index *m);
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef OBJECT_STORE_H
 #define OBJECT_STORE_H
 
+#include "thread-utils.h"
+
 struct alternate_object_database {
 	struct alternate_object_database *next;
 
@@ -73,7 +75,8 @@ struct packed_git {
 		 pack_keep:1,
 		 freshened:1,
 		 do_not_close:1,
-		 pack_promisor:1;
+		 pack_promisor:1,
+		 multi_pack_index:1;
 	unsigned char sha1[20];
 	struct revindex_entry *revindex;
 	/* something like ".git/objects/pack/xxxxx.pack" */
@@ -93,6 +96,13 @@ struct raw_object_store {
 	struct alternate_object_database *alt_odb_list;
 	struct alternate_object_database **alt_odb_tail;
 
+	/*
+	 * The commit-graph file of this object store (or its first
+	 * alternate that has one), see commit-graph.h.
+	 */
+	struct commit_graph *commit_graph;
+	unsigned commit_graph_attempted : 1; /* if loading has been attempted */
+
 	/*
 	 * private data
 	 *
@@ -100,6 +110,14 @@ struct raw_object_store {
 	 */
 
 	struct packed_git *packed_git;
+
+	/*
+	 * The multi-pack-indexes of this object store and its alternates,
+	 * see midx.h. Packs they cover stay in packed_git, marked with
+	 * 'multi_pack_index'.
+	 */
+	struct multi_pack_index *multi_pack_index;
+
 	/* A most-recently-used ordered version of the packed_git list. */
 	struct list_head packed_git_mru;
 
@@ -129,4 +147,39 @@ void sha1_file_name(struct repository *r, struct strbuf *buf, const unsigned cha
 
 void *map_sha1_file(struct repository *r, const unsigned char *sha1, unsigned long *size);
 
+/*
+ * Enabling the object read lock allows several threads to call
+ * read_object_file(), oid_object_info_extended() and the functions
+ * built on them concurrently. The pack windows, the delta base cache
+ * and the other state behind these functions are protected by
+ * obj_read_mutex, which is let go while objects are inflated and
+ * deltas are applied, so that the expensive parts of reading objects
+ * run in parallel.
+ *
+ * Code that modifies the object store (e.g. adds an alternate) while
+ * other threads may be reading objects must hold the lock itself.
+ */
+extern int obj_read_use_lock;
+extern void enable_obj_read_lock(void);
+extern void disable_obj_read_lock(void);
+
+#ifndef NO_PTHREADS
+extern pthread_mutex_t obj_read_mutex;
+
+static inline void obj_read_lock(void)
+{
+	if (obj_read_use_lock)
+		pthread_mutex_lock(&obj_read_mutex);
+}
+
+static inline void obj_read_unlock(void)
+{
+	if (obj_read_use_lock)
+		pthread_mutex_unlock(&obj_read_mutex);
+}
+#else
+#define obj_read_lock()
+#define obj_read_unlock()
+#endif
+
 #endif /* OBJECT_STORE_H */
@@ -6,6 +6,8 @@
 #include "tag.h"
 #include "object-store.h"
 #include "packfile.h"
+#include "commit-graph.h"
+#include "midx.h"
 
 static struct object **obj_hash;
 static int nr_objs, obj_hash_size;
@@ -483,6 +485,14 @@ void raw_object_store_clear(struct raw_object_store *o)
 	free_alt_odbs(o);
 	o->alt_odb_tail = NULL;
 
+	close_commit_graph(o);
+
+	while (o->multi_pack_index) {
+		struct multi_pack_index *m = o->multi_pack_index;
+		o->multi_pack_index = m->next;
+		close_midx(m);
+	}
+
 	INIT_LIST_HEAD(&o->packed_git_mru);
 	close_all_packs(o);
 	o->packed_git = NULL;
@@ -12,6 +12,7 @@
 #include "packfile.h"
 #include "repository.h"
 #include "object-store.h"
+#include "refs.h"
 
 /*
  * An entry on the bitmap index, representing the bitmap for a given
@@ -36,13 +37,6 @@ static struct bitmap_index {
 	/* Packfile to which this bitmap index belongs to */
 	struct packed_git *pack;
 
-	/*
-	 * Mark the first `reuse_objects` in the packfile as reused:
-	 * they will be sent as-is without using them for repacking
-	 * calculations
-	 */
-	uint32_t reuse_objects;
-
 	/* mmapped buffer of the whole bitmap index */
 	unsigned char *map;
 	size_t map_size; /* size of the mmaped buffer */
@@ -604,9 +598,6 @@ static void show_objects_for_type(
 	struct ewah_iterator it;
 	eword_t filter;
 
-	if (bitmap_git.reuse_objects == bitmap_git.pack->num_objects)
-		return;
-
 	ewah_iterator_init(&it, type_filter);
 
 	while (i < objects->word_alloc && ewah_iterator_next(&filter, &it)) {
@@ -622,9 +613,6 @@ static void show_objects_for_type(
 
 			offset += ewah_bit_ctz64(word >> offset);
 
-			if (pos + offset < bitmap_git.reuse_objects)
-				continue;
-
 			entry = &bitmap_git.pack->revindex[pos + offset];
 			nth_packed_object_oid(&oid, bitmap_git.pack, entry->nr);
 
@@ -740,67 +728,122 @@ int prepare_bitmap_walk(struct rev_info *revs)
 	return 0;
 }
 
+/*
+ * Mark the object at bit position `pos` in `reuse` if it can be sent
+ * verbatim from the bitmapped pack, i.e. if it is not a delta, or if
+ * its base comes earlier in the pack and is itself reused (so that
+ * pack-objects only has to adjust the base offset of an OFS_DELTA).
+ */
+static void try_partial_reuse(size_t pos, struct bitmap *reuse,
+			      struct pack_window **w_curs)
+{
+	struct revindex_entry *revidx;
+	off_t offset;
+	enum object_type type;
+	unsigned long size;
+
+	if (pos >= bitmap_git.pack->num_objects)
+		return; /* not actually in the pack */
+
+	revidx = &bitmap_git.pack->revindex[pos];
+	offset = revidx->offset;
+	type = unpack_object_header(bitmap_git.pack, w_curs, &offset, &size);
+	if (type < 0)
+		return; /* broken packfile, let the slow path complain */
+
+	if (type == OBJ_REF_DELTA || type == OBJ_OFS_DELTA) {
+		off_t base_offset;
+		int base_pos;
+
+		base_offset = get_delta_base(bitmap_git.pack, w_curs,
+					     &offset, type, revidx->offset);
+		if (!base_offset)
+			return;
+		base_pos = find_revindex_position(bitmap_git.pack, base_offset);
+		if (base_pos < 0)
+			return;
+
+		/*
+		 * We only look at each object once, in pack order, so the
+		 * base must come before the delta (which is always true
+		 * for OFS_DELTA, and for the REF_DELTAs we would find in a
+		 * pack we wrote ourselves). And if the base is not reused,
+		 * it would have to be sent after us and the delta converted
+		 * on the fly; leave that to the normal code path.
+		 */
+		if (base_pos >= pos || !bitmap_get(reuse, base_pos))
+			return;
+	}
+
+	bitmap_set(reuse, pos);
+}
+
 int reuse_partial_packfile_from_bitmap(struct packed_git **packfile,
 				       uint32_t *entries,
-				       off_t *up_to)
+				       struct bitmap **reuse_out)
 {
-	/*
-	 * Reuse the packfile content if we need more than
-	 * 90% of its objects
-	 */
-	static const double REUSE_PERCENT = 0.9;
-
 	struct bitmap *result = bitmap_git.result;
-	uint32_t reuse_threshold;
-	uint32_t i, reuse_objects = 0;
+	struct bitmap *reuse;
+	struct pack_window *w_curs = NULL;
+	size_t i = 0;
+	uint32_t offset;
 
 	assert(result);
 
-	for (i = 0; i < result->word_alloc; ++i) {
-		if (result->words[i] != (eword_t)~0) {
-			reuse_objects += ewah_bit_ctz64(~result->words[i]);
-			break;
-		}
+	/*
+	 * Whole words of wanted objects at the start of the pack are
+	 * reused without looking at them: all their delta bases come
+	 * before them, and are reused as well.
+	 */
+	while (i < result->word_alloc && result->words[i] == (eword_t)~0)
+		i++;
+	if (i > bitmap_git.pack->num_objects / BITS_IN_EWORD)
+		i = bitmap_git.pack->num_objects / BITS_IN_EWORD;
 
-		reuse_objects += BITS_IN_EWORD;
-	}
+	reuse = bitmap_word_alloc(i);
+	memset(reuse->words, 0xFF, i * sizeof(eword_t));
 
-#ifdef GIT_BITMAP_DEBUG
-	{
-		const unsigned char *sha1;
-		struct revindex_entry *entry;
-
-		entry = &bitmap_git.reverse_index->revindex[reuse_objects];
-		sha1 = nth_packed_object_sha1(bitmap_git.pack, entry->nr);
+	for (; i < result->word_alloc; ++i) {
+		eword_t word = result->words[i];
+		size_t pos = (i * BITS_IN_EWORD);
 
-		fprintf(stderr, "Failed to reuse at %d (%016llx)\n",
-			reuse_objects, result->words[i]);
-		fprintf(stderr, " %s\n", sha1_to_hex(sha1));
-	}
-#endif
-
-	if (!reuse_objects)
-		return -1;
+		for (offset = 0; offset < BITS_IN_EWORD; ++offset) {
+			if ((word >> offset) == 0)
+				break;
 
-	if (reuse_objects >= bitmap_git.pack->num_objects) {
-		bitmap_git.reuse_objects = *entries = bitmap_git.pack->num_objects;
-		*up_to = -1; /* reuse the full pack */
-		*packfile = bitmap_git.pack;
-		return 0;
+			offset += ewah_bit_ctz64(word >> offset);
+			try_partial_reuse(pos + offset, reuse, &w_curs);
+		}
 	}
 
-	reuse_threshold = bitmap_popcount(bitmap_git.result) * REUSE_PERCENT;
+	unuse_pack(&w_curs);
 
-	if (reuse_objects < reuse_threshold)
+	*entries = bitmap_popcount(reuse);
+	if (!*entries) {
+		bitmap_free(reuse);
 		return -1;
+	}
 
-	bitmap_git.reuse_objects = *entries = reuse_objects;
-	*up_to = bitmap_git.pack->revindex[reuse_objects].offset;
+	/*
+	 * The reused objects are sent as-is, and must not be yielded by
+	 * traverse_bitmap_commit_list() as well.
+	 */
+	bitmap_and_not(result, reuse);
 	*packfile = bitmap_git.pack;
-
+	*reuse_out = reuse;
 	return 0;
 }
 
+int bitmap_walk_contains(struct bitmap *bitmap, const struct object_id *oid)
+{
+	int pos;
+
+	if (!bitmap)
+		return 0;
+	pos = bitmap_position(oid->hash);
+	return pos >= 0 && bitmap_get(bitmap, pos);
+}
+
 void traverse_bitmap_commit_list(show_reachable_fn show_reachable)
 {
 	assert(bitmap_git.result);
@@ -882,6 +925,215 @@ void count_bitmap_commit_list(uint32_t *commits, uint32_t *trees,
 		*tags = count_object_type(bitmap_git.result, OBJ_TAG);
 }
 
+/*
+ * Open and load the bitmap index, unless prepare_bitmap_walk() already
+ * opened it without loading it.
+ */
+static int load_bitmap_index(void)
+{
+	if (bitmap_git.loaded)
+		return 0;
+	if (!bitmap_git.map && open_pack_bitmap() < 0)
+		return -1;
+	return load_pack_bitmap();
+}
+
+/*
+ * Return the set of commits reachable from `roots`, stopping the walk
+ * at the commits in `seen` (which may be NULL). Only commits are marked
+ * for the objects the walk has to visit, so the result is only good for
+ * counting commits.
+ */
+static struct bitmap *find_reachable_commits(struct object_list *roots,
+					     struct bitmap *seen,
+					     int ignore_missing_links)
+{
+	struct rev_info revs;
+	struct bitmap *result;
+
+	init_revisions(&revs, NULL);
+	revs.ignore_missing_links = ignore_missing_links;
+	result = find_objects(&revs, roots, seen);
+	reset_revision_walk();
+	return result;
+}
+
+/* Count the commits in `objects` that are not in `exclude` (may be NULL). */
+static uint32_t count_commits_not_in(struct bitmap *objects,
+				     struct bitmap *exclude)
+{
+	struct eindex *eindex = &bitmap_git.ext_index;
+	uint32_t i = 0, count = 0;
+	struct ewah_iterator it;
+	eword_t filter;
+
+	ewah_iterator_init(&it, bitmap_git.commits);
+	while (i < objects->word_alloc && ewah_iterator_next(&filter, &it)) {
+		eword_t word = objects->words[i] & filter;
+
+		if (exclude && i < exclude->word_alloc)
+			word &= ~exclude->words[i];
+		count += ewah_bit_popcount64(word);
+		i++;
+	}
+
+	for (i = 0; i < eindex->count; ++i) {
+		uint32_t pos = bitmap_git.pack->num_objects + i;
+
+		if (eindex->objects[i]->type == OBJ_COMMIT &&
+		    bitmap_get(objects, pos) &&
+		    !(exclude && bitmap_get(exclude, pos)))
+			count++;
+	}
+
+	return count;
+}
+
+static void free_object_list(struct object_list *list)
+{
+	while (list) {
+		struct object_list *next = list->next;
+		free(list);
+		list = next;
+	}
+}
+
+int count_bitmap_left_right(struct rev_info *revs,
+			    uint32_t *left, uint32_t *right)
+{
+	struct object_list *haves = NULL, *lefts = NULL, *rights = NULL;
+	struct bitmap *haves_bitmap = NULL;
+	struct bitmap *left_bitmap = NULL, *right_bitmap = NULL;
+	unsigned int i;
+	int ret = -1;
+
+	for (i = 0; i < revs->pending.nr; i++) {
+		struct object *object = revs->pending.objects[i].item;
+		unsigned int flags = object->flags;
+		struct object_list **list;
+
+		object = deref_tag(object, NULL, 0);
+		if (!object)
+			die("bad tag");
+		if (object->type == OBJ_NONE)
+			object = parse_object_or_die(&object->oid, NULL);
+		if (object->type != OBJ_COMMIT)
+			goto out;
+
+		if (flags & UNINTERESTING)
+			list = &haves;
+		else if (flags & SYMMETRIC_LEFT)
+			list = &lefts;
+		else
+			list = &rights;
+		object_list_insert(object, list);
+	}
+
+	if (load_bitmap_index() < 0)
+		goto out;
+	if (haves && !in_bitmapped_pack(haves))
+		goto out;
+
+	object_array_clear(&revs->pending);
+
+	if (haves)
+		haves_bitmap = find_reachable_commits(haves, NULL, 1);
+	left_bitmap = lefts ? find_reachable_commits(lefts, haves_bitmap, 0)
+			    : bitmap_new();
+	right_bitmap = rights ? find_reachable_commits(rights, haves_bitmap, 0)
+			      : bitmap_new();
+	if (haves_bitmap) {
+		bitmap_and_not(left_bitmap, haves_bitmap);
+		bitmap_and_not(right_bitmap, haves_bitmap);
+	}
+
+	*left = count_commits_not_in(left_bitmap, right_bitmap);
+	*right = count_commits_not_in(right_bitmap, left_bitmap);
+	ret = 0;
+
+out:
+	bitmap_free(haves_bitmap);
+	bitmap_free(left_bitmap);
+	bitmap_free(right_bitmap);
+	free_object_list(haves);
+	free_object_list(lefts);
+	free_object_list(rights);
+	return ret;
+}
+
+static int count_graft(const struct commit_graft *graft, void *cb_data)
+{
+	(*(int *)cb_data)++;
+	return 0;
+}
+
+static int count_replace_ref(const char *refname,
+			     const struct object_id *oid,
+			     int flags, void *cb_data)
+{
+	(*(int *)cb_data)++;
+	return 0;
+}
+
+/*
+ * Bitmaps record the history as it is in the packfile; grafts,
+ * replace refs and shallow boundaries change what a walk would see.
+ */
+static int bitmap_history_matches_walk(void)
+{
+	int nr = 0;
+
+	if (is_repository_shallow())
+		return 0;
+	lookup_commit_graft(&null_oid);
+	for_each_commit_graft(count_graft, &nr);
+	if (check_replace_refs)
+		for_each_replace_ref(count_replace_ref, &nr);
+	return !nr;
+}
+
+/*
+ * The commits reachable from the last `theirs` of bitmap_ahead_behind().
+ * Callers typically compare many branches against a single base, or
+ * each branch against its own upstream, so remembering one is enough.
+ */
+static struct {
+	struct commit *commit;
+	struct bitmap *reachable;
+} ahead_behind_base;
+
+int bitmap_ahead_behind(struct commit *ours, struct commit *theirs,
+			int *num_ours, int *num_theirs)
+{
+	static int usable = -1;
+	struct object_list *roots = NULL;
+	struct bitmap *reachable;
+
+	if (usable < 0)
+		usable = bitmap_history_matches_walk() && !load_bitmap_index();
+	if (!usable)
+		return -1;
+
+	if (ahead_behind_base.commit != theirs) {
+		bitmap_free(ahead_behind_base.reachable);
+		object_list_insert(&theirs->object, &roots);
+		ahead_behind_base.reachable = find_reachable_commits(roots, NULL, 0);
+		ahead_behind_base.commit = theirs;
+		free_object_list(roots);
+		roots = NULL;
+	}
+
+	object_list_insert(&ours->object, &roots);
+	reachable = find_reachable_commits(roots, NULL, 0);
+	free_object_list(roots);
+
+	*num_ours = count_commits_not_in(reachable, ahead_behind_base.reachable);
+	*num_theirs = count_commits_not_in(ahead_behind_base.reachable, reachable);
+
+	bitmap_free(reachable);
+	return 0;
+}
+
 struct bitmap_test_data {
 	struct bitmap *base;
 	struct progress *prg;
@@ -39,7 +39,39 @@ void count_bitmap_commit_list(uint32_t *commits, uint32_t *trees, uint32_t *blob
 void traverse_bitmap_commit_list(show_reachable_fn show_reachable);
 void test_bitmap_walk(struct rev_info *revs);
 int prepare_bitmap_walk(struct rev_info *revs);
-int reuse_partial_packfile_from_bitmap(struct packed_git **packfile, uint32_t *entries, off_t *up_to);
+
+/*
+ * Count the commits of "rev-list --left-right --count" using the bitmap
+ * index: those reachable only from the left side of a symmetric
+ * difference in `revs`, and those reachable only from the right side.
+ * Return -1 if the bitmap index cannot be used; the pending objects of
+ * `revs` are untouched then.
+ */
+int count_bitmap_left_right(struct rev_info *revs, uint32_t *left, uint32_t *right);
+
+/*
+ * Count the commits reachable from `ours` but not from `theirs`, and
+ * vice versa, using the bitmap index. Return -1 if there is no usable
+ * bitmap index, e.g. because grafts or replace refs are in effect.
+ */
+int bitmap_ahead_behind(struct commit *ours, struct commit *theirs,
+			int *num_ours, int *num_theirs);
+
+/*
+ * After prepare_bitmap_walk(), find the objects of the result that can be
+ * copied verbatim from the bitmapped pack: `*reuse` gets a bitmap of their
+ * positions (in pack order), `*entries` their number, and `*packfile` the
+ * pack. They are removed from the result of the walk. Returns -1 if there
+ * is nothing to reuse.
+ */
+int reuse_partial_packfile_from_bitmap(struct packed_git **packfile,
+				       uint32_t *entries,
+				       struct bitmap **reuse);
+/*
+ * Tell whether `oid` has its bit set in `bitmap`, which is indexed like
+ * the result of the current bitmap walk.
+ */
+int bitmap_walk_contains(struct bitmap *bitmap, const struct object_id *oid);
 int rebuild_existing_bitmaps(struct packing_data *mapping, khash_sha1 *reused_bitmaps, int show_progress);
 
 void bitmap_writer_show_progress(int show);
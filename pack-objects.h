@@ -27,6 +27,8 @@ struct object_entry {
 	unsigned no_try_delta:1;
 	unsigned tagged:1; /* near the very tip of refs */
 	unsigned filled:1; /* assigned write-order */
+	unsigned char layer; /* write-order layer, see compute_pack_layers() */
+	unsigned int tree_depth; /* maximum depth of a tree, for delta islands */
 
 	/*
 	 * State flags for depth-first search used for analyzing delta cycles.
@@ -15,6 +15,7 @@
 #include "tree-walk.h"
 #include "tree.h"
 #include "object-store.h"
+#include "midx.h"
 
 char *odb_pack_name(struct strbuf *buf,
 		    const unsigned char *sha1,
@@ -304,7 +305,7 @@ void close_pack_index(struct packed_git *p)
 	}
 }
 
-static void close_pack(struct packed_git *p)
+void close_pack(struct packed_git *p)
 {
 	close_pack_windows(p);
 	close_pack_fd(p);
@@ -625,7 +626,9 @@ void unuse_pack(struct pack_window **w_cursor)
 
 static void try_to_free_pack_memory(size_t size)
 {
+	obj_read_lock();
 	release_pack_memory(size);
+	obj_read_unlock();
 }
 
 struct packed_git *add_packed_git(const char *path, size_t path_len, int local)
@@ -753,6 +756,7 @@ static void prepare_packed_git_one(struct repository *r, char *objdir, int local
 		strbuf_release(&path);
 		return;
 	}
+	prepare_multi_pack_index_one(r, objdir, local);
 	strbuf_addch(&path, '/');
 	dirnamelen = path.len;
 	while ((de = readdir(dir)) != NULL) {
@@ -788,6 +792,9 @@ static void prepare_packed_git_one(struct repository *r, char *objdir, int local
 		if (!report_garbage)
 			continue;
 
+		if (!strcmp(de->d_name, "multi-pack-index"))
+			continue;
+
 		if (ends_with(de->d_name, ".idx") ||
 		    ends_with(de->d_name, ".pack") ||
 		    ends_with(de->d_name, ".bitmap") ||
@@ -815,11 +822,16 @@ unsigned long approximate_object_count(void)
 {
 	if (!the_repository->objects->approximate_object_count_valid) {
 		unsigned long count;
+		struct multi_pack_index *m;
 		struct packed_git *p;
 
 		prepare_packed_git(the_repository);
 		count = 0;
+		for (m = the_repository->objects->multi_pack_index; m; m = m->next)
+			count += m->num_objects;
 		for (p = the_repository->objects->packed_git; p; p = p->next) {
+			if (p->multi_pack_index)
+				continue;
 			if (open_pack_index(p))
 				continue;
 			count += p->num_objects;
@@ -894,6 +906,7 @@ static void prepare_packed_git(struct repository *r)
 	prepare_alt_odb(r);
 	for (alt = r->objects->alt_odb_list; alt; alt = alt->next)
 		prepare_packed_git_one(r, alt->path, 0);
+	link_multi_pack_index_packs(r);
 	rearrange_packed_git(r);
 	prepare_packed_git_mru(r);
 	r->objects->packed_git_initialized = 1;
@@ -918,6 +931,12 @@ struct list_head *get_packed_git_mru(struct repository *r)
 	return &r->objects->packed_git_mru;
 }
 
+struct multi_pack_index *get_multi_pack_index(struct repository *r)
+{
+	prepare_packed_git(r);
+	return r->objects->multi_pack_index;
+}
+
 unsigned long unpack_object_header_buffer(const unsigned char *buf,
 		unsigned long len, enum object_type *type, unsigned long *sizep)
 {
@@ -1033,7 +1052,7 @@ const struct packed_git *has_packed_and_bad(const unsigned char *sha1)
 	return NULL;
 }
 
-static off_t get_delta_base(struct packed_git *p,
+off_t get_delta_base(struct packed_git *p,
 				    struct pack_window **w_curs,
 				    off_t *curpos,
 				    enum object_type type,
@@ -1303,9 +1322,19 @@ void clear_delta_base_cache(void)
 static void add_delta_base_cache(struct packed_git *p, off_t base_offset,
 	void *base, unsigned long base_size, enum object_type type)
 {
-	struct delta_base_cache_entry *ent = xmalloc(sizeof(*ent));
+	struct delta_base_cache_entry *ent;
 	struct list_head *lru, *tmp;
 
+	/*
+	 * Another thread may have unpacked the same base while we did
+	 * not hold the object read lock.
+	 */
+	if (in_delta_base_cache(p, base_offset)) {
+		free(base);
+		return;
+	}
+
+	ent = xmalloc(sizeof(*ent));
 	delta_base_cached += base_size;
 
 	list_for_each_safe(lru, tmp, &delta_base_cache_lru) {
@@ -1435,7 +1464,13 @@ static void *unpack_compressed_entry(struct packed_git *p,
 	do {
 		in = use_pack(p, w_curs, curpos, &stream.avail_in);
 		stream.next_in = in;
+		/*
+		 * The window stays mapped while w_curs holds it, so other
+		 * threads can use the object store while we inflate.
+		 */
+		obj_read_unlock();
 		st = git_inflate(&stream, Z_FINISH);
+		obj_read_lock();
 		if (!stream.avail_out)
 			break; /* the payload is larger than it should be */
 		curpos += stream.next_in - in;
@@ -1586,13 +1621,11 @@ void *unpack_entry(struct packed_git *p, off_t obj_offset,
 		void *base = data;
 		void *external_base = NULL;
 		unsigned long delta_size, base_size = size;
+		off_t base_offset = obj_offset;
 		int i;
 
 		data = NULL;
 
-		if (base)
-			add_delta_base_cache(p, obj_offset, base, base_size, type);
-
 		if (!base) {
 			/*
 			 * We're probably in deep shit, but let's try to fetch
@@ -1630,13 +1663,24 @@ void *unpack_entry(struct packed_git *p, off_t obj_offset,
 			      "at offset %"PRIuMAX" from %s",
 			      (uintmax_t)curpos, p->pack_name);
 			data = NULL;
-			free(external_base);
+			if (external_base)
+				free(external_base);
+			else
+				add_delta_base_cache(p, base_offset, base,
+						     base_size, type);
 			continue;
 		}
 
+		/*
+		 * Nobody else can see the base before it goes into the
+		 * delta base cache below, so we need not hold the object
+		 * read lock while applying the delta to it.
+		 */
+		obj_read_unlock();
 		data = patch_delta(base, base_size,
 				   delta_data, delta_size,
 				   &size);
+		obj_read_lock();
 
 		/*
 		 * We could not apply the delta; warn the user, but keep going.
@@ -1650,7 +1694,11 @@ void *unpack_entry(struct packed_git *p, off_t obj_offset,
 			error("failed to apply delta");
 
 		free(delta_data);
-		free(external_base);
+		if (external_base)
+			free(external_base);
+		else
+			add_delta_base_cache(p, base_offset, base, base_size,
+					     type);
 	}
 
 	if (final_type)
@@ -1840,13 +1888,31 @@ static int fill_pack_entry(const unsigned char *sha1,
 int find_pack_entry(struct repository *r, const unsigned char *sha1, struct pack_entry *e)
 {
 	struct list_head *pos;
+	struct multi_pack_index *m;
+	struct object_id oid;
+	int midx_incomplete = 0;
 
 	prepare_packed_git(r);
 	if (!r->objects->packed_git)
 		return 0;
 
+	hashcpy(oid.hash, sha1);
+	for (m = r->objects->multi_pack_index; m; m = m->next) {
+		int ret = fill_midx_entry(&oid, e, m);
+		if (ret > 0)
+			return 1;
+		if (ret < 0)
+			midx_incomplete = 1;
+	}
+
 	list_for_each(pos, &r->objects->packed_git_mru) {
 		struct packed_git *p = list_entry(pos, struct packed_git, mru);
+		/*
+		 * Packs covered by a multi-pack-index were searched above,
+		 * unless the index pointed us at a pack we cannot use.
+		 */
+		if (p->multi_pack_index && !midx_incomplete)
+			continue;
 		if (fill_pack_entry(sha1, e, p)) {
 			list_move(&p->mru, &r->objects->packed_git_mru);
 			return 1;
@@ -1869,7 +1935,7 @@ int has_pack_index(const unsigned char *sha1)
 	return 1;
 }
 
-static int for_each_object_in_pack(struct packed_git *p, each_packed_object_fn cb, void *data)
+int for_each_object_in_pack(struct packed_git *p, each_packed_object_fn cb, void *data)
 {
 	uint32_t i;
 	int r = 0;
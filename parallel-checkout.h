@@ -0,0 +1,116 @@
+#ifndef PARALLEL_CHECKOUT_H
+#define PARALLEL_CHECKOUT_H
+
+#include "convert.h"
+
+struct cache_entry;
+struct checkout;
+
+/****************************************************************
+ * Users of parallel checkout
+ ****************************************************************/
+
+enum pc_status {
+	PC_UNINITIALIZED = 0,
+	PC_ACCEPTING_ENTRIES,
+	PC_RUNNING,
+};
+
+enum pc_status parallel_checkout_status(void);
+
+/*
+ * Read "checkout.workers" and "checkout.thresholdForParallelism".
+ * A value of zero or less for the former means "use as many workers
+ * as there are online CPUs".
+ */
+void get_parallel_checkout_configs(int *num_workers, int *threshold);
+
+/*
+ * Put parallel checkout into the PC_ACCEPTING_ENTRIES state. This should
+ * only be called if parallel checkout is currently uninitialized.
+ */
+void init_parallel_checkout(void);
+
+/*
+ * Return -1 if parallel checkout is currently not accepting entries or if
+ * the entry is not eligible for parallel checkout. Otherwise, enqueue the
+ * entry for a later write and return 0.
+ *
+ * The caller must already have removed whatever was in the way of the
+ * entry and created its leading directories, as checkout_entry() does.
+ */
+int enqueue_checkout(struct cache_entry *ce);
+
+/*
+ * Write all the queued entries, returning 0 on success. If the number of
+ * entries is smaller than 'threshold', or only one worker was asked for,
+ * the entries are written sequentially by the current process. Parallel
+ * checkout is uninitialized again when this returns.
+ */
+int run_parallel_checkout(struct checkout *state, int num_workers, int threshold);
+
+/****************************************************************
+ * Interface with checkout--worker
+ ****************************************************************/
+
+enum pc_item_status {
+	PC_ITEM_PENDING = 0,
+	PC_ITEM_WRITTEN,
+	/*
+	 * The entry could not be written because a file or directory was
+	 * already at its path, or because one of its leading directories
+	 * was replaced by a symlink. This happens when two paths collide,
+	 * e.g. on a case-insensitive filesystem; the main process retries
+	 * such entries sequentially.
+	 */
+	PC_ITEM_COLLIDED,
+	PC_ITEM_FAILED,
+};
+
+struct parallel_checkout_item {
+	/* pointer to a istate->cache[] entry. Not owned by us. */
+	struct cache_entry *ce;
+	struct conv_attrs ca;
+	size_t id; /* position in parallel_checkout.items[] of main process */
+
+	/* Output fields, sent from workers. */
+	enum pc_item_status status;
+	struct stat st;
+};
+
+/*
+ * The fixed-size portion of 'struct parallel_checkout_item' that is sent
+ * to the workers. It is followed by ce->name (without the trailing NUL).
+ * Main process and workers are the same executable, so the structure is
+ * sent as-is.
+ */
+struct pc_item_fixed_portion {
+	size_t id;
+	struct object_id oid;
+	unsigned int ce_mode;
+	enum crlf_action crlf_action;
+	int ident;
+	size_t name_len;
+};
+
+/*
+ * The fields of 'struct parallel_checkout_item' that are returned by the
+ * workers. 'st' must be the last field, as it is omitted unless the item
+ * was written.
+ */
+struct pc_item_result {
+	size_t id;
+	enum pc_item_status status;
+	struct stat st;
+};
+
+#define PC_ITEM_RESULT_BASE_SIZE offsetof(struct pc_item_result, st)
+
+/*
+ * Write the item to the working tree and fill its status (and, if the
+ * checkout refreshes the index, its stat data).
+ */
+void write_pc_item(struct parallel_checkout_item *pc_item,
+		   const struct checkout *state);
+
+#endif /* PARALLEL_CHECKOUT_H */
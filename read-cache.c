@@ -20,6 +20,8 @@
 #include "split-index.h"
 #include "utf8.h"
 #include "fsmonitor.h"
+#include "thread-utils.h"
+#include "sparse-index.h"
 
 /* Mask for the name length in ce_flags in the on-disk index */
 
@@ -40,6 +42,9 @@
 #define CACHE_EXT_LINK 0x6c696e6b	  /* "link" */
 #define CACHE_EXT_UNTRACKED 0x554E5452	  /* "UNTR" */
 #define CACHE_EXT_FSMONITOR 0x46534D4E	  /* "FSMN" */
+#define CACHE_EXT_ENDOFINDEXENTRIES 0x454F4945	/* "EOIE" */
+#define CACHE_EXT_INDEXENTRYOFFSETTABLE 0x49454F54 /* "IEOT" */
+#define CACHE_EXT_SPARSE_DIRECTORIES 0x73646972 /* "sdir" */
 
 /* changes that can be kept in $GIT_DIR/index (basically all extensions) */
 #define EXTMASK (RESOLVE_UNDO_CHANGED | CACHE_TREE_CHANGED | \
@@ -49,6 +54,39 @@
 struct index_state the_index;
 static const char *alternate_index_output;
 
+/*
+ * This is an estimate of the pathname length in the index.  We use
+ * this for V4 index files to guess the un-deltafied size of the index
+ * in memory because of pathname deltafication.  This is not required
+ * for V2/V3 index formats because their pathnames are not compressed.
+ * If the initial amount of memory set aside is not sufficient, the
+ * mem pool will allocate extra memory.
+ */
+#define CACHE_ENTRY_PATH_LENGTH 80
+
+static inline struct cache_entry *mem_pool__ce_alloc(struct mem_pool *mem_pool, size_t len)
+{
+	struct cache_entry *ce;
+	ce = mem_pool_alloc(mem_pool, cache_entry_size(len));
+	ce->mem_pool_allocated = 1;
+	return ce;
+}
+
+static inline struct cache_entry *mem_pool__ce_calloc(struct mem_pool *mem_pool, size_t len)
+{
+	struct cache_entry *ce;
+	ce = mem_pool_calloc(mem_pool, 1, cache_entry_size(len));
+	ce->mem_pool_allocated = 1;
+	return ce;
+}
+
+static struct mem_pool *find_mem_pool(struct index_state *istate)
+{
+	if (!istate->ce_mem_pool)
+		mem_pool_init(&istate->ce_mem_pool, 0);
+	return istate->ce_mem_pool;
+}
+
 static void set_index_entry(struct index_state *istate, int nr, struct cache_entry *ce)
 {
 	istate->cache[nr] = ce;
@@ -61,7 +99,7 @@ static void replace_index_entry(struct index_state *istate, int nr, struct cache
 
 	replace_index_entry_in_base(istate, old, ce);
 	remove_name_hash(istate, old);
-	free(old);
+	discard_cache_entry(old);
 	ce->ce_flags &= ~CE_HASHED;
 	set_index_entry(istate, nr, ce);
 	ce->ce_flags |= CE_UPDATE_IN_BASE;
@@ -74,7 +112,7 @@ void rename_index_entry_at(struct index_state *istate, int nr, const char *new_n
 	struct cache_entry *old_entry = istate->cache[nr], *new_entry;
 	int namelen = strlen(new_name);
 
-	new_entry = xmalloc(cache_entry_size(namelen));
+	new_entry = make_empty_cache_entry(istate, namelen);
 	copy_cache_entry(new_entry, old_entry);
 	new_entry->ce_flags &= ~CE_HASHED;
 	new_entry->ce_namelen = namelen;
@@ -623,7 +661,7 @@ static struct cache_entry *create_alias_ce(struct index_state *istate,
 
 	/* Ok, create the new entry using the name of the existing alias */
 	len = ce_namelen(alias);
-	new_entry = xcalloc(1, cache_entry_size(len));
+	new_entry = make_empty_cache_entry(istate, len);
 	memcpy(new_entry->name, alias->name, len);
 	copy_cache_entry(new_entry, ce);
 	save_or_free_index_entry(istate, ce);
@@ -640,7 +678,7 @@ void set_object_name_for_intent_to_add_entry(struct cache_entry *ce)
 
 int add_to_index(struct index_state *istate, const char *path, struct stat *st, int flags)
 {
-	int size, namelen, was_same;
+	int namelen, was_same;
 	mode_t st_mode = st->st_mode;
 	struct cache_entry *ce, *alias = NULL;
 	unsigned ce_option = CE_MATCH_IGNORE_VALID|CE_MATCH_IGNORE_SKIP_WORKTREE|CE_MATCH_RACY_IS_DIRTY;
@@ -662,8 +700,7 @@ int add_to_index(struct index_state *istate, const char *path, struct stat *st,
 		while (namelen && path[namelen-1] == '/')
 			namelen--;
 	}
-	size = cache_entry_size(namelen);
-	ce = xcalloc(1, size);
+	ce = make_empty_cache_entry(istate, namelen);
 	memcpy(ce->name, path, namelen);
 	ce->ce_namelen = namelen;
 	if (!intent_only)
@@ -704,13 +741,13 @@ int add_to_index(struct index_state *istate, const char *path, struct stat *st,
 				ce_mark_uptodate(alias);
 			alias->ce_flags |= CE_ADDED;
 
-			free(ce);
+			discard_cache_entry(ce);
 			return 0;
 		}
 	}
 	if (!intent_only) {
 		if (index_path(&ce->oid, path, st, newflags)) {
-			free(ce);
+			discard_cache_entry(ce);
 			return error("unable to index file %s", path);
 		}
 	} else
@@ -727,9 +764,9 @@ int add_to_index(struct index_state *istate, const char *path, struct stat *st,
 		    ce->ce_mode == alias->ce_mode);
 
 	if (pretend)
-		free(ce);
+		discard_cache_entry(ce);
 	else if (add_index_entry(istate, ce, add_option)) {
-		free(ce);
+		discard_cache_entry(ce);
 		return error("unable to add %s to index", path);
 	}
 	if (verbose && !was_same)
@@ -745,12 +782,36 @@ int add_file_to_index(struct index_state *istate, const char *path, int flags)
 	return add_to_index(istate, path, &st, flags);
 }
 
-struct cache_entry *make_cache_entry(unsigned int mode,
-		const unsigned char *sha1, const char *path, int stage,
-		unsigned int refresh_options)
+struct cache_entry *make_empty_cache_entry(struct index_state *istate, size_t len)
+{
+	return mem_pool__ce_calloc(find_mem_pool(istate), len);
+}
+
+struct cache_entry *dup_cache_entry(const struct cache_entry *ce,
+				    struct index_state *istate)
+{
+	unsigned int size = ce_size(ce);
+	struct cache_entry *new_entry = make_empty_cache_entry(istate, ce_namelen(ce));
+
+	memcpy(new_entry, ce, size);
+	new_entry->mem_pool_allocated = 1;
+	return new_entry;
+}
+
+struct cache_entry *make_empty_transient_cache_entry(size_t len)
+{
+	return xcalloc(1, cache_entry_size(len));
+}
+
+struct cache_entry *make_cache_entry(struct index_state *istate,
+				     unsigned int mode,
+				     const unsigned char *sha1,
+				     const char *path,
+				     int stage,
+				     unsigned int refresh_options)
 {
-	int size, len;
 	struct cache_entry *ce, *ret;
+	int len;
 
 	if (!verify_path(path)) {
 		error("Invalid path '%s'", path);
@@ -758,8 +819,7 @@ struct cache_entry *make_cache_entry(unsigned int mode,
 	}
 
 	len = strlen(path);
-	size = cache_entry_size(len);
-	ce = xcalloc(1, size);
+	ce = make_empty_cache_entry(istate, len);
 
 	hashcpy(ce->oid.hash, sha1);
 	memcpy(ce->name, path, len);
@@ -767,12 +827,37 @@ struct cache_entry *make_cache_entry(unsigned int mode,
 	ce->ce_namelen = len;
 	ce->ce_mode = create_ce_mode(mode);
 
-	ret = refresh_cache_entry(ce, refresh_options);
+	ret = refresh_cache_entry(istate, ce, refresh_options);
 	if (ret != ce)
-		free(ce);
+		discard_cache_entry(ce);
 	return ret;
 }
 
+struct cache_entry *make_transient_cache_entry(unsigned int mode,
+					       const unsigned char *sha1,
+					       const char *path,
+					       int stage)
+{
+	struct cache_entry *ce;
+	int len;
+
+	if (!verify_path(path)) {
+		error("Invalid path '%s'", path);
+		return NULL;
+	}
+
+	len = strlen(path);
+	ce = make_empty_transient_cache_entry(len);
+
+	hashcpy(ce->oid.hash, sha1);
+	memcpy(ce->name, path, len);
+	ce->ce_flags = create_ce_flags(stage);
+	ce->ce_namelen = len;
+	ce->ce_mode = create_ce_mode(mode);
+
+	return ce;
+}
+
 /*
  * Chmod an index entry with either +x or -x.
  *
@@ -1243,7 +1328,7 @@ static struct cache_entry *refresh_cache_ent(struct index_state *istate,
 {
 	struct stat st;
 	struct cache_entry *updated;
-	int changed, size;
+	int changed;
 	int refresh = options & CE_MATCH_REFRESH;
 	int ignore_valid = options & CE_MATCH_IGNORE_VALID;
 	int ignore_skip_worktree = options & CE_MATCH_IGNORE_SKIP_WORKTREE;
@@ -1323,8 +1408,7 @@ static struct cache_entry *refresh_cache_ent(struct index_state *istate,
 		return NULL;
 	}
 
-	size = ce_size(ce);
-	updated = xmalloc(size);
+	updated = make_empty_cache_entry(istate, ce_namelen(ce));
 	copy_cache_entry(updated, ce);
 	memcpy(updated->name, ce->name, ce->ce_namelen + 1);
 	fill_stat_cache_info(updated, &st);
@@ -1448,10 +1532,11 @@ int refresh_index(struct index_state *istate, unsigned int flags,
 	return has_errors;
 }
 
-struct cache_entry *refresh_cache_entry(struct cache_entry *ce,
-					       unsigned int options)
+struct cache_entry *refresh_cache_entry(struct index_state *istate,
+					struct cache_entry *ce,
+					unsigned int options)
 {
-	return refresh_cache_ent(&the_index, ce, options, NULL, NULL);
+	return refresh_cache_ent(istate, ce, options, NULL, NULL);
 }
 
 
@@ -1589,6 +1674,14 @@ static int read_index_extension(struct index_state *istate,
 	case CACHE_EXT_FSMONITOR:
 		read_fsmonitor_extension(istate, data, sz);
 		break;
+	case CACHE_EXT_SPARSE_DIRECTORIES:
+		/* no content, only an indication that this is a sparse index */
+		istate->sparse_index = 1;
+		break;
+	case CACHE_EXT_ENDOFINDEXENTRIES:
+	case CACHE_EXT_INDEXENTRYOFFSETTABLE:
+		/* already handled in do_read_index() */
+		break;
 	default:
 		if (*ext < 'A' || 'Z' < *ext)
 			return error("index uses %.4s extension, which we do not understand",
@@ -1609,12 +1702,13 @@ int read_index(struct index_state *istate)
 	return read_index_from(istate, get_index_file(), get_git_dir());
 }
 
-static struct cache_entry *cache_entry_from_ondisk(struct ondisk_cache_entry *ondisk,
+static struct cache_entry *cache_entry_from_ondisk(struct mem_pool *mem_pool,
+						   struct ondisk_cache_entry *ondisk,
 						   unsigned int flags,
 						   const char *name,
 						   size_t len)
 {
-	struct cache_entry *ce = xmalloc(cache_entry_size(len));
+	struct cache_entry *ce = mem_pool__ce_alloc(mem_pool, len);
 
 	ce->ce_stat_data.sd_ctime.sec = get_be32(&ondisk->ctime.sec);
 	ce->ce_stat_data.sd_mtime.sec = get_be32(&ondisk->mtime.sec);
@@ -1647,6 +1741,13 @@ static unsigned long expand_name_field(struct strbuf *name, const char *cp_)
 	const unsigned char *ep, *cp = (const unsigned char *)cp_;
 	size_t len = decode_varint(&cp);
 
+	/*
+	 * An empty previous name means we are at the start of a block
+	 * of entries listed in the IEOT extension, whose first entry
+	 * spells out its name in full whatever it says to strip.
+	 */
+	if (!name->len)
+		len = 0;
 	if (name->len < len)
 		die("malformed name field in the index");
 	strbuf_remove(name, name->len - len, len);
@@ -1656,7 +1757,8 @@ static unsigned long expand_name_field(struct strbuf *name, const char *cp_)
 	return (const char *)ep + 1 - cp_;
 }
 
-static struct cache_entry *create_from_disk(struct ondisk_cache_entry *ondisk,
+static struct cache_entry *create_from_disk(struct mem_pool *mem_pool,
+					    struct ondisk_cache_entry *ondisk,
 					    unsigned long *ent_size,
 					    struct strbuf *previous_name)
 {
@@ -1687,13 +1789,13 @@ static struct cache_entry *create_from_disk(struct ondisk_cache_entry *ondisk,
 		/* v3 and earlier */
 		if (len == CE_NAMEMASK)
 			len = strlen(name);
-		ce = cache_entry_from_ondisk(ondisk, flags, name, len);
+		ce = cache_entry_from_ondisk(mem_pool, ondisk, flags, name, len);
 
 		*ent_size = ondisk_ce_size(ce);
 	} else {
 		unsigned long consumed;
 		consumed = expand_name_field(previous_name, name);
-		ce = cache_entry_from_ondisk(ondisk, flags,
+		ce = cache_entry_from_ondisk(mem_pool, ondisk, flags,
 					     previous_name->buf,
 					     previous_name->len);
 
@@ -1765,18 +1867,452 @@ static void post_read_index_from(struct index_state *istate)
 	tweak_untracked_cache(istate);
 	tweak_split_index(istate);
 	tweak_fsmonitor(istate);
+
+	if (istate->sparse_index && command_requires_full_index)
+		ensure_full_index(istate);
+}
+
+/*
+ * The end of index entries (EOIE) extension is always the last one
+ * in the file, so that it can be found by looking backwards from the
+ * trailing checksum:
+ *
+ *   "EOIE"
+ *   <4-byte length>
+ *   <4-byte offset of the first extension>
+ *   <hash over the header of all the other extensions>
+ */
+#define EOIE_SIZE (4 + GIT_SHA1_RAWSZ)
+#define EOIE_SIZE_WITH_HEADER (4 + 4 + EOIE_SIZE)
+
+#ifndef NO_PTHREADS
+/*
+ * Return the offset at which the extensions start, or 0 if the index
+ * does not have a valid EOIE extension.
+ */
+static unsigned long read_eoie_extension(const char *mmap, size_t mmap_size)
+{
+	const char *index, *eoie;
+	uint32_t extsize;
+	unsigned long offset, src_offset, end_of_extensions;
+	unsigned char hash[GIT_MAX_RAWSZ];
+	git_hash_ctx c;
+
+	if (mmap_size < sizeof(struct cache_header) + EOIE_SIZE_WITH_HEADER + the_hash_algo->rawsz)
+		return 0;
+	end_of_extensions = mmap_size - the_hash_algo->rawsz - EOIE_SIZE_WITH_HEADER;
+
+	index = eoie = mmap + end_of_extensions;
+	if (CACHE_EXT(index) != CACHE_EXT_ENDOFINDEXENTRIES)
+		return 0;
+	index += sizeof(uint32_t);
+
+	extsize = get_be32(index);
+	if (extsize != EOIE_SIZE)
+		return 0;
+	index += sizeof(uint32_t);
+
+	/* the extensions must start between the header and the EOIE */
+	offset = get_be32(index);
+	if (offset < sizeof(struct cache_header) || mmap + offset >= eoie)
+		return 0;
+	index += sizeof(uint32_t);
+
+	/*
+	 * The hash only covers the signature and size of each extension,
+	 * not its contents, so it is cheap to verify that walking the
+	 * extensions from 'offset' lands exactly on the EOIE.
+	 */
+	the_hash_algo->init_fn(&c);
+	src_offset = offset;
+	while (src_offset < end_of_extensions) {
+		if (end_of_extensions - src_offset < 8)
+			return 0;
+		extsize = get_be32(mmap + src_offset + 4);
+		the_hash_algo->update_fn(&c, mmap + src_offset, 8);
+		src_offset += 8;
+		if (end_of_extensions - src_offset < extsize)
+			return 0;
+		src_offset += extsize;
+	}
+	the_hash_algo->final_fn(hash, &c);
+	if (hashcmp(hash, (const unsigned char *)index))
+		return 0;
+
+	return offset;
 }
+#endif
+
+static void write_eoie_extension(struct strbuf *sb, git_hash_ctx *eoie_context,
+				 unsigned long offset)
+{
+	uint32_t buffer;
+	unsigned char hash[GIT_MAX_RAWSZ];
+
+	put_be32(&buffer, offset);
+	strbuf_add(sb, &buffer, sizeof(uint32_t));
+
+	the_hash_algo->final_fn(hash, eoie_context);
+	strbuf_add(sb, hash, the_hash_algo->rawsz);
+}
+
+/*
+ * The index entry offset table (IEOT) extension splits the cache
+ * entries into blocks that can be parsed independently:
+ *
+ *   "IEOT"
+ *   <4-byte length>
+ *   <4-byte version>
+ *   for each block:
+ *     <4-byte offset of the first entry of the block>
+ *     <4-byte number of entries in the block>
+ */
+#define IEOT_VERSION (1)
+
+struct index_entry_offset {
+	/* starting byte offset into the index file, number of entries */
+	unsigned long offset;
+	int nr;
+};
+
+struct index_entry_offset_table {
+	int nr;
+	struct index_entry_offset entries[FLEX_ARRAY];
+};
+
+#ifndef NO_PTHREADS
+static struct index_entry_offset_table *read_ieot_extension(struct index_state *istate,
+							    const char *mmap, size_t mmap_size,
+							    unsigned long offset)
+{
+	const char *index = NULL;
+	uint32_t extsize, ext_version;
+	struct index_entry_offset_table *ieot;
+	unsigned long expected_offset = sizeof(struct cache_header);
+	int i, nr, total = 0;
+
+	/* find the IEOT extension; the EOIE has validated the layout */
+	while (offset <= mmap_size - the_hash_algo->rawsz - 8) {
+		extsize = get_be32(mmap + offset + 4);
+		if (CACHE_EXT((mmap + offset)) == CACHE_EXT_INDEXENTRYOFFSETTABLE) {
+			index = mmap + offset + 8;
+			break;
+		}
+		offset += 8;
+		offset += extsize;
+	}
+	if (!index)
+		return NULL;
+
+	if (extsize < sizeof(uint32_t) ||
+	    (extsize - sizeof(uint32_t)) % (sizeof(uint32_t) + sizeof(uint32_t))) {
+		error("invalid IEOT extension size %d", extsize);
+		return NULL;
+	}
+	ext_version = get_be32(index);
+	if (ext_version != IEOT_VERSION) {
+		error("invalid IEOT version %d", ext_version);
+		return NULL;
+	}
+	index += sizeof(uint32_t);
+
+	nr = (extsize - sizeof(uint32_t)) / (sizeof(uint32_t) + sizeof(uint32_t));
+	if (!nr)
+		return NULL;
+	ieot = xmalloc(st_add(sizeof(*ieot), st_mult(nr, sizeof(struct index_entry_offset))));
+	ieot->nr = nr;
+	for (i = 0; i < nr; i++) {
+		ieot->entries[i].offset = get_be32(index);
+		index += sizeof(uint32_t);
+		ieot->entries[i].nr = get_be32(index);
+		index += sizeof(uint32_t);
+		total += ieot->entries[i].nr;
+	}
+
+	/*
+	 * Blocks must cover all the entries; the first one starts right
+	 * after the header, and each later one after the one before it.
+	 */
+	for (i = 0; i < nr; i++) {
+		if (ieot->entries[i].offset < expected_offset ||
+		    ieot->entries[i].offset >= mmap_size)
+			break;
+		expected_offset = ieot->entries[i].offset + 1;
+	}
+	if (i < nr || total != istate->cache_nr ||
+	    ieot->entries[0].offset != sizeof(struct cache_header)) {
+		free(ieot);
+		return NULL;
+	}
+
+	return ieot;
+}
+#endif
+
+static void write_ieot_extension(struct strbuf *sb, struct index_entry_offset_table *ieot)
+{
+	uint32_t buffer;
+	int i;
+
+	put_be32(&buffer, IEOT_VERSION);
+	strbuf_add(sb, &buffer, sizeof(uint32_t));
+
+	for (i = 0; i < ieot->nr; i++) {
+		put_be32(&buffer, ieot->entries[i].offset);
+		strbuf_add(sb, &buffer, sizeof(uint32_t));
+		put_be32(&buffer, ieot->entries[i].nr);
+		strbuf_add(sb, &buffer, sizeof(uint32_t));
+	}
+}
+
+/*
+ * Mostly randomly chosen: it is not worth starting a thread unless it
+ * has at least this many cache entries to parse.
+ */
+#define THREAD_COST (10000)
+
+static int record_eoie(void)
+{
+	int val;
+
+	if (!git_config_get_bool("index.recordendofindexentries", &val))
+		return val;
+
+	/*
+	 * As a convenience, write the extensions needed for threaded
+	 * reading when the user explicitly asked for it.
+	 */
+	return !git_config_get_index_threads(&val) && val != 1;
+}
+
+static int record_ieot(void)
+{
+	int val;
+
+	if (!git_config_get_bool("index.recordoffsettable", &val))
+		return val;
+	return !git_config_get_index_threads(&val) && val != 1;
+}
+
+struct load_index_extensions {
+#ifndef NO_PTHREADS
+	pthread_t pthread;
+#endif
+	struct index_state *istate;
+	const char *mmap;
+	size_t mmap_size;
+	unsigned long src_offset;
+	int failed;
+};
+
+static void *load_index_extensions(void *_data)
+{
+	struct load_index_extensions *p = _data;
+	unsigned long src_offset = p->src_offset;
+
+	while (src_offset <= p->mmap_size - the_hash_algo->rawsz - 8) {
+		/* After an array of active_nr index entries,
+		 * there can be arbitrary number of extended
+		 * sections, each of which is prefixed with
+		 * extension name (4-byte) and section length
+		 * in 4-byte network byte order.
+		 */
+		uint32_t extsize = get_be32(p->mmap + src_offset + 4);
+		if (read_index_extension(p->istate,
+					 p->mmap + src_offset,
+					 (char *)p->mmap + src_offset + 8,
+					 extsize) < 0) {
+			p->failed = 1;
+			break;
+		}
+		src_offset += 8;
+		src_offset += extsize;
+	}
+	return NULL;
+}
+
+/*
+ * Guess how much memory `entries` cache entries parsed from `ondisk_size`
+ * bytes of the index need, so that they can be carved from a single
+ * block of the memory pool: in-core entries are larger than on-disk ones
+ * by a fixed amount plus some alignment, except that with version 4 the
+ * names are prefix-compressed on disk.
+ */
+static size_t estimate_cache_size(int version, size_t ondisk_size,
+				  unsigned int entries)
+{
+	size_t per_entry = sizeof(struct cache_entry) + sizeof(uintmax_t);
+
+	if (version == 4)
+		return st_mult(entries, per_entry + CACHE_ENTRY_PATH_LENGTH);
+	return st_add(ondisk_size,
+		      st_mult(entries, per_entry -
+			      offsetof(struct ondisk_cache_entry, name)));
+}
+
+/*
+ * Parse 'nr' cache entries starting at 'start_offset' into
+ * istate->cache[first..], allocating them from 'mem_pool', and return
+ * the number of bytes consumed.
+ */
+static unsigned long load_cache_entry_block(struct index_state *istate,
+					    struct mem_pool *mem_pool,
+					    const char *mmap, unsigned long start_offset,
+					    int first, int nr,
+					    struct strbuf *previous_name)
+{
+	int i;
+	unsigned long src_offset = start_offset;
+
+	for (i = first; i < first + nr; i++) {
+		struct ondisk_cache_entry *disk_ce;
+		struct cache_entry *ce;
+		unsigned long consumed;
+
+		disk_ce = (struct ondisk_cache_entry *)(mmap + src_offset);
+		ce = create_from_disk(mem_pool, disk_ce, &consumed, previous_name);
+		set_index_entry(istate, i, ce);
+
+		src_offset += consumed;
+	}
+	return src_offset - start_offset;
+}
+
+static unsigned long load_all_cache_entries(struct index_state *istate,
+					    const char *mmap, size_t mmap_size,
+					    unsigned long src_offset)
+{
+	struct strbuf previous_name_buf = STRBUF_INIT, *previous_name;
+	unsigned long consumed;
+
+	previous_name = (istate->version == 4) ? &previous_name_buf : NULL;
+	mem_pool_init(&istate->ce_mem_pool,
+		      estimate_cache_size(istate->version, mmap_size,
+					  istate->cache_nr));
+	consumed = load_cache_entry_block(istate, istate->ce_mem_pool,
+					  mmap, src_offset,
+					  0, istate->cache_nr, previous_name);
+	strbuf_release(&previous_name_buf);
+	return consumed;
+}
+
+#ifndef NO_PTHREADS
+
+struct load_cache_entries_thread_data {
+	pthread_t pthread;
+	struct index_state *istate;
+	struct mem_pool *ce_mem_pool;	/* to be combined into the index's */
+	const char *mmap;
+	struct index_entry_offset_table *ieot;
+	int ieot_start;		/* first IEOT block to parse */
+	int ieot_blocks;	/* number of IEOT blocks to parse */
+	int first;		/* position in istate->cache of the first entry */
+	unsigned long consumed;	/* number of bytes of the index parsed */
+};
+
+static void *load_cache_entries_thread(void *_data)
+{
+	struct load_cache_entries_thread_data *p = _data;
+	struct strbuf previous_name_buf = STRBUF_INIT, *previous_name;
+	int i, first = p->first;
+
+	previous_name = (p->istate->version == 4) ? &previous_name_buf : NULL;
+	for (i = p->ieot_start; i < p->ieot_start + p->ieot_blocks; i++) {
+		struct index_entry_offset *block = &p->ieot->entries[i];
+
+		/* each block is parsed without knowing the name before it */
+		if (previous_name)
+			strbuf_reset(previous_name);
+		p->consumed += load_cache_entry_block(p->istate, p->ce_mem_pool,
+						      p->mmap,
+						      block->offset, first,
+						      block->nr, previous_name);
+		first += block->nr;
+	}
+	strbuf_release(&previous_name_buf);
+	return NULL;
+}
+
+static unsigned long load_cache_entries_threaded(struct index_state *istate,
+						 const char *mmap, size_t mmap_size,
+						 int nr_threads,
+						 struct index_entry_offset_table *ieot)
+{
+	struct load_cache_entries_thread_data *data;
+	int i, ieot_blocks, ieot_start, first;
+	unsigned long consumed = 0;
+
+	if (nr_threads > ieot->nr)
+		nr_threads = ieot->nr;
+	data = xcalloc(nr_threads, sizeof(*data));
+
+	/* the memory of the threads' pools ends up here */
+	mem_pool_init(&istate->ce_mem_pool, 0);
+
+	first = ieot_start = 0;
+	ieot_blocks = DIV_ROUND_UP(ieot->nr, nr_threads);
+	for (i = 0; i < nr_threads; i++) {
+		struct load_cache_entries_thread_data *p = &data[i];
+		unsigned int nr = 0;
+		int j, err;
+
+		if (ieot_start + ieot_blocks > ieot->nr)
+			ieot_blocks = ieot->nr - ieot_start;
+
+		p->istate = istate;
+		p->mmap = mmap;
+		p->ieot = ieot;
+		p->ieot_start = ieot_start;
+		p->ieot_blocks = ieot_blocks;
+		p->first = first;
+
+		for (j = ieot_start; j < ieot_start + ieot_blocks; j++)
+			nr += ieot->entries[j].nr;
+		mem_pool_init(&p->ce_mem_pool,
+			      estimate_cache_size(istate->version,
+						  (uint64_t)mmap_size * nr /
+						  istate->cache_nr, nr));
+
+		err = pthread_create(&p->pthread, NULL, load_cache_entries_thread, p);
+		if (err)
+			die(_("unable to create load_cache_entries thread: %s"), strerror(err));
+
+		first += nr;
+		ieot_start += ieot_blocks;
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		struct load_cache_entries_thread_data *p = &data[i];
+		int err = pthread_join(p->pthread, NULL);
+
+		if (err)
+			die(_("unable to join load_cache_entries thread: %s"), strerror(err));
+		mem_pool_combine(istate->ce_mem_pool, p->ce_mem_pool);
+		mem_pool_discard(p->ce_mem_pool, 0);
+		consumed += p->consumed;
+	}
+	free(data);
+
+	return consumed;
+}
+
+#endif
 
 /* remember to discard_cache() before reading a different cache! */
 int do_read_index(struct index_state *istate, const char *path, int must_exist)
 {
-	int fd, i;
+	int fd;
 	struct stat st;
 	unsigned long src_offset;
 	struct cache_header *hdr;
 	void *mmap;
 	size_t mmap_size;
-	struct strbuf previous_name_buf = STRBUF_INIT, *previous_name;
+	struct load_index_extensions p;
+#ifndef NO_PTHREADS
+	unsigned long extension_offset = 0;
+	struct index_entry_offset_table *ieot = NULL;
+	int nr_threads, cpus;
+#endif
 
 	if (istate->initialized)
 		return istate->cache_nr;
@@ -1813,45 +2349,70 @@ int do_read_index(struct index_state *istate, const char *path, int must_exist)
 	istate->cache = xcalloc(istate->cache_alloc, sizeof(*istate->cache));
 	istate->initialized = 1;
 
-	if (istate->version == 4)
-		previous_name = &previous_name_buf;
-	else
-		previous_name = NULL;
+	memset(&p, 0, sizeof(p));
+	p.istate = istate;
+	p.mmap = mmap;
+	p.mmap_size = mmap_size;
 
 	src_offset = sizeof(*hdr);
-	for (i = 0; i < istate->cache_nr; i++) {
-		struct ondisk_cache_entry *disk_ce;
-		struct cache_entry *ce;
-		unsigned long consumed;
 
-		disk_ce = (struct ondisk_cache_entry *)((char *)mmap + src_offset);
-		ce = create_from_disk(disk_ce, &consumed, previous_name);
-		set_index_entry(istate, i, ce);
+#ifndef NO_PTHREADS
+	if (git_config_get_index_threads(&nr_threads))
+		nr_threads = 0;
+	if (!nr_threads) {
+		nr_threads = istate->cache_nr / THREAD_COST;
+		cpus = online_cpus();
+		if (nr_threads > cpus)
+			nr_threads = cpus;
+	}
 
-		src_offset += consumed;
+	/*
+	 * If the EOIE extension tells us where the extensions start,
+	 * parse them on their own thread while we load the entries.
+	 */
+	if (nr_threads > 1) {
+		extension_offset = read_eoie_extension(mmap, mmap_size);
+		if (extension_offset) {
+			int err;
+
+			p.src_offset = extension_offset;
+			err = pthread_create(&p.pthread, NULL, load_index_extensions, &p);
+			if (err)
+				die(_("unable to create load_index_extensions thread: %s"), strerror(err));
+			nr_threads--;
+		}
 	}
-	strbuf_release(&previous_name_buf);
+
+	if (extension_offset && nr_threads > 1)
+		ieot = read_ieot_extension(istate, mmap, mmap_size, extension_offset);
+
+	if (ieot) {
+		src_offset += load_cache_entries_threaded(istate, mmap, mmap_size,
+							  nr_threads, ieot);
+		free(ieot);
+	} else
+#endif
+		src_offset += load_all_cache_entries(istate, mmap, mmap_size,
+						     src_offset);
+
 	istate->timestamp.sec = st.st_mtime;
 	istate->timestamp.nsec = ST_MTIME_NSEC(st);
 
-	while (src_offset <= mmap_size - the_hash_algo->rawsz - 8) {
-		/* After an array of active_nr index entries,
-		 * there can be arbitrary number of extended
-		 * sections, each of which is prefixed with
-		 * extension name (4-byte) and section length
-		 * in 4-byte network byte order.
-		 */
-		uint32_t extsize;
-		memcpy(&extsize, (char *)mmap + src_offset + 4, 4);
-		extsize = ntohl(extsize);
-		if (read_index_extension(istate,
-					 (const char *) mmap + src_offset,
-					 (char *) mmap + src_offset + 8,
-					 extsize) < 0)
-			goto unmap;
-		src_offset += 8;
-		src_offset += extsize;
+	/* join the extension thread, or load the extensions ourselves */
+#ifndef NO_PTHREADS
+	if (extension_offset) {
+		int err = pthread_join(p.pthread, NULL);
+		if (err)
+			die(_("unable to join load_index_extensions thread: %s"), strerror(err));
+	} else
+#endif
+	{
+		p.src_offset = src_offset;
+		load_index_extensions(&p);
 	}
+	if (p.failed)
+		goto unmap;
+
 	munmap(mmap, mmap_size);
 	return istate->cache_nr;
 
@@ -1920,19 +2481,63 @@ int is_index_unborn(struct index_state *istate)
 	return (!istate->cache_nr && !istate->timestamp.sec);
 }
 
-int discard_index(struct index_state *istate)
+static int should_validate_cache_entries(void)
+{
+	static int validate_index_cache_entries = -1;
+
+	if (validate_index_cache_entries < 0)
+		validate_index_cache_entries =
+			git_env_bool("GIT_TEST_VALIDATE_INDEX_CACHE_ENTRIES", 0);
+	return validate_index_cache_entries;
+}
+
+/*
+ * Check that all the entries of the index come from its memory pool,
+ * or that of its split index base, and hence go away with it.
+ */
+static void validate_cache_entries(const struct index_state *istate)
 {
 	int i;
 
+	if (!should_validate_cache_entries() || !istate || !istate->initialized)
+		return;
+
 	for (i = 0; i < istate->cache_nr; i++) {
-		if (istate->cache[i]->index &&
-		    istate->split_index &&
+		struct cache_entry *ce = istate->cache[i];
+
+		if (istate->ce_mem_pool &&
+		    mem_pool_contains(istate->ce_mem_pool, ce))
+			continue;
+		if (istate->split_index &&
 		    istate->split_index->base &&
-		    istate->cache[i]->index <= istate->split_index->base->cache_nr &&
-		    istate->cache[i] == istate->split_index->base->cache[istate->cache[i]->index - 1])
+		    istate->split_index->base->ce_mem_pool &&
+		    mem_pool_contains(istate->split_index->base->ce_mem_pool, ce))
 			continue;
-		free(istate->cache[i]);
+		BUG("cache entry '%s' is not allocated from the index's memory pool",
+		    ce->name);
 	}
+}
+
+void discard_cache_entry(struct cache_entry *ce)
+{
+	if (ce && should_validate_cache_entries())
+		memset(ce, 0xCD, cache_entry_size(ce->ce_namelen));
+
+	if (ce && ce->mem_pool_allocated)
+		return;
+
+	free(ce);
+}
+
+int discard_index(struct index_state *istate)
+{
+	/*
+	 * The cache entries need not be freed one by one: they all come
+	 * from the memory pool of the index (or of its split index base),
+	 * which we discard as a whole below.
+	 */
+	validate_cache_entries(istate);
+
 	resolve_undo_clear_index(istate);
 	istate->cache_nr = 0;
 	istate->cache_changed = 0;
@@ -1941,8 +2546,26 @@ int discard_index(struct index_state *istate)
 	free_name_hash(istate);
 	cache_tree_free(&(istate->cache_tree));
 	istate->initialized = 0;
+	istate->sparse_index = 0;
 	FREE_AND_NULL(istate->cache);
 	istate->cache_alloc = 0;
+	if (istate->ce_mem_pool) {
+		struct split_index *si = istate->split_index;
+
+		/*
+		 * The base of a split index that is shared with another
+		 * index may hold on to entries of ours; it takes over our
+		 * memory then.
+		 */
+		if (si && si->refcount > 1 && si->base) {
+			mem_pool_init(&si->base->ce_mem_pool, 0);
+			mem_pool_combine(si->base->ce_mem_pool,
+					 istate->ce_mem_pool);
+		}
+		mem_pool_discard(istate->ce_mem_pool,
+				 should_validate_cache_entries());
+		istate->ce_mem_pool = NULL;
+	}
 	discard_split_index(istate);
 	free_untracked_cache(istate->untracked);
 	istate->untracked = NULL;
@@ -1997,11 +2620,15 @@ static int ce_write(git_hash_ctx *context, int fd, void *data, unsigned int len)
 	return 0;
 }
 
-static int write_index_ext_header(git_hash_ctx *context, int fd,
-				  unsigned int ext, unsigned int sz)
+static int write_index_ext_header(git_hash_ctx *context, git_hash_ctx *eoie_context,
+				  int fd, unsigned int ext, unsigned int sz)
 {
 	ext = htonl(ext);
 	sz = htonl(sz);
+	if (eoie_context) {
+		the_hash_algo->update_fn(eoie_context, &ext, 4);
+		the_hash_algo->update_fn(eoie_context, &sz, 4);
+	}
 	return ((ce_write(context, fd, &ext, 4) < 0) ||
 		(ce_write(context, fd, &sz, 4) < 0)) ? -1 : 0;
 }
@@ -2244,7 +2871,7 @@ static int do_write_index(struct index_state *istate, struct tempfile *tempfile,
 {
 	uint64_t start = getnanotime();
 	int newfd = tempfile->fd;
-	git_hash_ctx c;
+	git_hash_ctx c, eoie_ctx, *eoie_c = NULL;
 	struct cache_header hdr;
 	int i, err = 0, removed, extended, hdr_version;
 	struct cache_entry **cache = istate->cache;
@@ -2253,6 +2880,10 @@ static int do_write_index(struct index_state *istate, struct tempfile *tempfile,
 	struct ondisk_cache_entry_extended ondisk;
 	struct strbuf previous_name_buf = STRBUF_INIT, *previous_name;
 	int drop_cache_tree = istate->drop_cache_tree;
+	off_t offset;
+	int ieot_entries = 1;
+	struct index_entry_offset_table *ieot = NULL;
+	int nr, nr_threads;
 
 	for (i = removed = extended = 0; i < entries; i++) {
 		if (cache[i]->ce_flags & CE_REMOVE)
@@ -2286,6 +2917,40 @@ static int do_write_index(struct index_state *istate, struct tempfile *tempfile,
 	if (ce_write(&c, newfd, &hdr, sizeof(hdr)) < 0)
 		return -1;
 
+	if (record_ieot()) {
+		int ieot_blocks;
+
+		/*
+		 * By default, match the number of threads the reader will
+		 * use for the entries, leaving one for the extensions.
+		 */
+		if (git_config_get_index_threads(&nr_threads))
+			nr_threads = 0;
+		if (!nr_threads) {
+			ieot_blocks = istate->cache_nr / THREAD_COST;
+			if (ieot_blocks > online_cpus() - 1)
+				ieot_blocks = online_cpus() - 1;
+		} else {
+			ieot_blocks = nr_threads;
+			if (ieot_blocks > istate->cache_nr)
+				ieot_blocks = istate->cache_nr;
+		}
+
+		/* a single block would not help anybody */
+		if (ieot_blocks > 1) {
+			ieot = xcalloc(1, st_add(sizeof(*ieot),
+						 st_mult(ieot_blocks, sizeof(struct index_entry_offset))));
+			ieot_entries = DIV_ROUND_UP(entries, ieot_blocks);
+		}
+	}
+
+	offset = lseek(newfd, 0, SEEK_CUR);
+	if (offset < 0) {
+		free(ieot);
+		return -1;
+	}
+	offset += write_buffer_len;
+	nr = 0;
 	previous_name = (hdr_version == 4) ? &previous_name_buf : NULL;
 
 	for (i = 0; i < entries; i++) {
@@ -2307,23 +2972,75 @@ static int do_write_index(struct index_state *istate, struct tempfile *tempfile,
 
 			drop_cache_tree = 1;
 		}
+
+		/* start a new IEOT block if this one is full */
+		if (ieot && nr && (i % ieot_entries == 0)) {
+			ieot->entries[ieot->nr].nr = nr;
+			ieot->entries[ieot->nr].offset = offset;
+			ieot->nr++;
+			/*
+			 * In a v4 index, make sure the first entry of the
+			 * block shares no prefix with the previous name, so
+			 * that it can be read without knowing it.
+			 */
+			if (previous_name && previous_name->len)
+				previous_name->buf[0] = 0;
+			nr = 0;
+			offset = lseek(newfd, 0, SEEK_CUR);
+			if (offset < 0) {
+				free(ieot);
+				return -1;
+			}
+			offset += write_buffer_len;
+		}
 		if (ce_write_entry(&c, newfd, ce, previous_name, (struct ondisk_cache_entry *)&ondisk) < 0)
 			err = -1;
 
 		if (err)
 			break;
+		nr++;
+	}
+	if (ieot && nr) {
+		ieot->entries[ieot->nr].nr = nr;
+		ieot->entries[ieot->nr].offset = offset;
+		ieot->nr++;
 	}
 	strbuf_release(&previous_name_buf);
 
-	if (err)
+	if (err) {
+		free(ieot);
 		return err;
+	}
+
+	offset = lseek(newfd, 0, SEEK_CUR);
+	if (offset < 0) {
+		free(ieot);
+		return -1;
+	}
+	offset += write_buffer_len;
+	if (record_eoie()) {
+		the_hash_algo->init_fn(&eoie_ctx);
+		eoie_c = &eoie_ctx;
+	}
 
 	/* Write extension data here */
+	if (ieot) {
+		struct strbuf sb = STRBUF_INIT;
+
+		write_ieot_extension(&sb, ieot);
+		err = write_index_ext_header(&c, eoie_c, newfd, CACHE_EXT_INDEXENTRYOFFSETTABLE,
+					     sb.len) < 0 ||
+			ce_write(&c, newfd, sb.buf, sb.len) < 0;
+		strbuf_release(&sb);
+		free(ieot);
+		if (err)
+			return -1;
+	}
 	if (!strip_extensions && istate->split_index) {
 		struct strbuf sb = STRBUF_INIT;
 
 		err = write_link_extension(&sb, istate) < 0 ||
-			write_index_ext_header(&c, newfd, CACHE_EXT_LINK,
+			write_index_ext_header(&c, eoie_c, newfd, CACHE_EXT_LINK,
 					       sb.len) < 0 ||
 			ce_write(&c, newfd, sb.buf, sb.len) < 0;
 		strbuf_release(&sb);
@@ -2334,7 +3051,7 @@ static int do_write_index(struct index_state *istate, struct tempfile *tempfile,
 		struct strbuf sb = STRBUF_INIT;
 
 		cache_tree_write(&sb, istate->cache_tree);
-		err = write_index_ext_header(&c, newfd, CACHE_EXT_TREE, sb.len) < 0
+		err = write_index_ext_header(&c, eoie_c, newfd, CACHE_EXT_TREE, sb.len) < 0
 			|| ce_write(&c, newfd, sb.buf, sb.len) < 0;
 		strbuf_release(&sb);
 		if (err)
@@ -2344,7 +3061,7 @@ static int do_write_index(struct index_state *istate, struct tempfile *tempfile,
 		struct strbuf sb = STRBUF_INIT;
 
 		resolve_undo_write(&sb, istate->resolve_undo);
-		err = write_index_ext_header(&c, newfd, CACHE_EXT_RESOLVE_UNDO,
+		err = write_index_ext_header(&c, eoie_c, newfd, CACHE_EXT_RESOLVE_UNDO,
 					     sb.len) < 0
 			|| ce_write(&c, newfd, sb.buf, sb.len) < 0;
 		strbuf_release(&sb);
@@ -2355,24 +3072,46 @@ static int do_write_index(struct index_state *istate, struct tempfile *tempfile,
 		struct strbuf sb = STRBUF_INIT;
 
 		write_untracked_extension(&sb, istate->untracked);
-		err = write_index_ext_header(&c, newfd, CACHE_EXT_UNTRACKED,
+		err = write_index_ext_header(&c, eoie_c, newfd, CACHE_EXT_UNTRACKED,
 					     sb.len) < 0 ||
 			ce_write(&c, newfd, sb.buf, sb.len) < 0;
 		strbuf_release(&sb);
 		if (err)
 			return -1;
 	}
+	if (!strip_extensions && istate->sparse_index) {
+		err = write_index_ext_header(&c, eoie_c, newfd,
+					     CACHE_EXT_SPARSE_DIRECTORIES, 0) < 0;
+		if (err)
+			return -1;
+	}
 	if (!strip_extensions && istate->fsmonitor_last_update) {
 		struct strbuf sb = STRBUF_INIT;
 
 		write_fsmonitor_extension(&sb, istate);
-		err = write_index_ext_header(&c, newfd, CACHE_EXT_FSMONITOR, sb.len) < 0
+		err = write_index_ext_header(&c, eoie_c, newfd, CACHE_EXT_FSMONITOR, sb.len) < 0
 			|| ce_write(&c, newfd, sb.buf, sb.len) < 0;
 		strbuf_release(&sb);
 		if (err)
 			return -1;
 	}
 
+	/*
+	 * The EOIE extension must be written last, so that it can be
+	 * found without parsing anything else.
+	 */
+	if (eoie_c) {
+		struct strbuf sb = STRBUF_INIT;
+
+		write_eoie_extension(&sb, eoie_c, offset);
+		err = write_index_ext_header(&c, NULL, newfd, CACHE_EXT_ENDOFINDEXENTRIES,
+					     sb.len) < 0 ||
+			ce_write(&c, newfd, sb.buf, sb.len) < 0;
+		strbuf_release(&sb);
+		if (err)
+			return -1;
+	}
+
 	if (ce_flush(&c, newfd, istate->sha1))
 		return -1;
 	if (close_tempfile_gently(tempfile)) {
@@ -2539,8 +3278,9 @@ static int too_many_not_shared_entries(struct index_state *istate)
 int write_locked_index(struct index_state *istate, struct lock_file *lock,
 		       unsigned flags)
 {
-	int new_shared_index, ret;
+	int new_shared_index, ret, collapsed;
 	struct split_index *si = istate->split_index;
+	struct sparse_write_state sparse_state;
 
 	if ((flags & SKIP_IF_UNCHANGED) && !istate->cache_changed) {
 		if (flags & COMMIT_LOCK)
@@ -2548,6 +3288,12 @@ int write_locked_index(struct index_state *istate, struct lock_file *lock,
 		return 0;
 	}
 
+	/*
+	 * Write a sparse index if configured to, but hand the caller
+	 * back the index in the shape it had.
+	 */
+	collapsed = convert_to_sparse(istate, &sparse_state);
+
 	if (istate->fsmonitor_last_update)
 		fill_fsmonitor_bitmap(istate);
 
@@ -2600,6 +3346,8 @@ int write_locked_index(struct index_state *istate, struct lock_file *lock,
 	}
 
 out:
+	if (collapsed)
+		restore_full_index(istate, &sparse_state);
 	if (flags & COMMIT_LOCK)
 		rollback_lock_file(lock);
 	return ret;
@@ -2621,14 +3369,13 @@ int read_index_unmerged(struct index_state *istate)
 	for (i = 0; i < istate->cache_nr; i++) {
 		struct cache_entry *ce = istate->cache[i];
 		struct cache_entry *new_ce;
-		int size, len;
+		int len;
 
 		if (!ce_stage(ce))
 			continue;
 		unmerged = 1;
 		len = ce_namelen(ce);
-		size = cache_entry_size(len);
-		new_ce = xcalloc(1, size);
+		new_ce = make_empty_cache_entry(istate, len);
 		memcpy(new_ce->name, ce->name, len);
 		new_ce->ce_flags = create_ce_flags(0) | CE_CONFLICTED;
 		new_ce->ce_namelen = len;
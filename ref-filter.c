@@ -16,6 +16,8 @@
 #include "trailer.h"
 #include "wt-status.h"
 #include "commit-slab.h"
+#include "commit-graph.h"
+#include "argv-array.h"
 
 static struct ref_msg {
 	const char *gone;
@@ -97,6 +99,7 @@ static struct used_atom {
 		} objectname;
 		struct refname_atom refname;
 		char *head;
+		struct commit *ahead_behind_base;
 	} u;
 } *used_atom;
 static int used_atom_cnt, need_tagged, need_symref;
@@ -325,6 +328,17 @@ static void head_atom_parser(const struct ref_format *format, struct used_atom *
 	atom->u.head = resolve_refdup("HEAD", RESOLVE_REF_READING, NULL, NULL);
 }
 
+static void ahead_behind_atom_parser(const struct ref_format *format, struct used_atom *atom, const char *arg)
+{
+	struct object_id oid;
+
+	if (!arg)
+		die(_("expected format: %%(ahead-behind:<committish>)"));
+	if (get_oid_committish(arg, &oid) ||
+	    !(atom->u.ahead_behind_base = lookup_commit_reference_gently(&oid, 1)))
+		die(_("not a valid commit: %%(ahead-behind:%s)"), arg);
+}
+
 static struct {
 	const char *name;
 	cmp_type cmp_type;
@@ -363,6 +377,7 @@ static struct {
 	{ "symref", FIELD_STR, refname_atom_parser },
 	{ "flag" },
 	{ "HEAD", FIELD_STR, head_atom_parser },
+	{ "ahead-behind", FIELD_STR, ahead_behind_atom_parser },
 	{ "color", FIELD_STR, color_atom_parser },
 	{ "align", FIELD_STR, align_atom_parser },
 	{ "end" },
@@ -1427,6 +1442,19 @@ static void populate_value(struct ref_array_item *ref)
 			if (refname)
 				fill_remote_ref_details(atom, refname, branch, &v->s);
 			continue;
+		} else if (starts_with(name, "ahead-behind")) {
+			struct commit *commit;
+			int ahead, behind;
+
+			commit = lookup_commit_reference_gently(&ref->objectname, 1);
+			if (!commit) {
+				v->s = "";
+				continue;
+			}
+			count_ahead_behind(commit, atom->u.ahead_behind_base,
+					   &ahead, &behind, 1);
+			v->s = xstrfmt("%d %d", ahead, behind);
+			continue;
 		} else if (atom->u.remote_ref.push) {
 			const char *branch_name;
 			if (!skip_prefix(ref->refname, "refs/heads/",
@@ -1588,7 +1616,8 @@ static int in_commit_list(const struct commit_list *want, struct commit *c)
  */
 static enum contains_result contains_test(struct commit *candidate,
 					  const struct commit_list *want,
-					  struct contains_cache *cache)
+					  struct contains_cache *cache,
+					  uint32_t cutoff)
 {
 	enum contains_result *cached = contains_cache_at(cache, candidate);
 
@@ -1604,9 +1633,39 @@ static enum contains_result contains_test(struct commit *candidate,
 
 	/* Otherwise, we don't know; prepare to recurse */
 	parse_commit_or_die(candidate);
+
+	/*
+	 * A commit whose generation number is below that of every
+	 * commit we want cannot reach any of them.
+	 */
+	if (candidate->generation < cutoff)
+		return CONTAINS_NO;
+
 	return CONTAINS_UNKNOWN;
 }
 
+/*
+ * Return the smallest generation number of the commits in `want`; the
+ * walk need not look at commits below it. This is GENERATION_NUMBER_ZERO
+ * (no cutoff) if the commit-graph has no generation numbers, and
+ * GENERATION_NUMBER_INFINITY if none of `want` is in the commit-graph,
+ * which is still a valid cutoff: as the commit-graph is closed under
+ * reachability, no commit in it can reach a commit outside of it.
+ */
+static uint32_t contains_cutoff(const struct commit_list *want)
+{
+	uint32_t cutoff = GENERATION_NUMBER_INFINITY;
+
+	for (; want; want = want->next) {
+		struct commit *c = want->item;
+
+		parse_commit_or_die(c);
+		if (c->generation < cutoff)
+			cutoff = c->generation;
+	}
+	return cutoff;
+}
+
 static void push_to_contains_stack(struct commit *candidate, struct contains_stack *contains_stack)
 {
 	ALLOC_GROW(contains_stack->contains_stack, contains_stack->nr + 1, contains_stack->alloc);
@@ -1619,8 +1678,10 @@ static enum contains_result contains_tag_algo(struct commit *candidate,
 					      struct contains_cache *cache)
 {
 	struct contains_stack contains_stack = { 0, 0, NULL };
-	enum contains_result result = contains_test(candidate, want, cache);
+	enum contains_result result;
+	uint32_t cutoff = contains_cutoff(want);
 
+	result = contains_test(candidate, want, cache, cutoff);
 	if (result != CONTAINS_UNKNOWN)
 		return result;
 
@@ -1638,7 +1699,7 @@ static enum contains_result contains_tag_algo(struct commit *candidate,
 		 * If we just popped the stack, parents->item has been marked,
 		 * therefore contains_test will return a meaningful yes/no.
 		 */
-		else switch (contains_test(parents->item, want, cache)) {
+		else switch (contains_test(parents->item, want, cache, cutoff)) {
 		case CONTAINS_YES:
 			*contains_cache_at(cache, commit) = CONTAINS_YES;
 			contains_stack.nr--;
@@ -1652,13 +1713,25 @@ static enum contains_result contains_tag_algo(struct commit *candidate,
 		}
 	}
 	free(contains_stack.contains_stack);
-	return contains_test(candidate, want, cache);
+	return contains_test(candidate, want, cache, cutoff);
 }
 
 static int commit_contains(struct ref_filter *filter, struct commit *commit,
 			   struct commit_list *list, struct contains_cache *cache)
 {
-	if (filter->with_commit_tag_algo)
+	uint32_t cutoff = contains_cutoff(list);
+
+	/*
+	 * The depth-first walk remembers its answers in `cache`, so that
+	 * checking many refs costs a single walk overall; but without a
+	 * generation cutoff it has to go down to the root commits to
+	 * answer "no", which is why only "git tag" asks for it. With
+	 * generation numbers to stop it, it is the better choice for
+	 * branches, too.
+	 */
+	if (filter->with_commit_tag_algo ||
+	    (cutoff != GENERATION_NUMBER_ZERO &&
+	     cutoff != GENERATION_NUMBER_INFINITY))
 		return contains_tag_algo(commit, list, cache) == CONTAINS_YES;
 	return is_descendant_of(commit, list);
 }
@@ -1734,21 +1807,102 @@ static int filter_pattern_match(struct ref_filter *filter, const char *refname)
 	return match_pattern(filter, refname);
 }
 
+static int qsort_strcmp(const void *va, const void *vb)
+{
+	const char *a = *(const char **)va;
+	const char *b = *(const char **)vb;
+
+	return strcmp(a, b);
+}
+
+static void find_longest_prefixes_1(struct string_list *out,
+				    struct strbuf *prefix,
+				    const char **patterns, size_t nr)
+{
+	size_t i;
+
+	for (i = 0; i < nr; i++) {
+		char c = patterns[i][prefix->len];
+		if (!c || is_glob_special(c)) {
+			string_list_append(out, prefix->buf);
+			return;
+		}
+	}
+
+	i = 0;
+	while (i < nr) {
+		size_t end;
+
+		/*
+		 * Set "end" to the index of the element _after_ the last one
+		 * in our group.
+		 */
+		for (end = i + 1; end < nr; end++) {
+			if (patterns[i][prefix->len] != patterns[end][prefix->len])
+				break;
+		}
+
+		strbuf_addch(prefix, patterns[i][prefix->len]);
+		find_longest_prefixes_1(out, prefix, patterns + i, end - i);
+		strbuf_setlen(prefix, prefix->len - 1);
+
+		i = end;
+	}
+}
+
 /*
- * Find the longest prefix of pattern we can pass to
- * `for_each_fullref_in()`, namely the part of pattern preceding the
- * first glob character. (Note that `for_each_fullref_in()` is
+ * Find the longest prefixes of the patterns we can pass to
+ * `for_each_fullref_in()`, namely the parts of the patterns preceding
+ * their first glob character, such that no ref can start with more
+ * than one of them: where two patterns share a prefix, only the part
+ * they have in common is used. (Note that `for_each_fullref_in()` is
  * perfectly happy working with a prefix that doesn't end at a
- * pathname component boundary.)
+ * pathname component boundary.) The prefixes come out sorted.
  */
-static void find_longest_prefix(struct strbuf *out, const char *pattern)
+static void find_longest_prefixes(struct string_list *out,
+				  const char **patterns)
 {
-	const char *p;
+	struct argv_array sorted = ARGV_ARRAY_INIT;
+	struct strbuf prefix = STRBUF_INIT;
 
-	for (p = pattern; *p && !is_glob_special(*p); p++)
-		;
+	argv_array_pushv(&sorted, patterns);
+	QSORT(sorted.argv, sorted.argc, qsort_strcmp);
 
-	strbuf_add(out, pattern, p - pattern);
+	find_longest_prefixes_1(out, &prefix, sorted.argv, sorted.argc);
+
+	argv_array_clear(&sorted);
+	strbuf_release(&prefix);
+}
+
+/*
+ * Call for_each_fullref_in() for `base` followed by each of the
+ * disjoint prefixes of `patterns`, so that only the parts of the ref
+ * namespace the patterns can match are looked at, in order.
+ */
+static int for_each_fullref_in_prefixes(const char *base,
+					const char **patterns,
+					each_ref_fn cb,
+					void *cb_data,
+					int broken)
+{
+	struct string_list prefixes = STRING_LIST_INIT_DUP;
+	struct string_list_item *prefix;
+	struct strbuf buf = STRBUF_INIT;
+	int ret = 0;
+
+	find_longest_prefixes(&prefixes, patterns);
+
+	for_each_string_list_item(prefix, &prefixes) {
+		strbuf_reset(&buf);
+		strbuf_addf(&buf, "%s%s", base, prefix->string);
+		ret = for_each_fullref_in(buf.buf, cb, cb_data, broken);
+		if (ret)
+			break;
+	}
+
+	strbuf_release(&buf);
+	string_list_clear(&prefixes, 0);
+	return ret;
 }
 
 /*
@@ -1761,9 +1915,6 @@ static int for_each_fullref_in_pattern(struct ref_filter *filter,
 				       void *cb_data,
 				       int broken)
 {
-	struct strbuf prefix = STRBUF_INIT;
-	int ret;
-
 	if (!filter->match_as_path) {
 		/*
 		 * in this case, the patterns are applied after
@@ -1773,27 +1924,42 @@ static int for_each_fullref_in_pattern(struct ref_filter *filter,
 		return for_each_fullref_in("", cb, cb_data, broken);
 	}
 
-	if (!filter->name_patterns[0]) {
-		/* no patterns; we have to look at everything */
+	if (filter->ignore_case) {
+		/*
+		 * we can't handle case-insensitive comparisons,
+		 * so just return everything and let the caller
+		 * sort it out.
+		 */
 		return for_each_fullref_in("", cb, cb_data, broken);
 	}
 
-	if (filter->name_patterns[1]) {
-		/*
-		 * multiple patterns; in theory this could still work as long
-		 * as the patterns are disjoint. We'd just make multiple calls
-		 * to for_each_ref(). But if they're not disjoint, we'd end up
-		 * reporting the same ref multiple times. So let's punt on that
-		 * for now.
-		 */
+	if (!filter->name_patterns[0]) {
+		/* no patterns; we have to look at everything */
 		return for_each_fullref_in("", cb, cb_data, broken);
 	}
 
-	find_longest_prefix(&prefix, filter->name_patterns[0]);
+	return for_each_fullref_in_prefixes("", filter->name_patterns,
+					    cb, cb_data, broken);
+}
 
-	ret = for_each_fullref_in(prefix.buf, cb, cb_data, broken);
-	strbuf_release(&prefix);
-	return ret;
+/*
+ * Iterate over the refs under `kind_prefix` ("refs/heads/" and the
+ * like), which is stripped off before the patterns are matched by
+ * match_pattern(); this lets us look only at the refs under the
+ * prefixes of the patterns.
+ */
+static int for_each_fullref_in_kind(struct ref_filter *filter,
+				    const char *kind_prefix,
+				    each_ref_fn cb,
+				    void *cb_data,
+				    int broken)
+{
+	if (filter->match_as_path || filter->ignore_case ||
+	    !filter->name_patterns || !filter->name_patterns[0])
+		return for_each_fullref_in(kind_prefix, cb, cb_data, broken);
+
+	return for_each_fullref_in_prefixes(kind_prefix, filter->name_patterns,
+					    cb, cb_data, broken);
 }
 
 /*
@@ -1979,21 +2145,36 @@ static void do_merge_filter(struct ref_filter_cbdata *ref_cbdata)
 	struct ref_filter *filter = ref_cbdata->filter;
 	struct ref_array *array = ref_cbdata->array;
 	struct commit **to_clear = xcalloc(sizeof(struct commit *), array->nr);
+	uint32_t generation;
 
-	init_revisions(&revs, NULL);
+	for (i = 0; i < array->nr; i++)
+		to_clear[i] = array->items[i]->commit;
 
-	for (i = 0; i < array->nr; i++) {
-		struct ref_array_item *item = array->items[i];
-		add_pending_object(&revs, &item->commit->object, item->refname);
-		to_clear[i] = item->commit;
-	}
+	parse_commit_or_die(filter->merge_commit);
+	generation = filter->merge_commit->generation;
+	if (generation != GENERATION_NUMBER_ZERO &&
+	    generation != GENERATION_NUMBER_INFINITY) {
+		/*
+		 * Walk down from the merge commit only as far as the
+		 * generation numbers of the refs not found yet allow.
+		 */
+		tips_reachable_from_base(filter->merge_commit,
+					 to_clear, array->nr, UNINTERESTING);
+	} else {
+		init_revisions(&revs, NULL);
 
-	filter->merge_commit->object.flags |= UNINTERESTING;
-	add_pending_object(&revs, &filter->merge_commit->object, "");
+		for (i = 0; i < array->nr; i++) {
+			struct ref_array_item *item = array->items[i];
+			add_pending_object(&revs, &item->commit->object, item->refname);
+		}
 
-	revs.limited = 1;
-	if (prepare_revision_walk(&revs))
-		die(_("revision walk setup failed"));
+		filter->merge_commit->object.flags |= UNINTERESTING;
+		add_pending_object(&revs, &filter->merge_commit->object, "");
+
+		revs.limited = 1;
+		if (prepare_revision_walk(&revs))
+			die(_("revision walk setup failed"));
+	}
 
 	old_nr = array->nr;
 	array->nr = 0;
@@ -2048,11 +2229,11 @@ int filter_refs(struct ref_array *array, struct ref_filter *filter, unsigned int
 		 * of filter_ref_kind().
 		 */
 		if (filter->kind == FILTER_REFS_BRANCHES)
-			ret = for_each_fullref_in("refs/heads/", ref_filter_handler, &ref_cbdata, broken);
+			ret = for_each_fullref_in_kind(filter, "refs/heads/", ref_filter_handler, &ref_cbdata, broken);
 		else if (filter->kind == FILTER_REFS_REMOTES)
-			ret = for_each_fullref_in("refs/remotes/", ref_filter_handler, &ref_cbdata, broken);
+			ret = for_each_fullref_in_kind(filter, "refs/remotes/", ref_filter_handler, &ref_cbdata, broken);
 		else if (filter->kind == FILTER_REFS_TAGS)
-			ret = for_each_fullref_in("refs/tags/", ref_filter_handler, &ref_cbdata, broken);
+			ret = for_each_fullref_in_kind(filter, "refs/tags/", ref_filter_handler, &ref_cbdata, broken);
 		else if (filter->kind & FILTER_REFS_ALL)
 			ret = for_each_fullref_in_pattern(filter, ref_filter_handler, &ref_cbdata, broken);
 		if (!ret && (filter->kind & FILTER_REFS_DETACHED_HEAD))
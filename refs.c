@@ -13,11 +13,12 @@
 #include "tag.h"
 #include "submodule.h"
 #include "worktree.h"
+#include "argv-array.h"
 
 /*
  * List of all available backends
  */
-static struct ref_storage_be *refs_backends = &refs_be_files;
+static struct ref_storage_be *refs_backends = &refs_be_reftable;
 
 static struct ref_storage_be *find_ref_storage_backend(const char *name)
 {
@@ -487,6 +488,15 @@ static const char *ref_rev_parse_rules[] = {
 	NULL
 };
 
+void expand_ref_prefix(struct argv_array *prefixes, const char *prefix)
+{
+	const char **p;
+	int len = strlen(prefix);
+
+	for (p = ref_rev_parse_rules; *p; p++)
+		argv_array_pushf(prefixes, *p, len, prefix);
+}
+
 int refname_match(const char *abbrev_name, const char *full_name)
 {
 	const char **p;
@@ -1641,13 +1651,38 @@ static struct ref_store *ref_store_init(const char *gitdir,
 					unsigned int flags)
 {
 	const char *be_name = "files";
-	struct ref_storage_be *be = find_ref_storage_backend(be_name);
+	struct repository_format format;
+	struct ref_storage_be *be;
 	struct ref_store *refs;
 
+	format.ref_storage = NULL;
+	if (flags & REF_STORE_MAIN) {
+		if (repository_format_ref_storage)
+			be_name = repository_format_ref_storage;
+	} else {
+		/*
+		 * This is the ref store of another repository (e.g., a
+		 * submodule), whose format we have not read yet.
+		 */
+		struct strbuf config = STRBUF_INIT;
+
+		get_common_dir_noenv(&config, gitdir);
+		strbuf_addstr(&config, "/config");
+		if (read_repository_format(&format, config.buf) >= 0 &&
+		    format.ref_storage)
+			be_name = format.ref_storage;
+		strbuf_release(&config);
+		string_list_clear(&format.unknown_extensions, 0);
+		free(format.partial_clone);
+		free(format.work_tree);
+	}
+
+	be = find_ref_storage_backend(be_name);
 	if (!be)
-		die("BUG: reference backend %s is unknown", be_name);
+		die(_("unknown ref storage format '%s'"), be_name);
 
 	refs = be->init(gitdir, flags);
+	free(format.ref_storage);
 	return refs;
 }
 
@@ -1825,6 +1860,158 @@ int ref_update_reject_duplicates(struct string_list *refnames,
 	return 0;
 }
 
+int split_head_update(struct ref_update *update,
+		      struct ref_transaction *transaction,
+		      const char *head_ref,
+		      struct string_list *affected_refnames,
+		      struct strbuf *err)
+{
+	struct string_list_item *item;
+	struct ref_update *new_update;
+
+	if ((update->flags & REF_LOG_ONLY) ||
+	    (update->flags & REF_IS_PRUNING) ||
+	    (update->flags & REF_UPDATE_VIA_HEAD))
+		return 0;
+
+	if (strcmp(update->refname, head_ref))
+		return 0;
+
+	/*
+	 * First make sure that HEAD is not already in the
+	 * transaction. This check is O(lg N) in the transaction
+	 * size, but it happens at most once per transaction.
+	 */
+	if (string_list_has_string(affected_refnames, "HEAD")) {
+		/* An entry already existed */
+		strbuf_addf(err,
+			    "multiple updates for 'HEAD' (including one "
+			    "via its referent '%s') are not allowed",
+			    update->refname);
+		return TRANSACTION_NAME_CONFLICT;
+	}
+
+	new_update = ref_transaction_add_update(
+			transaction, "HEAD",
+			update->flags | REF_LOG_ONLY | REF_NO_DEREF,
+			&update->new_oid, &update->old_oid,
+			update->msg);
+
+	/*
+	 * Add "HEAD". This insertion is O(N) in the transaction
+	 * size, but it happens at most once per transaction.
+	 * Add new_update->refname instead of a literal "HEAD".
+	 */
+	if (strcmp(new_update->refname, "HEAD"))
+		BUG("%s unexpectedly not 'HEAD'", new_update->refname);
+	item = string_list_insert(affected_refnames, new_update->refname);
+	item->util = new_update;
+
+	return 0;
+}
+
+int split_symref_update(struct ref_update *update,
+			const char *referent,
+			struct ref_transaction *transaction,
+			struct string_list *affected_refnames,
+			struct strbuf *err)
+{
+	struct string_list_item *item;
+	struct ref_update *new_update;
+	unsigned int new_flags;
+
+	/*
+	 * First make sure that referent is not already in the
+	 * transaction. This check is O(lg N) in the transaction
+	 * size, but it happens at most once per symref in a
+	 * transaction.
+	 */
+	if (string_list_has_string(affected_refnames, referent)) {
+		/* An entry already exists */
+		strbuf_addf(err,
+			    "multiple updates for '%s' (including one "
+			    "via symref '%s') are not allowed",
+			    referent, update->refname);
+		return TRANSACTION_NAME_CONFLICT;
+	}
+
+	new_flags = update->flags;
+	if (!strcmp(update->refname, "HEAD")) {
+		/*
+		 * Record that the new update came via HEAD, so that
+		 * when we process it, split_head_update() doesn't try
+		 * to add another reflog update for HEAD. Note that
+		 * this bit will be propagated if the new_update
+		 * itself needs to be split.
+		 */
+		new_flags |= REF_UPDATE_VIA_HEAD;
+	}
+
+	new_update = ref_transaction_add_update(
+			transaction, referent, new_flags,
+			&update->new_oid, &update->old_oid,
+			update->msg);
+
+	new_update->parent_update = update;
+
+	/*
+	 * Change the symbolic ref update to log only. Also, it
+	 * doesn't need to check its old OID value, as that will be
+	 * done when new_update is processed.
+	 */
+	update->flags |= REF_LOG_ONLY | REF_NO_DEREF;
+	update->flags &= ~REF_HAVE_OLD;
+
+	/*
+	 * Add the referent. This insertion is O(N) in the transaction
+	 * size, but it happens at most once per symref in a
+	 * transaction. Make sure to add new_update->refname, which will
+	 * be valid as long as affected_refnames is in use, and NOT
+	 * referent, which might soon be freed by our caller.
+	 */
+	item = string_list_insert(affected_refnames, new_update->refname);
+	if (item->util)
+		BUG("%s unexpectedly found in affected_refnames",
+		    new_update->refname);
+	item->util = new_update;
+
+	return 0;
+}
+
+const char *original_update_refname(struct ref_update *update)
+{
+	while (update->parent_update)
+		update = update->parent_update;
+
+	return update->refname;
+}
+
+int check_old_oid(struct ref_update *update, struct object_id *oid,
+		  struct strbuf *err)
+{
+	if (!(update->flags & REF_HAVE_OLD) ||
+		   !oidcmp(oid, &update->old_oid))
+		return 0;
+
+	if (is_null_oid(&update->old_oid))
+		strbuf_addf(err, "cannot lock ref '%s': "
+			    "reference already exists",
+			    original_update_refname(update));
+	else if (is_null_oid(oid))
+		strbuf_addf(err, "cannot lock ref '%s': "
+			    "reference is missing but expected %s",
+			    original_update_refname(update),
+			    oid_to_hex(&update->old_oid));
+	else
+		strbuf_addf(err, "cannot lock ref '%s': "
+			    "is at %s but expected %s",
+			    original_update_refname(update),
+			    oid_to_hex(oid),
+			    oid_to_hex(&update->old_oid));
+
+	return -1;
+}
+
 int ref_transaction_prepare(struct ref_transaction *transaction,
 			    struct strbuf *err)
 {
@@ -15,16 +15,10 @@
  * This backend uses the following flags in `ref_update::flags` for
  * internal bookkeeping purposes. Their numerical values must not
  * conflict with REF_NO_DEREF, REF_FORCE_CREATE_REFLOG, REF_HAVE_NEW,
- * REF_HAVE_OLD, or REF_IS_PRUNING, which are also stored in
- * `ref_update::flags`.
+ * REF_HAVE_OLD, REF_IS_PRUNING, REF_LOG_ONLY, or REF_UPDATE_VIA_HEAD,
+ * which are also stored in `ref_update::flags`.
  */
 
-/*
- * Used as a flag in ref_update::flags when a loose ref is being
- * pruned. This flag must only be used when REF_NO_DEREF is set.
- */
-#define REF_IS_PRUNING (1 << 4)
-
 /*
  * Flag passed to lock_ref_sha1_basic() telling it to tolerate broken
  * refs (i.e., because the reference is about to be deleted anyway).
@@ -37,19 +31,6 @@
  */
 #define REF_NEEDS_COMMIT (1 << 6)
 
-/*
- * Used as a flag in ref_update::flags when we want to log a ref
- * update but not actually perform it.  This is used when a symbolic
- * ref update is split up.
- */
-#define REF_LOG_ONLY (1 << 7)
-
-/*
- * Used as a flag in ref_update::flags when the ref_update was via an
- * update to HEAD.
- */
-#define REF_UPDATE_VIA_HEAD (1 << 8)
-
 /*
  * Used as a flag in ref_update::flags when the loose reference has
  * been deleted.
@@ -2168,180 +2149,6 @@ static struct ref_iterator *files_reflog_iterator_begin(struct ref_store *ref_st
 	}
 }
 
-/*
- * If update is a direct update of head_ref (the reference pointed to
- * by HEAD), then add an extra REF_LOG_ONLY update for HEAD.
- */
-static int split_head_update(struct ref_update *update,
-			     struct ref_transaction *transaction,
-			     const char *head_ref,
-			     struct string_list *affected_refnames,
-			     struct strbuf *err)
-{
-	struct string_list_item *item;
-	struct ref_update *new_update;
-
-	if ((update->flags & REF_LOG_ONLY) ||
-	    (update->flags & REF_IS_PRUNING) ||
-	    (update->flags & REF_UPDATE_VIA_HEAD))
-		return 0;
-
-	if (strcmp(update->refname, head_ref))
-		return 0;
-
-	/*
-	 * First make sure that HEAD is not already in the
-	 * transaction. This check is O(lg N) in the transaction
-	 * size, but it happens at most once per transaction.
-	 */
-	if (string_list_has_string(affected_refnames, "HEAD")) {
-		/* An entry already existed */
-		strbuf_addf(err,
-			    "multiple updates for 'HEAD' (including one "
-			    "via its referent '%s') are not allowed",
-			    update->refname);
-		return TRANSACTION_NAME_CONFLICT;
-	}
-
-	new_update = ref_transaction_add_update(
-			transaction, "HEAD",
-			update->flags | REF_LOG_ONLY | REF_NO_DEREF,
-			&update->new_oid, &update->old_oid,
-			update->msg);
-
-	/*
-	 * Add "HEAD". This insertion is O(N) in the transaction
-	 * size, but it happens at most once per transaction.
-	 * Add new_update->refname instead of a literal "HEAD".
-	 */
-	if (strcmp(new_update->refname, "HEAD"))
-		BUG("%s unexpectedly not 'HEAD'", new_update->refname);
-	item = string_list_insert(affected_refnames, new_update->refname);
-	item->util = new_update;
-
-	return 0;
-}
-
-/*
- * update is for a symref that points at referent and doesn't have
- * REF_NO_DEREF set. Split it into two updates:
- * - The original update, but with REF_LOG_ONLY and REF_NO_DEREF set
- * - A new, separate update for the referent reference
- * Note that the new update will itself be subject to splitting when
- * the iteration gets to it.
- */
-static int split_symref_update(struct files_ref_store *refs,
-			       struct ref_update *update,
-			       const char *referent,
-			       struct ref_transaction *transaction,
-			       struct string_list *affected_refnames,
-			       struct strbuf *err)
-{
-	struct string_list_item *item;
-	struct ref_update *new_update;
-	unsigned int new_flags;
-
-	/*
-	 * First make sure that referent is not already in the
-	 * transaction. This check is O(lg N) in the transaction
-	 * size, but it happens at most once per symref in a
-	 * transaction.
-	 */
-	if (string_list_has_string(affected_refnames, referent)) {
-		/* An entry already exists */
-		strbuf_addf(err,
-			    "multiple updates for '%s' (including one "
-			    "via symref '%s') are not allowed",
-			    referent, update->refname);
-		return TRANSACTION_NAME_CONFLICT;
-	}
-
-	new_flags = update->flags;
-	if (!strcmp(update->refname, "HEAD")) {
-		/*
-		 * Record that the new update came via HEAD, so that
-		 * when we process it, split_head_update() doesn't try
-		 * to add another reflog update for HEAD. Note that
-		 * this bit will be propagated if the new_update
-		 * itself needs to be split.
-		 */
-		new_flags |= REF_UPDATE_VIA_HEAD;
-	}
-
-	new_update = ref_transaction_add_update(
-			transaction, referent, new_flags,
-			&update->new_oid, &update->old_oid,
-			update->msg);
-
-	new_update->parent_update = update;
-
-	/*
-	 * Change the symbolic ref update to log only. Also, it
-	 * doesn't need to check its old OID value, as that will be
-	 * done when new_update is processed.
-	 */
-	update->flags |= REF_LOG_ONLY | REF_NO_DEREF;
-	update->flags &= ~REF_HAVE_OLD;
-
-	/*
-	 * Add the referent. This insertion is O(N) in the transaction
-	 * size, but it happens at most once per symref in a
-	 * transaction. Make sure to add new_update->refname, which will
-	 * be valid as long as affected_refnames is in use, and NOT
-	 * referent, which might soon be freed by our caller.
-	 */
-	item = string_list_insert(affected_refnames, new_update->refname);
-	if (item->util)
-		BUG("%s unexpectedly found in affected_refnames",
-		    new_update->refname);
-	item->util = new_update;
-
-	return 0;
-}
-
-/*
- * Return the refname under which update was originally requested.
- */
-static const char *original_update_refname(struct ref_update *update)
-{
-	while (update->parent_update)
-		update = update->parent_update;
-
-	return update->refname;
-}
-
-/*
- * Check whether the REF_HAVE_OLD and old_oid values stored in update
- * are consistent with oid, which is the reference's current value. If
- * everything is OK, return 0; otherwise, write an error message to
- * err and return -1.
- */
-static int check_old_oid(struct ref_update *update, struct object_id *oid,
-			 struct strbuf *err)
-{
-	if (!(update->flags & REF_HAVE_OLD) ||
-		   !oidcmp(oid, &update->old_oid))
-		return 0;
-
-	if (is_null_oid(&update->old_oid))
-		strbuf_addf(err, "cannot lock ref '%s': "
-			    "reference already exists",
-			    original_update_refname(update));
-	else if (is_null_oid(oid))
-		strbuf_addf(err, "cannot lock ref '%s': "
-			    "reference is missing but expected %s",
-			    original_update_refname(update),
-			    oid_to_hex(&update->old_oid));
-	else
-		strbuf_addf(err, "cannot lock ref '%s': "
-			    "is at %s but expected %s",
-			    original_update_refname(update),
-			    oid_to_hex(oid),
-			    oid_to_hex(&update->old_oid));
-
-	return -1;
-}
-
 /*
  * Prepare for carrying out update:
  * - Lock the reference referred to by update.
@@ -2425,7 +2232,7 @@ static int lock_ref_for_update(struct files_ref_store *refs,
 			 * of processing the split-off update, so we
 			 * don't have to do it here.
 			 */
-			ret = split_symref_update(refs, update,
+			ret = split_symref_update(update,
 						  referent.buf, transaction,
 						  affected_refnames, err);
 			if (ret)
@@ -11,7 +11,8 @@
  * The following flags can appear in `ref_update::flags`. Their
  * numerical values must not conflict with those of REF_NO_DEREF and
  * REF_FORCE_CREATE_REFLOG, which are also stored in
- * `ref_update::flags`.
+ * `ref_update::flags`. Backends may use the values not listed here
+ * for their own bookkeeping.
  */
 
 /*
@@ -25,6 +26,25 @@
  */
 #define REF_HAVE_OLD (1 << 3)
 
+/*
+ * Used as a flag in ref_update::flags when a loose ref is being
+ * pruned. This flag must only be used when REF_NO_DEREF is set.
+ */
+#define REF_IS_PRUNING (1 << 4)
+
+/*
+ * Used as a flag in ref_update::flags when we want to log a ref
+ * update but not actually perform it.  This is used when a symbolic
+ * ref update is split up.
+ */
+#define REF_LOG_ONLY (1 << 7)
+
+/*
+ * Used as a flag in ref_update::flags when the ref_update was via an
+ * update to HEAD.
+ */
+#define REF_UPDATE_VIA_HEAD (1 << 8)
+
 /*
  * Return the length of time to retry acquiring a loose reference lock
  * before giving up, in milliseconds:
@@ -169,6 +189,45 @@ struct ref_update *ref_transaction_add_update(
 		const struct object_id *old_oid,
 		const char *msg);
 
+/*
+ * If update is a direct update of head_ref (the reference pointed to
+ * by HEAD), then add an extra REF_LOG_ONLY update for HEAD to
+ * transaction and to the sorted list affected_refnames.
+ */
+int split_head_update(struct ref_update *update,
+		      struct ref_transaction *transaction,
+		      const char *head_ref,
+		      struct string_list *affected_refnames,
+		      struct strbuf *err);
+
+/*
+ * update is for a symref that points at referent and doesn't have
+ * REF_NO_DEREF set. Split it into two updates:
+ * - The original update, but with REF_LOG_ONLY and REF_NO_DEREF set
+ * - A new, separate update for the referent reference
+ * Note that the new update will itself be subject to splitting when
+ * the iteration gets to it.
+ */
+int split_symref_update(struct ref_update *update,
+			const char *referent,
+			struct ref_transaction *transaction,
+			struct string_list *affected_refnames,
+			struct strbuf *err);
+
+/*
+ * Return the refname under which update was originally requested.
+ */
+const char *original_update_refname(struct ref_update *update);
+
+/*
+ * Check whether the REF_HAVE_OLD and old_oid values stored in update
+ * are consistent with oid, which is the reference's current value. If
+ * everything is OK, return 0; otherwise, write an error message to
+ * err and return -1.
+ */
+int check_old_oid(struct ref_update *update, struct object_id *oid,
+		  struct strbuf *err);
+
 /*
  * Transaction states.
  *
@@ -651,6 +710,7 @@ struct ref_storage_be {
 
 extern struct ref_storage_be refs_be_files;
 extern struct ref_storage_be refs_be_packed;
+extern struct ref_storage_be refs_be_reftable;
 
 /*
  * A representation of the reference store for the main repository or
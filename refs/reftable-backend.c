@@ -0,0 +1,1626 @@
+#include "../cache.h"
+#include "../config.h"
+#include "../refs.h"
+#include "refs-internal.h"
+#include "reftable.h"
+#include "../iterator.h"
+#include "../object.h"
+#include "../dir.h"
+#include "../chdir-notify.h"
+
+/*
+ * This backend uses the following flags in `ref_update::flags` for
+ * internal bookkeeping purposes; see the corresponding flags of the
+ * files backend.
+ */
+
+/* The update deletes the reference. */
+#define REF_DELETING (1 << 5)
+
+/* The value of the reference itself has to be written. */
+#define REF_NEEDS_COMMIT (1 << 6)
+
+/*
+ * A reftable ref store keeps the references shared by all worktrees
+ * in the stack "$GIT_COMMON_DIR/reftable". A linked worktree keeps
+ * its per-worktree references (HEAD and refs/bisect/) in a second
+ * stack, "$GIT_DIR/reftable"; in the main worktree they live in the
+ * shared stack. Reflogs are stored next to the references they
+ * belong to. Pseudorefs like ORIG_HEAD are still plain files in
+ * $GIT_DIR, and are written by the generic code.
+ */
+struct reftable_ref_store {
+	struct ref_store base;
+	unsigned int store_flags;
+
+	char *gitdir;
+	char *gitcommondir;
+
+	struct reftable_stack *main_stack;
+	struct reftable_stack *worktree_stack;
+};
+
+static struct ref_store *reftable_ref_store_create(const char *gitdir,
+						   unsigned int flags)
+{
+	struct reftable_ref_store *refs = xcalloc(1, sizeof(*refs));
+	struct ref_store *ref_store = (struct ref_store *)refs;
+	struct strbuf sb = STRBUF_INIT;
+
+	base_ref_store_init(ref_store, &refs_be_reftable);
+	refs->store_flags = flags;
+
+	refs->gitdir = xstrdup(gitdir);
+	get_common_dir_noenv(&sb, gitdir);
+	refs->gitcommondir = strbuf_detach(&sb, NULL);
+
+	strbuf_addf(&sb, "%s/reftable", refs->gitcommondir);
+	refs->main_stack = reftable_stack_new(sb.buf);
+	if (strcmp(refs->gitdir, refs->gitcommondir)) {
+		strbuf_reset(&sb);
+		strbuf_addf(&sb, "%s/reftable", refs->gitdir);
+		refs->worktree_stack = reftable_stack_new(sb.buf);
+	}
+	strbuf_release(&sb);
+
+	chdir_notify_reparent("reftable-backend $GIT_DIR",
+			      &refs->gitdir);
+	chdir_notify_reparent("reftable-backend $GIT_COMMONDIR",
+			      &refs->gitcommondir);
+
+	return ref_store;
+}
+
+/*
+ * Downcast ref_store to reftable_ref_store. Die if ref_store is not
+ * a reftable_ref_store or if it lacks any of the required_flags.
+ */
+static struct reftable_ref_store *reftable_downcast(struct ref_store *ref_store,
+						    unsigned int required_flags,
+						    const char *caller)
+{
+	struct reftable_ref_store *refs;
+
+	if (ref_store->be != &refs_be_reftable)
+		die("BUG: ref_store is type \"%s\" not \"reftable\" in %s",
+		    ref_store->be->name, caller);
+
+	refs = (struct reftable_ref_store *)ref_store;
+
+	if ((refs->store_flags & required_flags) != required_flags)
+		die("BUG: operation %s requires abilities 0x%x, but only have 0x%x",
+		    caller, required_flags, refs->store_flags);
+
+	return refs;
+}
+
+/* Return the stack holding `refname` and its reflog. */
+static struct reftable_stack *stack_for(struct reftable_ref_store *refs,
+					const char *refname)
+{
+	if (refs->worktree_stack &&
+	    ref_type(refname) == REF_TYPE_PER_WORKTREE)
+		return refs->worktree_stack;
+	return refs->main_stack;
+}
+
+static int reftable_init_db(struct ref_store *ref_store, struct strbuf *err)
+{
+	struct reftable_ref_store *refs =
+		reftable_downcast(ref_store, REF_STORE_WRITE, "init_db");
+	struct strbuf sb = STRBUF_INIT;
+
+	strbuf_addf(&sb, "%s/reftable", refs->gitcommondir);
+	safe_create_dir(sb.buf, 1);
+
+	/*
+	 * Repository discovery insists on a "HEAD" file. Give it one,
+	 * which also makes older versions of Git that do not know
+	 * about the "refStorage" extension see a broken HEAD rather
+	 * than an empty repository.
+	 */
+	strbuf_reset(&sb);
+	strbuf_addf(&sb, "%s/HEAD", refs->gitdir);
+	if (!file_exists(sb.buf))
+		write_file(sb.buf, "ref: refs/heads/.invalid");
+	adjust_shared_perm(sb.buf);
+	strbuf_release(&sb);
+	return 0;
+}
+
+/*
+ * Read a pseudoref, which is stored as a file in $GIT_DIR, like the
+ * files backend does.
+ */
+static int read_pseudoref(struct reftable_ref_store *refs,
+			  const char *refname, struct object_id *oid,
+			  struct strbuf *referent, unsigned int *type)
+{
+	struct strbuf path = STRBUF_INIT;
+	struct strbuf content = STRBUF_INIT;
+	const char *p;
+	int ret = -1, save_errno;
+
+	strbuf_addf(&path, "%s/%s", refs->gitdir, refname);
+	if (strbuf_read_file(&content, path.buf, 256) < 0)
+		goto out;
+
+	strbuf_rtrim(&content);
+	if (skip_prefix(content.buf, "ref:", &p)) {
+		while (isspace(*p))
+			p++;
+		strbuf_reset(referent);
+		strbuf_addstr(referent, p);
+		*type |= REF_ISSYMREF;
+		ret = 0;
+	} else if (parse_oid_hex(content.buf, oid, &p) ||
+		   (*p && !isspace(*p))) {
+		*type |= REF_ISBROKEN;
+		errno = EINVAL;
+	} else {
+		ret = 0;
+	}
+
+out:
+	save_errno = errno;
+	strbuf_release(&path);
+	strbuf_release(&content);
+	errno = save_errno;
+	return ret;
+}
+
+static int reftable_read_raw_ref(struct ref_store *ref_store,
+				 const char *refname, struct object_id *oid,
+				 struct strbuf *referent, unsigned int *type)
+{
+	struct reftable_ref_store *refs =
+		reftable_downcast(ref_store, REF_STORE_READ, "read_raw_ref");
+	struct reftable_ref ref = REFTABLE_REF_INIT;
+	int ret = 0;
+
+	*type = 0;
+	if (ref_type(refname) == REF_TYPE_PSEUDOREF)
+		return read_pseudoref(refs, refname, oid, referent, type);
+
+	if (reftable_stack_read_ref(stack_for(refs, refname), refname, &ref)) {
+		errno = ENOENT;
+		ret = -1;
+	} else if (ref.value_type == REFTABLE_REF_SYMREF) {
+		strbuf_reset(referent);
+		strbuf_addbuf(referent, &ref.target);
+		*type |= REF_ISSYMREF;
+	} else {
+		oidcpy(oid, &ref.oid);
+	}
+	reftable_ref_release(&ref);
+	return ret;
+}
+
+/* Which of the references of a stack an iterator should return. */
+enum stack_refs {
+	STACK_ALL_REFS,
+	STACK_SHARED_REFS,
+	STACK_PER_WORKTREE_REFS
+};
+
+static int stack_refs_want(enum stack_refs which, const char *refname)
+{
+	switch (which) {
+	case STACK_SHARED_REFS:
+		return ref_type(refname) != REF_TYPE_PER_WORKTREE;
+	case STACK_PER_WORKTREE_REFS:
+		return ref_type(refname) == REF_TYPE_PER_WORKTREE;
+	default:
+		return 1;
+	}
+}
+
+struct reftable_ref_iterator {
+	struct ref_iterator base;
+
+	struct reftable_ref_store *refs;
+	struct reftable_iterator *iter;
+	enum stack_refs which;
+	unsigned int flags;
+
+	/* Scratch space for current values: */
+	struct reftable_ref ref;
+	struct object_id oid;
+};
+
+static int reftable_ref_iterator_advance(struct ref_iterator *ref_iterator)
+{
+	struct reftable_ref_iterator *iter =
+		(struct reftable_ref_iterator *)ref_iterator;
+	int ok = ITER_DONE;
+
+	while (!reftable_iterator_next_ref(iter->iter, &iter->ref)) {
+		const char *refname = iter->ref.refname.buf;
+		int flags = 0;
+
+		/* HEAD lives in the same table, but is not iterated over. */
+		if (!starts_with(refname, "refs/") ||
+		    !stack_refs_want(iter->which, refname))
+			continue;
+
+		if (iter->flags & DO_FOR_EACH_PER_WORKTREE_ONLY &&
+		    ref_type(refname) != REF_TYPE_PER_WORKTREE)
+			continue;
+
+		if (iter->ref.value_type == REFTABLE_REF_SYMREF) {
+			flags |= REF_ISSYMREF;
+			if (!refs_resolve_ref_unsafe(&iter->refs->base, refname,
+						     RESOLVE_REF_READING,
+						     &iter->oid, NULL)) {
+				oidclr(&iter->oid);
+				flags |= REF_ISBROKEN;
+			}
+		} else {
+			oidcpy(&iter->oid, &iter->ref.oid);
+		}
+
+		if (check_refname_format(refname, REFNAME_ALLOW_ONELEVEL)) {
+			if (!refname_is_safe(refname))
+				die("reftable refname is dangerous: %s", refname);
+			oidclr(&iter->oid);
+			flags |= REF_BAD_NAME | REF_ISBROKEN;
+		}
+
+		if (!(iter->flags & DO_FOR_EACH_INCLUDE_BROKEN) &&
+		    !ref_resolves_to_object(refname, &iter->oid, flags))
+			continue;
+
+		iter->base.refname = refname;
+		iter->base.oid = &iter->oid;
+		iter->base.flags = flags;
+		return ITER_OK;
+	}
+
+	if (ref_iterator_abort(ref_iterator) != ITER_DONE)
+		ok = ITER_ERROR;
+
+	return ok;
+}
+
+static int reftable_ref_iterator_peel(struct ref_iterator *ref_iterator,
+				      struct object_id *peeled)
+{
+	struct reftable_ref_iterator *iter =
+		(struct reftable_ref_iterator *)ref_iterator;
+
+	if ((iter->base.flags & (REF_ISBROKEN | REF_ISSYMREF)))
+		return -1;
+
+	/* The peeled value is recorded whenever there is one. */
+	if (iter->ref.value_type != REFTABLE_REF_VAL2)
+		return -1;
+	oidcpy(peeled, &iter->ref.peeled);
+	return 0;
+}
+
+static int reftable_ref_iterator_abort(struct ref_iterator *ref_iterator)
+{
+	struct reftable_ref_iterator *iter =
+		(struct reftable_ref_iterator *)ref_iterator;
+
+	reftable_iterator_free(iter->iter);
+	reftable_ref_release(&iter->ref);
+	base_ref_iterator_free(ref_iterator);
+	return ITER_DONE;
+}
+
+static struct ref_iterator_vtable reftable_ref_iterator_vtable = {
+	reftable_ref_iterator_advance,
+	reftable_ref_iterator_peel,
+	reftable_ref_iterator_abort
+};
+
+static struct ref_iterator *stack_ref_iterator_begin(
+		struct reftable_ref_store *refs, struct reftable_stack *st,
+		const char *prefix, unsigned int flags, enum stack_refs which)
+{
+	struct reftable_ref_iterator *iter = xcalloc(1, sizeof(*iter));
+	struct ref_iterator *ref_iterator = &iter->base;
+
+	base_ref_iterator_init(ref_iterator, &reftable_ref_iterator_vtable, 1);
+	iter->refs = refs;
+	iter->which = which;
+	iter->flags = flags;
+	strbuf_init(&iter->ref.refname, 0);
+	strbuf_init(&iter->ref.target, 0);
+	iter->iter = reftable_stack_refs(st, prefix && *prefix ? prefix : "refs/");
+	return ref_iterator;
+}
+
+static struct ref_iterator *reftable_ref_iterator_begin(
+		struct ref_store *ref_store,
+		const char *prefix, unsigned int flags)
+{
+	struct reftable_ref_store *refs;
+	struct ref_iterator *worktree_iter;
+
+	if (!(flags & DO_FOR_EACH_INCLUDE_BROKEN))
+		refs = reftable_downcast(ref_store, REF_STORE_READ | REF_STORE_ODB,
+					 "ref_iterator_begin");
+	else
+		refs = reftable_downcast(ref_store, REF_STORE_READ,
+					 "ref_iterator_begin");
+
+	if (!refs->worktree_stack)
+		return stack_ref_iterator_begin(refs, refs->main_stack, prefix,
+						flags, STACK_ALL_REFS);
+
+	worktree_iter = stack_ref_iterator_begin(refs, refs->worktree_stack,
+						 prefix, flags,
+						 STACK_PER_WORKTREE_REFS);
+	if (flags & DO_FOR_EACH_PER_WORKTREE_ONLY)
+		return worktree_iter;
+
+	/*
+	 * The shared stack may contain the per-worktree refs of the
+	 * main worktree, which must not show up here.
+	 */
+	return overlay_ref_iterator_begin(
+			worktree_iter,
+			stack_ref_iterator_begin(refs, refs->main_stack, prefix,
+						 flags, STACK_SHARED_REFS));
+}
+
+/*
+ * The records of a table to be added to a stack. Records whose
+ * update_index is 0 get the update_index of the new table.
+ */
+struct table_records {
+	struct reftable_ref *refs;
+	size_t refs_nr, refs_alloc;
+	struct reftable_log *logs;
+	size_t logs_nr, logs_alloc;
+};
+
+static struct reftable_ref *add_ref_record(struct table_records *r,
+					   const char *refname)
+{
+	struct reftable_ref *ref;
+
+	ALLOC_GROW(r->refs, r->refs_nr + 1, r->refs_alloc);
+	ref = &r->refs[r->refs_nr++];
+	memset(ref, 0, sizeof(*ref));
+	strbuf_init(&ref->refname, 0);
+	strbuf_init(&ref->target, 0);
+	strbuf_addstr(&ref->refname, refname);
+	return ref;
+}
+
+static struct reftable_log *add_log_record(struct table_records *r,
+					   const char *refname)
+{
+	struct reftable_log *log;
+
+	ALLOC_GROW(r->logs, r->logs_nr + 1, r->logs_alloc);
+	log = &r->logs[r->logs_nr++];
+	memset(log, 0, sizeof(*log));
+	strbuf_init(&log->refname, 0);
+	strbuf_init(&log->ident, 0);
+	strbuf_init(&log->message, 0);
+	strbuf_addstr(&log->refname, refname);
+	return log;
+}
+
+static void release_table_records(struct table_records *r)
+{
+	size_t i;
+
+	for (i = 0; i < r->refs_nr; i++)
+		reftable_ref_release(&r->refs[i]);
+	for (i = 0; i < r->logs_nr; i++)
+		reftable_log_release(&r->logs[i]);
+	free(r->refs);
+	free(r->logs);
+	memset(r, 0, sizeof(*r));
+}
+
+/* Set `ref` to point at `oid`, recording its peeled value if any. */
+static void ref_record_set_oid(struct reftable_ref *ref,
+			       const struct object_id *oid)
+{
+	oidcpy(&ref->oid, oid);
+	if (peel_object(oid, &ref->peeled) == PEEL_PEELED)
+		ref->value_type = REFTABLE_REF_VAL2;
+	else
+		ref->value_type = REFTABLE_REF_VAL1;
+}
+
+/*
+ * Add a new reflog entry for `refname` to `r`, with the current
+ * committer identity and the cleaned-up `msg`.
+ */
+static void add_log_entry(struct table_records *r, const char *refname,
+			  const struct object_id *old_oid,
+			  const struct object_id *new_oid, const char *msg)
+{
+	struct reftable_log *log = add_log_record(r, refname);
+	const char *committer = git_committer_info(0);
+	const char *email_end = strrchr(committer, '>');
+	char *end;
+
+	log->value_type = REFTABLE_LOG_UPDATE;
+	oidcpy(&log->old_oid, old_oid);
+	oidcpy(&log->new_oid, new_oid);
+
+	if (!email_end)
+		BUG("committer ident '%s' has no email", committer);
+	strbuf_add(&log->ident, committer, email_end + 1 - committer);
+	log->time = parse_timestamp(email_end + 1, &end, 10);
+	log->tz = strtol(end, NULL, 10);
+
+	if (msg && *msg) {
+		char *buf = xmalloc(strlen(msg) + 3);
+		int len = copy_reflog_msg(buf, msg);
+
+		/* Drop the leading tab and the trailing newline. */
+		strbuf_add(&log->message, buf + 1, len - 2);
+		free(buf);
+	}
+}
+
+/*
+ * Before a reflog is created explicitly, it consists of a single
+ * entry without an identity, which the readers skip.
+ */
+static void add_log_placeholder(struct table_records *r, const char *refname)
+{
+	struct reftable_log *log = add_log_record(r, refname);
+
+	log->value_type = REFTABLE_LOG_UPDATE;
+}
+
+static int is_log_placeholder(const struct reftable_log *log)
+{
+	return !log->ident.len;
+}
+
+/*
+ * Add deletion records to `r` for the reflog entries of `refname` in
+ * `st`, except for the ones with an update_index in `keep`, which
+ * is sorted in decreasing order.
+ */
+static void add_log_deletions(struct table_records *r,
+			      struct reftable_stack *st, const char *refname,
+			      const uint64_t *keep, size_t keep_nr)
+{
+	struct reftable_iterator *it = reftable_stack_logs(st, refname);
+	struct reftable_log log = REFTABLE_LOG_INIT;
+
+	while (!reftable_iterator_next_log(it, &log)) {
+		while (keep_nr && *keep > log.update_index) {
+			keep++;
+			keep_nr--;
+		}
+		if (keep_nr && *keep == log.update_index)
+			continue;
+
+		add_log_record(r, refname)->update_index = log.update_index;
+	}
+	reftable_log_release(&log);
+	reftable_iterator_free(it);
+}
+
+static int stack_has_log(struct reftable_stack *st, const char *refname)
+{
+	struct reftable_iterator *it = reftable_stack_logs(st, refname);
+	struct reftable_log log = REFTABLE_LOG_INIT;
+	int ret = !reftable_iterator_next_log(it, &log);
+
+	reftable_log_release(&log);
+	reftable_iterator_free(it);
+	return ret;
+}
+
+/*
+ * Return true iff an update of `refname` with `flags` should be
+ * logged, following the same rules as the files backend.
+ */
+static int should_write_log(struct reftable_stack *st, const char *refname,
+			    unsigned int flags)
+{
+	if (log_all_ref_updates == LOG_REFS_UNSET)
+		log_all_ref_updates = is_bare_repository() ? LOG_REFS_NONE : LOG_REFS_NORMAL;
+
+	return (flags & REF_FORCE_CREATE_REFLOG) ||
+		should_autocreate_reflog(refname) ||
+		stack_has_log(st, refname);
+}
+
+static int ref_record_cmp(const void *a_, const void *b_)
+{
+	const struct reftable_ref *a = a_, *b = b_;
+
+	return strcmp(a->refname.buf, b->refname.buf);
+}
+
+/* Sort by refname, then newest first; 0 stands for the newest. */
+static int log_record_cmp(const void *a_, const void *b_)
+{
+	const struct reftable_log *a = a_, *b = b_;
+	uint64_t a_index = a->update_index - 1, b_index = b->update_index - 1;
+	int cmp = strcmp(a->refname.buf, b->refname.buf);
+
+	if (cmp)
+		return cmp;
+	return a_index < b_index ? 1 : a_index > b_index ? -1 : 0;
+}
+
+/*
+ * Write the records in `r` as a new table of the locked stack `st`,
+ * which is unlocked afterwards. Release the records.
+ */
+static int write_table_records(struct reftable_stack *st,
+			       struct table_records *r, struct strbuf *err)
+{
+	struct reftable_writer *w;
+	uint64_t update_index;
+	size_t i;
+	int ret;
+
+	if (!r->refs_nr && !r->logs_nr) {
+		reftable_stack_unlock(st);
+		return 0;
+	}
+
+	update_index = reftable_stack_next_update_index(st);
+	QSORT(r->refs, r->refs_nr, ref_record_cmp);
+	QSORT(r->logs, r->logs_nr, log_record_cmp);
+
+	w = reftable_writer_new(update_index, update_index);
+	for (i = 0; i < r->refs_nr; i++) {
+		r->refs[i].update_index = update_index;
+		reftable_writer_add_ref(w, &r->refs[i]);
+	}
+	for (i = 0; i < r->logs_nr; i++) {
+		if (!r->logs[i].update_index)
+			r->logs[i].update_index = update_index;
+		reftable_writer_add_log(w, &r->logs[i]);
+	}
+
+	ret = reftable_stack_add(st, w, err);
+	reftable_writer_free(w);
+	release_table_records(r);
+	return ret;
+}
+
+struct reftable_transaction_data {
+	int main_locked;
+	int worktree_locked;
+};
+
+/* What is remembered about an update between prepare and finish. */
+struct reftable_update_data {
+	/* The value of the reference before the update: */
+	struct object_id old_oid;
+	/* Whether the reference itself exists: */
+	int exists;
+};
+
+/*
+ * Unlock the stacks, and mark the transaction closed.
+ */
+static void reftable_transaction_cleanup(struct reftable_ref_store *refs,
+					 struct ref_transaction *transaction)
+{
+	struct reftable_transaction_data *data = transaction->backend_data;
+	size_t i;
+
+	for (i = 0; i < transaction->nr; i++)
+		FREE_AND_NULL(transaction->updates[i]->backend_data);
+
+	if (data) {
+		if (data->main_locked)
+			reftable_stack_unlock(refs->main_stack);
+		if (data->worktree_locked)
+			reftable_stack_unlock(refs->worktree_stack);
+		FREE_AND_NULL(transaction->backend_data);
+	}
+
+	transaction->state = REF_TRANSACTION_CLOSED;
+}
+
+/*
+ * Prepare for carrying out update:
+ * - Read the reference, check that its old OID value (if specified)
+ *   is correct, and in any case record it for the reflog.
+ * - If it is a symref update without REF_NO_DEREF, split it up into a
+ *   REF_LOG_ONLY update of the symref and add a separate update for
+ *   the referent to transaction.
+ * - If it is an update of head_ref, add a corresponding REF_LOG_ONLY
+ *   update of HEAD.
+ * - Check that the new value can be written.
+ */
+static int prepare_update(struct reftable_ref_store *refs,
+			  struct ref_update *update,
+			  struct ref_transaction *transaction,
+			  const char *head_ref,
+			  struct string_list *affected_refnames,
+			  struct strbuf *err)
+{
+	struct strbuf referent = STRBUF_INIT;
+	struct reftable_update_data *data = xcalloc(1, sizeof(*data));
+	int mustexist = (update->flags & REF_HAVE_OLD) &&
+		!is_null_oid(&update->old_oid);
+	int ret = 0;
+
+	update->backend_data = data;
+
+	if ((update->flags & REF_HAVE_NEW) && is_null_oid(&update->new_oid))
+		update->flags |= REF_DELETING;
+
+	if (head_ref) {
+		ret = split_head_update(update, transaction, head_ref,
+					affected_refnames, err);
+		if (ret)
+			goto out;
+	}
+
+	if (!refs_read_raw_ref(&refs->base, update->refname, &data->old_oid,
+			       &referent, &update->type)) {
+		data->exists = 1;
+	} else {
+		if (mustexist) {
+			strbuf_addf(err, "cannot lock ref '%s': "
+				    "unable to resolve reference '%s'",
+				    original_update_refname(update),
+				    update->refname);
+			ret = TRANSACTION_GENERIC_ERROR;
+			goto out;
+		}
+		if (refs_verify_refname_available(&refs->base, update->refname,
+						  affected_refnames, NULL,
+						  err)) {
+			char *reason = strbuf_detach(err, NULL);
+
+			strbuf_addf(err, "cannot lock ref '%s': %s",
+				    original_update_refname(update), reason);
+			free(reason);
+			ret = TRANSACTION_NAME_CONFLICT;
+			goto out;
+		}
+		oidclr(&data->old_oid);
+		update->type = 0;
+	}
+
+	if (update->type & REF_ISSYMREF) {
+		if (update->flags & REF_NO_DEREF) {
+			/*
+			 * We won't be reading the referent as part of
+			 * the transaction, so we have to read it here
+			 * to record and possibly check old_oid:
+			 */
+			if (refs_read_ref_full(&refs->base,
+					       referent.buf, 0,
+					       &data->old_oid, NULL)) {
+				oidclr(&data->old_oid);
+				if (update->flags & REF_HAVE_OLD) {
+					strbuf_addf(err, "cannot lock ref '%s': "
+						    "error reading reference",
+						    original_update_refname(update));
+					ret = TRANSACTION_GENERIC_ERROR;
+					goto out;
+				}
+			} else if (check_old_oid(update, &data->old_oid, err)) {
+				ret = TRANSACTION_GENERIC_ERROR;
+				goto out;
+			}
+		} else {
+			ret = split_symref_update(update, referent.buf,
+						  transaction,
+						  affected_refnames, err);
+			if (ret)
+				goto out;
+		}
+	} else {
+		struct ref_update *parent_update;
+
+		if (check_old_oid(update, &data->old_oid, err)) {
+			ret = TRANSACTION_GENERIC_ERROR;
+			goto out;
+		}
+
+		/*
+		 * If this update is happening indirectly because of a
+		 * symref update, record the old OID in the parent
+		 * update:
+		 */
+		for (parent_update = update->parent_update;
+		     parent_update;
+		     parent_update = parent_update->parent_update) {
+			struct reftable_update_data *parent_data =
+				parent_update->backend_data;
+			oidcpy(&parent_data->old_oid, &data->old_oid);
+		}
+	}
+
+	if ((update->flags & REF_HAVE_NEW) &&
+	    !(update->flags & REF_DELETING) &&
+	    !(update->flags & REF_LOG_ONLY) &&
+	    ((update->type & REF_ISSYMREF) ||
+	     oidcmp(&data->old_oid, &update->new_oid))) {
+		struct object *o = parse_object(&update->new_oid);
+
+		if (!o) {
+			strbuf_addf(err, "cannot update ref '%s': "
+				    "trying to write ref '%s' with nonexistent object %s",
+				    update->refname, update->refname,
+				    oid_to_hex(&update->new_oid));
+			ret = TRANSACTION_GENERIC_ERROR;
+			goto out;
+		}
+		if (o->type != OBJ_COMMIT && is_branch(update->refname)) {
+			strbuf_addf(err, "cannot update ref '%s': "
+				    "trying to write non-commit object %s to branch '%s'",
+				    update->refname,
+				    oid_to_hex(&update->new_oid),
+				    update->refname);
+			ret = TRANSACTION_GENERIC_ERROR;
+			goto out;
+		}
+		update->flags |= REF_NEEDS_COMMIT;
+	}
+
+out:
+	strbuf_release(&referent);
+	return ret;
+}
+
+static int reftable_transaction_prepare(struct ref_store *ref_store,
+					struct ref_transaction *transaction,
+					struct strbuf *err)
+{
+	struct reftable_ref_store *refs =
+		reftable_downcast(ref_store, REF_STORE_WRITE,
+				  "ref_transaction_prepare");
+	struct string_list affected_refnames = STRING_LIST_INIT_NODUP;
+	struct reftable_transaction_data *data;
+	char *head_ref = NULL;
+	int head_type;
+	size_t i;
+	int ret = 0;
+
+	assert(err);
+
+	data = xcalloc(1, sizeof(*data));
+	transaction->backend_data = data;
+
+	if (!transaction->nr)
+		goto cleanup;
+
+	/* Fail if a refname appears more than once in the transaction. */
+	for (i = 0; i < transaction->nr; i++) {
+		struct ref_update *update = transaction->updates[i];
+
+		string_list_append(&affected_refnames,
+				   update->refname)->util = update;
+	}
+	string_list_sort(&affected_refnames);
+	if (ref_update_reject_duplicates(&affected_refnames, err)) {
+		ret = TRANSACTION_GENERIC_ERROR;
+		goto cleanup;
+	}
+
+	/*
+	 * Lock the stacks before reading anything, so that the values
+	 * we check stay valid until the transaction is finished.
+	 */
+	if (reftable_stack_lock(refs->main_stack, err)) {
+		ret = TRANSACTION_GENERIC_ERROR;
+		goto cleanup;
+	}
+	data->main_locked = 1;
+	if (refs->worktree_stack) {
+		if (reftable_stack_lock(refs->worktree_stack, err)) {
+			ret = TRANSACTION_GENERIC_ERROR;
+			goto cleanup;
+		}
+		data->worktree_locked = 1;
+	}
+
+	/*
+	 * If HEAD is a symbolic reference, then record the name of
+	 * the reference that it points to, so that a direct update
+	 * of that reference is logged in the reflog of HEAD, too; see
+	 * files_transaction_prepare().
+	 */
+	head_ref = refs_resolve_refdup(ref_store, "HEAD",
+				       RESOLVE_REF_NO_RECURSE,
+				       NULL, &head_type);
+	if (head_ref && !(head_type & REF_ISSYMREF))
+		FREE_AND_NULL(head_ref);
+
+	/* Note that prepare_update() might append more updates. */
+	for (i = 0; i < transaction->nr; i++) {
+		ret = prepare_update(refs, transaction->updates[i],
+				     transaction, head_ref,
+				     &affected_refnames, err);
+		if (ret)
+			goto cleanup;
+	}
+
+cleanup:
+	free(head_ref);
+	string_list_clear(&affected_refnames, 0);
+
+	if (ret)
+		reftable_transaction_cleanup(refs, transaction);
+	else
+		transaction->state = REF_TRANSACTION_PREPARED;
+
+	return ret;
+}
+
+/*
+ * Write `content` to the file of the pseudoref `refname`, or delete
+ * the file if `content` is NULL.
+ */
+static int write_pseudoref_file(struct reftable_ref_store *refs,
+				const char *refname, const char *content,
+				struct strbuf *err)
+{
+	struct lock_file lock = LOCK_INIT;
+	struct strbuf path = STRBUF_INIT;
+	int fd, ret = 0;
+
+	strbuf_addf(&path, "%s/%s", refs->gitdir, refname);
+	if (!content) {
+		if (unlink(path.buf) && errno != ENOENT) {
+			strbuf_addf(err, "unable to delete '%s': %s",
+				    path.buf, strerror(errno));
+			ret = -1;
+		}
+		goto out;
+	}
+
+	fd = hold_lock_file_for_update_timeout(&lock, path.buf, 0,
+					       get_files_ref_lock_timeout_ms());
+	if (fd < 0) {
+		unable_to_lock_message(path.buf, errno, err);
+		ret = -1;
+	} else if (write_str_in_full(fd, content) < 0 ||
+		   commit_lock_file(&lock) < 0) {
+		strbuf_addf(err, "couldn't write '%s'", path.buf);
+		rollback_lock_file(&lock);
+		ret = -1;
+	}
+
+out:
+	strbuf_release(&path);
+	return ret;
+}
+
+static int reftable_transaction_finish(struct ref_store *ref_store,
+				       struct ref_transaction *transaction,
+				       struct strbuf *err)
+{
+	struct reftable_ref_store *refs =
+		reftable_downcast(ref_store, 0, "ref_transaction_finish");
+	struct table_records main_records = { NULL };
+	struct table_records worktree_records = { NULL };
+	size_t i;
+	int ret = 0;
+
+	assert(err);
+
+	/*
+	 * All the records of a stack go into a single new table,
+	 * which makes the transaction atomic (per stack).
+	 */
+	for (i = 0; i < transaction->nr; i++) {
+		struct ref_update *update = transaction->updates[i];
+		struct reftable_update_data *data = update->backend_data;
+		struct reftable_stack *st = stack_for(refs, update->refname);
+		struct table_records *r = st == refs->main_stack ?
+			&main_records : &worktree_records;
+
+		/* Pseudorefs live outside of the tables, and have no reflog. */
+		if (ref_type(update->refname) == REF_TYPE_PSEUDOREF) {
+			if (update->flags & REF_NEEDS_COMMIT) {
+				char *content = xstrfmt("%s\n",
+							oid_to_hex(&update->new_oid));
+
+				ret = write_pseudoref_file(refs, update->refname,
+							   content, err);
+				free(content);
+			} else if (update->flags & REF_DELETING) {
+				ret = write_pseudoref_file(refs, update->refname,
+							   NULL, err);
+			}
+			if (ret) {
+				ret = TRANSACTION_GENERIC_ERROR;
+				goto cleanup;
+			}
+			continue;
+		}
+
+		if (update->flags & REF_NEEDS_COMMIT)
+			ref_record_set_oid(add_ref_record(r, update->refname),
+					   &update->new_oid);
+		else if ((update->flags & REF_DELETING) &&
+			 !(update->flags & REF_LOG_ONLY) && data->exists)
+			add_ref_record(r, update->refname)->value_type =
+				REFTABLE_REF_DELETION;
+
+		if (((update->flags & REF_NEEDS_COMMIT) ||
+		     ((update->flags & REF_LOG_ONLY) &&
+		      (update->flags & REF_HAVE_NEW))) &&
+		    should_write_log(st, update->refname, update->flags))
+			add_log_entry(r, update->refname, &data->old_oid,
+				      &update->new_oid, update->msg);
+
+		/* A deleted reference loses its reflog. */
+		if ((update->flags & REF_DELETING) &&
+		    !(update->flags & REF_LOG_ONLY))
+			add_log_deletions(r, st, update->refname, NULL, 0);
+	}
+
+	ret = write_table_records(refs->main_stack, &main_records, err);
+	if (refs->worktree_stack) {
+		if (ret)
+			release_table_records(&worktree_records);
+		else
+			ret = write_table_records(refs->worktree_stack,
+						  &worktree_records, err);
+	}
+	if (ret)
+		ret = TRANSACTION_GENERIC_ERROR;
+
+cleanup:
+	release_table_records(&main_records);
+	release_table_records(&worktree_records);
+	reftable_transaction_cleanup(refs, transaction);
+	return ret;
+}
+
+static int reftable_transaction_abort(struct ref_store *ref_store,
+				      struct ref_transaction *transaction,
+				      struct strbuf *err)
+{
+	struct reftable_ref_store *refs =
+		reftable_downcast(ref_store, 0, "ref_transaction_abort");
+
+	reftable_transaction_cleanup(refs, transaction);
+	return 0;
+}
+
+static int reftable_initial_transaction_commit(struct ref_store *ref_store,
+					       struct ref_transaction *transaction,
+					       struct strbuf *err)
+{
+	int ret = reftable_transaction_prepare(ref_store, transaction, err);
+
+	if (!ret)
+		ret = reftable_transaction_finish(ref_store, transaction, err);
+	return ret;
+}
+
+static int reftable_pack_refs(struct ref_store *ref_store, unsigned int flags)
+{
+	struct reftable_ref_store *refs =
+		reftable_downcast(ref_store, REF_STORE_WRITE | REF_STORE_ODB,
+				  "pack_refs");
+	struct strbuf err = STRBUF_INIT;
+	int ret = 0;
+
+	if (reftable_stack_compact_all(refs->main_stack, &err) ||
+	    (refs->worktree_stack &&
+	     reftable_stack_compact_all(refs->worktree_stack, &err)))
+		ret = error("%s", err.buf);
+	strbuf_release(&err);
+	return ret;
+}
+
+static int reftable_create_symref(struct ref_store *ref_store,
+				  const char *refname, const char *target,
+				  const char *logmsg)
+{
+	struct reftable_ref_store *refs =
+		reftable_downcast(ref_store, REF_STORE_WRITE, "create_symref");
+	struct reftable_stack *st = stack_for(refs, refname);
+	struct table_records r = { NULL };
+	struct strbuf err = STRBUF_INIT;
+	struct strbuf referent = STRBUF_INIT;
+	struct object_id old_oid, new_oid;
+	unsigned int type;
+	struct reftable_ref *ref;
+	int ret;
+
+	if (ref_type(refname) == REF_TYPE_PSEUDOREF) {
+		char *content = xstrfmt("ref: %s\n", target);
+
+		if (write_pseudoref_file(refs, refname, content, &err))
+			ret = error("%s", err.buf);
+		else
+			ret = 0;
+		free(content);
+		goto out;
+	}
+
+	if (reftable_stack_lock(st, &err)) {
+		ret = error("%s", err.buf);
+		goto out;
+	}
+
+	/* Like the files backend, log the old value of the symref itself. */
+	if (refs_read_raw_ref(&refs->base, refname, &old_oid, &referent, &type) ||
+	    (type & REF_ISSYMREF))
+		oidclr(&old_oid);
+
+	ref = add_ref_record(&r, refname);
+	ref->value_type = REFTABLE_REF_SYMREF;
+	strbuf_addstr(&ref->target, target);
+
+	if (logmsg &&
+	    !refs_read_ref_full(&refs->base, target, RESOLVE_REF_READING,
+				&new_oid, NULL) &&
+	    should_write_log(st, refname, 0))
+		add_log_entry(&r, refname, &old_oid, &new_oid, logmsg);
+
+	ret = write_table_records(st, &r, &err);
+	if (ret)
+		error("%s", err.buf);
+
+out:
+	release_table_records(&r);
+	strbuf_release(&referent);
+	strbuf_release(&err);
+	return ret;
+}
+
+static int reftable_delete_refs(struct ref_store *ref_store, const char *msg,
+				struct string_list *refnames, unsigned int flags)
+{
+	struct ref_transaction *transaction;
+	struct strbuf err = STRBUF_INIT;
+	int i, ret = 0;
+
+	if (!refnames->nr)
+		return 0;
+
+	transaction = ref_store_transaction_begin(ref_store, &err);
+	if (!transaction)
+		goto error;
+
+	for (i = 0; i < refnames->nr; i++)
+		if (ref_transaction_delete(transaction, refnames->items[i].string,
+					   NULL, flags, msg, &err))
+			goto error;
+
+	if (ref_transaction_commit(transaction, &err))
+		goto error;
+	goto out;
+
+error:
+	if (refnames->nr == 1)
+		ret = error(_("could not delete reference %s: %s"),
+			    refnames->items[0].string, err.buf);
+	else
+		ret = error(_("could not delete references: %s"), err.buf);
+
+out:
+	ref_transaction_free(transaction);
+	strbuf_release(&err);
+	return ret;
+}
+
+static int reftable_copy_or_rename_ref(struct ref_store *ref_store,
+				       const char *oldrefname,
+				       const char *newrefname,
+				       const char *logmsg, int copy)
+{
+	struct reftable_ref_store *refs =
+		reftable_downcast(ref_store, REF_STORE_WRITE, "rename_ref");
+	struct reftable_stack *st = stack_for(refs, oldrefname);
+	struct table_records r = { NULL };
+	struct strbuf err = STRBUF_INIT;
+	struct reftable_iterator *it;
+	struct reftable_log log = REFTABLE_LOG_INIT;
+	uint64_t *copied = NULL;
+	size_t copied_nr = 0, copied_alloc = 0;
+	struct object_id orig_oid;
+	int flag = 0, ret;
+
+	/* Renaming a reference to itself only adds to its reflog. */
+	if (!strcmp(oldrefname, newrefname))
+		copy = 1;
+
+	if (st != stack_for(refs, newrefname))
+		return error("cannot move %s to %s: they are stored in different places",
+			     oldrefname, newrefname);
+
+	if (reftable_stack_lock(st, &err)) {
+		ret = error("%s", err.buf);
+		goto out;
+	}
+
+	if (!refs_resolve_ref_unsafe(&refs->base, oldrefname,
+				     RESOLVE_REF_READING | RESOLVE_REF_NO_RECURSE,
+				     &orig_oid, &flag)) {
+		ret = error("refname %s not found", oldrefname);
+		goto out;
+	}
+
+	if (flag & REF_ISSYMREF) {
+		if (copy)
+			ret = error("refname %s is a symbolic ref, copying it is not supported",
+				    oldrefname);
+		else
+			ret = error("refname %s is a symbolic ref, renaming it is not supported",
+				    oldrefname);
+		goto out;
+	}
+	if (!refs_rename_ref_available(&refs->base, oldrefname, newrefname)) {
+		ret = 1;
+		goto out;
+	}
+
+	/*
+	 * Everything goes into a single table: the reflog moves (or
+	 * is copied) to the new name, replacing whatever reflog the
+	 * new name had, followed by an entry for the rename itself.
+	 */
+	it = reftable_stack_logs(st, oldrefname);
+	while (!reftable_iterator_next_log(it, &log)) {
+		struct reftable_log *copy_log = add_log_record(&r, newrefname);
+
+		copy_log->update_index = log.update_index;
+		copy_log->value_type = log.value_type;
+		oidcpy(&copy_log->old_oid, &log.old_oid);
+		oidcpy(&copy_log->new_oid, &log.new_oid);
+		strbuf_addbuf(&copy_log->ident, &log.ident);
+		copy_log->time = log.time;
+		copy_log->tz = log.tz;
+		strbuf_addbuf(&copy_log->message, &log.message);
+
+		ALLOC_GROW(copied, copied_nr + 1, copied_alloc);
+		copied[copied_nr++] = log.update_index;
+	}
+	reftable_iterator_free(it);
+
+	add_log_deletions(&r, st, newrefname, copied, copied_nr);
+	if (!copy) {
+		add_ref_record(&r, oldrefname)->value_type = REFTABLE_REF_DELETION;
+		add_log_deletions(&r, st, oldrefname, NULL, 0);
+	}
+
+	ref_record_set_oid(add_ref_record(&r, newrefname), &orig_oid);
+	if (copied_nr || should_write_log(st, newrefname, 0))
+		add_log_entry(&r, newrefname, &orig_oid, &orig_oid, logmsg);
+
+	ret = write_table_records(st, &r, &err);
+	if (ret)
+		ret = error(_("unable to write '%s': %s"), newrefname, err.buf);
+
+out:
+	reftable_stack_unlock(st);
+	release_table_records(&r);
+	reftable_log_release(&log);
+	free(copied);
+	strbuf_release(&err);
+	return ret;
+}
+
+static int reftable_rename_ref(struct ref_store *ref_store,
+			       const char *oldrefname, const char *newrefname,
+			       const char *logmsg)
+{
+	return reftable_copy_or_rename_ref(ref_store, oldrefname, newrefname,
+					   logmsg, 0);
+}
+
+static int reftable_copy_ref(struct ref_store *ref_store,
+			     const char *oldrefname, const char *newrefname,
+			     const char *logmsg)
+{
+	return reftable_copy_or_rename_ref(ref_store, oldrefname, newrefname,
+					   logmsg, 1);
+}
+
+struct reftable_reflog_iterator {
+	struct ref_iterator base;
+
+	struct reftable_ref_store *refs;
+	struct reftable_iterator *iter;
+	enum stack_refs which;
+
+	struct reftable_log log;
+	struct strbuf refname;
+	struct object_id oid;
+};
+
+static int reftable_reflog_iterator_advance(struct ref_iterator *ref_iterator)
+{
+	struct reftable_reflog_iterator *iter =
+		(struct reftable_reflog_iterator *)ref_iterator;
+	int ok = ITER_DONE;
+
+	while (!reftable_iterator_next_log(iter->iter, &iter->log)) {
+		int flags;
+
+		/* The entries of a reflog are next to each other. */
+		if (iter->refname.len && !strbuf_cmp(&iter->refname,
+						     &iter->log.refname))
+			continue;
+		strbuf_reset(&iter->refname);
+		strbuf_addbuf(&iter->refname, &iter->log.refname);
+
+		if (!stack_refs_want(iter->which, iter->refname.buf))
+			continue;
+
+		if (refs_read_ref_full(&iter->refs->base, iter->refname.buf, 0,
+				       &iter->oid, &flags)) {
+			error("bad ref for %s", iter->refname.buf);
+			continue;
+		}
+
+		iter->base.refname = iter->refname.buf;
+		iter->base.oid = &iter->oid;
+		iter->base.flags = flags;
+		return ITER_OK;
+	}
+
+	if (ref_iterator_abort(ref_iterator) != ITER_DONE)
+		ok = ITER_ERROR;
+
+	return ok;
+}
+
+static int reftable_reflog_iterator_peel(struct ref_iterator *ref_iterator,
+					 struct object_id *peeled)
+{
+	die("BUG: ref_iterator_peel() called for reflog_iterator");
+}
+
+static int reftable_reflog_iterator_abort(struct ref_iterator *ref_iterator)
+{
+	struct reftable_reflog_iterator *iter =
+		(struct reftable_reflog_iterator *)ref_iterator;
+
+	reftable_iterator_free(iter->iter);
+	reftable_log_release(&iter->log);
+	strbuf_release(&iter->refname);
+	base_ref_iterator_free(ref_iterator);
+	return ITER_DONE;
+}
+
+static struct ref_iterator_vtable reftable_reflog_iterator_vtable = {
+	reftable_reflog_iterator_advance,
+	reftable_reflog_iterator_peel,
+	reftable_reflog_iterator_abort
+};
+
+static struct ref_iterator *stack_reflog_iterator_begin(
+		struct reftable_ref_store *refs, struct reftable_stack *st,
+		enum stack_refs which)
+{
+	struct reftable_reflog_iterator *iter = xcalloc(1, sizeof(*iter));
+	struct ref_iterator *ref_iterator = &iter->base;
+
+	base_ref_iterator_init(ref_iterator, &reftable_reflog_iterator_vtable, 1);
+	iter->refs = refs;
+	iter->which = which;
+	strbuf_init(&iter->log.refname, 0);
+	strbuf_init(&iter->log.ident, 0);
+	strbuf_init(&iter->log.message, 0);
+	strbuf_init(&iter->refname, 0);
+	iter->iter = reftable_stack_logs(st, NULL);
+	return ref_iterator;
+}
+
+static struct ref_iterator *reftable_reflog_iterator_begin(struct ref_store *ref_store)
+{
+	struct reftable_ref_store *refs =
+		reftable_downcast(ref_store, REF_STORE_READ,
+				  "reflog_iterator_begin");
+
+	if (!refs->worktree_stack)
+		return stack_reflog_iterator_begin(refs, refs->main_stack,
+						   STACK_ALL_REFS);
+
+	return overlay_ref_iterator_begin(
+			stack_reflog_iterator_begin(refs, refs->worktree_stack,
+						    STACK_PER_WORKTREE_REFS),
+			stack_reflog_iterator_begin(refs, refs->main_stack,
+						    STACK_SHARED_REFS));
+}
+
+static int show_log(struct reftable_log *log, struct strbuf *message,
+		    each_reflog_ent_fn fn, void *cb_data)
+{
+	strbuf_reset(message);
+	strbuf_addbuf(message, &log->message);
+	strbuf_addch(message, '\n');
+	return fn(&log->old_oid, &log->new_oid, log->ident.buf,
+		  log->time, log->tz, message->buf, cb_data);
+}
+
+/*
+ * Read all reflog entries of `refname`, newest first, into `logs`.
+ * Return -1 if there is no reflog.
+ */
+static int read_logs(struct reftable_stack *st, const char *refname,
+		     struct reftable_log **logs, size_t *nr)
+{
+	struct reftable_iterator *it = reftable_stack_logs(st, refname);
+	size_t alloc = 0;
+	int found = 0;
+
+	*logs = NULL;
+	*nr = 0;
+	for (;;) {
+		struct reftable_log *log;
+
+		ALLOC_GROW(*logs, *nr + 1, alloc);
+		log = &(*logs)[*nr];
+		memset(log, 0, sizeof(*log));
+		strbuf_init(&log->refname, 0);
+		strbuf_init(&log->ident, 0);
+		strbuf_init(&log->message, 0);
+		if (reftable_iterator_next_log(it, log)) {
+			reftable_log_release(log);
+			break;
+		}
+		found = 1;
+		if (is_log_placeholder(log))
+			reftable_log_release(log);
+		else
+			(*nr)++;
+	}
+	reftable_iterator_free(it);
+	return found ? 0 : -1;
+}
+
+static void release_logs(struct reftable_log *logs, size_t nr)
+{
+	size_t i;
+
+	for (i = 0; i < nr; i++)
+		reftable_log_release(&logs[i]);
+	free(logs);
+}
+
+static int reftable_for_each_reflog_ent(struct ref_store *ref_store,
+					const char *refname,
+					each_reflog_ent_fn fn, void *cb_data)
+{
+	struct reftable_ref_store *refs =
+		reftable_downcast(ref_store, REF_STORE_READ,
+				  "for_each_reflog_ent");
+	struct strbuf message = STRBUF_INIT;
+	struct reftable_log *logs;
+	size_t nr, i;
+	int ret = 0;
+
+	if (read_logs(stack_for(refs, refname), refname, &logs, &nr))
+		return -1;
+
+	for (i = nr; !ret && i--; )
+		ret = show_log(&logs[i], &message, fn, cb_data);
+
+	release_logs(logs, nr);
+	strbuf_release(&message);
+	return ret;
+}
+
+static int reftable_for_each_reflog_ent_reverse(struct ref_store *ref_store,
+						const char *refname,
+						each_reflog_ent_fn fn,
+						void *cb_data)
+{
+	struct reftable_ref_store *refs =
+		reftable_downcast(ref_store, REF_STORE_READ,
+				  "for_each_reflog_ent_reverse");
+	struct reftable_iterator *it =
+		reftable_stack_logs(stack_for(refs, refname), refname);
+	struct reftable_log log = REFTABLE_LOG_INIT;
+	struct strbuf message = STRBUF_INIT;
+	int found = 0, ret = 0;
+
+	while (!ret && !reftable_iterator_next_log(it, &log)) {
+		found = 1;
+		if (!is_log_placeholder(&log))
+			ret = show_log(&log, &message, fn, cb_data);
+	}
+
+	reftable_iterator_free(it);
+	reftable_log_release(&log);
+	strbuf_release(&message);
+	return found ? ret : -1;
+}
+
+static int reftable_reflog_exists(struct ref_store *ref_store,
+				  const char *refname)
+{
+	struct reftable_ref_store *refs =
+		reftable_downcast(ref_store, REF_STORE_READ, "reflog_exists");
+
+	return stack_has_log(stack_for(refs, refname), refname);
+}
+
+static int reftable_create_reflog(struct ref_store *ref_store,
+				  const char *refname, int force_create,
+				  struct strbuf *err)
+{
+	struct reftable_ref_store *refs =
+		reftable_downcast(ref_store, REF_STORE_WRITE, "create_reflog");
+	struct reftable_stack *st = stack_for(refs, refname);
+	struct table_records r = { NULL };
+
+	if (log_all_ref_updates == LOG_REFS_UNSET)
+		log_all_ref_updates = is_bare_repository() ? LOG_REFS_NONE : LOG_REFS_NORMAL;
+	if (!force_create && !should_autocreate_reflog(refname))
+		return 0;
+
+	if (reftable_stack_lock(st, err))
+		return -1;
+	if (!stack_has_log(st, refname))
+		add_log_placeholder(&r, refname);
+	return write_table_records(st, &r, err);
+}
+
+static int reftable_delete_reflog(struct ref_store *ref_store,
+				  const char *refname)
+{
+	struct reftable_ref_store *refs =
+		reftable_downcast(ref_store, REF_STORE_WRITE, "delete_reflog");
+	struct reftable_stack *st = stack_for(refs, refname);
+	struct table_records r = { NULL };
+	struct strbuf err = STRBUF_INIT;
+	int ret = 0;
+
+	if (reftable_stack_lock(st, &err)) {
+		ret = error("%s", err.buf);
+		goto out;
+	}
+	add_log_deletions(&r, st, refname, NULL, 0);
+	if (write_table_records(st, &r, &err))
+		ret = error("%s", err.buf);
+
+out:
+	release_table_records(&r);
+	strbuf_release(&err);
+	return ret;
+}
+
+static int reftable_reflog_expire(struct ref_store *ref_store,
+				  const char *refname, const struct object_id *oid,
+				  unsigned int flags,
+				  reflog_expiry_prepare_fn prepare_fn,
+				  reflog_expiry_should_prune_fn should_prune_fn,
+				  reflog_expiry_cleanup_fn cleanup_fn,
+				  void *policy_cb_data)
+{
+	struct reftable_ref_store *refs =
+		reftable_downcast(ref_store, REF_STORE_WRITE, "reflog_expire");
+	struct reftable_stack *st = stack_for(refs, refname);
+	struct table_records r = { NULL };
+	struct strbuf err = STRBUF_INIT;
+	struct strbuf message = STRBUF_INIT;
+	struct strbuf referent = STRBUF_INIT;
+	struct object_id last_kept_oid, ref_oid;
+	struct reftable_log *logs;
+	unsigned int type = 0;
+	size_t nr, i;
+	int status = 0;
+
+	/*
+	 * The reflog and the reference live in the same stack, so
+	 * locking it protects both of them.
+	 */
+	if (reftable_stack_lock(st, &err)) {
+		error("cannot lock ref '%s': %s", refname, err.buf);
+		strbuf_release(&err);
+		return -1;
+	}
+	if (read_logs(st, refname, &logs, &nr)) {
+		reftable_stack_unlock(st);
+		return 0;
+	}
+	if (refs_read_raw_ref(&refs->base, refname, &ref_oid, &referent, &type))
+		oidclr(&ref_oid);
+
+	oidclr(&last_kept_oid);
+	(*prepare_fn)(refname, oid, policy_cb_data);
+	for (i = nr; i--; ) {
+		struct reftable_log *log = &logs[i];
+		struct object_id *ooid = &log->old_oid;
+
+		if (flags & EXPIRE_REFLOGS_REWRITE)
+			ooid = &last_kept_oid;
+
+		strbuf_reset(&message);
+		strbuf_addbuf(&message, &log->message);
+		strbuf_addch(&message, '\n');
+
+		if ((*should_prune_fn)(ooid, &log->new_oid, log->ident.buf,
+				       log->time, log->tz, message.buf,
+				       policy_cb_data)) {
+			if (flags & EXPIRE_REFLOGS_DRY_RUN)
+				printf("would prune %s", message.buf);
+			else if (flags & EXPIRE_REFLOGS_VERBOSE)
+				printf("prune %s", message.buf);
+			add_log_record(&r, refname)->update_index =
+				log->update_index;
+		} else {
+			if (oidcmp(ooid, &log->old_oid)) {
+				struct reftable_log *rewritten =
+					add_log_record(&r, refname);
+
+				rewritten->update_index = log->update_index;
+				rewritten->value_type = REFTABLE_LOG_UPDATE;
+				oidcpy(&rewritten->old_oid, ooid);
+				oidcpy(&rewritten->new_oid, &log->new_oid);
+				strbuf_addbuf(&rewritten->ident, &log->ident);
+				rewritten->time = log->time;
+				rewritten->tz = log->tz;
+				strbuf_addbuf(&rewritten->message, &log->message);
+			}
+			oidcpy(&last_kept_oid, &log->new_oid);
+			if (flags & EXPIRE_REFLOGS_VERBOSE)
+				printf("keep %s", message.buf);
+		}
+	}
+	(*cleanup_fn)(policy_cb_data);
+
+	if (flags & EXPIRE_REFLOGS_DRY_RUN) {
+		reftable_stack_unlock(st);
+	} else {
+		/*
+		 * It doesn't make sense to adjust a reference pointed
+		 * to by a symbolic ref based on expiring entries in
+		 * the symbolic reference's reflog. Nor can we update
+		 * a reference if there are no remaining reflog
+		 * entries.
+		 */
+		if ((flags & EXPIRE_REFLOGS_UPDATE_REF) &&
+		    !(type & REF_ISSYMREF) &&
+		    !is_null_oid(&last_kept_oid) &&
+		    oidcmp(&last_kept_oid, &ref_oid))
+			ref_record_set_oid(add_ref_record(&r, refname),
+					   &last_kept_oid);
+
+		if (write_table_records(st, &r, &err))
+			status = error("unable to write reflog '%s': %s",
+				       refname, err.buf);
+	}
+
+	release_table_records(&r);
+	release_logs(logs, nr);
+	strbuf_release(&message);
+	strbuf_release(&referent);
+	strbuf_release(&err);
+	return status;
+}
+
+struct ref_storage_be refs_be_reftable = {
+	&refs_be_files,
+	"reftable",
+	reftable_ref_store_create,
+	reftable_init_db,
+	reftable_transaction_prepare,
+	reftable_transaction_finish,
+	reftable_transaction_abort,
+	reftable_initial_transaction_commit,
+
+	reftable_pack_refs,
+	reftable_create_symref,
+	reftable_delete_refs,
+	reftable_rename_ref,
+	reftable_copy_ref,
+
+	reftable_ref_iterator_begin,
+	reftable_read_raw_ref,
+
+	reftable_reflog_iterator_begin,
+	reftable_for_each_reflog_ent,
+	reftable_for_each_reflog_ent_reverse,
+	reftable_reflog_exists,
+	reftable_create_reflog,
+	reftable_delete_reflog,
+	reftable_reflog_expire
+};
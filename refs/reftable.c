@@ -0,0 +1,1576 @@
+#include "../cache.h"
+#include "../refs.h"
+#include "refs-internal.h"
+#include "reftable.h"
+#include "../lockfile.h"
+#include "../tempfile.h"
+#include "../varint.h"
+#include "../chdir-notify.h"
+
+/*
+ * A table starts with a header, followed by the blocks holding the
+ * ref records, an optional index of these blocks, the blocks
+ * holding the log records and their optional index. It ends with a
+ * footer holding a copy of the header, the offsets of the indexes
+ * and of the log blocks, and a checksum.
+ */
+#define REFTABLE_SIGNATURE "REFT"
+#define REFTABLE_VERSION 1
+#define HEADER_SIZE 24
+#define FOOTER_SIZE (HEADER_SIZE + 3 * 8 + 4)
+
+#define BLOCK_TYPE_REF 'r'
+#define BLOCK_TYPE_LOG 'g'
+#define BLOCK_TYPE_INDEX 'i'
+#define BLOCK_HEADER_SIZE 4
+
+/*
+ * Blocks are filled up to this size, except for the index blocks,
+ * which are always written as a single block.
+ */
+#define DEFAULT_BLOCK_SIZE 4096
+#define MAX_BLOCK_LEN 0xffffff
+
+/* Every this many records, a key is stored in full. */
+#define RESTART_INTERVAL 16
+#define MAX_RESTARTS 0xffff
+
+static void put_be16(unsigned char *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void put_be24(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 16;
+	p[1] = v >> 8;
+	p[2] = v;
+}
+
+static uint32_t get_be24(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | (uint32_t)p[2];
+}
+
+static void strbuf_add_varint(struct strbuf *sb, uint64_t value)
+{
+	unsigned char buf[16];
+	int len = encode_varint(value, buf);
+
+	strbuf_add(sb, buf, len);
+}
+
+/*
+ * Decode a varint from *p without reading past end. Return -1 if
+ * the data is truncated.
+ */
+static int get_varint(const unsigned char **p, const unsigned char *end,
+		      uint64_t *value)
+{
+	const unsigned char *q = *p;
+
+	while (q < end && (*q & 0x80))
+		q++;
+	if (q >= end)
+		return -1;
+	*value = decode_varint(p);
+	return 0;
+}
+
+static int skip_bytes(const unsigned char **p, const unsigned char *end,
+		      uint64_t n)
+{
+	if (n > (uint64_t)(end - *p))
+		return -1;
+	*p += n;
+	return 0;
+}
+
+static int key_cmp(const struct strbuf *a, const char *b, size_t b_len)
+{
+	int cmp = memcmp(a->buf, b, a->len < b_len ? a->len : b_len);
+
+	if (cmp)
+		return cmp;
+	return a->len < b_len ? -1 : a->len != b_len;
+}
+
+/*
+ * Log records are keyed by the refname, a NUL, and the reversed
+ * update_index, so that the entries of a ref are sorted newest first.
+ */
+static void log_key(struct strbuf *key, const char *refname,
+		    uint64_t update_index)
+{
+	unsigned char buf[8];
+
+	strbuf_reset(key);
+	strbuf_addstr(key, refname);
+	strbuf_addch(key, '\0');
+	put_be64(buf, ~update_index);
+	strbuf_add(key, buf, sizeof(buf));
+}
+
+void reftable_ref_release(struct reftable_ref *ref)
+{
+	strbuf_release(&ref->refname);
+	strbuf_release(&ref->target);
+}
+
+void reftable_log_release(struct reftable_log *log)
+{
+	strbuf_release(&log->refname);
+	strbuf_release(&log->ident);
+	strbuf_release(&log->message);
+}
+
+/*
+ * Writing tables
+ */
+
+struct writer_index_entry {
+	char *key;
+	size_t key_len;
+	uint64_t offset;
+};
+
+struct reftable_writer {
+	struct strbuf buf;
+	uint64_t min_update_index;
+	uint64_t max_update_index;
+	size_t block_size;
+
+	/* The type of the section being written, or 0. */
+	char section;
+	int logs_started;
+	size_t section_entries;
+
+	/* The block being written. */
+	size_t block_start;
+	size_t block_entries;
+	uint32_t *restarts;
+	size_t restarts_nr, restarts_alloc;
+	struct strbuf last_key;
+
+	/* The last key and offset of the blocks of the section. */
+	struct writer_index_entry *index;
+	size_t index_nr, index_alloc;
+
+	uint64_t ref_index_offset;
+	uint64_t log_offset;
+	uint64_t log_index_offset;
+
+	struct strbuf key;
+	struct strbuf value;
+	struct strbuf record;
+};
+
+struct reftable_writer *reftable_writer_new(uint64_t min_update_index,
+					    uint64_t max_update_index)
+{
+	struct reftable_writer *w = xcalloc(1, sizeof(*w));
+	unsigned char *header;
+
+	if (min_update_index > max_update_index)
+		BUG("reftable update_index range %"PRIuMAX"-%"PRIuMAX" is empty",
+		    (uintmax_t)min_update_index, (uintmax_t)max_update_index);
+
+	strbuf_init(&w->buf, 0);
+	strbuf_init(&w->last_key, 0);
+	strbuf_init(&w->key, 0);
+	strbuf_init(&w->value, 0);
+	strbuf_init(&w->record, 0);
+	w->min_update_index = min_update_index;
+	w->max_update_index = max_update_index;
+	w->block_size = DEFAULT_BLOCK_SIZE;
+
+	strbuf_grow(&w->buf, HEADER_SIZE);
+	header = (unsigned char *)w->buf.buf;
+	memcpy(header, REFTABLE_SIGNATURE, 4);
+	header[4] = REFTABLE_VERSION;
+	put_be24(header + 5, w->block_size);
+	put_be64(header + 8, min_update_index);
+	put_be64(header + 16, max_update_index);
+	strbuf_setlen(&w->buf, HEADER_SIZE);
+	return w;
+}
+
+void reftable_writer_free(struct reftable_writer *w)
+{
+	size_t i;
+
+	if (!w)
+		return;
+	for (i = 0; i < w->index_nr; i++)
+		free(w->index[i].key);
+	free(w->index);
+	free(w->restarts);
+	strbuf_release(&w->buf);
+	strbuf_release(&w->last_key);
+	strbuf_release(&w->key);
+	strbuf_release(&w->value);
+	strbuf_release(&w->record);
+	free(w);
+}
+
+static void writer_start_block(struct reftable_writer *w, char type)
+{
+	w->block_start = w->buf.len;
+	w->block_entries = 0;
+	w->restarts_nr = 0;
+	strbuf_addch(&w->buf, type);
+	strbuf_addchars(&w->buf, 0, BLOCK_HEADER_SIZE - 1);
+}
+
+static void writer_finish_block(struct reftable_writer *w)
+{
+	unsigned char buf[3];
+	size_t i, len;
+
+	for (i = 0; i < w->restarts_nr; i++) {
+		put_be24(buf, w->restarts[i]);
+		strbuf_add(&w->buf, buf, 3);
+	}
+	put_be16(buf, w->restarts_nr);
+	strbuf_add(&w->buf, buf, 2);
+
+	len = w->buf.len - w->block_start;
+	if (len > MAX_BLOCK_LEN)
+		die(_("reftable block of %"PRIuMAX" bytes is too large"),
+		    (uintmax_t)len);
+	put_be24((unsigned char *)w->buf.buf + w->block_start + 1, len);
+}
+
+/*
+ * Finish the current block and remember its last key for the index
+ * of the section.
+ */
+static void writer_flush_block(struct reftable_writer *w)
+{
+	struct writer_index_entry *e;
+
+	writer_finish_block(w);
+
+	ALLOC_GROW(w->index, w->index_nr + 1, w->index_alloc);
+	e = &w->index[w->index_nr++];
+	e->key = xmemdupz(w->last_key.buf, w->last_key.len);
+	e->key_len = w->last_key.len;
+	e->offset = w->block_start;
+}
+
+static void encode_record(struct strbuf *out, const struct strbuf *prev,
+			  const struct strbuf *key, unsigned int value_type,
+			  const struct strbuf *value, int restart)
+{
+	size_t prefix = 0;
+
+	if (!restart)
+		while (prefix < prev->len && prefix < key->len &&
+		       prev->buf[prefix] == key->buf[prefix])
+			prefix++;
+
+	strbuf_reset(out);
+	strbuf_add_varint(out, prefix);
+	strbuf_add_varint(out, ((uint64_t)(key->len - prefix) << 3) | value_type);
+	strbuf_add(out, key->buf + prefix, key->len - prefix);
+	strbuf_addbuf(out, value);
+}
+
+/*
+ * Append a record made of w->key and w->value to the current block,
+ * starting a new block first if it would grow beyond `limit` bytes.
+ */
+static void writer_add_record(struct reftable_writer *w, unsigned int value_type,
+			      size_t limit)
+{
+	int restart = !(w->block_entries % RESTART_INTERVAL) &&
+		w->restarts_nr < MAX_RESTARTS;
+
+	if (w->section_entries &&
+	    strbuf_cmp(&w->last_key, &w->key) >= 0)
+		BUG("reftable records added out of order");
+
+	encode_record(&w->record, &w->last_key, &w->key, value_type,
+		      &w->value, restart);
+	if (w->block_entries &&
+	    w->buf.len - w->block_start + w->record.len +
+	    3 * (w->restarts_nr + restart) + 2 > limit) {
+		writer_flush_block(w);
+		writer_start_block(w, w->section);
+		restart = 1;
+		encode_record(&w->record, &w->last_key, &w->key, value_type,
+			      &w->value, restart);
+	}
+
+	if (restart) {
+		ALLOC_GROW(w->restarts, w->restarts_nr + 1, w->restarts_alloc);
+		w->restarts[w->restarts_nr++] = w->buf.len - w->block_start;
+	}
+	strbuf_addbuf(&w->buf, &w->record);
+	w->block_entries++;
+	w->section_entries++;
+	strbuf_reset(&w->last_key);
+	strbuf_addbuf(&w->last_key, &w->key);
+}
+
+static void writer_begin_section(struct reftable_writer *w, char type)
+{
+	w->section = type;
+	w->section_entries = 0;
+	strbuf_reset(&w->last_key);
+	writer_start_block(w, type);
+}
+
+/*
+ * Finish the section being written. If it spans several blocks,
+ * write an index of them and return its offset; otherwise return 0.
+ */
+static uint64_t writer_end_section(struct reftable_writer *w)
+{
+	uint64_t index_offset = 0;
+	size_t i;
+
+	if (!w->section)
+		return 0;
+
+	if (!w->block_entries) {
+		/* Drop the header of the empty block. */
+		strbuf_setlen(&w->buf, w->block_start);
+	} else {
+		writer_flush_block(w);
+	}
+
+	if (w->index_nr > 1) {
+		index_offset = w->buf.len;
+		writer_begin_section(w, BLOCK_TYPE_INDEX);
+		for (i = 0; i < w->index_nr; i++) {
+			strbuf_reset(&w->key);
+			strbuf_add(&w->key, w->index[i].key, w->index[i].key_len);
+			strbuf_reset(&w->value);
+			strbuf_add_varint(&w->value, w->index[i].offset);
+			writer_add_record(w, 0, SIZE_MAX);
+		}
+		writer_finish_block(w);
+	}
+
+	for (i = 0; i < w->index_nr; i++)
+		free(w->index[i].key);
+	w->index_nr = 0;
+	w->section = 0;
+	return index_offset;
+}
+
+void reftable_writer_add_ref(struct reftable_writer *w,
+			     const struct reftable_ref *ref)
+{
+	if (w->logs_started)
+		BUG("reftable ref record added after log records");
+	if (!w->section)
+		writer_begin_section(w, BLOCK_TYPE_REF);
+	if (ref->update_index < w->min_update_index ||
+	    ref->update_index > w->max_update_index)
+		BUG("reftable ref record for '%s' outside of the table's update_index range",
+		    ref->refname.buf);
+
+	strbuf_reset(&w->key);
+	strbuf_addbuf(&w->key, &ref->refname);
+
+	strbuf_reset(&w->value);
+	strbuf_add_varint(&w->value, ref->update_index - w->min_update_index);
+	switch (ref->value_type) {
+	case REFTABLE_REF_DELETION:
+		break;
+	case REFTABLE_REF_VAL2:
+		strbuf_add(&w->value, ref->oid.hash, the_hash_algo->rawsz);
+		strbuf_add(&w->value, ref->peeled.hash, the_hash_algo->rawsz);
+		break;
+	case REFTABLE_REF_VAL1:
+		strbuf_add(&w->value, ref->oid.hash, the_hash_algo->rawsz);
+		break;
+	case REFTABLE_REF_SYMREF:
+		strbuf_add_varint(&w->value, ref->target.len);
+		strbuf_addbuf(&w->value, &ref->target);
+		break;
+	default:
+		BUG("unknown reftable ref value type %u", ref->value_type);
+	}
+
+	writer_add_record(w, ref->value_type, w->block_size);
+}
+
+void reftable_writer_add_log(struct reftable_writer *w,
+			     const struct reftable_log *log)
+{
+	unsigned char tz[2];
+
+	if (!w->logs_started) {
+		w->ref_index_offset = writer_end_section(w);
+		w->log_offset = w->buf.len;
+		w->logs_started = 1;
+		writer_begin_section(w, BLOCK_TYPE_LOG);
+	}
+
+	log_key(&w->key, log->refname.buf, log->update_index);
+
+	strbuf_reset(&w->value);
+	switch (log->value_type) {
+	case REFTABLE_LOG_DELETION:
+		break;
+	case REFTABLE_LOG_UPDATE:
+		strbuf_add(&w->value, log->old_oid.hash, the_hash_algo->rawsz);
+		strbuf_add(&w->value, log->new_oid.hash, the_hash_algo->rawsz);
+		strbuf_add_varint(&w->value, log->ident.len);
+		strbuf_addbuf(&w->value, &log->ident);
+		strbuf_add_varint(&w->value, log->time);
+		put_be16(tz, (uint16_t)(int16_t)log->tz);
+		strbuf_add(&w->value, tz, sizeof(tz));
+		strbuf_add_varint(&w->value, log->message.len);
+		strbuf_addbuf(&w->value, &log->message);
+		break;
+	default:
+		BUG("unknown reftable log value type %u", log->value_type);
+	}
+
+	writer_add_record(w, log->value_type, w->block_size);
+}
+
+static void writer_finish(struct reftable_writer *w)
+{
+	unsigned char *footer;
+	uint64_t index_offset = writer_end_section(w);
+
+	if (w->logs_started)
+		w->log_index_offset = index_offset;
+	else
+		w->ref_index_offset = index_offset;
+
+	strbuf_grow(&w->buf, FOOTER_SIZE);
+	footer = (unsigned char *)w->buf.buf + w->buf.len;
+	memcpy(footer, w->buf.buf, HEADER_SIZE);
+	put_be64(footer + HEADER_SIZE, w->ref_index_offset);
+	put_be64(footer + HEADER_SIZE + 8, w->log_offset);
+	put_be64(footer + HEADER_SIZE + 16, w->log_index_offset);
+	put_be32(footer + FOOTER_SIZE - 4,
+		 crc32(0, footer, FOOTER_SIZE - 4));
+	strbuf_setlen(&w->buf, w->buf.len + FOOTER_SIZE);
+}
+
+/*
+ * Reading tables
+ */
+
+struct reftable_table {
+	char *name;
+	const unsigned char *map;
+	size_t size;
+	size_t footer_offset;
+	uint64_t min_update_index;
+	uint64_t max_update_index;
+	uint64_t ref_index_offset;
+	uint64_t log_offset;
+	uint64_t log_index_offset;
+	unsigned int refcount;
+};
+
+static NORETURN void die_corrupt(struct reftable_table *t)
+{
+	die(_("reftable '%s' is corrupt"), t->name);
+}
+
+/*
+ * Open and check the table `name` in `dir`. If it does not exist
+ * and `missing` is non-NULL, set *missing and return NULL silently.
+ */
+static struct reftable_table *table_open(const char *dir, const char *name,
+					 int *missing)
+{
+	struct reftable_table *t;
+	struct strbuf path = STRBUF_INIT;
+	const unsigned char *footer;
+	struct stat st;
+	size_t size;
+	void *map;
+	int fd;
+
+	strbuf_addf(&path, "%s/%s", dir, name);
+	fd = open(path.buf, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT && missing)
+			*missing = 1;
+		else
+			error_errno(_("unable to open '%s'"), path.buf);
+		strbuf_release(&path);
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0) {
+		error_errno(_("unable to stat '%s'"), path.buf);
+		close(fd);
+		strbuf_release(&path);
+		return NULL;
+	}
+	size = xsize_t(st.st_size);
+	if (size < HEADER_SIZE + FOOTER_SIZE) {
+		error(_("reftable '%s' is too short"), path.buf);
+		close(fd);
+		strbuf_release(&path);
+		return NULL;
+	}
+	map = xmmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	t = xcalloc(1, sizeof(*t));
+	t->name = xstrdup(name);
+	t->map = map;
+	t->size = size;
+	t->refcount = 1;
+	t->footer_offset = size - FOOTER_SIZE;
+	footer = t->map + t->footer_offset;
+
+	if (memcmp(t->map, REFTABLE_SIGNATURE, 4) ||
+	    t->map[4] != REFTABLE_VERSION ||
+	    memcmp(t->map, footer, HEADER_SIZE) ||
+	    get_be32(footer + FOOTER_SIZE - 4) !=
+	    crc32(0, footer, FOOTER_SIZE - 4)) {
+		error(_("'%s' is not a valid reftable"), path.buf);
+		goto fail;
+	}
+
+	t->min_update_index = get_be64(t->map + 8);
+	t->max_update_index = get_be64(t->map + 16);
+	t->ref_index_offset = get_be64(footer + HEADER_SIZE);
+	t->log_offset = get_be64(footer + HEADER_SIZE + 8);
+	t->log_index_offset = get_be64(footer + HEADER_SIZE + 16);
+	if (t->ref_index_offset >= t->footer_offset ||
+	    t->log_offset >= t->footer_offset ||
+	    t->log_index_offset >= t->footer_offset) {
+		error(_("reftable '%s' has invalid offsets"), path.buf);
+		goto fail;
+	}
+
+	strbuf_release(&path);
+	return t;
+
+fail:
+	munmap((void *)t->map, t->size);
+	free(t->name);
+	free(t);
+	strbuf_release(&path);
+	return NULL;
+}
+
+static void table_release(struct reftable_table *t)
+{
+	if (!t || --t->refcount)
+		return;
+	munmap((void *)t->map, t->size);
+	free(t->name);
+	free(t);
+}
+
+/*
+ * A record as found in a block. Its key is kept by the iterator
+ * that found it; its value is decoded on demand.
+ */
+struct raw_record {
+	struct reftable_table *t;
+	unsigned int value_type;
+	const unsigned char *val;
+	const unsigned char *val_end;
+};
+
+/*
+ * Decode the key of the record at p, which is prefix-compressed
+ * against `key`, into `key`. Return a pointer to the value, or NULL
+ * if the record is corrupt.
+ */
+static const unsigned char *decode_key(const unsigned char *p,
+				       const unsigned char *end,
+				       struct strbuf *key,
+				       unsigned int *value_type)
+{
+	uint64_t prefix, suffix;
+
+	if (get_varint(&p, end, &prefix) ||
+	    get_varint(&p, end, &suffix) ||
+	    prefix > key->len ||
+	    (suffix >> 3) > (uint64_t)(end - p))
+		return NULL;
+
+	*value_type = suffix & 7;
+	suffix >>= 3;
+	strbuf_setlen(key, prefix);
+	strbuf_add(key, p, suffix);
+	return p + suffix;
+}
+
+/* Return the end of the value at p, or NULL if it is corrupt. */
+static const unsigned char *value_end(char block_type, unsigned int value_type,
+				      const unsigned char *p,
+				      const unsigned char *end)
+{
+	const unsigned rawsz = the_hash_algo->rawsz;
+	uint64_t n;
+
+	switch (block_type) {
+	case BLOCK_TYPE_REF:
+		if (get_varint(&p, end, &n))
+			return NULL;
+		switch (value_type) {
+		case REFTABLE_REF_DELETION:
+			break;
+		case REFTABLE_REF_VAL1:
+			if (skip_bytes(&p, end, rawsz))
+				return NULL;
+			break;
+		case REFTABLE_REF_VAL2:
+			if (skip_bytes(&p, end, 2 * rawsz))
+				return NULL;
+			break;
+		case REFTABLE_REF_SYMREF:
+			if (get_varint(&p, end, &n) || skip_bytes(&p, end, n))
+				return NULL;
+			break;
+		default:
+			return NULL;
+		}
+		return p;
+	case BLOCK_TYPE_LOG:
+		switch (value_type) {
+		case REFTABLE_LOG_DELETION:
+			break;
+		case REFTABLE_LOG_UPDATE:
+			if (skip_bytes(&p, end, 2 * rawsz) ||
+			    get_varint(&p, end, &n) || skip_bytes(&p, end, n) ||
+			    get_varint(&p, end, &n) || skip_bytes(&p, end, 2) ||
+			    get_varint(&p, end, &n) || skip_bytes(&p, end, n))
+				return NULL;
+			break;
+		default:
+			return NULL;
+		}
+		return p;
+	case BLOCK_TYPE_INDEX:
+		if (get_varint(&p, end, &n))
+			return NULL;
+		return p;
+	default:
+		BUG("unknown reftable block type '%c'", block_type);
+	}
+}
+
+static void decode_ref(const struct strbuf *key, const struct raw_record *rec,
+		       struct reftable_ref *ref)
+{
+	const unsigned rawsz = the_hash_algo->rawsz;
+	const unsigned char *p = rec->val;
+	uint64_t n = 0;
+
+	strbuf_reset(&ref->refname);
+	strbuf_addbuf(&ref->refname, key);
+	strbuf_reset(&ref->target);
+	oidclr(&ref->oid);
+	oidclr(&ref->peeled);
+
+	/* value_end() has checked the record already */
+	get_varint(&p, rec->val_end, &n);
+	ref->update_index = rec->t->min_update_index + n;
+	ref->value_type = rec->value_type;
+	switch (rec->value_type) {
+	case REFTABLE_REF_VAL2:
+		hashcpy(ref->peeled.hash, p + rawsz);
+		/* fallthrough */
+	case REFTABLE_REF_VAL1:
+		hashcpy(ref->oid.hash, p);
+		break;
+	case REFTABLE_REF_SYMREF:
+		get_varint(&p, rec->val_end, &n);
+		strbuf_add(&ref->target, p, n);
+		break;
+	}
+}
+
+static void decode_log(const struct strbuf *key, const struct raw_record *rec,
+		       struct reftable_log *log)
+{
+	const unsigned rawsz = the_hash_algo->rawsz;
+	const unsigned char *p = rec->val;
+	uint64_t n = 0;
+
+	if (key->len < 9 || key->buf[key->len - 9] ||
+	    memchr(key->buf, '\0', key->len - 9))
+		die_corrupt(rec->t);
+
+	strbuf_reset(&log->refname);
+	strbuf_add(&log->refname, key->buf, key->len - 9);
+	log->update_index = ~get_be64(key->buf + key->len - 8);
+	log->value_type = rec->value_type;
+	oidclr(&log->old_oid);
+	oidclr(&log->new_oid);
+	strbuf_reset(&log->ident);
+	strbuf_reset(&log->message);
+	log->time = 0;
+	log->tz = 0;
+
+	if (rec->value_type != REFTABLE_LOG_UPDATE)
+		return;
+
+	hashcpy(log->old_oid.hash, p);
+	hashcpy(log->new_oid.hash, p + rawsz);
+	p += 2 * rawsz;
+	get_varint(&p, rec->val_end, &n);
+	strbuf_add(&log->ident, p, n);
+	p += n;
+	get_varint(&p, rec->val_end, &n);
+	log->time = n;
+	log->tz = (int16_t)get_be16(p);
+	p += 2;
+	get_varint(&p, rec->val_end, &n);
+	strbuf_add(&log->message, p, n);
+}
+
+struct block_iter {
+	struct reftable_table *t;
+	char type;
+	size_t block_off;
+	size_t block_len;
+	size_t restarts_off;
+	unsigned int nrestarts;
+	size_t pos;
+	struct strbuf key;
+};
+
+/*
+ * Point bi at the first record of the block of the given type at
+ * `off`. Return -1 if there is no such block there.
+ */
+static int block_iter_init(struct block_iter *bi, struct reftable_table *t,
+			   uint64_t off, char type)
+{
+	const unsigned char *p;
+	size_t len;
+
+	if (off < HEADER_SIZE || off + BLOCK_HEADER_SIZE + 2 > t->footer_offset)
+		return -1;
+	p = t->map + off;
+	if (*p != type)
+		return -1;
+
+	len = get_be24(p + 1);
+	if (len < BLOCK_HEADER_SIZE + 2 || off + len > t->footer_offset)
+		die_corrupt(t);
+	bi->nrestarts = get_be16(p + len - 2);
+	if (!bi->nrestarts ||
+	    3 * bi->nrestarts + 2 + BLOCK_HEADER_SIZE > len)
+		die_corrupt(t);
+
+	bi->t = t;
+	bi->type = type;
+	bi->block_off = off;
+	bi->block_len = len;
+	bi->restarts_off = off + len - 2 - 3 * bi->nrestarts;
+	bi->pos = off + BLOCK_HEADER_SIZE;
+	strbuf_reset(&bi->key);
+	return 0;
+}
+
+/* Return 0 and decode the next record, or 1 at the end of the block. */
+static int block_iter_next(struct block_iter *bi, struct raw_record *rec)
+{
+	const unsigned char *p = bi->t->map + bi->pos;
+	const unsigned char *end = bi->t->map + bi->restarts_off;
+
+	if (p >= end)
+		return 1;
+
+	rec->t = bi->t;
+	rec->val = decode_key(p, end, &bi->key, &rec->value_type);
+	if (!rec->val)
+		die_corrupt(bi->t);
+	rec->val_end = value_end(bi->type, rec->value_type, rec->val, end);
+	if (!rec->val_end)
+		die_corrupt(bi->t);
+	bi->pos = rec->val_end - bi->t->map;
+	return 0;
+}
+
+static size_t block_iter_restart(struct block_iter *bi, unsigned int i)
+{
+	size_t off = get_be24(bi->t->map + bi->restarts_off + 3 * i);
+
+	if (off < BLOCK_HEADER_SIZE || bi->block_off + off >= bi->restarts_off)
+		die_corrupt(bi->t);
+	return bi->block_off + off;
+}
+
+/*
+ * Position bi so that the next call to block_iter_next() returns the
+ * first record whose key is not smaller than `key`.
+ */
+static void block_iter_seek(struct block_iter *bi, const char *key,
+			    size_t key_len)
+{
+	const unsigned char *end = bi->t->map + bi->restarts_off;
+	struct strbuf prev = STRBUF_INIT;
+	unsigned int lo = 0, hi = bi->nrestarts;
+
+	/* Find the first restart point whose key is larger than key. */
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		unsigned int value_type;
+
+		strbuf_reset(&prev);
+		if (!decode_key(bi->t->map + block_iter_restart(bi, mid), end,
+				&prev, &value_type))
+			die_corrupt(bi->t);
+		if (key_cmp(&prev, key, key_len) > 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	/* The record we want is after the restart point before it. */
+	bi->pos = lo ? block_iter_restart(bi, lo - 1)
+		     : bi->block_off + BLOCK_HEADER_SIZE;
+	strbuf_reset(&bi->key);
+	for (;;) {
+		size_t pos = bi->pos;
+		struct raw_record rec;
+
+		strbuf_reset(&prev);
+		strbuf_addbuf(&prev, &bi->key);
+		if (block_iter_next(bi, &rec))
+			break;
+		if (key_cmp(&bi->key, key, key_len) >= 0) {
+			bi->pos = pos;
+			strbuf_swap(&bi->key, &prev);
+			break;
+		}
+	}
+	strbuf_release(&prev);
+}
+
+/* An iterator over the ref or the log blocks of a table. */
+struct table_iter {
+	struct reftable_table *t;
+	char type;
+	struct block_iter bi;
+	int done;
+};
+
+static void table_iter_start(struct table_iter *ti)
+{
+	uint64_t off = ti->type == BLOCK_TYPE_REF ? HEADER_SIZE
+						  : ti->t->log_offset;
+
+	ti->done = !off || block_iter_init(&ti->bi, ti->t, off, ti->type);
+}
+
+static void table_iter_init(struct table_iter *ti, struct reftable_table *t,
+			    char type)
+{
+	ti->t = t;
+	ti->type = type;
+	strbuf_init(&ti->bi.key, 0);
+	table_iter_start(ti);
+}
+
+static void table_iter_release(struct table_iter *ti)
+{
+	strbuf_release(&ti->bi.key);
+}
+
+static int table_iter_next(struct table_iter *ti, struct raw_record *rec)
+{
+	while (!ti->done) {
+		uint64_t next;
+
+		if (!block_iter_next(&ti->bi, rec))
+			return 0;
+		next = ti->bi.block_off + ti->bi.block_len;
+		ti->done = block_iter_init(&ti->bi, ti->t, next, ti->type);
+	}
+	return 1;
+}
+
+static void table_iter_seek(struct table_iter *ti, const char *key,
+			    size_t key_len)
+{
+	uint64_t index_off = ti->type == BLOCK_TYPE_REF ?
+		ti->t->ref_index_offset : ti->t->log_index_offset;
+	struct block_iter ibi;
+	struct raw_record rec;
+	const unsigned char *p;
+	uint64_t off;
+
+	if (!index_off) {
+		/* Without an index, there is at most one block. */
+		table_iter_start(ti);
+		if (!ti->done)
+			block_iter_seek(&ti->bi, key, key_len);
+		return;
+	}
+
+	/* The index holds the last key of each block. */
+	strbuf_init(&ibi.key, 0);
+	if (block_iter_init(&ibi, ti->t, index_off, BLOCK_TYPE_INDEX))
+		die_corrupt(ti->t);
+	block_iter_seek(&ibi, key, key_len);
+	if (block_iter_next(&ibi, &rec)) {
+		ti->done = 1;
+	} else {
+		p = rec.val;
+		if (get_varint(&p, rec.val_end, &off) ||
+		    block_iter_init(&ti->bi, ti->t, off, ti->type))
+			die_corrupt(ti->t);
+		ti->done = 0;
+		block_iter_seek(&ti->bi, key, key_len);
+	}
+	strbuf_release(&ibi.key);
+}
+
+/*
+ * An iterator over the union of several tables, ordered from oldest
+ * to newest. When several tables have a record with the same key,
+ * only the one from the newest table is returned.
+ */
+struct merged_iter {
+	struct table_iter *subs;
+	struct raw_record *recs;
+	int *valid;
+	size_t nr;
+	struct strbuf key;
+};
+
+static void merged_iter_init(struct merged_iter *mi,
+			     struct reftable_table **tables, size_t nr,
+			     char type)
+{
+	size_t i;
+
+	mi->nr = nr;
+	ALLOC_ARRAY(mi->subs, nr);
+	ALLOC_ARRAY(mi->recs, nr);
+	ALLOC_ARRAY(mi->valid, nr);
+	strbuf_init(&mi->key, 0);
+	for (i = 0; i < nr; i++) {
+		table_iter_init(&mi->subs[i], tables[i], type);
+		mi->valid[i] = !table_iter_next(&mi->subs[i], &mi->recs[i]);
+	}
+}
+
+static void merged_iter_seek(struct merged_iter *mi, const char *key,
+			     size_t key_len)
+{
+	size_t i;
+
+	for (i = 0; i < mi->nr; i++) {
+		table_iter_seek(&mi->subs[i], key, key_len);
+		mi->valid[i] = !table_iter_next(&mi->subs[i], &mi->recs[i]);
+	}
+}
+
+/*
+ * Return 0 and set mi->key and *rec to the next record, or return 1
+ * when all tables are exhausted.
+ */
+static int merged_iter_next(struct merged_iter *mi, struct raw_record *rec)
+{
+	ssize_t best = -1;
+	size_t i;
+
+	for (i = 0; i < mi->nr; i++) {
+		if (!mi->valid[i])
+			continue;
+		if (best < 0 ||
+		    strbuf_cmp(&mi->subs[i].bi.key, &mi->subs[best].bi.key) <= 0)
+			best = i;
+	}
+	if (best < 0)
+		return 1;
+
+	strbuf_reset(&mi->key);
+	strbuf_addbuf(&mi->key, &mi->subs[best].bi.key);
+	*rec = mi->recs[best];
+
+	/* Skip the records shadowed by the one we return. */
+	for (i = 0; i < mi->nr; i++)
+		if (mi->valid[i] && !strbuf_cmp(&mi->subs[i].bi.key, &mi->key))
+			mi->valid[i] = !table_iter_next(&mi->subs[i],
+							&mi->recs[i]);
+	return 0;
+}
+
+static void merged_iter_release(struct merged_iter *mi)
+{
+	size_t i;
+
+	for (i = 0; i < mi->nr; i++)
+		table_iter_release(&mi->subs[i]);
+	free(mi->subs);
+	free(mi->recs);
+	free(mi->valid);
+	strbuf_release(&mi->key);
+}
+
+/*
+ * Stacks
+ */
+
+#define STACK_RELOAD_TRIES 5
+
+struct reftable_stack {
+	char *dir;
+	char *list_file;
+	struct stat_validity list_validity;
+
+	/* The tables of the stack, oldest first. */
+	struct reftable_table **tables;
+	size_t nr, alloc;
+
+	struct lock_file lock;
+};
+
+struct reftable_stack *reftable_stack_new(const char *dir)
+{
+	struct reftable_stack *st = xcalloc(1, sizeof(*st));
+
+	st->dir = xstrdup(dir);
+	st->list_file = xstrfmt("%s/tables.list", dir);
+	chdir_notify_reparent("reftable stack", &st->dir);
+	chdir_notify_reparent("reftable tables.list", &st->list_file);
+	return st;
+}
+
+static void release_tables(struct reftable_table **tables, size_t nr)
+{
+	size_t i;
+
+	for (i = 0; i < nr; i++)
+		table_release(tables[i]);
+	free(tables);
+}
+
+static struct reftable_table *find_table(struct reftable_stack *st,
+					 const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < st->nr; i++)
+		if (!strcmp(st->tables[i]->name, name))
+			return st->tables[i];
+	return NULL;
+}
+
+static int read_tables_list(struct reftable_stack *st,
+			    struct string_list *names,
+			    struct stat_validity *validity)
+{
+	struct strbuf sb = STRBUF_INIT;
+	const char *p, *eol;
+	int fd;
+
+	fd = open(st->list_file, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 0;
+		return error_errno(_("unable to open '%s'"), st->list_file);
+	}
+	if (strbuf_read(&sb, fd, 0) < 0) {
+		error_errno(_("unable to read '%s'"), st->list_file);
+		close(fd);
+		strbuf_release(&sb);
+		return -1;
+	}
+	stat_validity_update(validity, fd);
+	close(fd);
+
+	for (p = sb.buf; *p; p = *eol ? eol + 1 : eol) {
+		eol = strchrnul(p, '\n');
+		if (eol == p)
+			continue;
+		if (memchr(p, '/', eol - p)) {
+			error(_("invalid table name in '%s'"), st->list_file);
+			strbuf_release(&sb);
+			return -1;
+		}
+		string_list_append_nodup(names, xmemdupz(p, eol - p));
+	}
+	strbuf_release(&sb);
+	return 0;
+}
+
+/*
+ * Read "tables.list" and open the tables it names, reusing the ones
+ * we already have. A table can vanish between reading the list and
+ * opening it if another process compacts the stack meanwhile; read
+ * the list again in that case.
+ */
+static int stack_reload(struct reftable_stack *st)
+{
+	int tries;
+
+	for (tries = 0; tries < STACK_RELOAD_TRIES; tries++) {
+		struct string_list names = STRING_LIST_INIT_DUP;
+		struct stat_validity validity = { NULL };
+		struct reftable_table **tables;
+		int missing = 0;
+		size_t i;
+
+		if (read_tables_list(st, &names, &validity)) {
+			stat_validity_clear(&validity);
+			string_list_clear(&names, 0);
+			return -1;
+		}
+
+		ALLOC_ARRAY(tables, names.nr);
+		for (i = 0; i < names.nr; i++) {
+			const char *name = names.items[i].string;
+
+			tables[i] = find_table(st, name);
+			if (tables[i])
+				tables[i]->refcount++;
+			else
+				tables[i] = table_open(st->dir, name, &missing);
+			if (!tables[i])
+				break;
+		}
+		if (i < names.nr) {
+			release_tables(tables, i);
+			stat_validity_clear(&validity);
+			string_list_clear(&names, 0);
+			if (missing)
+				continue;
+			return -1;
+		}
+
+		release_tables(st->tables, st->nr);
+		st->tables = tables;
+		st->nr = st->alloc = names.nr;
+		stat_validity_clear(&st->list_validity);
+		st->list_validity = validity;
+		string_list_clear(&names, 0);
+		return 0;
+	}
+
+	return error(_("unable to read a consistent reftable stack in '%s'"),
+		     st->dir);
+}
+
+int reftable_stack_reload(struct reftable_stack *st)
+{
+	if (stat_validity_check(&st->list_validity, st->list_file))
+		return 0;
+	return stack_reload(st);
+}
+
+static void stack_refresh(struct reftable_stack *st)
+{
+	if (reftable_stack_reload(st))
+		die(_("unable to read reftable stack in '%s'"), st->dir);
+}
+
+uint64_t reftable_stack_next_update_index(struct reftable_stack *st)
+{
+	stack_refresh(st);
+	return st->nr ? st->tables[st->nr - 1]->max_update_index + 1 : 1;
+}
+
+int reftable_stack_read_ref(struct reftable_stack *st, const char *refname,
+			    struct reftable_ref *ref)
+{
+	size_t i, len = strlen(refname);
+
+	stack_refresh(st);
+	for (i = st->nr; i--; ) {
+		struct table_iter ti;
+		struct raw_record rec;
+		int found;
+
+		table_iter_init(&ti, st->tables[i], BLOCK_TYPE_REF);
+		table_iter_seek(&ti, refname, len);
+		found = !table_iter_next(&ti, &rec) &&
+			!key_cmp(&ti.bi.key, refname, len);
+		if (found)
+			decode_ref(&ti.bi.key, &rec, ref);
+		table_iter_release(&ti);
+		if (found)
+			return ref->value_type == REFTABLE_REF_DELETION;
+	}
+	return 1;
+}
+
+struct reftable_iterator {
+	struct reftable_table **tables;
+	size_t nr;
+	struct merged_iter mi;
+	/* The iteration stops at the first key not starting with this. */
+	struct strbuf prefix;
+};
+
+static struct reftable_iterator *stack_iterator(struct reftable_stack *st,
+						char type,
+						struct strbuf *prefix)
+{
+	struct reftable_iterator *it = xcalloc(1, sizeof(*it));
+	size_t i;
+
+	stack_refresh(st);
+	ALLOC_ARRAY(it->tables, st->nr);
+	for (i = 0; i < st->nr; i++) {
+		it->tables[i] = st->tables[i];
+		it->tables[i]->refcount++;
+	}
+	it->nr = st->nr;
+	strbuf_init(&it->prefix, 0);
+	strbuf_swap(&it->prefix, prefix);
+
+	merged_iter_init(&it->mi, it->tables, it->nr, type);
+	if (it->prefix.len)
+		merged_iter_seek(&it->mi, it->prefix.buf, it->prefix.len);
+	return it;
+}
+
+struct reftable_iterator *reftable_stack_refs(struct reftable_stack *st,
+					      const char *prefix)
+{
+	struct strbuf sb = STRBUF_INIT;
+
+	if (prefix)
+		strbuf_addstr(&sb, prefix);
+	return stack_iterator(st, BLOCK_TYPE_REF, &sb);
+}
+
+struct reftable_iterator *reftable_stack_logs(struct reftable_stack *st,
+					      const char *refname)
+{
+	struct strbuf sb = STRBUF_INIT;
+
+	if (refname) {
+		strbuf_addstr(&sb, refname);
+		strbuf_addch(&sb, '\0');
+	}
+	return stack_iterator(st, BLOCK_TYPE_LOG, &sb);
+}
+
+/* Return 0 and set *rec to the next live record, or 1 when done. */
+static int iterator_next(struct reftable_iterator *it, struct raw_record *rec)
+{
+	while (!merged_iter_next(&it->mi, rec)) {
+		if (it->mi.key.len < it->prefix.len ||
+		    memcmp(it->mi.key.buf, it->prefix.buf, it->prefix.len))
+			return 1;
+		/* both deletion types are 0 */
+		if (rec->value_type != REFTABLE_REF_DELETION)
+			return 0;
+	}
+	return 1;
+}
+
+int reftable_iterator_next_ref(struct reftable_iterator *it,
+			       struct reftable_ref *ref)
+{
+	struct raw_record rec;
+
+	if (iterator_next(it, &rec))
+		return 1;
+	decode_ref(&it->mi.key, &rec, ref);
+	return 0;
+}
+
+int reftable_iterator_next_log(struct reftable_iterator *it,
+			       struct reftable_log *log)
+{
+	struct raw_record rec;
+
+	if (iterator_next(it, &rec))
+		return 1;
+	decode_log(&it->mi.key, &rec, log);
+	return 0;
+}
+
+void reftable_iterator_free(struct reftable_iterator *it)
+{
+	if (!it)
+		return;
+	merged_iter_release(&it->mi);
+	release_tables(it->tables, it->nr);
+	strbuf_release(&it->prefix);
+	free(it);
+}
+
+int reftable_stack_lock(struct reftable_stack *st, struct strbuf *err)
+{
+	safe_create_dir(st->dir, 1);
+	if (hold_lock_file_for_update_timeout(
+			    &st->lock, st->list_file, 0,
+			    get_files_ref_lock_timeout_ms()) < 0) {
+		unable_to_lock_message(st->list_file, errno, err);
+		return -1;
+	}
+
+	/* Somebody might have updated the stack just before we locked it. */
+	if (stack_reload(st)) {
+		rollback_lock_file(&st->lock);
+		strbuf_addf(err, _("unable to read reftable stack in '%s'"),
+			    st->dir);
+		return -1;
+	}
+	return 0;
+}
+
+void reftable_stack_unlock(struct reftable_stack *st)
+{
+	rollback_lock_file(&st->lock);
+}
+
+/*
+ * Write the table built by w into the stack's directory, and put its
+ * name into `name`.
+ */
+static int write_table(struct reftable_stack *st, struct reftable_writer *w,
+		       struct strbuf *name, struct strbuf *err)
+{
+	struct strbuf path = STRBUF_INIT;
+	struct tempfile *tmp;
+	const char *suffix;
+	int ret = -1;
+
+	writer_finish(w);
+
+	strbuf_addf(&path, "%s/tmp_reftable_XXXXXX", st->dir);
+	tmp = mks_tempfile_m(path.buf, 0666);
+	if (!tmp) {
+		strbuf_addf(err, _("unable to create '%s': %s"),
+			    path.buf, strerror(errno));
+		goto out;
+	}
+	if (write_in_full(get_tempfile_fd(tmp), w->buf.buf, w->buf.len) < 0 ||
+	    close_tempfile_gently(tmp) < 0) {
+		strbuf_addf(err, _("unable to write '%s': %s"),
+			    get_tempfile_path(tmp), strerror(errno));
+		delete_tempfile(&tmp);
+		goto out;
+	}
+
+	/* Reuse the random part of the temporary name. */
+	suffix = get_tempfile_path(tmp) + strlen(get_tempfile_path(tmp)) - 6;
+	strbuf_reset(name);
+	strbuf_addf(name, "0x%012"PRIx64"-0x%012"PRIx64"-%s.ref",
+		    w->min_update_index, w->max_update_index, suffix);
+	strbuf_reset(&path);
+	strbuf_addf(&path, "%s/%s", st->dir, name->buf);
+	if (rename_tempfile(&tmp, path.buf) < 0) {
+		strbuf_addf(err, _("unable to rename table to '%s': %s"),
+			    path.buf, strerror(errno));
+		goto out;
+	}
+	adjust_shared_perm(path.buf);
+	ret = 0;
+
+out:
+	strbuf_release(&path);
+	return ret;
+}
+
+static void unlink_table(struct reftable_stack *st, const char *name)
+{
+	struct strbuf path = STRBUF_INIT;
+
+	strbuf_addf(&path, "%s/%s", st->dir, name);
+	unlink_or_warn(path.buf);
+	strbuf_release(&path);
+}
+
+/*
+ * Merge `nr` consecutive tables into a new one. The deletion records
+ * are only needed to shadow records in older tables, so they are
+ * dropped if there are none.
+ */
+static struct reftable_table *merge_tables(struct reftable_stack *st,
+					   struct reftable_table **tables,
+					   size_t nr, int drop_deletions,
+					   struct strbuf *err)
+{
+	struct reftable_writer *w;
+	struct reftable_ref ref = REFTABLE_REF_INIT;
+	struct reftable_log log = REFTABLE_LOG_INIT;
+	struct reftable_table *t = NULL;
+	struct strbuf name = STRBUF_INIT;
+	struct merged_iter mi;
+	struct raw_record rec;
+
+	w = reftable_writer_new(tables[0]->min_update_index,
+				tables[nr - 1]->max_update_index);
+
+	merged_iter_init(&mi, tables, nr, BLOCK_TYPE_REF);
+	while (!merged_iter_next(&mi, &rec)) {
+		if (drop_deletions && rec.value_type == REFTABLE_REF_DELETION)
+			continue;
+		decode_ref(&mi.key, &rec, &ref);
+		reftable_writer_add_ref(w, &ref);
+	}
+	merged_iter_release(&mi);
+
+	merged_iter_init(&mi, tables, nr, BLOCK_TYPE_LOG);
+	while (!merged_iter_next(&mi, &rec)) {
+		if (drop_deletions && rec.value_type == REFTABLE_LOG_DELETION)
+			continue;
+		decode_log(&mi.key, &rec, &log);
+		reftable_writer_add_log(w, &log);
+	}
+	merged_iter_release(&mi);
+
+	if (!write_table(st, w, &name, err)) {
+		t = table_open(st->dir, name.buf, NULL);
+		if (!t) {
+			strbuf_addf(err, _("unable to read back '%s'"), name.buf);
+			unlink_table(st, name.buf);
+		}
+	}
+
+	reftable_ref_release(&ref);
+	reftable_log_release(&log);
+	reftable_writer_free(w);
+	strbuf_release(&name);
+	return t;
+}
+
+/*
+ * Keep the stack shallow: merge the newest tables as long as the
+ * table before them is not more than twice as large as they are
+ * together. Return the index of the first table to merge.
+ */
+static size_t compaction_start(struct reftable_table **tables, size_t nr)
+{
+	size_t i = nr - 1;
+	uint64_t bytes = tables[i]->size;
+
+	while (i > 0 && tables[i - 1]->size <= 2 * bytes) {
+		i--;
+		bytes += tables[i]->size;
+	}
+	return i;
+}
+
+/*
+ * Make `tables` (which we own references to) the new contents of the
+ * locked stack, after merging the ones starting at `first`, and
+ * commit the lock.
+ */
+static int stack_commit(struct reftable_stack *st,
+			struct reftable_table **tables, size_t nr,
+			size_t first, struct strbuf *err)
+{
+	struct strbuf list = STRBUF_INIT;
+	size_t i, merged_nr = 0;
+	struct reftable_table *merged = NULL;
+	int ret = -1;
+
+	if (first + 1 < nr) {
+		merged = merge_tables(st, tables + first, nr - first,
+				      !first, err);
+		if (!merged)
+			goto out;
+		merged_nr = nr - first;
+	}
+
+	for (i = 0; i < nr - merged_nr; i++)
+		strbuf_addf(&list, "%s\n", tables[i]->name);
+	if (merged_nr)
+		strbuf_addf(&list, "%s\n", merged->name);
+
+	if (write_in_full(get_lock_file_fd(&st->lock), list.buf, list.len) < 0 ||
+	    commit_lock_file(&st->lock) < 0) {
+		strbuf_addf(err, _("unable to write '%s': %s"),
+			    st->list_file, strerror(errno));
+		if (merged_nr) {
+			unlink_table(st, merged->name);
+			table_release(merged);
+		}
+		goto out;
+	}
+
+	if (merged_nr) {
+		for (i = first; i < nr; i++) {
+			unlink_table(st, tables[i]->name);
+			table_release(tables[i]);
+		}
+		tables[first] = merged;
+	}
+	release_tables(st->tables, st->nr);
+	st->tables = tables;
+	st->nr = st->alloc = nr - merged_nr + !!merged_nr;
+	stat_validity_clear(&st->list_validity);
+	tables = NULL;
+	nr = 0;
+	ret = 0;
+
+out:
+	if (tables)
+		release_tables(tables, nr);
+	rollback_lock_file(&st->lock);
+	strbuf_release(&list);
+	return ret;
+}
+
+int reftable_stack_add(struct reftable_stack *st, struct reftable_writer *w,
+		       struct strbuf *err)
+{
+	struct strbuf name = STRBUF_INIT;
+	struct reftable_table **tables;
+	size_t i;
+
+	if (!is_lock_file_locked(&st->lock))
+		BUG("reftable stack '%s' is not locked", st->dir);
+
+	if (write_table(st, w, &name, err))
+		goto fail;
+
+	ALLOC_ARRAY(tables, st->nr + 1);
+	for (i = 0; i < st->nr; i++) {
+		tables[i] = st->tables[i];
+		tables[i]->refcount++;
+	}
+	tables[i] = table_open(st->dir, name.buf, NULL);
+	if (!tables[i]) {
+		strbuf_addf(err, _("unable to read back '%s'"), name.buf);
+		unlink_table(st, name.buf);
+		release_tables(tables, i);
+		goto fail;
+	}
+
+	if (stack_commit(st, tables, st->nr + 1,
+			 compaction_start(tables, st->nr + 1), err)) {
+		unlink_table(st, name.buf);
+		strbuf_release(&name);
+		return -1;
+	}
+	strbuf_release(&name);
+	return 0;
+
+fail:
+	rollback_lock_file(&st->lock);
+	strbuf_release(&name);
+	return -1;
+}
+
+int reftable_stack_compact_all(struct reftable_stack *st, struct strbuf *err)
+{
+	struct reftable_table **tables;
+	size_t i;
+
+	if (reftable_stack_lock(st, err))
+		return -1;
+	if (st->nr < 2) {
+		rollback_lock_file(&st->lock);
+		return 0;
+	}
+
+	ALLOC_ARRAY(tables, st->nr);
+	for (i = 0; i < st->nr; i++) {
+		tables[i] = st->tables[i];
+		tables[i]->refcount++;
+	}
+	return stack_commit(st, tables, st->nr, 0, err);
+}
@@ -0,0 +1,144 @@
+#ifndef REFS_REFTABLE_H
+#define REFS_REFTABLE_H
+
+/*
+ * Reading and writing reftables, and stacks of them.
+ *
+ * A reftable is an immutable, sorted file holding references and
+ * reflog entries in prefix-compressed blocks; see
+ * Documentation/technical/reftable.txt for the format. A stack is a
+ * directory holding a number of tables together with a "tables.list"
+ * file naming them, oldest first. Records in newer tables shadow the
+ * records with the same key in older ones, so every update is done
+ * by appending a new table to the stack; the stack is kept short by
+ * merging tables whenever a new one is added.
+ */
+
+#include "../lockfile.h"
+
+/* The value types of a ref record: */
+#define REFTABLE_REF_DELETION 0
+#define REFTABLE_REF_VAL1 1	/* oid */
+#define REFTABLE_REF_VAL2 2	/* oid and peeled oid */
+#define REFTABLE_REF_SYMREF 3	/* name of the referent */
+
+/* The value types of a log record: */
+#define REFTABLE_LOG_DELETION 0
+#define REFTABLE_LOG_UPDATE 1
+
+struct reftable_ref {
+	struct strbuf refname;
+	uint64_t update_index;
+	unsigned int value_type;
+	struct object_id oid;
+	struct object_id peeled;
+	struct strbuf target;
+};
+
+#define REFTABLE_REF_INIT { STRBUF_INIT, 0, 0, { { 0 } }, { { 0 } }, STRBUF_INIT }
+
+void reftable_ref_release(struct reftable_ref *ref);
+
+/*
+ * A reflog entry. `ident` is the "Name <email>" part of the
+ * committer, and `message` the cleaned-up reflog message without a
+ * trailing newline. Entries are keyed by refname and update_index,
+ * and are returned newest first.
+ */
+struct reftable_log {
+	struct strbuf refname;
+	uint64_t update_index;
+	unsigned int value_type;
+	struct object_id old_oid;
+	struct object_id new_oid;
+	struct strbuf ident;
+	timestamp_t time;
+	int tz;
+	struct strbuf message;
+};
+
+#define REFTABLE_LOG_INIT { STRBUF_INIT, 0, 0, { { 0 } }, { { 0 } }, \
+			    STRBUF_INIT, 0, 0, STRBUF_INIT }
+
+void reftable_log_release(struct reftable_log *log);
+
+/*
+ * Build a table in memory. Ref records must be added first, sorted
+ * by refname, then log records, sorted by refname and by decreasing
+ * update_index.
+ */
+struct reftable_writer;
+
+struct reftable_writer *reftable_writer_new(uint64_t min_update_index,
+					    uint64_t max_update_index);
+void reftable_writer_add_ref(struct reftable_writer *w,
+			     const struct reftable_ref *ref);
+void reftable_writer_add_log(struct reftable_writer *w,
+			     const struct reftable_log *log);
+void reftable_writer_free(struct reftable_writer *w);
+
+struct reftable_stack;
+
+/*
+ * Create a handle on the stack stored in `dir`. Nothing is read
+ * until the stack is first used; a missing directory is an empty
+ * stack.
+ */
+struct reftable_stack *reftable_stack_new(const char *dir);
+
+/*
+ * Re-read "tables.list" if it changed since it was last read. Return
+ * 0 on success, or -1 after reporting an error.
+ */
+int reftable_stack_reload(struct reftable_stack *st);
+
+/* The update_index to be used by the next table added to the stack. */
+uint64_t reftable_stack_next_update_index(struct reftable_stack *st);
+
+/*
+ * Look up `refname`. Return 0 and fill in `ref` if it exists, 1 if
+ * it does not.
+ */
+int reftable_stack_read_ref(struct reftable_stack *st, const char *refname,
+			    struct reftable_ref *ref);
+
+/*
+ * Iterate over the refs whose name starts with `prefix` (which may
+ * be NULL), or over the reflog entries of `refname` (or of all refs,
+ * if it is NULL). Deleted refs and entries are skipped. The iterator
+ * works on a snapshot of the stack; it is not affected by later
+ * reloads.
+ */
+struct reftable_iterator;
+
+struct reftable_iterator *reftable_stack_refs(struct reftable_stack *st,
+					      const char *prefix);
+struct reftable_iterator *reftable_stack_logs(struct reftable_stack *st,
+					      const char *refname);
+
+/* Return 0 and fill in the next record, or 1 when done. */
+int reftable_iterator_next_ref(struct reftable_iterator *it,
+			       struct reftable_ref *ref);
+int reftable_iterator_next_log(struct reftable_iterator *it,
+			       struct reftable_log *log);
+void reftable_iterator_free(struct reftable_iterator *it);
+
+/*
+ * Lock the stack for writing and re-read it under the lock. Return 0
+ * on success; otherwise, write an error to `err` and return -1.
+ */
+int reftable_stack_lock(struct reftable_stack *st, struct strbuf *err);
+void reftable_stack_unlock(struct reftable_stack *st);
+
+/*
+ * Write the table built by `w` into the locked stack, merge the
+ * newest tables if the stack became too deep, then commit and unlock
+ * the stack. The stack is unlocked even on errors.
+ */
+int reftable_stack_add(struct reftable_stack *st, struct reftable_writer *w,
+		       struct strbuf *err);
+
+/* Lock the stack and merge all of its tables into one. */
+int reftable_stack_compact_all(struct reftable_stack *st, struct strbuf *err);
+
+#endif /* REFS_REFTABLE_H */
@@ -10,6 +10,8 @@
 #include "string-list.h"
 #include "mergesort.h"
 #include "argv-array.h"
+#include "pack.h"
+#include "pack-bitmap.h"
 
 enum map_direction { FROM_SRC, FROM_DST };
 
@@ -651,6 +653,28 @@ void free_refspec(int nr_refspec, struct refspec *refspec)
 	free(refspec);
 }
 
+void refspec_ref_prefixes(const struct refspec *refspecs, int nr_refspec,
+			  struct argv_array *ref_prefixes)
+{
+	int i;
+
+	for (i = 0; i < nr_refspec; i++) {
+		const struct refspec *item = &refspecs[i];
+		const char *glob;
+
+		if (item->exact_sha1 || !item->src)
+			continue;
+
+		glob = strchr(item->src, '*');
+		if (glob)
+			argv_array_pushf(ref_prefixes, "%.*s",
+					 (int)(glob - item->src),
+					 item->src);
+		else
+			expand_ref_prefix(ref_prefixes, item->src);
+	}
+}
+
 static int valid_remote_nick(const char *name)
 {
 	if (!name[0] || is_dot_or_dotdot(name))
@@ -2021,6 +2045,58 @@ int ref_newer(const struct object_id *new_oid, const struct object_id *old_oid)
 	return found;
 }
 
+/*
+ * Count the commits reachable from ours but not from theirs, and vice
+ * versa. With "use_bitmaps", the bitmap index answers this without
+ * walking the history, if there is one; loading it costs much more
+ * than the short walk between a branch and its upstream usually does,
+ * so this only pays off for callers comparing many commits to the same
+ * base.
+ */
+void count_ahead_behind(struct commit *ours, struct commit *theirs,
+			int *num_ours, int *num_theirs, int use_bitmaps)
+{
+	struct rev_info revs;
+	struct argv_array argv = ARGV_ARRAY_INIT;
+
+	*num_ours = *num_theirs = 0;
+	if (ours == theirs)
+		return;
+	if (use_bitmaps &&
+	    !bitmap_ahead_behind(ours, theirs, num_ours, num_theirs))
+		return;
+
+	/* Run "rev-list --left-right ours...theirs" internally... */
+	argv_array_push(&argv, ""); /* ignored */
+	argv_array_push(&argv, "--left-right");
+	argv_array_pushf(&argv, "%s...%s",
+			 oid_to_hex(&ours->object.oid),
+			 oid_to_hex(&theirs->object.oid));
+	argv_array_push(&argv, "--");
+
+	init_revisions(&revs, NULL);
+	setup_revisions(argv.argc, argv.argv, &revs, NULL);
+	if (prepare_revision_walk(&revs))
+		die("revision walk setup failed");
+
+	/* ... and count the commits on each side. */
+	while (1) {
+		struct commit *c = get_revision(&revs);
+		if (!c)
+			break;
+		if (c->object.flags & SYMMETRIC_LEFT)
+			(*num_ours)++;
+		else
+			(*num_theirs)++;
+	}
+
+	/* clear object flags smudged by the above traversal */
+	clear_commit_marks(ours, ALL_REV_FLAGS);
+	clear_commit_marks(theirs, ALL_REV_FLAGS);
+
+	argv_array_clear(&argv);
+}
+
 /*
  * Lookup the upstream branch for the given branch and if present, optionally
  * compute the commit ahead/behind values for the pair.
@@ -2042,9 +2118,7 @@ int stat_tracking_info(struct branch *branch, int *num_ours, int *num_theirs,
 {
 	struct object_id oid;
 	struct commit *ours, *theirs;
-	struct rev_info revs;
 	const char *base;
-	struct argv_array argv = ARGV_ARRAY_INIT;
 
 	/* Cannot stat unless we are marked to build on top of somebody else. */
 	base = branch_get_upstream(branch, NULL);
@@ -2076,35 +2150,7 @@ int stat_tracking_info(struct branch *branch, int *num_ours, int *num_theirs,
 	if (abf != AHEAD_BEHIND_FULL)
 		BUG("stat_tracking_info: invalid abf '%d'", abf);
 
-	/* Run "rev-list --left-right ours...theirs" internally... */
-	argv_array_push(&argv, ""); /* ignored */
-	argv_array_push(&argv, "--left-right");
-	argv_array_pushf(&argv, "%s...%s",
-			 oid_to_hex(&ours->object.oid),
-			 oid_to_hex(&theirs->object.oid));
-	argv_array_push(&argv, "--");
-
-	init_revisions(&revs, NULL);
-	setup_revisions(argv.argc, argv.argv, &revs, NULL);
-	if (prepare_revision_walk(&revs))
-		die("revision walk setup failed");
-
-	/* ... and count the commits on each side. */
-	while (1) {
-		struct commit *c = get_revision(&revs);
-		if (!c)
-			break;
-		if (c->object.flags & SYMMETRIC_LEFT)
-			(*num_ours)++;
-		else
-			(*num_theirs)++;
-	}
-
-	/* clear object flags smudged by the above traversal */
-	clear_commit_marks(ours, ALL_REV_FLAGS);
-	clear_commit_marks(theirs, ALL_REV_FLAGS);
-
-	argv_array_clear(&argv);
+	count_ahead_behind(ours, theirs, num_ours, num_theirs, 0);
 	return 1;
 }
 
@@ -151,10 +151,17 @@ int check_ref_type(const struct ref *ref, int flags);
 void free_refs(struct ref *ref);
 
 struct oid_array;
-extern struct ref **get_remote_heads(int in, char *src_buf, size_t src_len,
+struct packet_reader;
+struct argv_array;
+extern struct ref **get_remote_heads(struct packet_reader *reader,
 				     struct ref **list, unsigned int flags,
 				     struct oid_array *extra_have,
-				     struct oid_array *shallow);
+				     struct oid_array *shallow_points);
+
+/* Used for protocol v2 in order to retrieve refs from a remote */
+extern struct ref **get_remote_refs(int fd_out, struct packet_reader *reader,
+				    struct ref **list, int for_push,
+				    const struct argv_array *ref_prefixes);
 
 int resolve_remote_symref(struct ref *ref, struct ref *list);
 int ref_newer(const struct object_id *new_oid, const struct object_id *old_oid);
@@ -174,6 +181,15 @@ extern struct refspec *parse_push_refspec(int nr_refspec, const char **refspec);
 
 void free_refspec(int nr_refspec, struct refspec *refspec);
 
+/*
+ * Add to 'ref_prefixes' the prefixes of the remote refs that the
+ * source sides of the given refspecs can match, for use when asking a
+ * server to limit its ref advertisement.
+ */
+struct argv_array;
+void refspec_ref_prefixes(const struct refspec *refspecs, int nr_refspec,
+			  struct argv_array *ref_prefixes);
+
 extern int query_refspecs(struct refspec *specs, int nr, struct refspec *query);
 char *apply_refspecs(struct refspec *refspecs, int nr_refspec,
 		     const char *name);
@@ -266,6 +282,9 @@ enum ahead_behind_flags {
 };
 
 /* Reporting of tracking info */
+struct commit;
+void count_ahead_behind(struct commit *ours, struct commit *theirs,
+			int *num_ours, int *num_theirs, int use_bitmaps);
 int stat_tracking_info(struct branch *branch, int *num_ours, int *num_theirs,
 		       const char **upstream_name, enum ahead_behind_flags abf);
 int format_tracking_info(struct branch *branch, struct strbuf *sb,
@@ -22,6 +22,9 @@
 #include "packfile.h"
 #include "worktree.h"
 #include "argv-array.h"
+#include "commit-graph.h"
+#include "bloom.h"
+#include "object-store.h"
 
 volatile show_early_output_fn_t show_early_output;
 
@@ -437,8 +440,120 @@ static void file_change(struct diff_options *options,
 	options->flags.has_changes = 1;
 }
 
+static struct trace_key trace_bloom = TRACE_KEY_INIT(BLOOM_FILTER);
+
+static struct {
+	unsigned int filter_not_present;
+	unsigned int maybe;
+	unsigned int definitely_not;
+} bloom_count;
+
+static void trace_bloom_filter_statistics(void)
+{
+	trace_printf_key(&trace_bloom,
+			 "statistics: filter_not_present %u, maybe %u, definitely_not %u",
+			 bloom_count.filter_not_present, bloom_count.maybe,
+			 bloom_count.definitely_not);
+}
+
+/*
+ * The filters record the exact paths (and their leading directories)
+ * that a commit changes, so they can only answer for pathspecs that
+ * name such paths literally.
+ */
+static int forbid_bloom_filters(struct pathspec *spec)
+{
+	int i;
+
+	if (spec->has_wildcard)
+		return 1;
+	if (spec->magic & ~(PATHSPEC_LITERAL | PATHSPEC_FROMTOP))
+		return 1;
+	for (i = 0; i < spec->nr; i++) {
+		if (spec->items[i].magic & ~(PATHSPEC_LITERAL | PATHSPEC_FROMTOP))
+			return 1;
+		if (!spec->items[i].len)
+			return 1;
+	}
+	return 0;
+}
+
+static void prepare_to_use_bloom_filter(struct rev_info *revs)
+{
+	struct commit_graph *g;
+	int i;
+	static int statistics_registered;
+
+	/*
+	 * Reflog walks fake the parents of the commits they show, so the
+	 * comparison is not against the first parent the filter knows.
+	 */
+	if (!revs->prune || !revs->prune_data.nr || revs->bloom_keys ||
+	    revs->reflog_info || revs->diffopt.flags.follow_renames ||
+	    forbid_bloom_filters(&revs->prune_data))
+		return;
+
+	if (!prepare_commit_graph())
+		return;
+	g = the_repository->objects->commit_graph;
+	if (!g->bloom_filter_settings)
+		return;
+
+	revs->bloom_filter_settings = g->bloom_filter_settings;
+	ALLOC_ARRAY(revs->bloom_keys, revs->prune_data.nr);
+	for (i = 0; i < revs->prune_data.nr; i++) {
+		struct pathspec_item *pi = &revs->prune_data.items[i];
+		int len = pi->len;
+
+		/* "dir/" is recorded in the filters as "dir" */
+		while (len > 1 && pi->match[len - 1] == '/')
+			len--;
+		fill_bloom_key(pi->match, len, &revs->bloom_keys[i],
+			       revs->bloom_filter_settings);
+	}
+	revs->bloom_keys_nr = revs->prune_data.nr;
+
+	if (!statistics_registered && trace_want(&trace_bloom)) {
+		atexit(trace_bloom_filter_statistics);
+		statistics_registered = 1;
+	}
+}
+
+/*
+ * Return 0 if the filter of 'commit' says that none of the paths we
+ * are limited to changed with respect to its first parent, and
+ * non-zero if they may have changed or we cannot tell.
+ */
+static int check_maybe_different_in_bloom_filter(struct rev_info *revs,
+						 struct commit *commit)
+{
+	struct bloom_filter *filter;
+	int i, result = 1;
+
+	if (commit->graph_pos == COMMIT_NOT_FROM_GRAPH ||
+	    !(filter = get_bloom_filter(commit, 0))) {
+		bloom_count.filter_not_present++;
+		return -1;
+	}
+
+	for (i = 0; i < revs->bloom_keys_nr; i++) {
+		result = bloom_filter_contains(filter, &revs->bloom_keys[i],
+					       revs->bloom_filter_settings);
+		if (result)
+			break;
+	}
+
+	if (result)
+		bloom_count.maybe++;
+	else
+		bloom_count.definitely_not++;
+
+	return result;
+}
+
 static int rev_compare_tree(struct rev_info *revs,
-			    struct commit *parent, struct commit *commit)
+			    struct commit *parent, struct commit *commit,
+			    int nth_parent)
 {
 	struct tree *t1 = parent->tree;
 	struct tree *t2 = commit->tree;
@@ -466,6 +581,11 @@ static int rev_compare_tree(struct rev_info *revs,
 			return REV_TREE_SAME;
 	}
 
+	/* the filters only know about the changes against the first parent */
+	if (revs->bloom_keys_nr && !nth_parent &&
+	    !check_maybe_different_in_bloom_filter(revs, commit))
+		return REV_TREE_SAME;
+
 	tree_difference = REV_TREE_SAME;
 	revs->pruning.flags.has_changes = 0;
 	if (diff_tree_oid(&t1->object.oid, &t2->object.oid, "",
@@ -668,7 +788,7 @@ static void try_to_simplify_commit(struct rev_info *revs, struct commit *commit)
 			die("cannot simplify commit %s (because of %s)",
 			    oid_to_hex(&commit->object.oid),
 			    oid_to_hex(&p->object.oid));
-		switch (rev_compare_tree(revs, p, commit)) {
+		switch (rev_compare_tree(revs, p, commit, nth_parent)) {
 		case REV_TREE_SAME:
 			if (!revs->simplify_history || !relevant_commit(p)) {
 				/* Even if a merge with an uninteresting
@@ -2900,6 +3020,7 @@ int prepare_revision_walk(struct rev_info *revs)
 		commit_list_sort_by_date(&revs->commits);
 	if (revs->no_walk)
 		return 0;
+	prepare_to_use_bloom_filter(revs);
 	if (revs->limited)
 		if (limit_list(revs) < 0)
 			return -1;
@@ -29,6 +29,8 @@ struct rev_info;
 struct log_info;
 struct string_list;
 struct saved_parents;
+struct bloom_key;
+struct bloom_filter_settings;
 
 struct rev_cmdline_info {
 	unsigned int nr;
@@ -224,6 +226,14 @@ struct rev_info {
 
 	struct commit_list *previous_parents;
 	const char *break_bar;
+
+	/*
+	 * Changed-path Bloom filter keys of the paths we are limited to,
+	 * used to skip the tree diff of commits that cannot touch them.
+	 */
+	struct bloom_key *bloom_keys;
+	int bloom_keys_nr;
+	struct bloom_filter_settings *bloom_filter_settings;
 };
 
 extern int ref_excluded(struct string_list *, const char *path);
@@ -1059,8 +1059,10 @@ static void *unpack_sha1_rest(git_zstream *stream, void *buffer, unsigned long s
 		 */
 		stream->next_out = buf + bytes;
 		stream->avail_out = size - bytes;
+		obj_read_unlock();
 		while (status == Z_OK)
 			status = git_inflate(stream, Z_FINISH);
+		obj_read_lock();
 	}
 	if (status == Z_STREAM_END && !stream->avail_in) {
 		git_inflate_end(stream);
@@ -1230,7 +1232,34 @@ static int sha1_loose_object_info(struct repository *r,
 
 int fetch_if_missing = 1;
 
-int oid_object_info_extended(const struct object_id *oid, struct object_info *oi, unsigned flags)
+#ifndef NO_PTHREADS
+pthread_mutex_t obj_read_mutex;
+#endif
+int obj_read_use_lock;
+
+void enable_obj_read_lock(void)
+{
+#ifndef NO_PTHREADS
+	if (obj_read_use_lock)
+		return;
+	obj_read_use_lock = 1;
+	/* packed objects may read their delta bases from elsewhere */
+	init_recursive_mutex(&obj_read_mutex);
+#endif
+}
+
+void disable_obj_read_lock(void)
+{
+#ifndef NO_PTHREADS
+	if (!obj_read_use_lock)
+		die("BUG: object read lock is not enabled");
+	obj_read_use_lock = 0;
+	pthread_mutex_destroy(&obj_read_mutex);
+#endif
+}
+
+static int do_oid_object_info_extended(const struct object_id *oid,
+				       struct object_info *oi, unsigned flags)
 {
 	static struct object_info blank_oi = OBJECT_INFO_INIT;
 	struct pack_entry e;
@@ -1309,7 +1338,7 @@ int oid_object_info_extended(const struct object_id *oid, struct object_info *oi
 	rtype = packed_object_info(e.p, e.offset, oi);
 	if (rtype < 0) {
 		mark_bad_packed_object(e.p, real->hash);
-		return oid_object_info_extended(real, oi, 0);
+		return do_oid_object_info_extended(real, oi, 0);
 	} else if (oi->whence == OI_PACKED) {
 		oi->u.packed.offset = e.offset;
 		oi->u.packed.pack = e.p;
@@ -1320,6 +1349,16 @@ int oid_object_info_extended(const struct object_id *oid, struct object_info *oi
 	return 0;
 }
 
+int oid_object_info_extended(const struct object_id *oid, struct object_info *oi, unsigned flags)
+{
+	int ret;
+
+	obj_read_lock();
+	ret = do_oid_object_info_extended(oid, oi, flags);
+	obj_read_unlock();
+	return ret;
+}
+
 /* returns enum object_type or negative */
 int oid_object_info(const struct object_id *oid, unsigned long *sizep)
 {
@@ -1346,7 +1385,7 @@ static void *read_object(const unsigned char *sha1, enum object_type *type,
 
 	hashcpy(oid.hash, sha1);
 
-	if (oid_object_info_extended(&oid, &oi, 0) < 0)
+	if (do_oid_object_info_extended(&oid, &oi, 0) < 0)
 		return NULL;
 	return content;
 }
@@ -1383,13 +1422,17 @@ void *read_object_file_extended(const struct object_id *oid,
 	const struct packed_git *p;
 	const char *path;
 	struct stat st;
-	const struct object_id *repl = lookup_replace ? lookup_replace_object(oid)
-						      : oid;
+	const struct object_id *repl;
+
+	obj_read_lock();
+	repl = lookup_replace ? lookup_replace_object(oid) : oid;
 
 	errno = 0;
 	data = read_object(repl->hash, type, size);
-	if (data)
+	if (data) {
+		obj_read_unlock();
 		return data;
+	}
 
 	if (errno && errno != ENOENT)
 		die_errno("failed to read object %s", oid_to_hex(oid));
@@ -1407,6 +1450,7 @@ void *read_object_file_extended(const struct object_id *oid,
 		die("packed object %s (stored in %s) is corrupt",
 		    oid_to_hex(repl), p->pack_name);
 
+	obj_read_unlock();
 	return NULL;
 }
 
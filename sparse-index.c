@@ -0,0 +1,312 @@
+#include "cache.h"
+#include "config.h"
+#include "cache-tree.h"
+#include "sparse-index.h"
+#include "tree.h"
+#include "tree-walk.h"
+#include "pathspec.h"
+
+static struct trace_key trace_sparse_index = TRACE_KEY_INIT(SPARSE_INDEX);
+
+int command_requires_full_index = 1;
+
+struct entry_list {
+	struct cache_entry **entries;
+	int nr, alloc;
+	int dirs;
+};
+
+static void add_entry(struct entry_list *list, struct cache_entry *ce)
+{
+	ALLOC_GROW(list->entries, list->nr + 1, list->alloc);
+	list->entries[list->nr++] = ce;
+}
+
+static int sparse_index_wanted(struct index_state *istate)
+{
+	int sparse_checkout = 0, sparse_index = 0;
+	int i;
+
+	if (istate->split_index)
+		return 0;
+	git_config_get_bool("core.sparsecheckout", &sparse_checkout);
+	git_config_get_bool("index.sparse", &sparse_index);
+	if (!sparse_checkout || !sparse_index)
+		return 0;
+
+	for (i = 0; i < istate->cache_nr; i++)
+		if (ce_stage(istate->cache[i]))
+			return 0;
+	return 1;
+}
+
+/*
+ * Can the entries the (sub)tree "it" covers, starting with cache[0],
+ * be replaced by a sparse directory entry?
+ */
+static int can_collapse(struct cache_tree *it,
+			struct cache_entry **cache, int nr)
+{
+	int i;
+
+	if (!it || it->entry_count <= 0 || it->entry_count > nr)
+		return 0;
+	for (i = 0; i < it->entry_count; i++) {
+		const struct cache_entry *ce = cache[i];
+
+		if (!ce_skip_worktree(ce) || ce_stage(ce) ||
+		    (ce->ce_flags & CE_INTENT_TO_ADD))
+			return 0;
+	}
+	return 1;
+}
+
+static struct cache_entry *make_sparse_dir_entry(struct index_state *istate,
+						 const char *path, int len,
+						 const struct object_id *oid)
+{
+	struct cache_entry *ce = make_empty_cache_entry(istate, len);
+
+	memcpy(ce->name, path, len);
+	ce->ce_namelen = len;
+	ce->ce_mode = S_IFDIR;
+	ce->ce_flags = create_ce_flags(0) | CE_SKIP_WORKTREE;
+	oidcpy(&ce->oid, oid);
+	return ce;
+}
+
+/*
+ * Copy the entries below "base" (the tree "it" of the cache-tree) to
+ * "out", collapsing the subdirectories that can be. Returns the number
+ * of entries of "cache" that are below "base".
+ */
+static int collapse_directories(struct index_state *istate,
+				struct cache_tree *it,
+				struct cache_entry **cache, int nr,
+				const char *base, int baselen,
+				struct entry_list *out)
+{
+	struct strbuf name = STRBUF_INIT;
+	int i = 0;
+
+	while (i < nr) {
+		struct cache_entry *ce = cache[i];
+		struct cache_tree *sub;
+		const char *path = ce->name, *slash;
+		int pathlen = ce_namelen(ce), sublen;
+
+		if (pathlen <= baselen || memcmp(base, path, baselen))
+			break; /* at the end of this level */
+
+		slash = strchr(path + baselen, '/');
+		if (!slash) {
+			add_entry(out, ce);
+			i++;
+			continue;
+		}
+
+		sublen = slash - (path + baselen);
+		strbuf_reset(&name);
+		strbuf_add(&name, path + baselen, sublen);
+		sub = cache_tree_find(it, name.buf);
+
+		if (can_collapse(sub, cache + i, nr - i)) {
+			add_entry(out, make_sparse_dir_entry(istate, path,
+							     baselen + sublen + 1,
+							     &sub->oid));
+			out->dirs++;
+			i += sub->entry_count;
+			continue;
+		}
+
+		i += collapse_directories(istate, sub, cache + i, nr - i,
+					  path, baselen + sublen + 1, out);
+	}
+
+	strbuf_release(&name);
+	return i;
+}
+
+int convert_to_sparse(struct index_state *istate,
+		      struct sparse_write_state *state)
+{
+	struct entry_list out = { NULL };
+
+	if (!sparse_index_wanted(istate)) {
+		ensure_full_index(istate);
+		return 0;
+	}
+	if (istate->sparse_index)
+		return 0;
+
+	/* we need to know the trees of the directories we collapse */
+	if (!istate->cache_tree)
+		istate->cache_tree = cache_tree();
+	if (cache_tree_update(istate, WRITE_TREE_SILENT))
+		return 0;
+
+	collapse_directories(istate, istate->cache_tree,
+			     istate->cache, istate->cache_nr, "", 0, &out);
+	if (!out.dirs) {
+		free(out.entries);
+		return 0;
+	}
+
+	trace_printf_key(&trace_sparse_index,
+			 "collapsed %u entries into %d sparse directories",
+			 istate->cache_nr - out.nr + out.dirs, out.dirs);
+	state->cache = istate->cache;
+	state->cache_nr = istate->cache_nr;
+	state->cache_alloc = istate->cache_alloc;
+	istate->cache = out.entries;
+	istate->cache_nr = out.nr;
+	istate->cache_alloc = out.alloc;
+	istate->sparse_index = 1;
+	cache_tree_recount_entries(istate);
+	return 1;
+}
+
+void restore_full_index(struct index_state *istate,
+			struct sparse_write_state *state)
+{
+	int i;
+
+	/* the other entries are still in the array we set aside */
+	for (i = 0; i < istate->cache_nr; i++)
+		if (S_ISSPARSEDIR(istate->cache[i]->ce_mode))
+			discard_cache_entry(istate->cache[i]);
+	free(istate->cache);
+	istate->cache = state->cache;
+	istate->cache_nr = state->cache_nr;
+	istate->cache_alloc = state->cache_alloc;
+	istate->sparse_index = 0;
+	cache_tree_recount_entries(istate);
+}
+
+struct expand_data {
+	struct index_state *istate;
+	struct entry_list *out;
+};
+
+static int add_path_to_index(const struct object_id *oid,
+			     struct strbuf *base, const char *path,
+			     unsigned int mode, int stage, void *context)
+{
+	struct expand_data *data = context;
+	struct cache_entry *ce;
+	int len;
+
+	if (S_ISDIR(mode))
+		return READ_TREE_RECURSIVE;
+
+	len = base->len + strlen(path);
+	ce = make_empty_cache_entry(data->istate, len);
+	memcpy(ce->name, base->buf, base->len);
+	memcpy(ce->name + base->len, path, len - base->len);
+	ce->ce_namelen = len;
+	ce->ce_mode = create_ce_mode(mode);
+	ce->ce_flags = create_ce_flags(0) | CE_SKIP_WORKTREE;
+	oidcpy(&ce->oid, oid);
+	add_entry(data->out, ce);
+	return 0;
+}
+
+void ensure_full_index(struct index_state *istate)
+{
+	struct entry_list out = { NULL };
+	struct expand_data data = { istate, &out };
+	struct pathspec match_all;
+	int i;
+
+	if (!istate->sparse_index)
+		return;
+
+	memset(&match_all, 0, sizeof(match_all));
+	for (i = 0; i < istate->cache_nr; i++) {
+		struct cache_entry *ce = istate->cache[i];
+		struct tree *tree;
+
+		if (!S_ISSPARSEDIR(ce->ce_mode)) {
+			add_entry(&out, ce);
+			continue;
+		}
+
+		tree = parse_tree_indirect(&ce->oid);
+		if (!tree)
+			die(_("could not read tree %s of sparse directory '%s'"),
+			    oid_to_hex(&ce->oid), ce->name);
+		if (read_tree_recursive(tree, ce->name, ce_namelen(ce), 0,
+					&match_all, add_path_to_index, &data))
+			die(_("could not expand sparse directory '%s'"),
+			    ce->name);
+		out.dirs++;
+		discard_cache_entry(ce);
+	}
+
+	trace_printf_key(&trace_sparse_index,
+			 "expanded %d sparse directories into %d entries",
+			 out.dirs, out.nr - istate->cache_nr + out.dirs);
+	free_name_hash(istate);
+	free(istate->cache);
+	istate->cache = out.entries;
+	istate->cache_nr = out.nr;
+	istate->cache_alloc = out.alloc;
+	istate->sparse_index = 0;
+	cache_tree_recount_entries(istate);
+}
+
+void expand_to_path(struct index_state *istate, const char *path, int pathlen)
+{
+	struct strbuf dir = STRBUF_INIT;
+	const char *slash = path;
+
+	if (!istate->sparse_index)
+		return;
+
+	while (slash && slash < path + pathlen) {
+		int pos;
+
+		slash = memchr(slash + 1, '/', path + pathlen - slash - 1);
+		strbuf_reset(&dir);
+		strbuf_add(&dir, path, slash ? slash - path : pathlen);
+		strbuf_addch(&dir, '/');
+
+		pos = index_name_pos(istate, dir.buf, dir.len);
+		if (pos >= 0 && S_ISSPARSEDIR(istate->cache[pos]->ce_mode)) {
+			ensure_full_index(istate);
+			break;
+		}
+	}
+	strbuf_release(&dir);
+}
+
+int sparse_dirs_match_tree(struct index_state *istate,
+			   const struct object_id *tree)
+{
+	struct strbuf dir = STRBUF_INIT;
+	int i, ret = 1;
+
+	if (!istate->sparse_index)
+		return 1;
+
+	for (i = 0; ret && i < istate->cache_nr; i++) {
+		const struct cache_entry *ce = istate->cache[i];
+		struct cache_tree *it;
+		struct object_id oid;
+		unsigned mode;
+
+		if (!S_ISSPARSEDIR(ce->ce_mode))
+			continue;
+
+		strbuf_reset(&dir);
+		strbuf_add(&dir, ce->name, ce_namelen(ce) - 1);
+		it = cache_tree_find(istate->cache_tree, dir.buf);
+		if (!it || it->entry_count < 0 || oidcmp(&it->oid, &ce->oid) ||
+		    get_tree_entry(tree, dir.buf, &oid, &mode) ||
+		    !S_ISDIR(mode) || oidcmp(&oid, &ce->oid))
+			ret = 0;
+	}
+
+	strbuf_release(&dir);
+	return ret;
+}
@@ -0,0 +1,74 @@
+#ifndef SPARSE_INDEX_H
+#define SPARSE_INDEX_H
+
+struct index_state;
+struct object_id;
+
+/*
+ * With core.sparseCheckout and index.sparse, directories of which not
+ * a single file is checked out (all their entries are skip-worktree)
+ * are written to the index as a single "sparse directory" entry: the
+ * directory name with a trailing '/', mode S_IFDIR and the object name
+ * of the tree, so that the size of the index, and the time to read
+ * it, depend on the part of the working tree that is checked out.
+ *
+ * Most code expects one entry per file, so the index is expanded back
+ * when it is read, unless the command has set
+ * command_requires_full_index to 0 before, promising to cope with
+ * sparse directory entries, or to call ensure_full_index() where it
+ * cannot.
+ */
+extern int command_requires_full_index;
+
+/*
+ * The entries of a full index, set aside while it is written sparse.
+ */
+struct sparse_write_state {
+	struct cache_entry **cache;
+	unsigned int cache_nr, cache_alloc;
+};
+
+/*
+ * Used when writing the index. Collapse the directories outside of the
+ * sparse checkout, if the configuration asks for a sparse index and
+ * the index can be one (it is not split, and has no unmerged entries);
+ * otherwise, make sure the index is a full one.
+ *
+ * A full index is not modified in the process: its array of entries is
+ * set aside in "state" and replaced by a collapsed copy. Return 1 if
+ * that happened, in which case restore_full_index() has to be called
+ * once the index is written.
+ */
+extern int convert_to_sparse(struct index_state *istate,
+			     struct sparse_write_state *state);
+
+/*
+ * Put back the entries convert_to_sparse() set aside, so that the
+ * caller gets the index, and the cache entries it may hold on to, as
+ * they were.
+ */
+extern void restore_full_index(struct index_state *istate,
+			       struct sparse_write_state *state);
+
+/*
+ * Replace each sparse directory entry by the entries of the files in
+ * its tree, all of them marked skip-worktree.
+ */
+extern void ensure_full_index(struct index_state *istate);
+
+/*
+ * Expand the index if "path" is a directory below, or at, a sparse
+ * directory entry, i.e. when its contents are about to be looked at.
+ */
+extern void expand_to_path(struct index_state *istate,
+			   const char *path, int pathlen);
+
+/*
+ * Return 1 if each sparse directory entry has the same tree as the
+ * corresponding directory of "tree", and the cache-tree knows it too,
+ * so that comparing the index with "tree" can skip them as a whole.
+ */
+extern int sparse_dirs_match_tree(struct index_state *istate,
+				  const struct object_id *tree);
+
+#endif /* SPARSE_INDEX_H */
@@ -73,10 +73,20 @@ void move_cache_to_base_index(struct index_state *istate)
 	int i;
 
 	/*
-	 * do not delete old si->base, its index entries may be shared
-	 * with istate->cache[]. Accept a bit of leaking here because
-	 * this code is only used by short-lived update-index.
+	 * The entries of the old base index may be shared with
+	 * istate->cache[]: take over its memory before discarding it.
 	 */
+	if (si->base) {
+		if (si->base->ce_mem_pool) {
+			mem_pool_init(&istate->ce_mem_pool, 0);
+			mem_pool_combine(istate->ce_mem_pool,
+					 si->base->ce_mem_pool);
+		}
+		si->base->cache_nr = 0;
+		discard_index(si->base);
+		free(si->base);
+	}
+
 	si->base = xcalloc(1, sizeof(*si->base));
 	si->base->version = istate->version;
 	/* zero timestamp disables racy test in ce_write_index() */
@@ -123,7 +133,7 @@ static void replace_entry(size_t pos, void *data)
 	src->ce_flags |= CE_UPDATE_IN_BASE;
 	src->ce_namelen = dst->ce_namelen;
 	copy_cache_entry(dst, src);
-	free(src);
+	discard_cache_entry(src);
 	si->nr_replacements++;
 }
 
@@ -224,7 +234,7 @@ void prepare_to_write_split_index(struct index_state *istate)
 			base->ce_flags = base_flags;
 			if (ret)
 				ce->ce_flags |= CE_UPDATE_IN_BASE;
-			free(base);
+			discard_cache_entry(base);
 			si->base->cache[ce->index - 1] = ce;
 		}
 		for (i = 0; i < si->base->cache_nr; i++) {
@@ -286,6 +296,12 @@ void discard_split_index(struct index_state *istate)
 	if (si->refcount)
 		return;
 	if (si->base) {
+		/*
+		 * Its entries may be shared with those of the index we
+		 * are discarding, which does not free them one by one
+		 * either; only its memory pool matters.
+		 */
+		si->base->cache_nr = 0;
 		discard_index(si->base);
 		free(si->base);
 	}
@@ -301,7 +317,7 @@ void save_or_free_index_entry(struct index_state *istate, struct cache_entry *ce
 	    ce == istate->split_index->base->cache[ce->index - 1])
 		ce->ce_flags |= CE_REMOVE;
 	else
-		free(ce);
+		discard_cache_entry(ce);
 }
 
 void replace_index_entry_in_base(struct index_state *istate,
@@ -314,7 +330,7 @@ void replace_index_entry_in_base(struct index_state *istate,
 	    old_entry->index <= istate->split_index->base->cache_nr) {
 		new_entry->index = old_entry->index;
 		if (old_entry != istate->split_index->base->cache[new_entry->index - 1])
-			free(istate->split_index->base->cache[new_entry->index - 1]);
+			discard_cache_entry(istate->split_index->base->cache[new_entry->index - 1]);
 		istate->split_index->base->cache[new_entry->index - 1] = new_entry;
 	}
 }
@@ -329,14 +345,28 @@ void add_split_index(struct index_state *istate)
 
 void remove_split_index(struct index_state *istate)
 {
-	if (istate->split_index) {
+	struct split_index *si = istate->split_index;
+
+	if (!si)
+		return;
+	if (si->refcount == 1) {
+		/*
+		 * Our entries may come from the base index: take over its
+		 * memory before discarding it.
+		 */
+		if (si->base && si->base->ce_mem_pool) {
+			mem_pool_init(&istate->ce_mem_pool, 0);
+			mem_pool_combine(istate->ce_mem_pool,
+					 si->base->ce_mem_pool);
+		}
+		discard_split_index(istate);
+	} else {
 		/*
-		 * can't discard_split_index(&the_index); because that
-		 * will destroy split_index->base->cache[], which may
-		 * be shared with the_index.cache[]. So yeah we're
-		 * leaking a bit here.
+		 * The base index is shared with another index and cannot
+		 * give its memory away, while we may still be using some
+		 * of it; so yeah we're leaking a bit here.
 		 */
 		istate->split_index = NULL;
-		istate->cache_changed |= SOMETHING_CHANGED;
 	}
+	istate->cache_changed |= SOMETHING_CHANGED;
 }
@@ -11,4 +11,15 @@ test_perf "read_cache/discard_cache $count times" "
 	test-tool read-cache $count
 "
 
+test_expect_success 'write index with entry offset table' '
+	git -c index.threads=8 update-index --force-write-index
+'
+
+for threads in 1 2 4 8
+do
+	test_perf "read_cache/discard_cache $count times with $threads threads" "
+		GIT_TEST_INDEX_THREADS=$threads test-tool read-cache $count
+	"
+done
+
 test_done
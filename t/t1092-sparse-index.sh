@@ -0,0 +1,150 @@
+#!/bin/sh
+
+test_description='sparse index
+
+With index.sparse, directories that are entirely outside of the sparse
+checkout are stored in the index as a single entry pointing at their
+tree. Check that commands give the same results as with a full index,
+and that "git status" works without expanding such an index.
+'
+. ./test-lib.sh
+
+test_expect_success 'setup' '
+	git init original &&
+	(
+		cd original &&
+		mkdir -p in deep/in deep/out/sub out &&
+		for f in a z in/a deep/a deep/in/a deep/out/a \
+			 deep/out/sub/a out/a out/b
+		do
+			echo "$f" >$f || return 1
+		done &&
+		git add . &&
+		git commit -m initial &&
+		git checkout -b outside &&
+		echo changed >>deep/out/sub/a &&
+		git commit -a -m "change outside" &&
+		git checkout master
+	) &&
+	cat >sparse-checkout <<-\EOF &&
+	/*
+	!/out/
+	!/deep/out/
+	EOF
+	for repo in full sparse
+	do
+		git clone original $repo &&
+		git -C $repo config core.sparseCheckout true &&
+		cp sparse-checkout $repo/.git/info/ &&
+		git -C $repo read-tree -mu HEAD || return 1
+	done &&
+	git -C sparse config index.sparse true &&
+	git -C sparse reset --hard
+'
+
+test_sparse_match () {
+	(cd full && "$@") >full-out &&
+	(cd sparse && "$@") >sparse-out &&
+	test_cmp full-out sparse-out
+}
+
+test_expect_success 'index is written sparse' '
+	git -C sparse status --porcelain &&
+	test_path_is_missing sparse/out &&
+	test_path_is_missing sparse/deep/out &&
+	test $(wc -c <sparse/.git/index) -lt $(wc -c <full/.git/index)
+'
+
+test_expect_success 'status does not expand the index' '
+	test_sparse_match git status --porcelain=v2 &&
+	GIT_TRACE_SPARSE_INDEX="$(pwd)/trace" git -C sparse status &&
+	test_path_is_missing trace
+'
+
+test_expect_success 'other commands see a full index' '
+	test_sparse_match git ls-files --stage &&
+	test_sparse_match git ls-files -t &&
+	rm -f trace &&
+	GIT_TRACE_SPARSE_INDEX="$(pwd)/trace" git -C sparse ls-files &&
+	grep "expanded 2 sparse directories into 4 entries" trace
+'
+
+test_expect_success 'writing the index does not expand it again' '
+	test_when_finished "git -C sparse reset --hard" &&
+	echo more >>sparse/in/a &&
+	rm -f trace &&
+	GIT_TRACE_SPARSE_INDEX="$(pwd)/trace" git -C sparse add in/a &&
+	grep "expanded 2 sparse directories" trace >expanded &&
+	test_line_count = 1 expanded &&
+	grep "collapsed 4 entries into 2 sparse directories" trace &&
+	test $(wc -c <sparse/.git/index) -lt $(wc -c <full/.git/index)
+'
+
+test_expect_success 'status with changes' '
+	test_when_finished "git -C full reset --hard; git -C sparse reset --hard" &&
+	for repo in full sparse
+	do
+		echo more >>$repo/in/a &&
+		echo new >$repo/deep/new &&
+		git -C $repo add deep/new &&
+		echo untracked >$repo/untracked || return 1
+	done &&
+	test_sparse_match git status --porcelain=v2 &&
+	test_sparse_match git diff --cached --stat
+'
+
+test_expect_success 'commit -a' '
+	for repo in full sparse
+	do
+		echo more >>$repo/deep/in/a &&
+		git -C $repo commit -a -m inside || return 1
+	done &&
+	test_sparse_match git rev-parse HEAD^{tree} &&
+	test_sparse_match git status --porcelain=v2
+'
+
+test_expect_success 'status after moving HEAD into a changed sparse directory' '
+	for repo in full sparse
+	do
+		git -C $repo reset --soft origin/outside || return 1
+	done &&
+	test_sparse_match git status --porcelain=v2 &&
+	test_sparse_match git diff --cached
+'
+
+test_expect_success 'tracked files in a sparse directory that exists' '
+	test_when_finished "rm -rf full/out sparse/out" &&
+	for repo in full sparse
+	do
+		git -C $repo reset --hard &&
+		mkdir $repo/out &&
+		echo out/a >$repo/out/a &&
+		echo untracked >$repo/out/untracked || return 1
+	done &&
+	test_sparse_match git status --porcelain=v2 --untracked-files=all
+'
+
+test_expect_success 'changing the sparse checkout' '
+	for repo in full sparse
+	do
+		echo "/*" >$repo/.git/info/sparse-checkout &&
+		git -C $repo read-tree -mu HEAD || return 1
+	done &&
+	test_path_is_file sparse/out/a &&
+	test_sparse_match git ls-files --stage &&
+	test_sparse_match git status --porcelain=v2 &&
+	cp sparse-checkout sparse/.git/info/ &&
+	git -C sparse read-tree -mu HEAD &&
+	test_path_is_missing sparse/out &&
+	test $(wc -c <sparse/.git/index) -lt $(wc -c <full/.git/index)
+'
+
+test_expect_success 'index.sparse=false writes a full index' '
+	git -C sparse -c index.sparse=false reset --hard &&
+	rm -f trace &&
+	GIT_TRACE_SPARSE_INDEX="$(pwd)/trace" git -C sparse ls-files &&
+	test_path_is_missing trace &&
+	test_sparse_match git ls-files --stage
+'
+
+test_done
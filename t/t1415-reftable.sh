@@ -0,0 +1,300 @@
+#!/bin/sh
+
+test_description='reftable ref storage backend'
+
+. ./test-lib.sh
+
+INVALID_SHA1=aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa
+
+table_count () {
+	wc -l <"$1/reftable/tables.list"
+}
+
+test_expect_success 'init with an unknown ref storage format fails' '
+	test_must_fail git init --ref-storage=nosuch unknown 2>err &&
+	test_i18ngrep "unknown ref storage format" err &&
+	test_path_is_missing unknown/.git/config
+'
+
+test_expect_success 'init a reftable repository' '
+	git init --ref-storage=reftable repo &&
+	test "$(git -C repo config core.repositoryformatversion)" = 1 &&
+	test "$(git -C repo config extensions.refStorage)" = reftable &&
+	test_path_is_file repo/.git/reftable/tables.list &&
+	echo refs/heads/master >expect &&
+	git -C repo symbolic-ref HEAD >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'reinit keeps the format, but refuses to change it' '
+	git init repo &&
+	test "$(git -C repo config extensions.refStorage)" = reftable &&
+	test_must_fail git init --ref-storage=files repo 2>err &&
+	test_i18ngrep "different ref storage format" err
+'
+
+test_expect_success 'refs and reflogs are stored in the reftable' '
+	(
+		cd repo &&
+		test_commit one &&
+		test_commit two &&
+		git tag -a -m annotated annotated one &&
+		test_path_is_missing .git/refs/heads/master &&
+		test_path_is_missing .git/logs &&
+		git rev-parse two >expect &&
+		git rev-parse master >actual &&
+		test_cmp expect actual &&
+		git rev-parse one >expect &&
+		git rev-parse annotated^{} >actual &&
+		test_cmp expect actual &&
+		test_line_count = 2 .git/reftable/tables.list ||
+		test_line_count = 1 .git/reftable/tables.list
+	)
+'
+
+test_expect_success 'for-each-ref and show-ref' '
+	(
+		cd repo &&
+		git branch side one &&
+		cat >expect <<-EOF &&
+		$(git rev-parse master) commit	refs/heads/master
+		$(git rev-parse one) commit	refs/heads/side
+		EOF
+		git for-each-ref refs/heads/ >actual &&
+		test_cmp expect actual &&
+		cat >expect <<-EOF &&
+		$(git rev-parse annotated) refs/tags/annotated
+		$(git rev-parse one) refs/tags/annotated^{}
+		$(git rev-parse one) refs/tags/one
+		$(git rev-parse two) refs/tags/two
+		EOF
+		git show-ref -d --tags >actual &&
+		test_cmp expect actual
+	)
+'
+
+test_expect_success 'symbolic refs' '
+	(
+		cd repo &&
+		git symbolic-ref refs/heads/alias refs/heads/side &&
+		echo refs/heads/side >expect &&
+		git symbolic-ref refs/heads/alias >actual &&
+		test_cmp expect actual &&
+		git rev-parse side >expect &&
+		git rev-parse alias >actual &&
+		test_cmp expect actual &&
+		git update-ref -m "via alias" refs/heads/alias two &&
+		git rev-parse two >expect &&
+		git rev-parse side >actual &&
+		test_cmp expect actual &&
+		git update-ref --no-deref -d refs/heads/alias &&
+		test_must_fail git rev-parse --verify -q alias &&
+		git rev-parse --verify side
+	)
+'
+
+test_expect_success 'update-ref --stdin is atomic' '
+	(
+		cd repo &&
+		git rev-parse master >expect &&
+		cat >input <<-EOF &&
+		create refs/heads/new $(git rev-parse one)
+		update refs/heads/master $(git rev-parse one) $INVALID_SHA1
+		EOF
+		test_must_fail git update-ref --stdin <input 2>err &&
+		test_i18ngrep "is at $(git rev-parse master) but expected $INVALID_SHA1" err &&
+		test_must_fail git rev-parse --verify -q refs/heads/new &&
+		git rev-parse master >actual &&
+		test_cmp expect actual
+	)
+'
+
+test_expect_success 'directory/file conflicts are detected' '
+	(
+		cd repo &&
+		test_must_fail git update-ref refs/heads/side/sub one 2>err &&
+		test_i18ngrep "refs/heads/side.* exists" err &&
+		test_must_fail git update-ref refs/heads refs/heads/master 2>err
+	)
+'
+
+test_expect_success 'nonexistent objects and non-commit branches are rejected' '
+	(
+		cd repo &&
+		test_must_fail git update-ref refs/heads/bad $INVALID_SHA1 &&
+		test_must_fail git update-ref refs/heads/bad annotated &&
+		test_must_fail git rev-parse --verify -q refs/heads/bad
+	)
+'
+
+test_expect_success 'reflogs follow updates of the branch and of HEAD' '
+	(
+		cd repo &&
+		git checkout side &&
+		test_commit three &&
+		git checkout master &&
+		cat >expect <<-\EOF &&
+		commit: three
+		via alias
+		branch: Created from one
+		EOF
+		git log -g --format=%gs side >actual &&
+		test_cmp expect actual &&
+		cat >expect <<-\EOF &&
+		checkout: moving from side to master
+		commit: three
+		checkout: moving from master to side
+		EOF
+		git log -g --format=%gs -3 HEAD >actual &&
+		test_cmp expect actual
+	)
+'
+
+test_expect_success 'deleting a branch deletes its reflog' '
+	(
+		cd repo &&
+		git branch doomed &&
+		git reflog exists refs/heads/doomed &&
+		git branch -D doomed &&
+		test_must_fail git reflog exists refs/heads/doomed &&
+		git branch doomed &&
+		git log -g --format=%gs doomed >actual &&
+		test_line_count = 1 actual
+	)
+'
+
+test_expect_success 'branch -m moves the reflog, branch -c copies it' '
+	(
+		cd repo &&
+		git log -g --format=%gs side >side.log &&
+		git branch -m side moved &&
+		test_must_fail git rev-parse --verify -q side &&
+		test_must_fail git reflog exists refs/heads/side &&
+		git log -g --format=%gs moved >actual &&
+		sed 1d actual >actual.old &&
+		test_cmp side.log actual.old &&
+		head -n 1 actual >actual.new &&
+		echo "Branch: renamed refs/heads/side to refs/heads/moved" >expect &&
+		test_cmp expect actual.new &&
+		git branch -c moved copied &&
+		git reflog exists refs/heads/moved &&
+		git log -g --format=%gs copied >actual &&
+		test_line_count = $(($(wc -l <side.log) + 2)) actual
+	)
+'
+
+test_expect_success 'reflog expire and delete' '
+	(
+		cd repo &&
+		git log -g --format=%gs master >before &&
+		test_line_count = 2 before &&
+		git reflog delete master@{1} &&
+		git log -g --format=%gs master >actual &&
+		test_line_count = $(($(wc -l <before) - 1)) actual &&
+		git reflog expire --expire=now --all &&
+		git log -g --format=%gs master >actual &&
+		test_must_be_empty actual
+	)
+'
+
+test_expect_success 'pseudorefs are files' '
+	(
+		cd repo &&
+		git update-ref ORIG_HEAD one &&
+		git rev-parse one >expect &&
+		test_cmp expect .git/ORIG_HEAD &&
+		echo "update FETCH_LIKE_HEAD $(git rev-parse two)" |
+		git update-ref --stdin &&
+		git rev-parse two >expect &&
+		test_cmp expect .git/FETCH_LIKE_HEAD &&
+		git update-ref -d FETCH_LIKE_HEAD &&
+		test_path_is_missing .git/FETCH_LIKE_HEAD
+	)
+'
+
+test_expect_success 'the stack is compacted automatically' '
+	(
+		cd repo &&
+		for i in $(test_seq 50)
+		do
+			git update-ref refs/heads/counter-$i HEAD || return 1
+		done &&
+		test $(table_count .git) -le 8 &&
+		git for-each-ref refs/heads/counter-* >actual &&
+		test_line_count = 50 actual
+	)
+'
+
+test_expect_success 'pack-refs merges all tables' '
+	(
+		cd repo &&
+		git for-each-ref >expect &&
+		git pack-refs --all &&
+		test $(table_count .git) = 1 &&
+		git for-each-ref >actual &&
+		test_cmp expect actual
+	)
+'
+
+test_expect_success 'many refs' '
+	(
+		cd repo &&
+		oid=$(git rev-parse HEAD) &&
+		for i in $(test_seq 3000)
+		do
+			echo "create refs/many/$(($i % 10))/ref$i $oid" || return 1
+		done >input &&
+		git update-ref --stdin <input &&
+		git for-each-ref refs/many/ >all &&
+		test_line_count = 3000 all &&
+		git for-each-ref refs/many/7/ >actual &&
+		test_line_count = 300 actual &&
+		! grep -v "refs/many/7/" actual &&
+		git rev-parse refs/many/3/ref2003 >actual &&
+		echo $oid >expect &&
+		test_cmp expect actual &&
+		test_must_fail git rev-parse --verify -q refs/many/3/ref2004 &&
+		sed -e "s/^create \([^ ]*\) .*/delete \1/" input | awk "NR % 2" |
+		git update-ref --stdin &&
+		git for-each-ref refs/many/ >actual &&
+		test_line_count = 1500 actual &&
+		git pack-refs --all &&
+		git for-each-ref refs/many/ >actual &&
+		test_line_count = 1500 actual
+	)
+'
+
+test_expect_success 'worktrees have their own HEAD and bisect refs' '
+	git -C repo worktree add --detach ../wt one &&
+	(
+		cd wt &&
+		git rev-parse one >expect &&
+		git rev-parse HEAD >actual &&
+		test_cmp expect actual &&
+		git checkout -b wt-branch &&
+		git update-ref refs/bisect/bad HEAD &&
+		git for-each-ref --format="%(refname)" refs/bisect >actual &&
+		echo refs/bisect/bad >expect &&
+		test_cmp expect actual &&
+		git reflog exists HEAD
+	) &&
+	echo refs/heads/master >expect &&
+	git -C repo symbolic-ref HEAD >actual &&
+	test_cmp expect actual &&
+	git -C repo for-each-ref refs/bisect >actual &&
+	test_must_be_empty actual &&
+	git -C repo rev-parse --verify wt-branch
+'
+
+test_expect_success 'corrupt tables are detected' '
+	(
+		cd repo &&
+		table=.git/reftable/$(head -n 1 .git/reftable/tables.list) &&
+		chmod +w "$table" &&
+		printf "XXXX" | dd of="$table" bs=1 seek=0 conv=notrunc &&
+		test_must_fail git rev-parse master 2>err &&
+		test_i18ngrep "not a valid reftable" err
+	)
+'
+
+test_done
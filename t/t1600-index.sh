@@ -73,4 +73,70 @@ test_expect_success 'GIT_INDEX_VERSION takes precedence over config' '
 	)
 '
 
+test_index_entries_match () {
+	git -c index.threads=1 ls-files -s >expect &&
+	GIT_TEST_INDEX_THREADS=3 git ls-files -s >actual &&
+	test_cmp expect actual
+}
+
+for version in 2 3 4
+do
+	test_expect_success "index.threads records offset table in index v$version" '
+		(
+			sane_unset GIT_INDEX_VERSION GIT_TEST_INDEX_THREADS &&
+			rm -f .git/index &&
+			git config --replace-all index.version $version &&
+			mkdir -p dir/sub &&
+			for i in 1 2 3 4 5 6 7
+			do
+				echo $i >dir/sub/file$i &&
+				echo $i >dir/file$i || return 1
+			done &&
+			git add a dir &&
+			if test $version = 3
+			then
+				git update-index --skip-worktree dir/file1
+			fi &&
+			echo $version >>a &&
+			git -c index.threads=3 add a &&
+			grep IEOT .git/index &&
+			grep EOIE .git/index &&
+			test_index_entries_match &&
+			git -c index.threads=3 diff --exit-code
+		)
+	'
+done
+
+test_expect_success 'extensions are still read with the offset table' '
+	(
+		sane_unset GIT_TEST_INDEX_THREADS &&
+		git config --replace-all index.version 4 &&
+		git config index.threads 3 &&
+		echo changed >dir/file2 &&
+		git add dir/file2 &&
+		git write-tree &&
+		grep IEOT .git/index &&
+		test-tool dump-cache-tree >cache-tree.threaded &&
+		git config index.threads 1 &&
+		test-tool dump-cache-tree >cache-tree.serial &&
+		test_cmp cache-tree.serial cache-tree.threaded &&
+		test_index_entries_match &&
+		git config --unset index.threads
+	)
+'
+
+test_expect_success 'index.threads=false does not write offset table' '
+	(
+		sane_unset GIT_TEST_INDEX_THREADS &&
+		git -c index.threads=false update-index --index-version 2 &&
+		! grep IEOT .git/index &&
+		! grep EOIE .git/index &&
+		git -c index.recordEndOfIndexEntries=true \
+			update-index --index-version 3 &&
+		! grep IEOT .git/index &&
+		grep EOIE .git/index &&
+		test_index_entries_match
+	)
+'
+
 test_done
@@ -7,6 +7,7 @@ test_description='split index mode tests'
 # We need total control of index splitting here
 sane_unset GIT_TEST_SPLIT_INDEX
 sane_unset GIT_FSMONITOR_TEST
+sane_unset GIT_TEST_INDEX_THREADS
 
 test_expect_success 'enable split index' '
 	git config splitIndex.maxPercentChange 100 &&
@@ -439,4 +440,26 @@ test_expect_success 'writing split index with null sha1 does not write cache tre
 	test_line_count = 0 cache-tree.out
 '
 
+test_expect_success 'cache entries go away with their index, not before' '
+	git init validate &&
+	(
+		cd validate &&
+		GIT_TEST_VALIDATE_INDEX_CACHE_ENTRIES=1 &&
+		export GIT_TEST_VALIDATE_INDEX_CACHE_ENTRIES &&
+		test_commit initial &&
+		git update-index --split-index &&
+		test_commit split-one &&
+		echo changed >split-one.t &&
+		git add split-one.t &&
+		git checkout -b validate-entries &&
+		git reset --hard HEAD^ &&
+		test_commit split-two &&
+		git update-index --no-split-index &&
+		git checkout -
+	) &&
+	git -C validate ls-files >actual &&
+	grep "^split-one.t$" actual &&
+	! grep "^split-two.t$" actual
+'
+
 test_done
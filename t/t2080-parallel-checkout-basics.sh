@@ -0,0 +1,187 @@
+#!/bin/sh
+
+test_description='parallel-checkout basics
+
+Ensure that parallel-checkout basically works on clone and checkout,
+spawning the required number of workers and correctly populating both
+the index and the working tree.
+'
+
+TEST_NO_CREATE_REPO=1
+. ./test-lib.sh
+
+# The tests below pick the number of workers themselves.
+sane_unset GIT_TEST_CHECKOUT_WORKERS
+
+# Runs "git -c checkout.workers=$1 $3..." with GIT_TRACE set and checks
+# that exactly $2 workers were spawned.
+test_checkout_workers () {
+	workers=$1 &&
+	expected=$2 &&
+	shift 2 &&
+	rm -f trace &&
+	GIT_TRACE="$(pwd)/trace" git -c checkout.workers=$workers \
+		-c checkout.thresholdForParallelism=0 "$@" &&
+	grep "run_command: .*checkout--worker" trace >workers &&
+	test_line_count = $expected workers
+}
+
+test_expect_success 'setup repo for checkout with various types of changes' '
+	git init various &&
+	(
+		cd various &&
+		git checkout -b B1 &&
+		echo a >a &&
+		mkdir dir &&
+		echo b >dir/b &&
+		echo c >c &&
+		echo d >d &&
+		echo e >e &&
+		for i in $(test_seq 1 30)
+		do
+			echo $i >dir/file$i || return 1
+		done &&
+		echo x >x &&
+		chmod +x x &&
+		git add . &&
+		git commit -m B1 &&
+
+		git checkout -b B2 &&
+		echo modified >a &&
+		rm -rf dir &&
+		echo dir >dir &&
+		rm c &&
+		mkdir c &&
+		echo c >c/c &&
+		chmod +x d &&
+		rm e &&
+		echo new >new &&
+		git add -A . &&
+		git commit -m B2 &&
+
+		git checkout --quiet B1
+	)
+'
+
+test_expect_success 'sequential checkout spawns no workers' '
+	rm -f trace &&
+	GIT_TRACE="$(pwd)/trace" git -C various \
+		-c checkout.workers=1 checkout --quiet B2 &&
+	! grep checkout--worker trace &&
+	git -C various checkout --quiet B1
+'
+
+test_expect_success 'parallel checkout of various changes' '
+	git clone various various_seq &&
+	git -C various_seq checkout --quiet B2 &&
+
+	test_checkout_workers 2 2 -C various checkout --quiet B2 &&
+	git -C various diff-files --exit-code &&
+	git -C various diff-index --cached --exit-code HEAD &&
+	for f in a c/c d dir new x
+	do
+		test_cmp various_seq/$f various/$f || return 1
+	done &&
+	test_path_is_missing various/e &&
+	test -x various/d &&
+	test -x various/x
+'
+
+test_expect_success 'parallel checkout back to the first branch' '
+	test_checkout_workers 2 2 -C various checkout --quiet B1 &&
+	git -C various diff-files --exit-code &&
+	git -C various diff-index --cached --exit-code HEAD &&
+	test_path_is_dir various/dir &&
+	test_path_is_file various/c &&
+	test_path_is_missing various/new &&
+	echo 30 >expect &&
+	test_cmp expect various/dir/file30
+'
+
+test_expect_success 'parallel checkout on clone' '
+	test_checkout_workers 4 4 clone various various_par &&
+	git -C various_par diff-files --exit-code &&
+	git -C various_par status --porcelain >actual &&
+	test_must_be_empty actual &&
+	git -C various_par ls-files -s >actual &&
+	git -C various ls-files -s >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'no workers are spawned below the threshold' '
+	rm -f trace &&
+	GIT_TRACE="$(pwd)/trace" git -c checkout.workers=2 \
+		-c checkout.thresholdForParallelism=1000 \
+		clone various various_threshold &&
+	! grep checkout--worker trace &&
+	git -C various_threshold diff-files --exit-code
+'
+
+test_expect_success SYMLINKS 'parallel checkout with symlinks' '
+	git init symlinks &&
+	(
+		cd symlinks &&
+		echo a >a &&
+		mkdir dir &&
+		echo b >dir/b &&
+		ln -s a link_to_a &&
+		ln -s dir link_to_dir &&
+		git add . &&
+		git commit -m symlinks
+	) &&
+	test_checkout_workers 2 2 clone symlinks symlinks_par &&
+	test -h symlinks_par/link_to_a &&
+	test -h symlinks_par/link_to_dir &&
+	echo a >expect &&
+	test_cmp expect symlinks_par/link_to_a &&
+	git -C symlinks_par diff-files --exit-code
+'
+
+test_expect_success 'parallel checkout honors eol and ident attributes' '
+	git init attrs &&
+	(
+		cd attrs &&
+		echo "crlf.txt text eol=crlf" >.gitattributes &&
+		echo "ident.txt ident" >>.gitattributes &&
+		echo "auto.txt text=auto" >>.gitattributes &&
+		printf "one\ntwo\n" >crlf.txt &&
+		printf "\$Id\$\n" >ident.txt &&
+		printf "auto\n" >auto.txt &&
+		git add . &&
+		git commit -m attrs
+	) &&
+	git -c checkout.workers=1 -c core.autocrlf=true clone attrs attrs_seq &&
+	test_checkout_workers 2 2 -c core.autocrlf=true clone attrs attrs_par &&
+	printf "one\r\ntwo\r\n" >expect &&
+	test_cmp expect attrs_par/crlf.txt &&
+	test_cmp attrs_seq/ident.txt attrs_par/ident.txt &&
+	grep "Id: [0-9a-f]" attrs_par/ident.txt &&
+	printf "auto\r\n" >expect &&
+	test_cmp expect attrs_par/auto.txt
+'
+
+test_expect_success 'paths with smudge filters are written sequentially' '
+	write_script rot13.sh <<-\EOF &&
+	tr "a-zA-Z" "n-za-mN-ZA-M"
+	EOF
+	test_config_global filter.rot13.smudge "\"$(pwd)/rot13.sh\"" &&
+	test_config_global filter.rot13.clean "\"$(pwd)/rot13.sh\"" &&
+	git init filter &&
+	(
+		cd filter &&
+		echo "*.r13 filter=rot13" >.gitattributes &&
+		echo hello >hello.r13 &&
+		echo plain >plain.txt &&
+		git add . &&
+		git commit -m filter
+	) &&
+	git clone --no-checkout filter filter_par &&
+	test_checkout_workers 2 2 -C filter_par checkout --quiet master &&
+	echo hello >expect &&
+	test_cmp expect filter_par/hello.r13 &&
+	echo plain >expect &&
+	test_cmp expect filter_par/plain.txt &&
+	git -C filter_par diff-files --exit-code
+'
+
+test_done
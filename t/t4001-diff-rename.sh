@@ -250,4 +250,80 @@ test_expect_success 'diff-tree -l0 defaults to a big rename limit, not zero' '
 	grep "myotherfile.*myfile" actual
 '
 
+test_expect_success 'setup many inexact renames' '
+	mkdir many &&
+	for i in $(test_seq 100)
+	do
+		test_seq $((1000 * $i)) $((1000 * $i + 30)) >many/file$i || return 1
+	done &&
+	git add many &&
+	git commit -m "many files" &&
+	git mv many moved &&
+	for i in $(test_seq 100)
+	do
+		echo change >>moved/file$i || return 1
+	done &&
+	# a candidate that is too different in size from every source
+	test_seq 1 5000 >moved/big &&
+	git add moved &&
+	git commit -m "move and edit"
+'
+
+test_expect_success 'rename detection with several threads' '
+	git -c diff.renameThreads=1 diff -M --name-status HEAD^ HEAD >expect &&
+	test_line_count = 101 expect &&
+	grep "^R0[0-9][0-9]	many/file37	moved/file37$" expect &&
+	grep "^A	moved/big$" expect &&
+	git -c diff.renameThreads=4 diff -M --name-status HEAD^ HEAD >actual &&
+	test_cmp expect actual &&
+	git -c diff.renameThreads=4 diff -C -C --name-status HEAD^ HEAD >actual &&
+	git -c diff.renameThreads=1 diff -C -C --name-status HEAD^ HEAD >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'renames with unique basenames do not need the matrix' '
+	git diff -M -l5 --name-status HEAD^ HEAD >actual 2>err &&
+	test_line_count = 101 actual &&
+	grep "^R0[0-9][0-9]	many/file37	moved/file37$" actual &&
+	test_must_be_empty err
+'
+
+test_expect_success 'setup a moved tree with common basenames' '
+	for d in one two three two/sub only
+	do
+		mkdir -p tree/$d &&
+		test_seq 1 30 | sed "s|^|$d |" >tree/$d/Makefile || return 1
+	done &&
+	for d in one two three
+	do
+		test_seq 1 30 | sed "s|^|unique $d |" >tree/$d/$d.c || return 1
+	done &&
+	git add tree &&
+	git commit -m "tree" &&
+	git mv tree newtree &&
+	git mv newtree/one newtree/uno &&
+	for f in $(git ls-files newtree)
+	do
+		echo change >>$f || return 1
+	done &&
+	git commit -a -m "move tree"
+'
+
+test_expect_success 'directory renames guide the pairing of common basenames' '
+	git diff -M -l2 --name-status HEAD^ HEAD >actual 2>err &&
+	sed -e "s/^R[0-9]*	/R	/" actual >actual.munged &&
+	cat >expect <<-\EOF &&
+	R	tree/only/Makefile	newtree/only/Makefile
+	R	tree/three/Makefile	newtree/three/Makefile
+	R	tree/three/three.c	newtree/three/three.c
+	R	tree/two/Makefile	newtree/two/Makefile
+	R	tree/two/sub/Makefile	newtree/two/sub/Makefile
+	R	tree/two/two.c	newtree/two/two.c
+	R	tree/one/Makefile	newtree/uno/Makefile
+	R	tree/one/one.c	newtree/uno/one.c
+	EOF
+	test_cmp expect actual.munged &&
+	test_must_be_empty err
+'
+
 test_done
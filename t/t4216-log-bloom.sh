@@ -0,0 +1,174 @@
+#!/bin/sh
+
+test_description='git log for a path with changed-path Bloom filters'
+. ./test-lib.sh
+
+test_expect_success 'setup test - repo, commits, commit graph, log outputs' '
+	git init &&
+	mkdir A A/B A/B/C &&
+	test_commit c1 A/file1 &&
+	test_commit c2 A/B/file2 &&
+	test_commit c3 A/B/C/file3 &&
+	test_commit c4 A/file1 &&
+	test_commit c5 A/B/file2 &&
+	test_commit c6 A/B/C/file3 &&
+	test_commit c7 A/file1 &&
+	test_commit c8 A/B/file2 &&
+	test_commit c9 A/B/C/file3 &&
+	test_commit c10 file_to_be_deleted &&
+	git checkout -b side HEAD~4 &&
+	test_commit side1 A/side &&
+	test_commit side2 A/B/side2 &&
+	git checkout master &&
+	git merge side -m merge &&
+	test_commit c11 file4 &&
+	rm file_to_be_deleted &&
+	git add . &&
+	git commit -m "delete file" &&
+	git mv file4 A/B/file4 &&
+	git commit -m "rename file4" &&
+	git commit-graph write --reachable --changed-paths
+'
+
+graph_read_expect () {
+	NUM_CHUNKS=5
+	cat >expect <<- EOF
+	header: 43475048 1 1 $NUM_CHUNKS 0
+	num_commits: $1
+	chunks: oid_fanout oid_lookup commit_metadata bloom_indexes bloom_data
+	EOF
+	git commit-graph read >actual &&
+	test_cmp expect actual
+}
+
+test_expect_success 'commit-graph write wrote out the bloom chunks' '
+	graph_read_expect 16
+'
+
+setup () {
+	rm -f trace.txt &&
+	git -c core.commitGraph=false log --pretty="format:%s" $1 >log_wo_bloom &&
+	GIT_TRACE_BLOOM_FILTER="$(pwd)/trace.txt" \
+		git -c core.commitGraph=true log --pretty="format:%s" $1 >log_w_bloom
+}
+
+test_bloom_filters_used () {
+	log_args=$1
+	setup "$log_args" &&
+	grep "definitely_not [1-9]" trace.txt &&
+	test_cmp log_wo_bloom log_w_bloom
+}
+
+test_bloom_filters_not_used () {
+	log_args=$1
+	setup "$log_args" &&
+	! grep "statistics" trace.txt &&
+	test_cmp log_wo_bloom log_w_bloom
+}
+
+for path in A A/B A/B/C A/file1 A/B/file2 A/B/C/file3 A/B/file4 A/side file4 file_to_be_deleted
+do
+	for option in "" \
+		      "--all" \
+		      "--full-history" \
+		      "--full-history --simplify-merges" \
+		      "--simplify-merges" \
+		      "--simplify-by-decoration" \
+		      "--first-parent" \
+		      "--topo-order" \
+		      "--date-order" \
+		      "--author-date-order" \
+		      "--ancestry-path side..master"
+	do
+		test_expect_success "git log option: $option for path: $path" '
+			test_bloom_filters_used "$option -- $path"
+		'
+	done
+done
+
+test_expect_success 'git log -- folder works with and without the trailing slash' '
+	test_bloom_filters_used "-- A" &&
+	test_bloom_filters_used "-- A/"
+'
+
+test_expect_success 'git log for path that does not exist' '
+	test_bloom_filters_used "-- path_does_not_exist"
+'
+
+test_expect_success 'git log with multiple paths' '
+	test_bloom_filters_used "-- A/file1 A/side" &&
+	test_bloom_filters_used "-- A/B/C/file3 file4"
+'
+
+test_expect_success 'git log from a subdirectory' '
+	(
+		cd A &&
+		rm -f trace.txt &&
+		git -c core.commitGraph=false log --pretty="format:%s" -- file1 B >../expect &&
+		GIT_TRACE_BLOOM_FILTER="$(pwd)/../trace.txt" \
+			git -c core.commitGraph=true log --pretty="format:%s" -- file1 B >../actual
+	) &&
+	grep "definitely_not [1-9]" trace.txt &&
+	test_cmp expect actual
+'
+
+test_expect_success 'git log with --walk-reflogs does not use Bloom filters' '
+	test_bloom_filters_not_used "--walk-reflogs -- A"
+'
+
+test_expect_success 'git log -- multiple path specs does not use Bloom filters with wildcards' '
+	test_bloom_filters_not_used "-- file4 A/file1 A/fil?9" &&
+	test_bloom_filters_not_used "-- :(glob)A/* A/file1" &&
+	test_bloom_filters_not_used "-- :(icase)a/file1"
+'
+
+test_expect_success 'git log -- "." pathspec at root does not use Bloom filters' '
+	test_bloom_filters_not_used "-- ."
+'
+
+test_expect_success 'git log with --follow does not use Bloom filters' '
+	test_bloom_filters_not_used "--follow -- A/B/file4"
+'
+
+test_expect_success 'git log with commitGraph.readChangedPaths=false does not use Bloom filters' '
+	rm -f trace.txt &&
+	GIT_TRACE_BLOOM_FILTER="$(pwd)/trace.txt" \
+		git -c core.commitGraph=true -c commitGraph.readChangedPaths=false \
+		log --pretty="format:%s" -- A >actual &&
+	! grep "statistics" trace.txt &&
+	git -c core.commitGraph=false log --pretty="format:%s" -- A >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'commits not in the graph fall back to a tree diff' '
+	test_commit c12 A/file1 &&
+	test_commit c13 other &&
+	setup "-- A/file1" &&
+	grep "filter_not_present [1-9]" trace.txt &&
+	grep "definitely_not [1-9]" trace.txt &&
+	test_cmp log_wo_bloom log_w_bloom
+'
+
+test_expect_success 'later writes keep the Bloom filters' '
+	git commit-graph write --reachable &&
+	graph_read_expect 18 &&
+	git -c core.commitGraph=true commit-graph write --reachable &&
+	graph_read_expect 18 &&
+	test_bloom_filters_used "-- A/file1"
+'
+
+test_expect_success 'Bloom filters for commits changing many paths' '
+	mkdir many &&
+	for i in $(test_seq 600)
+	do
+		echo $i >many/file$i || return 1
+	done &&
+	git add many &&
+	git commit -m "many paths" &&
+	test_commit c14 many/file1 &&
+	git commit-graph write --reachable &&
+	test_bloom_filters_used "-- many/file1" &&
+	test_bloom_filters_used "-- A"
+'
+
+test_done
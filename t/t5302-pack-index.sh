@@ -267,4 +267,35 @@ test_expect_success 'index-pack --fsck-objects also warns upon missing tagger in
     grep "^warning:.* expected .tagger. line" err
 '
 
+test_expect_success 'index-pack --pipeline-hash gives the same results' '
+    git index-pack --pipeline-hash -o pipelined.idx "test-2-${pack2}.pack" &&
+    cmp "test-2-${pack2}.idx" pipelined.idx &&
+    git index-pack --stdin --pipeline-hash stdin.pack <"test-2-${pack2}.pack" &&
+    cmp "test-2-${pack2}.pack" stdin.pack &&
+    cmp "test-2-${pack2}.idx" stdin.idx &&
+    test_copy_bytes 5000 <"test-2-${pack2}.pack" >truncated &&
+    test_must_fail git -c pack.pipelineHash=true index-pack --stdin \
+	truncated.pack <truncated 2>err &&
+    test_i18ngrep "early EOF" err
+'
+
+test_expect_success 'index-pack --fix-thin resolves deltas on all threads' '
+    for i in $(test_seq 10 30)
+    do
+	echo changed >>wide_delta_0$i &&
+	git update-index wide_delta_0$i || return 1
+    done &&
+    tree=$(git write-tree) &&
+    commit2=$(git commit-tree -p $commit $tree </dev/null) &&
+    printf "%s\n^%s\n" $commit2 $commit |
+    git pack-objects --revs --thin --stdout >thin.pack &&
+    git index-pack --stdin --fix-thin --threads=1 fixed-1.pack <thin.pack &&
+    GIT_FORCE_THREADS=1 git index-pack --stdin --fix-thin --threads=4 \
+	--pipeline-hash fixed-4.pack <thin.pack &&
+    cmp fixed-1.pack fixed-4.pack &&
+    cmp fixed-1.idx fixed-4.idx &&
+    git verify-pack -v fixed-4.pack >out &&
+    grep "^non delta: 23 objects" out
+'
+
 test_done
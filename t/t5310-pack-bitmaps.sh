@@ -74,6 +74,41 @@ rev_list_tests() {
 		test_cmp expect actual
 	'
 
+	test_expect_success "counting left and right sides ($state)" '
+		for range in other...master master...other HEAD~2...other^ \
+			     "5...other ^4" "master...HEAD"
+		do
+			git rev-list --left-right --count $range >expect &&
+			git rev-list --use-bitmap-index --left-right --count \
+				$range >actual &&
+			test_cmp expect actual || return 1
+		done
+	'
+
+	test_expect_success "ahead-behind counts via bitmap ($state)" '
+		git for-each-ref --format="%(refname)" refs/heads "refs/tags/[0-9]*" \
+			"refs/tags/side-*" >refs &&
+		while read ref
+		do
+			echo "$ref $(git rev-list --count other..$ref) $(git rev-list --count $ref..other)" ||
+			return 1
+		done <refs >expect &&
+		git for-each-ref --format="%(refname) %(ahead-behind:other)" \
+			refs/heads "refs/tags/[0-9]*" "refs/tags/side-*" >actual &&
+		test_cmp expect actual &&
+		git for-each-ref --format="[%(ahead-behind:other)]" refs/tags/tagged-blob >actual &&
+		echo "[]" >expect &&
+		test_cmp expect actual
+	'
+
+	test_expect_success "upstream tracking info with bitmaps ($state)" '
+		test_config branch.other.remote . &&
+		test_config branch.other.merge refs/heads/master &&
+		echo "[ahead $(git rev-list --count master..other), behind $(git rev-list --count other..master)]" >expect &&
+		git for-each-ref --format="%(upstream:track)" refs/heads/other >actual &&
+		test_cmp expect actual
+	'
+
 	test_expect_success "counting commits with limiting ($state)" '
 		git rev-list --count HEAD -- 1.t >expect &&
 		git rev-list --use-bitmap-index --count HEAD -- 1.t >actual &&
@@ -331,4 +366,65 @@ test_expect_success 'pack reuse respects --incremental' '
 	git show-index <empty.idx >actual &&
 	test_cmp expect actual
 '
+
+test_expect_success 'set up history with long delta chains' '
+	for i in $(test_seq 20)
+	do
+		test_seq $((100 * $i)) >chain &&
+		git add chain &&
+		git commit -q -m "chain $i" || return 1
+	done &&
+	git tag -a -m "annotated" chain-tag HEAD~12 &&
+	git repack -adb
+'
+
+# Check that the pack on stdin is valid, and has exactly the objects
+# listed in "expect".
+check_pack_objects () {
+	cat >partial.pack &&
+	git index-pack --strict partial.pack &&
+	git show-index <partial.idx >idx &&
+	cut -d" " -f2 idx | sort >actual &&
+	test_cmp expect actual
+}
+
+partial_pack () {
+	git pack-objects --delta-base-offset --revs --stdout "$@"
+}
+
+test_expect_success 'partial pack reuse skips excluded objects' '
+	git rev-list --objects HEAD ^HEAD~10 |
+	cut -d" " -f1 | sort >expect &&
+	printf "HEAD\n^HEAD~10\n" | partial_pack |
+	check_pack_objects
+'
+
+test_expect_success 'partial pack reuse with holes early in the pack' '
+	git rev-list --objects HEAD~4 ^HEAD~14 |
+	cut -d" " -f1 | sort >expect &&
+	printf "HEAD~4\n^HEAD~14\n" | partial_pack |
+	check_pack_objects
+'
+
+test_expect_success 'partial pack reuse without delta base offsets' '
+	git rev-list --objects HEAD ^HEAD~10 |
+	cut -d" " -f1 | sort >expect &&
+	printf "HEAD\n^HEAD~10\n" |
+	git pack-objects --revs --stdout |
+	check_pack_objects
+'
+
+test_expect_success 'include-tag does not duplicate reused tags' '
+	{
+		git rev-list --objects HEAD ^HEAD~15 &&
+		git rev-parse chain-tag
+	} | cut -d" " -f1 | sort >expect &&
+	printf "HEAD\n^HEAD~15\n" | partial_pack --include-tag |
+	check_pack_objects &&
+	git rev-list --objects chain-tag ^HEAD~15 |
+	cut -d" " -f1 | sort >expect &&
+	printf "chain-tag\n^HEAD~15\n" | partial_pack --include-tag |
+	check_pack_objects
+'
+
 test_done
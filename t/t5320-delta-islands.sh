@@ -0,0 +1,137 @@
+#!/bin/sh
+
+test_description='exercise delta islands'
+. ./test-lib.sh
+
+# returns true iff $1 is a delta based on $2
+is_delta_base () {
+	delta_base=$(echo "$1" | git cat-file --batch-check="%(deltabase)") &&
+	echo >&2 "$1 has base $delta_base" &&
+	test "$delta_base" = "$2"
+}
+
+# generate a commit on branch $1 with a single file, "file", whose
+# content is mostly based on the seed $2, but with a unique bit
+# of content $3 appended. This should allow us to see whether
+# blobs of different refs delta against each other.
+commit () {
+	blob=$({ test-tool genrandom "$2" 10240 && echo "$3"; } |
+	       git hash-object -w --stdin) &&
+	tree=$(printf "100644 blob %s\tfile\n" "$blob" | git mktree) &&
+	commit=$(echo "$2-$3" | git commit-tree "$tree" ${4:+-p "$4"}) &&
+	git update-ref "refs/heads/$1" "$commit" &&
+	eval "$1"'=$(git rev-parse $1:file)' &&
+	eval "echo >&2 $1=\$$1"
+}
+
+test_expect_success 'setup commits' '
+	commit one seed 1 &&
+	commit two seed 12
+'
+
+# Note: This is heavily dependent on the "prefer larger objects as base"
+# heuristic.
+test_expect_success 'vanilla repack deltas one against two' '
+	git repack -adf &&
+	is_delta_base $one $two
+'
+
+test_expect_success 'island repack with no island definition is vanilla' '
+	git repack -adfi &&
+	is_delta_base $one $two
+'
+
+test_expect_success 'island repack with no matches is vanilla' '
+	git -c "pack.island=refs/foo" repack -adfi &&
+	is_delta_base $one $two
+'
+
+test_expect_success 'separate islands disallows delta' '
+	git -c "pack.island=refs/heads/(.*)" repack -adfi &&
+	! is_delta_base $one $two &&
+	! is_delta_base $two $one
+'
+
+test_expect_success 'same island allows delta' '
+	git -c "pack.island=refs/heads" repack -adfi &&
+	is_delta_base $one $two
+'
+
+test_expect_success 'coalesce same-named islands' '
+	git \
+		-c "pack.island=refs/(.*)/one" \
+		-c "pack.island=refs/(.*)/two" \
+		repack -adfi &&
+	is_delta_base $one $two
+'
+
+test_expect_success 'island restrictions drop reused deltas' '
+	git repack -adfi &&
+	is_delta_base $one $two &&
+	git -c "pack.island=refs/heads/(.*)" repack -adi &&
+	! is_delta_base $one $two &&
+	! is_delta_base $two $one
+'
+
+test_expect_success 'island regexes are additive' '
+	git -c "pack.island=refs/heads/one" \
+	    -c "pack.island=refs/heads/two" \
+	    repack -adfi &&
+	is_delta_base $one $two
+'
+
+test_expect_success 'the last matching regex wins' '
+	git -c "pack.island=refs/heads/(.*)" \
+	    -c "pack.island=refs/heads" \
+	    repack -adfi &&
+	is_delta_base $one $two &&
+	git -c "pack.island=refs/heads" \
+	    -c "pack.island=refs/heads/(.*)" \
+	    repack -adfi &&
+	! is_delta_base $one $two &&
+	! is_delta_base $two $one
+'
+
+test_expect_success 'island core places core objects first' '
+	cat >expect <<-EOF &&
+	$one
+	$two
+	EOF
+	git -c "pack.island=refs/heads/(.*)" \
+	    -c "pack.islandcore=one" \
+	    repack -adfi &&
+	git verify-pack -v .git/objects/pack/*.pack |
+	cut -d" " -f1 |
+	egrep "$one|$two" >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'islands can be used together with bitmaps' '
+	git repack -adfb &&
+	git -c "pack.island=refs/heads/(.*)" repack -adfi &&
+	! is_delta_base $one $two &&
+	! is_delta_base $two $one
+'
+
+test_expect_success 'setup deeper tree and annotated tag' '
+	blob=$(git rev-parse two:file) &&
+	tree=$(printf "100644 blob %s\tfile\n" "$blob" | git mktree) &&
+	tree=$(printf "040000 tree %s\tsub\n" "$tree" | git mktree) &&
+	tree=$(printf "040000 tree %s\tdir\n" "$tree" | git mktree) &&
+	commit=$(echo deep | git commit-tree $tree -p two) &&
+	git update-ref refs/heads/two $commit &&
+	git tag -a -m "tag one" tagged-one one &&
+	git update-ref -d refs/heads/one
+'
+
+test_expect_success 'islands are propagated through tags and deep trees' '
+	git -c "pack.island=refs/heads/(.*)" \
+	    -c "pack.island=refs/tags/tagged-(.*)" \
+	    repack -adfi &&
+	! is_delta_base $one $two &&
+	! is_delta_base $two $one &&
+	git -c "pack.island=refs/" repack -adfi &&
+	is_delta_base $one $two
+'
+
+test_done
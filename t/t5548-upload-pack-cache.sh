@@ -0,0 +1,106 @@
+#!/bin/sh
+
+test_description='upload-pack serves packs from uploadpack.packCache'
+. ./test-lib.sh
+
+test_expect_success 'create some history to fetch' '
+	test_commit one &&
+	test_commit two &&
+	write_script .git/hook <<-\EOF &&
+		echo >&2 "hook running"
+		"$@"
+	EOF
+	git config --global uploadpack.packObjectsHook ./hook &&
+	git config --global uploadpack.packCache "$(pwd)/cache"
+'
+
+clone () {
+	rm -rf dst.git &&
+	git clone --bare --no-local "$@" . dst.git 2>stderr &&
+	git -C dst.git fsck
+}
+
+test_expect_success 'first clone fills the cache' '
+	clone &&
+	grep "hook running" stderr &&
+	ls cache/*.pack >cached &&
+	test_line_count = 1 cached
+'
+
+test_expect_success 'identical clone is served from the cache' '
+	clone &&
+	! grep "hook running" stderr &&
+	git rev-parse two >expect &&
+	git -C dst.git rev-parse two >actual &&
+	test_cmp expect actual &&
+	ls cache/*.pack >cached &&
+	test_line_count = 1 cached
+'
+
+test_expect_success 'a different request is not served from the cache' '
+	clone --depth=1 &&
+	grep "hook running" stderr &&
+	ls cache/*.pack >cached &&
+	test_line_count = 2 cached &&
+	clone --depth=1 &&
+	! grep "hook running" stderr
+'
+
+test_expect_success 'new tags invalidate include-tag packs' '
+	git tag -a -m "annotated" annotated one &&
+	clone &&
+	grep "hook running" stderr &&
+	git -C dst.git rev-parse --verify annotated
+'
+
+test_expect_success 'protocol v2 shares the cache' '
+	rm -rf dst.git &&
+	GIT_TRACE_PACKET="$(pwd)/trace" git -c protocol.version=2 \
+		clone --bare --no-local . dst.git 2>stderr &&
+	grep "clone< version 2" trace &&
+	! grep "hook running" stderr &&
+	git -C dst.git fsck
+'
+
+test_expect_success 'expired packs are not used, and pruned' '
+	for f in cache/*.pack
+	do
+		test-tool chmtime -7200 "$f" || return 1
+	done &&
+	clone &&
+	grep "hook running" stderr &&
+	ls cache/*.pack >cached &&
+	test_line_count = 1 cached
+'
+
+test_expect_success 'packs larger than the budget are not cached' '
+	rm -rf cache &&
+	test_config_global uploadpack.packCacheMaxSize 10 &&
+	clone &&
+	grep "hook running" stderr &&
+	test_path_is_missing cache/*.pack &&
+	clone &&
+	grep "hook running" stderr
+'
+
+test_expect_success 'least recently used packs are dropped to stay in budget' '
+	rm -rf cache &&
+	clone &&
+	size=$(cat cache/*.pack | wc -c) &&
+	test_config_global uploadpack.packCacheMaxSize $(($size + 10)) &&
+	clone --depth=1 &&
+	ls cache/*.pack >cached &&
+	test_line_count = 1 cached &&
+	clone --depth=1 &&
+	! grep "hook running" stderr
+'
+
+test_expect_success 'cache is not configurable from repo config' '
+	rm -rf cache &&
+	git config --global --unset uploadpack.packCache &&
+	test_config uploadpack.packCache "$(pwd)/cache" &&
+	clone &&
+	test_path_is_missing cache
+'
+
+test_done
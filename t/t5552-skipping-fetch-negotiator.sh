@@ -0,0 +1,139 @@
+#!/bin/sh
+
+test_description='test skipping fetch negotiator'
+. ./test-lib.sh
+
+have_sent () {
+	while test "$#" -ne 0
+	do
+		grep "fetch> have $(git -C client rev-parse $1)" trace
+		if test $? -ne 0
+		then
+			echo "No have $(git -C client rev-parse $1) ($1)"
+			return 1
+		fi
+		shift
+	done
+}
+
+have_not_sent () {
+	while test "$#" -ne 0
+	do
+		grep "fetch> have $(git -C client rev-parse $1)" trace
+		if test $? -eq 0
+		then
+			return 1
+		fi
+		shift
+	done
+}
+
+test_expect_success 'commits with no parents are sent regardless of skip distance' '
+	git init server &&
+	test_commit -C server to_fetch &&
+
+	git init client &&
+	for i in $(test_seq 7)
+	do
+		test_commit -C client c$i
+	done &&
+
+	# We send: "c7" (skip 1) "c5" (skip 2) "c2" (skip 4). After that, since
+	# "c1" has no parent, it is still sent as "have" even though it would
+	# normally be skipped.
+	test_config -C client fetch.negotiationalgorithm skipping &&
+	GIT_TRACE_PACKET="$(pwd)/trace" git -C client fetch "$(pwd)/server" &&
+	have_sent c7 c5 c2 c1 &&
+	have_not_sent c6 c4 c3
+'
+
+test_expect_success 'when two skips collide, favor the larger one' '
+	rm -rf server client trace &&
+	git init server &&
+	test_commit -C server to_fetch &&
+
+	git init client &&
+	for i in $(test_seq 11)
+	do
+		test_commit -C client c$i
+	done &&
+	git -C client checkout c5 &&
+	test_commit -C client c5side &&
+
+	# We send "c11" (skip 1) "c9" (skip 2) "c6", and "c5side". c5 is
+	# reached from c6 with a skip of 4, and from c5side with a skip of
+	# 1; the larger one wins, so nothing is sent until "c1", which has
+	# no parent.
+	test_config -C client fetch.negotiationalgorithm skipping &&
+	GIT_TRACE_PACKET="$(pwd)/trace" git -C client fetch "$(pwd)/server" &&
+	have_sent c5side c11 c9 c6 c1 &&
+	have_not_sent c10 c8 c7 c5 c4 c3 c2
+'
+
+test_expect_success 'ancestors of acked commits are not sent' '
+	rm -rf server client trace &&
+	git init server &&
+	for i in $(test_seq 5)
+	do
+		test_commit -C server s$i
+	done &&
+	git clone server client &&
+	for i in $(test_seq 20)
+	do
+		test_commit -C client c$i
+	done &&
+	test_commit -C server to_fetch &&
+
+	# The server acks s5, the common commit it is sent first; none of
+	# its ancestors need to be sent.
+	test_config -C client fetch.negotiationalgorithm skipping &&
+	GIT_TRACE_PACKET="$(pwd)/trace" git -C client fetch origin to_fetch &&
+	have_not_sent s4 s3 s2 s1
+'
+
+test_expect_success 'the number of haves is logarithmic in the history depth' '
+	rm -rf server client trace &&
+	git init server &&
+	test_commit -C server base &&
+	git clone server client &&
+	for i in $(test_seq 200)
+	do
+		test_tick &&
+		echo $i >client/file &&
+		git -C client add file &&
+		git -C client commit -q -m c$i || return 1
+	done &&
+	test_commit -C server to_fetch &&
+	cp -R client client-skipping &&
+
+	GIT_TRACE_PACKET="$(pwd)/trace" git -C client fetch origin &&
+	grep "fetch> have" trace >default &&
+	test_line_count -gt 200 default &&
+
+	rm trace &&
+	test_config -C client-skipping fetch.negotiationalgorithm skipping &&
+	GIT_TRACE_PACKET="$(pwd)/trace" git -C client-skipping fetch origin &&
+	grep "fetch> have" trace >skipping &&
+	test_line_count -lt 30 skipping
+'
+
+test_expect_success 'skipping negotiator with protocol v2' '
+	rm -rf server client trace &&
+	git init server &&
+	test_commit -C server to_fetch &&
+
+	git init client &&
+	for i in $(test_seq 7)
+	do
+		test_commit -C client c$i
+	done &&
+
+	test_config -C client fetch.negotiationalgorithm skipping &&
+	GIT_TRACE_PACKET="$(pwd)/trace" git -C client \
+		-c protocol.version=2 fetch "$(pwd)/server" &&
+	have_sent c7 c5 c2 c1 &&
+	have_not_sent c6 c4 c3 &&
+	git -C client rev-parse --verify FETCH_HEAD
+'
+
+test_done
@@ -795,4 +795,32 @@ test_expect_success ':remotename and :remoteref' '
 	)
 '
 
+test_expect_success '%(ahead-behind) counts commits on each side' '
+	test_when_finished "rm -rf ahead-behind" &&
+	git init ahead-behind &&
+	(
+		cd ahead-behind &&
+		test_commit base &&
+		git checkout -b side &&
+		test_commit side-1 &&
+		test_commit side-2 &&
+		git checkout master &&
+		test_commit main-1 &&
+		git tag -a -m annotated annotated side-1 &&
+		cat >expect <<-\EOF &&
+		refs/heads/master 0 0
+		refs/heads/side 2 1
+		refs/tags/annotated 1 1
+		refs/tags/base 0 1
+		EOF
+		git for-each-ref --format="%(refname) %(ahead-behind:master)" \
+			refs/heads refs/tags/annotated refs/tags/base >actual &&
+		test_cmp expect actual &&
+		test_must_fail git for-each-ref --format="%(ahead-behind)" 2>err &&
+		test_i18ngrep "expected format" err &&
+		test_must_fail git for-each-ref --format="%(ahead-behind:nosuch)" 2>err &&
+		test_i18ngrep "not a valid commit" err
+	)
+'
+
 test_done
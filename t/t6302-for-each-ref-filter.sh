@@ -441,4 +441,76 @@ test_expect_success '--merged is incompatible with --no-merged' '
 	test_must_fail git for-each-ref --merged HEAD --no-merged HEAD
 '
 
+test_expect_success 'setup refs in several namespaces' '
+	for ref in team-x/one team-x/two team-y/one other/one
+	do
+		git update-ref refs/heads/$ref master &&
+		git tag prefix-$ref master || return 1
+	done &&
+	git pack-refs --all &&
+	git update-ref refs/heads/team-x/loose master &&
+	git update-ref refs/heads/team-xz master
+'
+
+test_expect_success 'for-each-ref with overlapping patterns' '
+	cat >expect <<-\EOF &&
+	refs/heads/team-x/loose
+	refs/heads/team-x/one
+	refs/heads/team-x/two
+	refs/heads/team-xz
+	refs/heads/team-y/one
+	refs/tags/prefix-other/one
+	EOF
+	git for-each-ref --format="%(refname)" \
+		"refs/heads/team-x*" refs/heads/team-x/ "refs/heads/team-?/one" \
+		refs/tags/prefix-other >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'for-each-ref with patterns does not read other loose refs' '
+	test_when_finished "rm -rf .git/refs/heads/other" &&
+	mkdir -p .git/refs/heads/other &&
+	echo "not a ref" >.git/refs/heads/other/broken &&
+	git for-each-ref --format="%(refname)" \
+		"refs/heads/team-x/*" "refs/tags/prefix-team-x/*" >actual 2>err &&
+	test_line_count = 5 actual &&
+	test_must_be_empty err &&
+	git for-each-ref --format="%(refname)" "refs/heads/" >actual 2>err &&
+	test_i18ngrep "ignoring broken ref refs/heads/other/broken" err
+'
+
+test_expect_success 'branch and tag listing with patterns' '
+	test_when_finished "rm -rf .git/refs/heads/other" &&
+	mkdir -p .git/refs/heads/other &&
+	echo "not a ref" >.git/refs/heads/other/broken &&
+	cat >expect <<-\EOF &&
+	team-x/loose
+	team-x/one
+	team-x/two
+	team-xz
+	EOF
+	git branch --format="%(refname:short)" --list "team-x*" "team-x/one" \
+		>actual 2>err &&
+	test_cmp expect actual &&
+	test_must_be_empty err &&
+	cat >expect <<-\EOF &&
+	prefix-team-x/one
+	prefix-team-x/two
+	prefix-team-y/one
+	EOF
+	git tag --list "prefix-team-*" >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'branch listing with --ignore-case is not limited by prefix' '
+	cat >expect <<-\EOF &&
+	team-x/loose
+	team-x/one
+	team-x/two
+	EOF
+	git branch --format="%(refname:short)" --ignore-case \
+		--list "TEAM-X/*" >actual &&
+	test_cmp expect actual
+'
+
 test_done
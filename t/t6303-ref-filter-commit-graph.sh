@@ -0,0 +1,71 @@
+#!/bin/sh
+
+test_description='ref-filter reachability filters with generation numbers
+
+Check that --contains, --no-contains, --merged and --no-merged give the
+same answers whether or not generation numbers from the commit-graph are
+available to cut the walks short, also with commits outside the graph
+and with clock skew.
+'
+. ./test-lib.sh
+
+test_expect_success 'setup history with skewed dates' '
+	# a grid of merges, where the second parent of each merge was
+	# made "earlier" than the commits it builds on
+	test_commit base &&
+	for i in $(test_seq 1 6)
+	do
+		git checkout -q -b side-$i base &&
+		for j in $(test_seq 1 $i)
+		do
+			test_tick &&
+			test_commit side-$i-$j || return 1
+		done &&
+		git checkout -q master &&
+		GIT_COMMITTER_DATE="$(($test_tick - 100000 * $i)) -0700" &&
+		export GIT_COMMITTER_DATE &&
+		git merge -q --no-ff -m "merge $i" side-$i &&
+		sane_unset GIT_COMMITTER_DATE &&
+		git tag merge-$i &&
+		test_commit main-$i || return 1
+	done &&
+	git tag -a -m "annotated" annotated side-3-2 &&
+	git branch old-main main-2
+'
+
+filters="--contains=side-2-1 --contains=merge-3 --contains=base
+	--no-contains=side-4-2 --no-contains=main-3
+	--merged=main-4 --merged=side-5 --merged=merge-2
+	--no-merged=main-5 --no-merged=side-6-3"
+
+run_filters () {
+	for filter in $filters
+	do
+		echo "# $filter" &&
+		git tag --list $filter &&
+		git branch --list --format="%(refname)" $filter &&
+		git for-each-ref --format="%(refname)" $filter || return 1
+	done
+}
+
+test_expect_success 'answers without commit-graph' '
+	run_filters >expect &&
+	test_line_count -gt 100 expect
+'
+
+test_expect_success 'answers with full commit-graph' '
+	git commit-graph write --reachable &&
+	test_config core.commitGraph true &&
+	run_filters >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'answers with commits outside the commit-graph' '
+	rm -f .git/objects/info/commit-graph &&
+	git rev-parse merge-3 | git commit-graph write --stdin-commits &&
+	test_config core.commitGraph true &&
+	run_filters >actual &&
+	test_cmp expect actual
+'
+
+test_done
@@ -0,0 +1,113 @@
+#!/bin/sh
+
+test_description='git status with the built-in file system monitor'
+
+. ./test-lib.sh
+
+if test -z "$HAVE_INOTIFY" || test -n "$NO_UNIX_SOCKETS"
+then
+	skip_all='skipping fsmonitor--daemon tests: no inotify or unix sockets'
+	test_done
+fi
+
+start_daemon () {
+	git fsmonitor--daemon start &&
+	test_when_finished "git fsmonitor--daemon stop" &&
+	# let queries made from now on fall within what the daemon saw
+	sleep 1 &&
+	git update-index --fsmonitor
+}
+
+test_expect_success 'setup' '
+	mkdir dir1 dir2 &&
+	for f in unchanged modified dir1/unchanged dir1/modified dir2/modified
+	do
+		echo "$f" >$f || return 1
+	done &&
+	cat >.gitignore <<-\EOF &&
+	.gitignore
+	expect
+	actual
+	status
+	EOF
+	git add . &&
+	git commit -m initial &&
+	git config core.useBuiltinFSMonitor true &&
+	git config core.untrackedCache true
+'
+
+test_expect_success 'without a running daemon, everything is checked' '
+	test_must_fail git fsmonitor--daemon status &&
+	git update-index --fsmonitor &&
+	echo more >>modified &&
+	git status --porcelain >actual &&
+	echo " M modified" >expect &&
+	test_cmp expect actual &&
+	git checkout modified
+'
+
+test_expect_success 'the daemon reports only what changed' '
+	start_daemon &&
+	git fsmonitor--daemon status >status &&
+	grep "is watching" status &&
+	git status --porcelain &&
+	echo more >>modified &&
+	echo more >>dir1/modified &&
+	echo new >dir2/new &&
+	GIT_TRACE_FSMONITOR="$(pwd)/.git/trace" git status --porcelain >actual &&
+	cat >expect <<-\EOF &&
+	 M dir1/modified
+	 M modified
+	?? dir2/new
+	EOF
+	test_cmp expect actual &&
+	grep "returned success" .git/trace &&
+	grep "fsmonitor_refresh_callback .dir1/modified." .git/trace &&
+	grep "fsmonitor_refresh_callback .dir2/new." .git/trace &&
+	! grep "fsmonitor_refresh_callback .unchanged." .git/trace &&
+	! grep "fsmonitor_refresh_callback .dir1/unchanged." .git/trace
+'
+
+test_expect_success 'renamed directories are reported as a whole' '
+	git reset --hard &&
+	git clean -fd &&
+	start_daemon &&
+	git status --porcelain &&
+	mv dir1 dir3 &&
+	GIT_TRACE_FSMONITOR="$(pwd)/.git/trace" git status --porcelain >actual &&
+	cat >expect <<-\EOF &&
+	 D dir1/modified
+	 D dir1/unchanged
+	?? dir3/
+	EOF
+	test_cmp expect actual &&
+	grep "fsmonitor_refresh_callback .dir1/." .git/trace &&
+	mv dir3 dir1 &&
+	git status --porcelain >actual &&
+	test_must_be_empty actual
+'
+
+test_expect_success 'new directories are watched, too' '
+	start_daemon &&
+	mkdir -p new/sub &&
+	echo one >new/sub/file &&
+	git status --porcelain >actual &&
+	echo "?? new/" >expect &&
+	test_cmp expect actual &&
+	git add new &&
+	git commit -m "new directory" &&
+	git status --porcelain &&
+	echo two >new/sub/file &&
+	git status --porcelain >actual &&
+	echo " M new/sub/file" >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'the daemon can be stopped' '
+	git fsmonitor--daemon start &&
+	git fsmonitor--daemon stop &&
+	test_must_fail git fsmonitor--daemon status &&
+	test_path_is_missing .git/fsmonitor--daemon.ipc
+'
+
+test_done
@@ -817,6 +817,33 @@ do
 	"
 done
 
+test_expect_success PTHREADS 'threaded grep of the index and of trees' '
+	git grep --threads=1 -n -e "Hello" -e "^t" --cached >expect &&
+	git grep --threads=8 -n -e "Hello" -e "^t" --cached >actual &&
+	test_cmp expect actual &&
+	git grep --threads=1 -n -e "Hello" -e "^t" HEAD HEAD^{tree} >expect &&
+	git grep --threads=8 -n -e "Hello" -e "^t" HEAD HEAD^{tree} >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success PTHREADS 'threaded grep of a tree with deltified blobs' '
+	test_create_repo deltas &&
+	(
+		cd deltas &&
+		for i in $(test_seq 1 30)
+		do
+			{ test_seq 1 300 && echo "file $i"; } >file$i || return 1
+		done &&
+		git add . &&
+		git commit -m deltas &&
+		git repack -a -d -f --depth=50 &&
+		git grep --threads=1 -e "file 1" -e 300 HEAD >expect &&
+		git -c core.deltaBaseCacheLimit=1k \
+			grep --threads=8 -e "file 1" -e 300 HEAD >actual &&
+		test_cmp expect actual
+	)
+'
+
 test_expect_success !PTHREADS,C_LOCALE_OUTPUT 'grep --threads=N or pack.threads=N warns when no pthreads' '
 	git grep --threads=2 Hello hello_world 2>err &&
 	grep ^warning: err >warnings &&
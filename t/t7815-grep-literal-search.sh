@@ -0,0 +1,64 @@
+#!/bin/sh
+
+test_description='grep -F and log -S with the vectorized literal search
+
+Fixed strings are looked for with SSE2 or AVX2 instructions where the
+CPU has them. Check that they find the same matches as the scalar
+search, also around the edges of the blocks they look at.
+'
+. ./test-lib.sh
+
+test_expect_success 'setup' '
+	# put "needle" and "NeEdLe" at every offset from 0 to 70 into
+	# lines that end right after it and lines that go on
+	for i in $(test_seq 0 70)
+	do
+		pad=$(printf "%${i}s" "" | tr " " x) &&
+		echo "${pad}needle" &&
+		echo "${pad}NeEdLe tail of the line" &&
+		echo "${pad}needl" &&
+		echo "${pad}n${pad}e" || return 1
+	done >file &&
+	printf "trailing needle" >no-newline &&
+	printf "n" >single &&
+	git add file no-newline single &&
+	git commit -m initial &&
+	for i in 1 2 3
+	do
+		echo "needle $i" >>file &&
+		git commit -a -m "needle $i" || return 1
+	done
+'
+
+for search in scalar sse2 avx2
+do
+	for pattern in needle NeEdLe n e ne eedl "e tail of the li"
+	do
+		test_expect_success "grep -F $pattern ($search)" "
+			GIT_TEST_LITERAL_SEARCH=scalar \
+				git grep -F -n --color=always -e '$pattern' >expect &&
+			GIT_TEST_LITERAL_SEARCH=$search \
+				git grep -F -n --color=always -e '$pattern' >actual &&
+			test_cmp expect actual &&
+			GIT_TEST_LITERAL_SEARCH=scalar \
+				git grep -F -i -n --color=always -e '$pattern' >expect &&
+			GIT_TEST_LITERAL_SEARCH=$search \
+				git grep -F -i -n --color=always -e '$pattern' >actual &&
+			test_cmp expect actual
+		"
+	done
+
+	test_expect_success "log -S ($search)" "
+		GIT_TEST_LITERAL_SEARCH=scalar \
+			git log -Sneedle --format=%s >expect &&
+		GIT_TEST_LITERAL_SEARCH=$search \
+			git log -Sneedle --format=%s >actual &&
+		test_cmp expect actual &&
+		test_line_count = 4 actual &&
+		GIT_TEST_LITERAL_SEARCH=$search \
+			git log -SNEEDLE --regexp-ignore-case --format=%s >actual &&
+		test_cmp expect actual
+	"
+done
+
+test_done
@@ -0,0 +1,155 @@
+#!/bin/sh
+
+test_description='grep with the trigram index
+
+The trigram index lets git grep skip blobs that cannot match. Check
+that it finds the same matches as a search without it, that it is
+updated incrementally, and that it does not skip worktree files whose
+contents may differ from their blobs.
+'
+. ./test-lib.sh
+
+test_expect_success 'setup' '
+	for i in $(test_seq 1 20)
+	do
+		echo "file $i" >file$i &&
+		echo "common line" >>file$i || return 1
+	done &&
+	echo "a needle in a haystack" >>file3 &&
+	echo "A NEEDLE IN CAPS" >>file7 &&
+	echo "colour and color" >>file11 &&
+	echo "hello brave new world" >>file13 &&
+	git add . &&
+	git commit -m initial
+'
+
+test_expect_success 'write the trigram index' '
+	GIT_TRACE_TRIGRAM_INDEX="$(pwd)/trace" git grep --write-trigram-index &&
+	test_path_is_file .git/objects/info/grep-index &&
+	grep "added 20 blobs" trace
+'
+
+test_expect_success 'writing it again reads no blob' '
+	rm -f trace &&
+	GIT_TRACE_TRIGRAM_INDEX="$(pwd)/trace" git grep --write-trigram-index &&
+	test_path_is_missing trace
+'
+
+for pattern in "-e needle" "-i -e needle" "-F -e needle" "-e colou*r" \
+	"-E -e colou?r" "-e hello.*world" "-e ne[e]dle" "-e needle -e world" \
+	"-w -e color" "-c -e haystack" "-l -e common" "-L -e needle" \
+	"-v -e common" "-e ab" "-e no-such-thing"
+do
+	for where in "" "--cached" "HEAD"
+	do
+		test_expect_success "grep $pattern $where" "
+			test_might_fail git grep -n $pattern $where >expect &&
+			test_might_fail git grep --trigram-index -n $pattern \
+				$where >actual &&
+			test_cmp expect actual
+		"
+	done
+done
+
+test_expect_success 'selective patterns skip blobs' '
+	GIT_TRACE_TRIGRAM_INDEX="$(pwd)/trace" \
+		git grep --trigram-index -l needle >actual &&
+	test_write_lines file3 >expect &&
+	test_cmp expect actual &&
+	grep "2 of 20 blobs may match" trace &&
+	grep "skipped 18 files" trace
+'
+
+test_expect_success 'grep.trigramIndex enables the index' '
+	rm -f trace &&
+	GIT_TRACE_TRIGRAM_INDEX="$(pwd)/trace" \
+		git -c grep.trigramIndex=true grep --cached -l needle >actual &&
+	grep "skipped 18 files" trace &&
+	rm -f trace &&
+	GIT_TRACE_TRIGRAM_INDEX="$(pwd)/trace" git -c grep.trigramIndex=true \
+		grep --no-trigram-index --cached -l needle >actual &&
+	! grep skipped trace
+'
+
+test_expect_success 'patterns without trigrams do not use the index' '
+	rm -f trace &&
+	GIT_TRACE_TRIGRAM_INDEX="$(pwd)/trace" \
+		git grep --trigram-index -e needle -e "n.e" >actual &&
+	grep "cannot use it" trace &&
+	! grep skipped trace
+'
+
+test_expect_success 'blobs that are not indexed are searched' '
+	echo "another needle" >>file5 &&
+	git commit -a -m "another needle" &&
+	git grep --trigram-index -l needle HEAD >actual &&
+	test_write_lines HEAD:file3 HEAD:file5 >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'the index is updated incrementally' '
+	rm -f trace &&
+	GIT_TRACE_TRIGRAM_INDEX="$(pwd)/trace" git grep --write-trigram-index &&
+	grep "added 1 blobs, 21 blobs" trace &&
+	git grep --trigram-index -l needle HEAD HEAD~1 >actual &&
+	test_write_lines HEAD:file3 HEAD:file5 HEAD~1:file3 >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'index the blobs of a tree' '
+	git checkout -b side &&
+	echo "needle on a side branch" >>file9 &&
+	git commit -a -m side &&
+	git checkout master &&
+	rm -f trace &&
+	GIT_TRACE_TRIGRAM_INDEX="$(pwd)/trace" \
+		git grep --write-trigram-index side &&
+	grep "added 1 blobs" trace &&
+	rm -f trace &&
+	GIT_TRACE_TRIGRAM_INDEX="$(pwd)/trace" \
+		git grep --trigram-index -l "needle on" side >actual &&
+	test_write_lines side:file9 >expect &&
+	test_cmp expect actual &&
+	grep "1 of 22 blobs may match" trace
+'
+
+test_expect_success 'modified worktree files are searched' '
+	echo "needle added later" >>file1 &&
+	test_when_finished "git checkout file1" &&
+	git grep --trigram-index -l needle >actual &&
+	test_write_lines file1 file3 file5 >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'worktree files with conversion are searched' '
+	echo "file2 ident" >file2 &&
+	printf "\$Id\$\n" >>file2 &&
+	echo "file2 ident" >.gitattributes &&
+	git add .gitattributes file2 &&
+	git commit -m ident &&
+	rm file2 &&
+	git checkout file2 &&
+	git grep --write-trigram-index &&
+	git grep --trigram-index -l "Id: " >actual &&
+	test_write_lines file2 >expect &&
+	test_cmp expect actual &&
+	test_must_fail git grep --cached --trigram-index -l "Id: "
+'
+
+test_expect_success 'literal parentheses do not end a group' '
+	echo zzz >parens &&
+	git add parens &&
+	git commit -m parens &&
+	git grep --write-trigram-index HEAD &&
+	echo "HEAD:parens:1:zzz" >expect &&
+	git grep -n "\\(a)abcd\\)*zzz" HEAD >actual &&
+	test_cmp expect actual &&
+	git grep --trigram-index -n "\\(a)abcd\\)*zzz" HEAD >actual &&
+	test_cmp expect actual &&
+	git grep -E -n "z(\\)abcd)?zz" HEAD >actual &&
+	test_cmp expect actual &&
+	git grep -E --trigram-index -n "z(\\)abcd)?zz" HEAD >actual &&
+	test_cmp expect actual
+'
+
+test_done
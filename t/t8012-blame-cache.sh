@@ -0,0 +1,146 @@
+#!/bin/sh
+
+test_description='git blame with the blame cache'
+. ./test-lib.sh
+
+PROG='git blame -c --cache'
+. "$TEST_DIRECTORY"/annotate-tests.sh
+
+test_expect_success 'setup history' '
+	git checkout -b cache-test master &&
+	test_seq 1 50 >hot &&
+	git add hot &&
+	test_tick &&
+	git commit -m "add hot" &&
+	for i in 1 2 3 4 5 6 7 8 9 10
+	do
+		sed -e "$((i * 4))s/.*/changed in commit $i/" hot >hot.new &&
+		mv hot.new hot &&
+		echo "line $i" >>hot &&
+		test_tick &&
+		git commit -a -m "change $i" || return 1
+	done &&
+	git mv hot moved &&
+	test_tick &&
+	git commit -m "rename" &&
+	echo "after the rename" >>moved &&
+	test_tick &&
+	git commit -a -m "after the rename" &&
+	rm -rf .git/blame-cache
+'
+
+test_expect_success 'blame with the cache matches blame without it' '
+	git blame --porcelain HEAD~4 -- hot >expect &&
+	git blame --cache --porcelain HEAD~4 -- hot >actual &&
+	test_cmp expect actual &&
+	test_path_is_dir .git/blame-cache &&
+	git blame --cache --porcelain HEAD~4 -- hot >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'a cached blame does not look at history' '
+	git blame --cache --show-stats HEAD~4 -- hot >actual &&
+	grep "num commits: 0" actual
+'
+
+test_expect_success 'blame of a descendant starts from the cache' '
+	git blame --porcelain --show-stats HEAD -- moved >expect &&
+	git blame --cache --porcelain --show-stats HEAD -- moved >actual &&
+	sed -n -e "s/^num commits: //p" expect >uncached &&
+	sed -n -e "s/^num commits: //p" actual >cached &&
+	test $(cat cached) -gt 0 &&
+	test $(cat cached) -lt $(cat uncached) &&
+	sed -e "/^num /d" expect >expect.blame &&
+	sed -e "/^num /d" actual >actual.blame &&
+	test_cmp expect.blame actual.blame
+'
+
+test_expect_success 'blame.cache enables the cache' '
+	git -c blame.cache=true blame --show-stats HEAD -- moved >actual &&
+	grep "num commits: 0" actual &&
+	git -c blame.cache=true blame --no-cache --show-stats \
+		HEAD -- moved >actual &&
+	! grep "num commits: 0" actual
+'
+
+test_expect_success 'other formats and the work tree use the cache' '
+	for opts in "" "-n -f" "--line-porcelain" "-L 10,20" "-s -e"
+	do
+		git blame $opts HEAD -- moved >expect &&
+		git blame --cache $opts HEAD -- moved >actual &&
+		test_cmp expect actual &&
+		git blame $opts -- moved >expect &&
+		git blame --cache $opts -- moved >actual &&
+		test_cmp expect actual || return 1
+	done
+'
+
+test_expect_success 'incremental output finds the same entries' '
+	git blame --incremental HEAD -- moved >incremental &&
+	grep "^[0-9a-f]\{40\} [0-9]* [0-9]* [0-9]*$" incremental |
+	sort -k3,3n >expect &&
+	git blame --cache --incremental HEAD -- moved >incremental &&
+	grep "^[0-9a-f]\{40\} [0-9]* [0-9]* [0-9]*$" incremental |
+	sort -k3,3n >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'options that change the blame are part of the key' '
+	git blame --porcelain --root HEAD~6 -- hot >expect &&
+	git blame --cache --porcelain --root HEAD~6 -- hot >actual &&
+	test_cmp expect actual &&
+	git blame --porcelain HEAD~6 -- hot >expect &&
+	git blame --cache --porcelain HEAD~6 -- hot >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'partial blame is not recorded' '
+	rm -rf .git/blame-cache &&
+	git blame --cache -L 1,5 HEAD~8 -- hot &&
+	test_path_is_missing .git/blame-cache
+'
+
+test_expect_success 'limited blame does not use the cache' '
+	git blame --cache HEAD~8 -- hot &&
+	git blame HEAD~8..HEAD~4 -- hot >expect &&
+	git blame --cache HEAD~8..HEAD~4 -- hot >actual &&
+	test_cmp expect actual &&
+	git blame --since=$((test_tick - 300)) HEAD -- moved >expect &&
+	git blame --cache --since=$((test_tick - 300)) HEAD -- moved >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'a corrupt cache is ignored' '
+	git blame HEAD~8 -- hot >expect &&
+	for f in $(find .git/blame-cache -type f)
+	do
+		echo garbage >$f || return 1
+	done &&
+	git blame --cache HEAD~8 -- hot >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'gc removes the records that were not used' '
+	rm -rf .git/blame-cache &&
+	git blame --cache HEAD~8 -- hot &&
+	git blame --cache HEAD~6 -- hot &&
+	find .git/blame-cache -type f >files &&
+	test_line_count = 2 files &&
+	for f in $(cat files)
+	do
+		test-tool chmtime =-1209600 $f || return 1
+	done &&
+	git blame --cache HEAD~8 -- hot &&
+	git -c gc.blameCacheExpire=never gc &&
+	find .git/blame-cache -type f >actual &&
+	test_cmp files actual &&
+	git gc &&
+	find .git/blame-cache -type f >actual &&
+	test_line_count = 1 actual &&
+	git blame --cache --show-stats HEAD~8 -- hot >stats &&
+	grep "num commits: 0" stats &&
+	git -c gc.blameCacheExpire=now gc &&
+	test_path_is_missing .git/blame-cache
+'
+
+test_done
@@ -12,6 +12,7 @@
 #include "argv-array.h"
 #include "refs.h"
 #include "transport-internal.h"
+#include "protocol.h"
 
 static int debug;
 
@@ -26,6 +27,7 @@ struct helper_data {
 		option : 1,
 		push : 1,
 		connect : 1,
+		stateless_connect : 1,
 		signed_tags : 1,
 		check_connectivity : 1,
 		no_disconnect_req : 1,
@@ -188,6 +190,8 @@ static struct child_process *get_helper(struct transport *transport)
 			refspecs[refspec_nr++] = xstrdup(arg);
 		} else if (!strcmp(capname, "connect")) {
 			data->connect = 1;
+		} else if (!strcmp(capname, "stateless-connect")) {
+			data->stateless_connect = 1;
 		} else if (!strcmp(capname, "signed-tags")) {
 			data->signed_tags = 1;
 		} else if (skip_prefix(capname, "export-marks ", &arg)) {
@@ -552,6 +556,7 @@ static int process_connect_service(struct transport *transport,
 	struct strbuf cmdbuf = STRBUF_INIT;
 	struct child_process *helper;
 	int r, duped, ret = 0;
+	int stateless = 0;
 	FILE *input;
 
 	helper = get_helper(transport);
@@ -580,9 +585,19 @@ static int process_connect_service(struct transport *transport,
 			warning("Invalid remote service path.");
 	}
 
-	if (data->connect)
+	if (data->connect) {
 		strbuf_addf(&cmdbuf, "connect %s\n", name);
-	else
+	} else if (data->stateless_connect &&
+		   get_protocol_version_config() == protocol_v2 &&
+		   !strcmp("git-upload-pack", name)) {
+		/*
+		 * Protocol v2 requests are self-contained, so a helper
+		 * that can only relay one request at a time (e.g. over
+		 * http) can still carry them.
+		 */
+		strbuf_addf(&cmdbuf, "stateless-connect %s\n", name);
+		stateless = 1;
+	} else
 		goto exit;
 
 	sendline(data, &cmdbuf);
@@ -595,6 +610,8 @@ static int process_connect_service(struct transport *transport,
 			fprintf(stderr, "Debug: Smart transport connection "
 				"ready.\n");
 		ret = 1;
+		if (stateless)
+			transport->stateless_rpc = 1;
 	} else if (!strcmp(cmdbuf.buf, "fallback")) {
 		if (debug)
 			fprintf(stderr, "Debug: Falling back to dumb "
@@ -1031,7 +1048,8 @@ static int has_attribute(const char *attrs, const char *attr) {
 	}
 }
 
-static struct ref *get_refs_list(struct transport *transport, int for_push)
+static struct ref *get_refs_list(struct transport *transport, int for_push,
+				 const struct argv_array *ref_prefixes)
 {
 	struct helper_data *data = transport->data;
 	struct child_process *helper;
@@ -1044,7 +1062,8 @@ static struct ref *get_refs_list(struct transport *transport, int for_push)
 
 	if (process_connect(transport, for_push)) {
 		do_take_over(transport);
-		return transport->vtable->get_refs_list(transport, for_push);
+		return transport->vtable->get_refs_list(transport, for_push,
+							ref_prefixes);
 	}
 
 	if (data->push && for_push)
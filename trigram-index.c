@@ -0,0 +1,608 @@
+#include "cache.h"
+#include "csum-file.h"
+#include "lockfile.h"
+#include "hashmap.h"
+#include "object-store.h"
+#include "progress.h"
+#include "sha1-array.h"
+#include "varint.h"
+#include "trigram-index.h"
+
+#define TRIGRAM_INDEX_SIGNATURE 0x47524958 /* "GRIX" */
+#define TRIGRAM_INDEX_VERSION 1
+#define TRIGRAM_INDEX_OID_VERSION 1
+#define TRIGRAM_INDEX_OID_LEN GIT_SHA1_RAWSZ
+
+#define TRIGRAM_INDEX_HEADER_SIZE 16
+#define TRIGRAM_ENTRY_WIDTH 12
+#define TRIGRAM_END 0xffffffff
+
+/*
+ * The file starts with a header of the signature, the version and hash
+ * version bytes, two bytes of padding, and the number of blobs and of
+ * trigrams as 32-bit values, all in network order. Then come:
+ *
+ *  - the object names of the indexed blobs, sorted;
+ *
+ *  - the posting lists: for each trigram, the positions of the blobs
+ *    that contain it in the table above, in ascending order. The first
+ *    position is stored as is and each following one as its distance
+ *    to the previous one minus one, all of them as varints;
+ *
+ *  - the trigram table: one entry per trigram, sorted, of the trigram
+ *    as a 32-bit value and the offset of its posting list within the
+ *    posting lists as a 64-bit value. A last entry, with the trigram
+ *    TRIGRAM_END, records where the posting lists end;
+ *
+ *  - the checksum of all of the above.
+ */
+struct trigram_index {
+	const unsigned char *data;
+	size_t data_len;
+
+	uint32_t nr_blobs;
+	uint32_t nr_trigrams;
+	const unsigned char *blob_oids;
+	const unsigned char *postings;
+	uint64_t postings_len;
+	const unsigned char *trigrams;
+
+	/* one bit per blob that may match; NULL until a pattern is added */
+	unsigned char *candidates;
+};
+
+static struct trace_key trace_trigram_index = TRACE_KEY_INIT(TRIGRAM_INDEX);
+
+char *get_trigram_index_filename(const char *obj_dir)
+{
+	return xstrfmt("%s/info/grep-index", obj_dir);
+}
+
+struct trigram_index *load_trigram_index(const char *obj_dir)
+{
+	char *index_file = get_trigram_index_filename(obj_dir);
+	struct trigram_index *ti = NULL;
+	const unsigned char *data;
+	void *map;
+	size_t size;
+	uint64_t fixed_size;
+	struct stat st;
+	int fd = git_open(index_file);
+
+	if (fd < 0)
+		goto out;
+	if (fstat(fd, &st)) {
+		close(fd);
+		goto out;
+	}
+	size = xsize_t(st.st_size);
+	if (size < TRIGRAM_INDEX_HEADER_SIZE + TRIGRAM_ENTRY_WIDTH +
+		   TRIGRAM_INDEX_OID_LEN) {
+		close(fd);
+		error(_("trigram index %s is too small"), index_file);
+		goto out;
+	}
+	map = xmmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	data = map;
+
+	if (get_be32(data) != TRIGRAM_INDEX_SIGNATURE ||
+	    data[4] != TRIGRAM_INDEX_VERSION ||
+	    data[5] != TRIGRAM_INDEX_OID_VERSION) {
+		error(_("trigram index %s has an unknown format"), index_file);
+		munmap(map, size);
+		goto out;
+	}
+
+	ti = xcalloc(1, sizeof(*ti));
+	ti->data = data;
+	ti->data_len = size;
+	ti->nr_blobs = get_be32(data + 8);
+	ti->nr_trigrams = get_be32(data + 12);
+
+	fixed_size = TRIGRAM_INDEX_HEADER_SIZE +
+		(uint64_t)ti->nr_blobs * TRIGRAM_INDEX_OID_LEN +
+		((uint64_t)ti->nr_trigrams + 1) * TRIGRAM_ENTRY_WIDTH +
+		TRIGRAM_INDEX_OID_LEN;
+	if (size < fixed_size) {
+		error(_("trigram index %s is too small"), index_file);
+		free_trigram_index(ti);
+		ti = NULL;
+		goto out;
+	}
+	ti->blob_oids = data + TRIGRAM_INDEX_HEADER_SIZE;
+	ti->postings = ti->blob_oids +
+		(size_t)ti->nr_blobs * TRIGRAM_INDEX_OID_LEN;
+	ti->postings_len = size - fixed_size;
+	ti->trigrams = ti->postings + ti->postings_len;
+
+out:
+	free(index_file);
+	return ti;
+}
+
+void free_trigram_index(struct trigram_index *ti)
+{
+	if (!ti)
+		return;
+	munmap((void *)ti->data, ti->data_len);
+	free(ti->candidates);
+	free(ti);
+}
+
+static int blob_pos(const unsigned char *oids, uint32_t nr,
+		    const struct object_id *oid)
+{
+	uint32_t lo = 0, hi = nr;
+
+	while (lo < hi) {
+		uint32_t mi = lo + (hi - lo) / 2;
+		int cmp = hashcmp(oids + (size_t)mi * TRIGRAM_INDEX_OID_LEN,
+				  oid->hash);
+
+		if (!cmp)
+			return mi;
+		if (cmp < 0)
+			lo = mi + 1;
+		else
+			hi = mi;
+	}
+	return -1;
+}
+
+struct posting_iter {
+	const unsigned char *p, *end;
+	uint32_t next;
+};
+
+static int next_posting(struct posting_iter *it, uint32_t *pos)
+{
+	if (it->p >= it->end)
+		return 0;
+	*pos = it->next + decode_varint(&it->p);
+	it->next = *pos + 1;
+	return 1;
+}
+
+static void add_posting(struct strbuf *sb, uint32_t *next, uint32_t pos)
+{
+	unsigned char buf[16];
+
+	strbuf_add(sb, buf, encode_varint(pos - *next, buf));
+	*next = pos + 1;
+}
+
+/*
+ * Find the posting list of the i-th trigram of the table, returning
+ * -1 if the table does not make sense.
+ */
+static int init_posting_iter(struct trigram_index *ti, uint32_t i,
+			     struct posting_iter *it)
+{
+	const unsigned char *entry = ti->trigrams + (size_t)i * TRIGRAM_ENTRY_WIDTH;
+	uint64_t start = get_be64(entry + 4);
+	uint64_t end = get_be64(entry + TRIGRAM_ENTRY_WIDTH + 4);
+
+	if (start > end || end > ti->postings_len)
+		return -1;
+	it->p = ti->postings + start;
+	it->end = ti->postings + end;
+	it->next = 0;
+	return 0;
+}
+
+static int trigram_pos(struct trigram_index *ti, uint32_t trigram)
+{
+	uint32_t lo = 0, hi = ti->nr_trigrams;
+
+	while (lo < hi) {
+		uint32_t mi = lo + (hi - lo) / 2;
+		uint32_t t = get_be32(ti->trigrams + (size_t)mi * TRIGRAM_ENTRY_WIDTH);
+
+		if (t == trigram)
+			return mi;
+		if (t < trigram)
+			lo = mi + 1;
+		else
+			hi = mi;
+	}
+	return -1;
+}
+
+/*
+ * Call "fn" for each trigram of "buf" that does not contain a newline,
+ * after folding the contents to lowercase. A trigram may be reported
+ * more than once.
+ */
+static void for_each_trigram(const unsigned char *buf, size_t size,
+			     void (*fn)(uint32_t trigram, void *data),
+			     void *data)
+{
+	uint32_t trigram = 0;
+	size_t i, run = 0;
+
+	for (i = 0; i < size; i++) {
+		if (buf[i] == '\n') {
+			run = 0;
+			continue;
+		}
+		trigram = ((trigram << 8) | tolower_trans_tbl[buf[i]]) & 0xffffff;
+		if (++run >= 3)
+			fn(trigram, data);
+	}
+}
+
+struct trigram_set {
+	uint32_t *trigram;
+	size_t nr, alloc;
+	unsigned char *seen; /* one bit for each of the 1 << 24 trigrams */
+};
+
+static void add_to_trigram_set(uint32_t trigram, void *data)
+{
+	struct trigram_set *set = data;
+	unsigned char bit = 1 << (trigram & 7);
+
+	if (set->seen[trigram >> 3] & bit)
+		return;
+	set->seen[trigram >> 3] |= bit;
+	ALLOC_GROW(set->trigram, set->nr + 1, set->alloc);
+	set->trigram[set->nr++] = trigram;
+}
+
+static void clear_trigram_set(struct trigram_set *set)
+{
+	size_t i;
+
+	for (i = 0; i < set->nr; i++)
+		set->seen[set->trigram[i] >> 3] = 0;
+	set->nr = 0;
+}
+
+static int cmp_posting_len(const void *va, const void *vb, void *data)
+{
+	struct trigram_index *ti = data;
+	uint32_t a = *(const uint32_t *)va, b = *(const uint32_t *)vb;
+	const unsigned char *ea = ti->trigrams + (size_t)a * TRIGRAM_ENTRY_WIDTH;
+	const unsigned char *eb = ti->trigrams + (size_t)b * TRIGRAM_ENTRY_WIDTH;
+	uint64_t la = get_be64(ea + TRIGRAM_ENTRY_WIDTH + 4) - get_be64(ea + 4);
+	uint64_t lb = get_be64(eb + TRIGRAM_ENTRY_WIDTH + 4) - get_be64(eb + 4);
+
+	return la < lb ? -1 : la > lb;
+}
+
+int trigram_index_add_pattern(struct trigram_index *ti,
+			      const struct string_list *literals)
+{
+	struct trigram_set set = { NULL };
+	size_t bitmap_len = ((size_t)ti->nr_blobs + 7) / 8;
+	unsigned char *match, *next;
+	uint32_t *pos;
+	size_t i, j, nr_pos = 0;
+	int ret = 0;
+
+	set.seen = xcalloc(1, 1 << 21);
+	for (i = 0; i < literals->nr; i++) {
+		const char *s = literals->items[i].string;
+		for_each_trigram((const unsigned char *)s, strlen(s),
+				 add_to_trigram_set, &set);
+	}
+	free(set.seen);
+	if (!set.nr) {
+		free(set.trigram);
+		return -1;
+	}
+
+	if (!ti->candidates)
+		ti->candidates = xcalloc(1, bitmap_len);
+
+	/*
+	 * Intersect the posting lists, the shortest ones first, so that
+	 * we can stop early once no blob is left.
+	 */
+	ALLOC_ARRAY(pos, set.nr);
+	for (i = 0; i < set.nr; i++) {
+		int p = trigram_pos(ti, set.trigram[i]);
+		if (p < 0)
+			goto out; /* no blob has it */
+		pos[nr_pos++] = p;
+	}
+	QSORT_S(pos, nr_pos, cmp_posting_len, ti);
+
+	match = xcalloc(1, bitmap_len);
+	next = xcalloc(1, bitmap_len);
+	for (i = 0; i < nr_pos; i++) {
+		struct posting_iter it;
+		uint32_t blob;
+		int any = 0;
+
+		if (init_posting_iter(ti, pos[i], &it) < 0) {
+			error(_("trigram index is corrupt"));
+			ret = -1;
+			break;
+		}
+		memset(next, 0, bitmap_len);
+		while (next_posting(&it, &blob)) {
+			if (blob >= ti->nr_blobs)
+				break;
+			next[blob >> 3] |= 1 << (blob & 7);
+		}
+		for (j = 0; j < bitmap_len; j++) {
+			match[j] = i ? (match[j] & next[j]) : next[j];
+			any |= match[j];
+		}
+		if (!any)
+			break;
+	}
+	if (!ret)
+		for (j = 0; j < bitmap_len; j++)
+			ti->candidates[j] |= match[j];
+	free(match);
+	free(next);
+
+out:
+	if (!ret && trace_want(&trace_trigram_index)) {
+		uint32_t nr = 0;
+		for (j = 0; j < ti->nr_blobs; j++)
+			if (ti->candidates[j >> 3] & (1 << (j & 7)))
+				nr++;
+		trace_printf_key(&trace_trigram_index,
+				 "trigram index: %"PRIu32" of %"PRIu32" blobs may match",
+				 nr, ti->nr_blobs);
+	}
+	free(pos);
+	free(set.trigram);
+	return ret;
+}
+
+int trigram_index_may_match(struct trigram_index *ti,
+			    const struct object_id *oid)
+{
+	int pos;
+
+	if (!ti->candidates)
+		return 1;
+	pos = blob_pos(ti->blob_oids, ti->nr_blobs, oid);
+	if (pos < 0)
+		return 1;
+	return !!(ti->candidates[pos >> 3] & (1 << (pos & 7)));
+}
+
+struct new_postings {
+	struct hashmap_entry ent;
+	uint32_t trigram;
+	uint32_t next;
+	struct strbuf list;
+};
+
+static unsigned int trigram_hash(uint32_t trigram)
+{
+	return trigram * 2654435761u;
+}
+
+static int cmp_new_postings(const void *va, const void *vb)
+{
+	const struct new_postings *a = *(const struct new_postings **)va;
+	const struct new_postings *b = *(const struct new_postings **)vb;
+
+	return a->trigram < b->trigram ? -1 : a->trigram > b->trigram;
+}
+
+struct new_blobs {
+	struct trigram_index *old;
+	struct oid_array oids;
+};
+
+static int collect_new_blob(const struct object_id *oid, void *data)
+{
+	struct new_blobs *fresh = data;
+
+	if (!fresh->old ||
+	    blob_pos(fresh->old->blob_oids, fresh->old->nr_blobs, oid) < 0)
+		oid_array_append(&fresh->oids, oid);
+	return 0;
+}
+
+static void index_blob(struct hashmap *map, struct trigram_set *set,
+		       const struct object_id *oid, uint32_t pos)
+{
+	enum object_type type;
+	unsigned long size;
+	void *buf;
+	size_t i;
+
+	buf = read_object_file(oid, &type, &size);
+	if (!buf)
+		die(_("unable to read %s"), oid_to_hex(oid));
+	if (type != OBJ_BLOB)
+		die(_("%s is not a blob"), oid_to_hex(oid));
+
+	for_each_trigram(buf, size, add_to_trigram_set, set);
+	for (i = 0; i < set->nr; i++) {
+		unsigned int hash = trigram_hash(set->trigram[i]);
+		struct new_postings *p = hashmap_get_from_hash(map, hash, NULL);
+
+		if (!p) {
+			p = xcalloc(1, sizeof(*p));
+			hashmap_entry_init(p, hash);
+			p->trigram = set->trigram[i];
+			strbuf_init(&p->list, 0);
+			hashmap_add(map, p);
+		}
+		add_posting(&p->list, &p->next, pos);
+	}
+	clear_trigram_set(set);
+	free(buf);
+}
+
+void write_trigram_index(const char *obj_dir, struct oid_array *blobs)
+{
+	char *index_file = get_trigram_index_filename(obj_dir);
+	struct trigram_index *old = load_trigram_index(obj_dir);
+	struct new_blobs fresh = { old, OID_ARRAY_INIT };
+	uint32_t nr_old = old ? old->nr_blobs : 0;
+	uint32_t nr_blobs, nr_trigrams, *old_pos = NULL, *new_pos;
+	struct trigram_set set = { NULL };
+	struct hashmap map;
+	struct hashmap_iter iter;
+	struct new_postings *p, **sorted;
+	size_t nr_sorted = 0;
+	struct progress *progress;
+	struct lock_file lk = LOCK_INIT;
+	struct hashfile *f;
+	struct strbuf table = STRBUF_INIT, list = STRBUF_INIT;
+	uint64_t offset = 0;
+	uint32_t i, j, k;
+
+	oid_array_for_each_unique(blobs, collect_new_blob, &fresh);
+	if (old && !fresh.oids.nr)
+		goto out;
+	if (nr_old + (uint64_t)fresh.oids.nr > INT_MAX)
+		die(_("too many blobs to write the trigram index"));
+	nr_blobs = nr_old + fresh.oids.nr;
+
+	/* Where the old and the new blobs go in the merged table. */
+	ALLOC_ARRAY(old_pos, nr_old);
+	ALLOC_ARRAY(new_pos, fresh.oids.nr);
+	for (i = j = 0; i < nr_old || j < fresh.oids.nr; ) {
+		if (j == fresh.oids.nr ||
+		    (i < nr_old &&
+		     hashcmp(old->blob_oids + (size_t)i * TRIGRAM_INDEX_OID_LEN,
+			     fresh.oids.oid[j].hash) < 0)) {
+			old_pos[i] = i + j;
+			i++;
+		} else {
+			new_pos[j] = i + j;
+			j++;
+		}
+	}
+
+	hashmap_init(&map, NULL, NULL, 0);
+	set.seen = xcalloc(1, 1 << 21);
+	progress = start_delayed_progress(_("Indexing blobs for grep"),
+					  fresh.oids.nr);
+	for (j = 0; j < fresh.oids.nr; j++) {
+		index_blob(&map, &set, &fresh.oids.oid[j], new_pos[j]);
+		display_progress(progress, j + 1);
+	}
+	stop_progress(&progress);
+	free(set.seen);
+	free(set.trigram);
+
+	ALLOC_ARRAY(sorted, hashmap_get_size(&map));
+	hashmap_iter_init(&map, &iter);
+	while ((p = hashmap_iter_next(&iter)))
+		sorted[nr_sorted++] = p;
+	QSORT(sorted, nr_sorted, cmp_new_postings);
+
+	nr_trigrams = nr_sorted;
+	for (i = j = 0; old && i < old->nr_trigrams; i++) {
+		uint32_t t = get_be32(old->trigrams + (size_t)i * TRIGRAM_ENTRY_WIDTH);
+		while (j < nr_sorted && sorted[j]->trigram < t)
+			j++;
+		if (j == nr_sorted || sorted[j]->trigram != t)
+			nr_trigrams++;
+	}
+
+	if (safe_create_leading_directories(index_file))
+		die_errno(_("unable to create leading directories of %s"),
+			  index_file);
+	hold_lock_file_for_update(&lk, index_file, LOCK_DIE_ON_ERROR);
+	f = hashfd(get_lock_file_fd(&lk), get_lock_file_path(&lk));
+
+	hashwrite_be32(f, TRIGRAM_INDEX_SIGNATURE);
+	hashwrite_u8(f, TRIGRAM_INDEX_VERSION);
+	hashwrite_u8(f, TRIGRAM_INDEX_OID_VERSION);
+	hashwrite_u8(f, 0); /* unused padding bytes */
+	hashwrite_u8(f, 0);
+	hashwrite_be32(f, nr_blobs);
+	hashwrite_be32(f, nr_trigrams);
+
+	for (i = j = 0; i < nr_old || j < fresh.oids.nr; ) {
+		if (i < nr_old && old_pos[i] == i + j) {
+			hashwrite(f, old->blob_oids + (size_t)i * TRIGRAM_INDEX_OID_LEN,
+				  TRIGRAM_INDEX_OID_LEN);
+			i++;
+		} else {
+			hashwrite(f, fresh.oids.oid[j].hash, TRIGRAM_INDEX_OID_LEN);
+			j++;
+		}
+	}
+
+	/*
+	 * Merge the posting lists of the old index, renumbered, with those
+	 * of the new blobs. Both are sorted by blob, and no blob is in both.
+	 */
+	for (i = j = 0; (old && i < old->nr_trigrams) || j < nr_sorted; ) {
+		struct posting_iter old_it = { NULL }, new_it = { NULL };
+		uint32_t t, old_blob = 0, new_blob = 0, next = 0;
+		int have_old, have_new;
+		unsigned char entry[TRIGRAM_ENTRY_WIDTH];
+
+		t = old && i < old->nr_trigrams ?
+			get_be32(old->trigrams + (size_t)i * TRIGRAM_ENTRY_WIDTH) :
+			TRIGRAM_END;
+		if (j < nr_sorted && sorted[j]->trigram <= t)
+			t = sorted[j]->trigram;
+
+		if (old && i < old->nr_trigrams &&
+		    t == get_be32(old->trigrams + (size_t)i * TRIGRAM_ENTRY_WIDTH)) {
+			if (init_posting_iter(old, i, &old_it) < 0)
+				die(_("trigram index %s is corrupt"), index_file);
+			i++;
+		}
+		if (j < nr_sorted && t == sorted[j]->trigram) {
+			new_it.p = (const unsigned char *)sorted[j]->list.buf;
+			new_it.end = new_it.p + sorted[j]->list.len;
+			j++;
+		}
+
+		strbuf_reset(&list);
+		have_old = next_posting(&old_it, &old_blob);
+		have_new = next_posting(&new_it, &new_blob);
+		while (have_old || have_new) {
+			if (have_old && old_blob >= nr_old)
+				die(_("trigram index %s is corrupt"), index_file);
+			if (have_old && (!have_new || old_pos[old_blob] < new_blob)) {
+				add_posting(&list, &next, old_pos[old_blob]);
+				have_old = next_posting(&old_it, &old_blob);
+			} else {
+				add_posting(&list, &next, new_blob);
+				have_new = next_posting(&new_it, &new_blob);
+			}
+		}
+		hashwrite(f, list.buf, list.len);
+
+		put_be32(entry, t);
+		put_be32(entry + 4, offset >> 32);
+		put_be32(entry + 8, offset & 0xffffffff);
+		strbuf_add(&table, entry, sizeof(entry));
+		offset += list.len;
+	}
+	hashwrite(f, table.buf, table.len);
+	hashwrite_be32(f, TRIGRAM_END);
+	hashwrite_be32(f, offset >> 32);
+	hashwrite_be32(f, offset & 0xffffffff);
+
+	hashclose(f, NULL, CSUM_HASH_IN_STREAM);
+	free_trigram_index(old);
+	old = NULL;
+	if (commit_lock_file(&lk))
+		die_errno(_("unable to write trigram index %s"), index_file);
+	trace_printf_key(&trace_trigram_index,
+			 "trigram index: added %d blobs, %"PRIu32" blobs and %"PRIu32" trigrams in total",
+			 fresh.oids.nr, nr_blobs, nr_trigrams);
+
+	for (k = 0; k < nr_sorted; k++)
+		strbuf_release(&sorted[k]->list);
+	hashmap_free(&map, 1);
+	free(sorted);
+	free(new_pos);
+	strbuf_release(&table);
+	strbuf_release(&list);
+out:
+	free(old_pos);
+	free_trigram_index(old);
+	oid_array_clear(&fresh.oids);
+	free(index_file);
+}
@@ -0,0 +1,54 @@
+#ifndef TRIGRAM_INDEX_H
+#define TRIGRAM_INDEX_H
+
+#include "string-list.h"
+
+struct object_id;
+struct oid_array;
+
+/*
+ * A trigram index records, for each sequence of three bytes, which
+ * blobs contain it somewhere. It is keyed by blob object name rather
+ * than by path, so the same index serves every commit that shares
+ * blobs with the ones indexed. Contents are folded to ASCII lowercase
+ * before they are split into trigrams, and trigrams that span a line
+ * end are left out, as grep never matches across lines.
+ *
+ * The index lives in "$GIT_DIR/objects/info/grep-index".
+ */
+struct trigram_index;
+
+extern char *get_trigram_index_filename(const char *obj_dir);
+
+/*
+ * Map the index of the object directory, or return NULL if there is
+ * none or it cannot be used.
+ */
+extern struct trigram_index *load_trigram_index(const char *obj_dir);
+extern void free_trigram_index(struct trigram_index *ti);
+
+/*
+ * Add the blobs in "blobs" that are not indexed yet, keeping what is
+ * already there. The array is sorted as a side effect.
+ */
+extern void write_trigram_index(const char *obj_dir, struct oid_array *blobs);
+
+/*
+ * Narrow the index down to the blobs that may match one more pattern,
+ * given as the literal strings that every match of it must contain.
+ * The patterns added this way are OR'ed together. Return -1 if the
+ * strings are too short to yield a single trigram, in which case the
+ * index cannot tell which blobs to skip and should not be consulted.
+ */
+extern int trigram_index_add_pattern(struct trigram_index *ti,
+				     const struct string_list *literals);
+
+/*
+ * Return 0 if the blob is known not to match any of the patterns added
+ * with trigram_index_add_pattern(), and 1 if it has to be looked at:
+ * either it may match, or it is not in the index at all.
+ */
+extern int trigram_index_may_match(struct trigram_index *ti,
+				   const struct object_id *oid);
+
+#endif /* TRIGRAM_INDEX_H */
@@ -17,16 +17,14 @@
 #include "sigchain.h"
 #include "version.h"
 #include "string-list.h"
-#include "parse-options.h"
 #include "argv-array.h"
 #include "prio-queue.h"
 #include "protocol.h"
 #include "quote.h"
-
-static const char * const upload_pack_usage[] = {
-	N_("git upload-pack [<options>] <dir>"),
-	NULL
-};
+#include "upload-pack.h"
+#include "sha1-array.h"
+#include "lockfile.h"
+#include "dir.h"
 
 /* Remember to update object flag allocation in object.h */
 #define THEY_HAVE	(1u << 11)
@@ -64,9 +62,11 @@ static int keepalive = 5;
  * otherwise maximum packet size (up to 65520 bytes).
  */
 static int use_sideband;
-static int advertise_refs;
 static int stateless_rpc;
 static const char *pack_objects_hook;
+static const char *pack_cache_dir;
+static unsigned long pack_cache_max_size = 1024 * 1024 * 1024;
+static int pack_cache_ttl = 3600;
 
 static int filter_capability_requested;
 static int allow_filter;
@@ -96,12 +96,195 @@ static void send_client_data(int fd, const char *data, ssize_t sz)
 
 static int write_one_shallow(const struct commit_graft *graft, void *cb_data)
 {
-	FILE *fp = cb_data;
+	struct strbuf *buf = cb_data;
 	if (graft->nr_parent == -1)
-		fprintf(fp, "--shallow %s\n", oid_to_hex(&graft->oid));
+		strbuf_addf(buf, "--shallow %s\n", oid_to_hex(&graft->oid));
+	return 0;
+}
+
+/*
+ * The pack cache keeps the output of pack-objects in the directory
+ * given by uploadpack.packCache, in a file named after the hash of
+ * everything that went into it: the pack-objects arguments (which
+ * carry the capabilities and filter of the request), its input (the
+ * wants, haves and shallow commits) and, with include-tag, the tags
+ * of the repository. As only object names are hashed, the cache can
+ * be shared by all repositories of a fork network. A file that has
+ * not been used for uploadpack.packCacheTTL seconds is removed, as
+ * are the least recently used ones while the cache is larger than
+ * uploadpack.packCacheMaxSize.
+ */
+
+/*
+ * While pack-objects is counting and compressing objects, nothing is
+ * written to the lockfile of the pack being cached, so it is touched
+ * every PACK_CACHE_TOUCH_LOCK seconds to tell those waiting for it that
+ * it is still being worked on; they give up once it has not been
+ * changed for PACK_CACHE_STALE_LOCK seconds.
+ */
+#define PACK_CACHE_TOUCH_LOCK 15
+#define PACK_CACHE_STALE_LOCK 60
+
+static int hash_one_tag(const char *refname, const struct object_id *oid,
+			int flag, void *cb_data)
+{
+	git_SHA_CTX *ctx = cb_data;
+	git_SHA1_Update(ctx, refname, strlen(refname) + 1);
+	git_SHA1_Update(ctx, oid->hash, GIT_SHA1_RAWSZ);
 	return 0;
 }
 
+static void pack_cache_path(struct strbuf *path, const struct argv_array *args,
+			    const struct strbuf *input)
+{
+	git_SHA_CTX ctx;
+	unsigned char hash[GIT_SHA1_RAWSZ];
+	int i;
+
+	git_SHA1_Init(&ctx);
+	for (i = 0; i < args->argc; i++) {
+		/* progress does not change the pack */
+		if (!strcmp(args->argv[i], "--progress"))
+			continue;
+		git_SHA1_Update(&ctx, args->argv[i], strlen(args->argv[i]) + 1);
+	}
+	git_SHA1_Update(&ctx, input->buf, input->len);
+	if (use_include_tag)
+		for_each_tag_ref(hash_one_tag, &ctx);
+	git_SHA1_Final(hash, &ctx);
+
+	strbuf_addf(path, "%s/%s.pack", pack_cache_dir, sha1_to_hex(hash));
+}
+
+static int send_cached_pack(const char *path)
+{
+	char data[8192];
+	ssize_t sz;
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		return 0;
+	if (fstat(fd, &st) ||
+	    (pack_cache_ttl > 0 && st.st_mtime + pack_cache_ttl < time(NULL))) {
+		close(fd);
+		return 0;
+	}
+
+	/* keep it from being expired while it is being used */
+	utime(path, NULL);
+
+	while ((sz = xread(fd, data, sizeof(data))) > 0)
+		send_client_data(1, data, sz);
+	if (sz < 0)
+		die_errno("git upload-pack: unable to read cached pack %s", path);
+	close(fd);
+
+	if (use_sideband)
+		packet_flush(1);
+	return 1;
+}
+
+/*
+ * Wait for another upload-pack that is writing the pack at `path` to
+ * finish, keeping the client alive in the meantime. Give up when its
+ * lockfile has not been written to or touched for a while, as then it
+ * must have died without removing it.
+ */
+static void wait_for_cached_pack(const char *path)
+{
+	struct strbuf lock_path = STRBUF_INIT;
+	int waited = 0;
+	struct stat st;
+
+	strbuf_addf(&lock_path, "%s%s", path, LOCK_SUFFIX);
+	while (!lstat(lock_path.buf, &st) &&
+	       st.st_mtime + PACK_CACHE_STALE_LOCK >= time(NULL)) {
+		sleep(1);
+		if (use_sideband && keepalive > 0 && ++waited >= keepalive) {
+			static const char buf[] = "0005\1";
+			write_or_die(1, buf, 5);
+			waited = 0;
+		}
+	}
+	strbuf_release(&lock_path);
+}
+
+static void touch_pack_cache_lock(struct lock_file *lk, time_t *last)
+{
+	time_t now = time(NULL);
+
+	if (now < *last + PACK_CACHE_TOUCH_LOCK)
+		return;
+	utime(get_lock_file_path(lk), NULL);
+	*last = now;
+}
+
+struct pack_cache_file {
+	char *path;
+	time_t mtime;
+	off_t size;
+	unsigned keep:1;
+};
+
+static int pack_cache_file_cmp(const void *a_, const void *b_)
+{
+	const struct pack_cache_file *a = a_, *b = b_;
+
+	/* the pack just written, then the most recently used ones */
+	if (a->keep != b->keep)
+		return a->keep ? -1 : 1;
+	if (a->mtime != b->mtime)
+		return a->mtime < b->mtime ? 1 : -1;
+	return strcmp(a->path, b->path);
+}
+
+static void prune_pack_cache(const char *keep)
+{
+	struct pack_cache_file *files = NULL;
+	size_t nr = 0, alloc = 0, i;
+	unsigned long total = 0;
+	time_t now = time(NULL);
+	struct dirent *de;
+	DIR *dir = opendir(pack_cache_dir);
+
+	if (!dir)
+		return;
+	while ((de = readdir(dir)) != NULL) {
+		struct stat st;
+		char *path;
+
+		if (!ends_with(de->d_name, ".pack"))
+			continue;
+		path = xstrfmt("%s/%s", pack_cache_dir, de->d_name);
+		if (stat(path, &st)) {
+			free(path);
+			continue;
+		}
+		if (pack_cache_ttl > 0 && st.st_mtime + pack_cache_ttl < now) {
+			unlink_or_warn(path);
+			free(path);
+			continue;
+		}
+		ALLOC_GROW(files, nr + 1, alloc);
+		files[nr].path = path;
+		files[nr].mtime = st.st_mtime;
+		files[nr].size = st.st_size;
+		files[nr].keep = !strcmp(path, keep);
+		nr++;
+	}
+	closedir(dir);
+
+	QSORT(files, nr, pack_cache_file_cmp);
+	for (i = 0; i < nr; i++) {
+		total += files[i].size;
+		if (pack_cache_max_size && total > pack_cache_max_size)
+			unlink_or_warn(files[i].path);
+		free(files[i].path);
+	}
+	free(files);
+}
+
 static void create_pack_file(void)
 {
 	struct child_process pack_objects = CHILD_PROCESS_INIT;
@@ -111,7 +294,12 @@ static void create_pack_file(void)
 	int buffered = -1;
 	ssize_t sz;
 	int i;
-	FILE *pipe_fd;
+	struct strbuf input = STRBUF_INIT;
+	struct strbuf cache_path = STRBUF_INIT;
+	struct lock_file cache_lock = LOCK_INIT;
+	int cache_fd = -1;
+	unsigned long cached_size = 0;
+	time_t cache_touched = 0;
 
 	if (!pack_objects_hook)
 		pack_objects.git_cmd = 1;
@@ -151,6 +339,36 @@ static void create_pack_file(void)
 		}
 	}
 
+	if (shallow_nr)
+		for_each_commit_graft(write_one_shallow, &input);
+
+	for (i = 0; i < want_obj.nr; i++)
+		strbuf_addf(&input, "%s\n",
+			    oid_to_hex(&want_obj.objects[i].item->oid));
+	strbuf_addstr(&input, "--not\n");
+	for (i = 0; i < have_obj.nr; i++)
+		strbuf_addf(&input, "%s\n",
+			    oid_to_hex(&have_obj.objects[i].item->oid));
+	for (i = 0; i < extra_edge_obj.nr; i++)
+		strbuf_addf(&input, "%s\n",
+			    oid_to_hex(&extra_edge_obj.objects[i].item->oid));
+	strbuf_addch(&input, '\n');
+
+	if (pack_cache_dir) {
+		pack_cache_path(&cache_path, &pack_objects.args, &input);
+		if (send_cached_pack(cache_path.buf))
+			goto cached;
+		if (!safe_create_leading_directories_const(cache_path.buf))
+			cache_fd = hold_lock_file_for_update(&cache_lock,
+							     cache_path.buf, 0);
+		if (cache_fd < 0 && errno == EEXIST) {
+			/* somebody else is creating it right now */
+			wait_for_cached_pack(cache_path.buf);
+			if (send_cached_pack(cache_path.buf))
+				goto cached;
+		}
+	}
+
 	pack_objects.in = -1;
 	pack_objects.out = -1;
 	pack_objects.err = -1;
@@ -158,33 +376,21 @@ static void create_pack_file(void)
 	if (start_command(&pack_objects))
 		die("git upload-pack: unable to fork git-pack-objects");
 
-	pipe_fd = xfdopen(pack_objects.in, "w");
-
-	if (shallow_nr)
-		for_each_commit_graft(write_one_shallow, pipe_fd);
-
-	for (i = 0; i < want_obj.nr; i++)
-		fprintf(pipe_fd, "%s\n",
-			oid_to_hex(&want_obj.objects[i].item->oid));
-	fprintf(pipe_fd, "--not\n");
-	for (i = 0; i < have_obj.nr; i++)
-		fprintf(pipe_fd, "%s\n",
-			oid_to_hex(&have_obj.objects[i].item->oid));
-	for (i = 0; i < extra_edge_obj.nr; i++)
-		fprintf(pipe_fd, "%s\n",
-			oid_to_hex(&extra_edge_obj.objects[i].item->oid));
-	fprintf(pipe_fd, "\n");
-	fflush(pipe_fd);
-	fclose(pipe_fd);
+	if (write_in_full(pack_objects.in, input.buf, input.len) < 0)
+		die_errno("git upload-pack: unable to feed git-pack-objects");
+	close(pack_objects.in);
 
 	/* We read from pack_objects.err to capture stderr output for
 	 * progress bar, and pack_objects.out to capture the pack data.
 	 */
 
+	if (0 <= cache_fd)
+		cache_touched = time(NULL);
+
 	while (1) {
 		struct pollfd pfd[2];
 		int pe, pu, pollsize;
-		int ret;
+		int ret, timeout;
 
 		reset_timeout();
 
@@ -207,8 +413,13 @@ static void create_pack_file(void)
 		if (!pollsize)
 			break;
 
-		ret = poll(pfd, pollsize,
-			keepalive < 0 ? -1 : 1000 * keepalive);
+		timeout = keepalive < 0 ? -1 : 1000 * keepalive;
+		if (0 <= cache_fd &&
+		    (timeout < 0 || timeout > 1000 * PACK_CACHE_TOUCH_LOCK))
+			timeout = 1000 * PACK_CACHE_TOUCH_LOCK;
+		ret = poll(pfd, pollsize, timeout);
+		if (0 <= cache_fd)
+			touch_pack_cache_lock(&cache_lock, &cache_touched);
 
 		if (ret < 0) {
 			if (errno != EINTR) {
@@ -252,8 +463,18 @@ static void create_pack_file(void)
 			}
 			sz = xread(pack_objects.out, cp,
 				  sizeof(data) - outsz);
-			if (0 < sz)
-				;
+			if (0 < sz) {
+				if (0 <= cache_fd) {
+					cached_size += sz;
+					if ((pack_cache_max_size &&
+					     cached_size > pack_cache_max_size) ||
+					    write_in_full(cache_fd, cp, sz) < 0) {
+						/* too big, or no space */
+						rollback_lock_file(&cache_lock);
+						cache_fd = -1;
+					}
+				}
+			}
 			else if (sz == 0) {
 				close(pack_objects.out);
 				pack_objects.out = -1;
@@ -280,7 +501,7 @@ static void create_pack_file(void)
 		 * protocol to say anything, so those clients are just out of
 		 * luck.
 		 */
-		if (!ret && use_sideband) {
+		if (!ret && use_sideband && keepalive > 0) {
 			static const char buf[] = "0005\1";
 			write_or_die(1, buf, 5);
 		}
@@ -291,6 +512,14 @@ static void create_pack_file(void)
 		goto fail;
 	}
 
+	if (0 <= cache_fd) {
+		if (commit_lock_file(&cache_lock))
+			warning_errno("unable to write cached pack %s",
+				      cache_path.buf);
+		else
+			prune_pack_cache(cache_path.buf);
+	}
+
 	/* flush the data */
 	if (0 <= buffered) {
 		data[0] = buffered;
@@ -299,9 +528,13 @@ static void create_pack_file(void)
 	}
 	if (use_sideband)
 		packet_flush(1);
+ cached:
+	strbuf_release(&input);
+	strbuf_release(&cache_path);
 	return;
 
  fail:
+	rollback_lock_file(&cache_lock);
 	send_client_data(3, abort_msg, sizeof(abort_msg));
 	die("git upload-pack: %s", abort_msg);
 }
@@ -734,7 +967,6 @@ static void deepen(int depth, int deepen_relative,
 	}
 
 	send_unshallow(shallows);
-	packet_flush(1);
 }
 
 static void deepen_by_rev_list(int ac, const char **av,
@@ -746,7 +978,122 @@ static void deepen_by_rev_list(int ac, const char **av,
 	send_shallow(result);
 	free_commit_list(result);
 	send_unshallow(shallows);
-	packet_flush(1);
+}
+
+/* Returns 1 if a shallow list is sent or 0 otherwise */
+static int send_shallow_list(int depth, int deepen_rev_list,
+			     timestamp_t deepen_since,
+			     struct string_list *deepen_not,
+			     struct object_array *shallows)
+{
+	int ret = 0;
+
+	if (depth > 0 && deepen_rev_list)
+		die("git upload-pack: deepen and deepen-since (or deepen-not) cannot be used together");
+	if (depth > 0) {
+		deepen(depth, deepen_relative, shallows);
+		ret = 1;
+	} else if (deepen_rev_list) {
+		struct argv_array av = ARGV_ARRAY_INIT;
+		int i;
+
+		argv_array_push(&av, "rev-list");
+		if (deepen_since)
+			argv_array_pushf(&av, "--max-age=%"PRItime, deepen_since);
+		if (deepen_not->nr) {
+			argv_array_push(&av, "--not");
+			for (i = 0; i < deepen_not->nr; i++) {
+				struct string_list_item *s = deepen_not->items + i;
+				argv_array_push(&av, s->string);
+			}
+			argv_array_push(&av, "--not");
+		}
+		for (i = 0; i < want_obj.nr; i++) {
+			struct object *o = want_obj.objects[i].item;
+			argv_array_push(&av, oid_to_hex(&o->oid));
+		}
+		deepen_by_rev_list(av.argc, av.argv, shallows);
+		argv_array_clear(&av);
+		ret = 1;
+	} else {
+		if (shallows->nr > 0) {
+			int i;
+			for (i = 0; i < shallows->nr; i++)
+				register_shallow(&shallows->objects[i].item->oid);
+		}
+	}
+
+	shallow_nr += shallows->nr;
+	return ret;
+}
+
+static int process_shallow(const char *line, struct object_array *shallows)
+{
+	const char *arg;
+	if (skip_prefix(line, "shallow ", &arg)) {
+		struct object_id oid;
+		struct object *object;
+		if (get_oid_hex(arg, &oid))
+			die("invalid shallow line: %s", line);
+		object = parse_object(&oid);
+		if (!object)
+			return 1;
+		if (object->type != OBJ_COMMIT)
+			die("invalid shallow object %s", oid_to_hex(&oid));
+		if (!(object->flags & CLIENT_SHALLOW)) {
+			object->flags |= CLIENT_SHALLOW;
+			add_object_array(object, NULL, shallows);
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+static int process_deepen(const char *line, int *depth)
+{
+	const char *arg;
+	if (skip_prefix(line, "deepen ", &arg)) {
+		char *end = NULL;
+		*depth = (int)strtol(arg, &end, 0);
+		if (!end || *end || *depth <= 0)
+			die("Invalid deepen: %s", line);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int process_deepen_since(const char *line, timestamp_t *deepen_since, int *deepen_rev_list)
+{
+	const char *arg;
+	if (skip_prefix(line, "deepen-since ", &arg)) {
+		char *end = NULL;
+		*deepen_since = parse_timestamp(arg, &end, 0);
+		if (!end || *end || !*deepen_since ||
+		    /* revisions.c's max_age -1 is special */
+		    *deepen_since == -1)
+			die("Invalid deepen-since: %s", line);
+		*deepen_rev_list = 1;
+		return 1;
+	}
+	return 0;
+}
+
+static int process_deepen_not(const char *line, struct string_list *deepen_not, int *deepen_rev_list)
+{
+	const char *arg;
+	if (skip_prefix(line, "deepen-not ", &arg)) {
+		char *ref = NULL;
+		struct object_id oid;
+		if (expand_ref(arg, strlen(arg), &oid, &ref) != 1)
+			die("git upload-pack: ambiguous deepen-not: %s", line);
+		string_list_append(deepen_not, ref);
+		free(ref);
+		*deepen_rev_list = 1;
+		return 1;
+	}
+	return 0;
 }
 
 static void receive_needs(void)
@@ -770,49 +1117,14 @@ static void receive_needs(void)
 		if (!line)
 			break;
 
-		if (skip_prefix(line, "shallow ", &arg)) {
-			struct object_id oid;
-			struct object *object;
-			if (get_oid_hex(arg, &oid))
-				die("invalid shallow line: %s", line);
-			object = parse_object(&oid);
-			if (!object)
-				continue;
-			if (object->type != OBJ_COMMIT)
-				die("invalid shallow object %s", oid_to_hex(&oid));
-			if (!(object->flags & CLIENT_SHALLOW)) {
-				object->flags |= CLIENT_SHALLOW;
-				add_object_array(object, NULL, &shallows);
-			}
+		if (process_shallow(line, &shallows))
 			continue;
-		}
-		if (skip_prefix(line, "deepen ", &arg)) {
-			char *end = NULL;
-			depth = strtol(arg, &end, 0);
-			if (!end || *end || depth <= 0)
-				die("Invalid deepen: %s", line);
+		if (process_deepen(line, &depth))
 			continue;
-		}
-		if (skip_prefix(line, "deepen-since ", &arg)) {
-			char *end = NULL;
-			deepen_since = parse_timestamp(arg, &end, 0);
-			if (!end || *end || !deepen_since ||
-			    /* revisions.c's max_age -1 is special */
-			    deepen_since == -1)
-				die("Invalid deepen-since: %s", line);
-			deepen_rev_list = 1;
+		if (process_deepen_since(line, &deepen_since, &deepen_rev_list))
 			continue;
-		}
-		if (skip_prefix(line, "deepen-not ", &arg)) {
-			char *ref = NULL;
-			struct object_id oid;
-			if (expand_ref(arg, strlen(arg), &oid, &ref) != 1)
-				die("git upload-pack: ambiguous deepen-not: %s", line);
-			string_list_append(&deepen_not, ref);
-			free(ref);
-			deepen_rev_list = 1;
+		if (process_deepen_not(line, &deepen_not, &deepen_rev_list))
 			continue;
-		}
 		if (skip_prefix(line, "filter ", &arg)) {
 			if (!filter_capability_requested)
 				die("git upload-pack: filtering capability not negotiated");
@@ -881,40 +1193,10 @@ static void receive_needs(void)
 
 	if (depth == 0 && !deepen_rev_list && shallows.nr == 0)
 		return;
-	if (depth > 0 && deepen_rev_list)
-		die("git upload-pack: deepen and deepen-since (or deepen-not) cannot be used together");
-	if (depth > 0)
-		deepen(depth, deepen_relative, &shallows);
-	else if (deepen_rev_list) {
-		struct argv_array av = ARGV_ARRAY_INIT;
-		int i;
-
-		argv_array_push(&av, "rev-list");
-		if (deepen_since)
-			argv_array_pushf(&av, "--max-age=%"PRItime, deepen_since);
-		if (deepen_not.nr) {
-			argv_array_push(&av, "--not");
-			for (i = 0; i < deepen_not.nr; i++) {
-				struct string_list_item *s = deepen_not.items + i;
-				argv_array_push(&av, s->string);
-			}
-			argv_array_push(&av, "--not");
-		}
-		for (i = 0; i < want_obj.nr; i++) {
-			struct object *o = want_obj.objects[i].item;
-			argv_array_push(&av, oid_to_hex(&o->oid));
-		}
-		deepen_by_rev_list(av.argc, av.argv, &shallows);
-		argv_array_clear(&av);
-	}
-	else
-		if (shallows.nr > 0) {
-			int i;
-			for (i = 0; i < shallows.nr; i++)
-				register_shallow(&shallows.objects[i].item->oid);
-		}
 
-	shallow_nr += shallows.nr;
+	if (send_shallow_list(depth, deepen_rev_list, deepen_since,
+			      &deepen_not, &shallows))
+		packet_flush(1);
 	object_array_clear(&shallows);
 }
 
@@ -1004,33 +1286,6 @@ static int find_symref(const char *refname, const struct object_id *oid,
 	return 0;
 }
 
-static void upload_pack(void)
-{
-	struct string_list symref = STRING_LIST_INIT_DUP;
-
-	head_ref_namespaced(find_symref, &symref);
-
-	if (advertise_refs || !stateless_rpc) {
-		reset_timeout();
-		head_ref_namespaced(send_ref, &symref);
-		for_each_namespaced_ref(send_ref, &symref);
-		advertise_shallow_grafts(1);
-		packet_flush(1);
-	} else {
-		head_ref_namespaced(check_ref, NULL);
-		for_each_namespaced_ref(check_ref, NULL);
-	}
-	string_list_clear(&symref, 1);
-	if (advertise_refs)
-		return;
-
-	receive_needs();
-	if (want_obj.nr) {
-		get_common_commits();
-		create_pack_file();
-	}
-}
-
 static int upload_pack_config(const char *var, const char *value, void *unused)
 {
 	if (!strcmp("uploadpack.allowtipsha1inwant", var)) {
@@ -1055,64 +1310,411 @@ static int upload_pack_config(const char *var, const char *value, void *unused)
 	} else if (current_config_scope() != CONFIG_SCOPE_REPO) {
 		if (!strcmp("uploadpack.packobjectshook", var))
 			return git_config_string(&pack_objects_hook, var, value);
+		if (!strcmp("uploadpack.packcache", var))
+			return git_config_pathname(&pack_cache_dir, var, value);
+		if (!strcmp("uploadpack.packcachemaxsize", var)) {
+			pack_cache_max_size = git_config_ulong(var, value);
+			return 0;
+		}
+		if (!strcmp("uploadpack.packcachettl", var)) {
+			pack_cache_ttl = git_config_int(var, value);
+			return 0;
+		}
 	} else if (!strcmp("uploadpack.allowfilter", var)) {
 		allow_filter = git_config_bool(var, value);
 	}
 	return parse_hide_refs_config(var, value, "uploadpack");
 }
 
-int cmd_main(int argc, const char **argv)
+void upload_pack(struct upload_pack_options *options)
 {
-	const char *dir;
-	int strict = 0;
-	struct option options[] = {
-		OPT_BOOL(0, "stateless-rpc", &stateless_rpc,
-			 N_("quit after a single request/response exchange")),
-		OPT_BOOL(0, "advertise-refs", &advertise_refs,
-			 N_("exit immediately after initial ref advertisement")),
-		OPT_BOOL(0, "strict", &strict,
-			 N_("do not try <directory>/.git/ if <directory> is no Git directory")),
-		OPT_INTEGER(0, "timeout", &timeout,
-			    N_("interrupt transfer after <n> seconds of inactivity")),
-		OPT_END()
-	};
+	struct string_list symref = STRING_LIST_INIT_DUP;
+
+	stateless_rpc = options->stateless_rpc;
+	timeout = options->timeout;
+	daemon_mode = options->daemon_mode;
+
+	git_config(upload_pack_config, NULL);
+
+	head_ref_namespaced(find_symref, &symref);
+
+	if (options->advertise_refs || !stateless_rpc) {
+		reset_timeout();
+		head_ref_namespaced(send_ref, &symref);
+		for_each_namespaced_ref(send_ref, &symref);
+		advertise_shallow_grafts(1);
+		packet_flush(1);
+	} else {
+		head_ref_namespaced(check_ref, NULL);
+		for_each_namespaced_ref(check_ref, NULL);
+	}
+	string_list_clear(&symref, 1);
+	if (options->advertise_refs)
+		return;
+
+	receive_needs();
+	if (want_obj.nr) {
+		get_common_commits();
+		create_pack_file();
+	}
+}
+
+struct upload_pack_data {
+	struct oid_array haves;
+
+	struct object_array shallows;
+	struct string_list deepen_not;
+	int depth;
+	timestamp_t deepen_since;
+	int deepen_rev_list;
+	int deepen_relative;
+
+	unsigned done : 1;
+};
+
+static void upload_pack_data_init(struct upload_pack_data *data)
+{
+	struct oid_array haves = OID_ARRAY_INIT;
+	struct object_array shallows = OBJECT_ARRAY_INIT;
+	struct string_list deepen_not = STRING_LIST_INIT_DUP;
+
+	memset(data, 0, sizeof(*data));
+	data->haves = haves;
+	data->shallows = shallows;
+	data->deepen_not = deepen_not;
+}
+
+static void upload_pack_data_clear(struct upload_pack_data *data)
+{
+	oid_array_clear(&data->haves);
+	object_array_clear(&data->shallows);
+	string_list_clear(&data->deepen_not, 0);
+}
+
+/*
+ * Without a ref advertisement in this process, mark the tips of our
+ * (non-hidden) refs once so that requests for other objects can be
+ * checked the same way as in the stateless v0 protocol.
+ */
+static void mark_our_refs(void)
+{
+	static int marked;
+
+	if (marked)
+		return;
+	head_ref_namespaced(check_ref, NULL);
+	for_each_namespaced_ref(check_ref, NULL);
+	marked = 1;
+}
+
+static int parse_want(const char *line, int *has_non_tip)
+{
+	const char *arg;
+	if (skip_prefix(line, "want ", &arg)) {
+		struct object_id oid;
+		struct object *o;
+
+		if (get_oid_hex(arg, &oid))
+			die("git upload-pack: protocol error, "
+			    "expected to get oid, not '%s'", line);
+
+		o = parse_object(&oid);
+		if (!o) {
+			packet_write_fmt(1,
+					 "ERR upload-pack: not our ref %s",
+					 oid_to_hex(&oid));
+			die("git upload-pack: not our ref %s",
+			    oid_to_hex(&oid));
+		}
+
+		if (!(o->flags & WANTED)) {
+			o->flags |= WANTED;
+			if (!((allow_unadvertised_object_request & ALLOW_ANY_SHA1) == ALLOW_ANY_SHA1
+			      || is_our_ref(o)))
+				*has_non_tip = 1;
+			add_object_array(o, NULL, &want_obj);
+		}
+
+		return 1;
+	}
+
+	return 0;
+}
+
+static int parse_have(const char *line, struct oid_array *haves)
+{
+	const char *arg;
+	if (skip_prefix(line, "have ", &arg)) {
+		struct object_id oid;
+
+		if (get_oid_hex(arg, &oid))
+			die("git upload-pack: expected SHA1 object, got '%s'", arg);
+		oid_array_append(haves, &oid);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void process_args(struct packet_reader *request,
+			 struct upload_pack_data *data)
+{
+	int has_non_tip = 0;
+
+	mark_our_refs();
+
+	while (packet_reader_read(request) != PACKET_READ_FLUSH) {
+		const char *arg = request->line;
+		const char *p;
 
-	packet_trace_identity("upload-pack");
-	check_replace_refs = 0;
+		/* process want */
+		if (parse_want(arg, &has_non_tip))
+			continue;
+		/* process have line */
+		if (parse_have(arg, &data->haves))
+			continue;
 
-	argc = parse_options(argc, argv, NULL, options, upload_pack_usage, 0);
+		/* process args like thin-pack */
+		if (!strcmp(arg, "thin-pack")) {
+			use_thin_pack = 1;
+			continue;
+		}
+		if (!strcmp(arg, "ofs-delta")) {
+			use_ofs_delta = 1;
+			continue;
+		}
+		if (!strcmp(arg, "no-progress")) {
+			no_progress = 1;
+			continue;
+		}
+		if (!strcmp(arg, "include-tag")) {
+			use_include_tag = 1;
+			continue;
+		}
+		if (!strcmp(arg, "done")) {
+			data->done = 1;
+			continue;
+		}
 
-	if (argc != 1)
-		usage_with_options(upload_pack_usage, options);
+		/* Shallow related arguments */
+		if (process_shallow(arg, &data->shallows))
+			continue;
+		if (process_deepen(arg, &data->depth))
+			continue;
+		if (process_deepen_since(arg, &data->deepen_since,
+					 &data->deepen_rev_list))
+			continue;
+		if (process_deepen_not(arg, &data->deepen_not,
+				       &data->deepen_rev_list))
+			continue;
+		if (!strcmp(arg, "deepen-relative")) {
+			data->deepen_relative = 1;
+			continue;
+		}
 
-	if (timeout)
-		daemon_mode = 1;
+		if (allow_filter && skip_prefix(arg, "filter ", &p)) {
+			parse_list_objects_filter(&filter_options, p);
+			continue;
+		}
 
-	setup_path();
+		/* ignore unknown lines maybe? */
+		die("unexpected line: '%s'", arg);
+	}
+
+	if (has_non_tip)
+		check_non_tip();
+}
+
+static int process_haves(struct oid_array *haves, struct oid_array *common)
+{
+	int i;
+
+	/* Process haves */
+	for (i = 0; i < haves->nr; i++) {
+		const struct object_id *oid = &haves->oid[i];
+		struct object *o;
+		int we_knew_they_have = 0;
+
+		if (!has_object_file(oid))
+			continue;
 
-	dir = argv[0];
+		oid_array_append(common, oid);
 
-	if (!enter_repo(dir, strict))
-		die("'%s' does not appear to be a git repository", dir);
+		o = parse_object(oid);
+		if (!o)
+			die("oops (%s)", oid_to_hex(oid));
+		if (o->type == OBJ_COMMIT) {
+			struct commit_list *parents;
+			struct commit *commit = (struct commit *)o;
+			if (o->flags & THEY_HAVE)
+				we_knew_they_have = 1;
+			else
+				o->flags |= THEY_HAVE;
+			if (!oldest_have || (commit->date < oldest_have))
+				oldest_have = commit->date;
+			for (parents = commit->parents;
+			     parents;
+			     parents = parents->next)
+				parents->item->object.flags |= THEY_HAVE;
+		}
+		if (!we_knew_they_have)
+			add_object_array(o, NULL, &have_obj);
+	}
+
+	return 0;
+}
+
+static int send_acks(struct oid_array *acks, struct strbuf *response)
+{
+	int i;
+
+	packet_buf_write(response, "acknowledgments\n");
+
+	/* Send Acks */
+	if (!acks->nr)
+		packet_buf_write(response, "NAK\n");
+
+	for (i = 0; i < acks->nr; i++) {
+		packet_buf_write(response, "ACK %s\n",
+				 oid_to_hex(&acks->oid[i]));
+	}
+
+	if (ok_to_give_up()) {
+		/* Send Ready */
+		packet_buf_write(response, "ready\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+static int process_haves_and_send_acks(struct upload_pack_data *data)
+{
+	struct oid_array common = OID_ARRAY_INIT;
+	struct strbuf response = STRBUF_INIT;
+	int ret = 0;
+
+	process_haves(&data->haves, &common);
+	if (data->done) {
+		ret = 1;
+	} else if (send_acks(&common, &response)) {
+		packet_buf_delim(&response);
+		ret = 1;
+	} else {
+		/* Add Flush */
+		packet_buf_flush(&response);
+		ret = 0;
+	}
+
+	/* Send response */
+	write_or_die(1, response.buf, response.len);
+	strbuf_release(&response);
+
+	oid_array_clear(&data->haves);
+	oid_array_clear(&common);
+	return ret;
+}
+
+static void send_shallow_info(struct upload_pack_data *data)
+{
+	/* No shallow info needs to be sent */
+	if (!data->depth && !data->deepen_rev_list && !data->shallows.nr &&
+	    !is_repository_shallow())
+		return;
+
+	packet_write_fmt(1, "shallow-info\n");
+
+	deepen_relative = data->deepen_relative;
+	if (!send_shallow_list(data->depth, data->deepen_rev_list,
+			       data->deepen_since, &data->deepen_not,
+			       &data->shallows) && is_repository_shallow())
+		deepen(INFINITE_DEPTH, data->deepen_relative, &data->shallows);
+
+	packet_delim(1);
+}
+
+enum fetch_state {
+	FETCH_PROCESS_ARGS = 0,
+	FETCH_SEND_ACKS,
+	FETCH_SEND_PACK,
+	FETCH_DONE,
+};
+
+int upload_pack_v2(struct repository *r, struct argv_array *keys,
+		   struct packet_reader *request)
+{
+	enum fetch_state state = FETCH_PROCESS_ARGS;
+	struct upload_pack_data data;
 
 	git_config(upload_pack_config, NULL);
 
-	switch (determine_protocol_version_server()) {
-	case protocol_v1:
-		/*
-		 * v1 is just the original protocol with a version string,
-		 * so just fall through after writing the version string.
-		 */
-		if (advertise_refs || !stateless_rpc)
-			packet_write_fmt(1, "version 1\n");
-
-		/* fallthrough */
-	case protocol_v0:
-		upload_pack();
-		break;
-	case protocol_unknown_version:
-		BUG("unknown protocol version");
+	upload_pack_data_init(&data);
+	use_sideband = LARGE_PACKET_MAX;
+
+	/*
+	 * Every v2 request stands on its own and the process serving it
+	 * need not have advertised any refs, so wants are checked the
+	 * same way as in the stateless v0 protocol.
+	 */
+	stateless_rpc = 1;
+
+	while (state != FETCH_DONE) {
+		switch (state) {
+		case FETCH_PROCESS_ARGS:
+			process_args(request, &data);
+
+			if (!want_obj.nr) {
+				/*
+				 * Request didn't contain any 'want' lines,
+				 * guess they didn't want anything.
+				 */
+				state = FETCH_DONE;
+			} else if (data.haves.nr) {
+				/*
+				 * Request had 'have' lines, so lets ACK them.
+				 */
+				state = FETCH_SEND_ACKS;
+			} else {
+				/*
+				 * Request had 'want's but no 'have's so we can
+				 * immediately go to construct and send a pack.
+				 */
+				state = FETCH_SEND_PACK;
+			}
+			break;
+		case FETCH_SEND_ACKS:
+			if (process_haves_and_send_acks(&data))
+				state = FETCH_SEND_PACK;
+			else
+				state = FETCH_DONE;
+			break;
+		case FETCH_SEND_PACK:
+			send_shallow_info(&data);
+
+			packet_write_fmt(1, "packfile\n");
+			create_pack_file();
+			state = FETCH_DONE;
+			break;
+		case FETCH_DONE:
+			continue;
+		}
 	}
 
+	upload_pack_data_clear(&data);
 	return 0;
 }
+
+int upload_pack_advertise(struct repository *r,
+			  struct strbuf *value)
+{
+	if (value) {
+		int allow_filter_value;
+
+		strbuf_addstr(value, "shallow");
+		if (!repo_config_get_bool(r, "uploadpack.allowfilter",
+					  &allow_filter_value) &&
+		    allow_filter_value)
+			strbuf_addstr(value, " filter");
+	}
+	return 1;
+}